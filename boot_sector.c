@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "boot_sector.h"
+#include "fatfs.h"
 
 int fat_read_bootsector (kos_blockdev_t *bd, fat_BS_t *bs) 
 {
@@ -16,7 +17,7 @@ int fat_read_bootsector (kos_blockdev_t *bd, fat_BS_t *bs)
     if(!(buf = malloc(512*sizeof(unsigned char)))) 	
 		return -ENOMEM;
 		
-	if(bd->read_blocks(bd, 0, 1, buf))
+	if(fat_dev_read(bd, FAT_TRACE_BOOT, 0, 1, buf))
 	{
 		free(buf);
         return -EIO;
@@ -0,0 +1,485 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fatfs.h"
+#include "fat_defs.h"
+#include "dir_cache.h"
+
+/* Recompute head/tail/span from the free bitmap of a sector */
+static void summarize_sector(fat_dir_sector_t *ds, int entries)
+{
+	int i;
+	int run = 0;
+
+	ds->head = 0;
+	ds->tail = 0;
+	ds->span = 0;
+
+	for(i = 0; i < entries && (ds->free & (1 << i)); i++)
+		ds->head++;
+
+	for(i = entries - 1; i >= 0 && (ds->free & (1 << i)); i--)
+		ds->tail++;
+
+	for(i = 0; i < entries; i++)
+	{
+		if(ds->free & (1 << i))
+		{
+			if(++run > ds->span)
+				ds->span = run;
+		}
+		else
+			run = 0;
+	}
+}
+
+/* FNV-1a over the 11 bytes of a short name */
+static unsigned int hash_short(const unsigned char *short_name)
+{
+	int i;
+	unsigned int h = 2166136261U;
+
+	for(i = 0; i < 11; i++)
+		h = (h ^ short_name[i]) * 16777619U;
+
+	return h;
+}
+
+/* FNV-1a over a UCS-2 name. ASCII letters are folded to lower case the same way lookups compare them */
+static unsigned int hash_long(const unsigned short *name, int len)
+{
+	int i;
+	unsigned int c;
+	unsigned int h = 2166136261U ^ 0x4C464E; /* Keep long names apart from short names */
+
+	for(i = 0; i < len; i++)
+	{
+		c = name[i];
+
+		if(c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+
+		h = (h ^ (c & 0xFF)) * 16777619U;
+		h = (h ^ (c >> 8)) * 16777619U;
+	}
+
+	return h;
+}
+
+/* Three bit positions per name out of one hash(double hashing) */
+static void bloom_set(fat_dir_cache_t *dc, unsigned int h)
+{
+	int i;
+	unsigned int step = (h >> 17) | 1;
+	unsigned int bit;
+
+	for(i = 0; i < 3; i++, h += step)
+	{
+		bit = h & (dc->bloom_bits - 1);
+		dc->bloom[bit >> 5] |= 1U << (bit & 31);
+	}
+}
+
+static int bloom_test(fat_dir_cache_t *dc, unsigned int h)
+{
+	int i;
+	unsigned int step = (h >> 17) | 1;
+	unsigned int bit;
+
+	for(i = 0; i < 3; i++, h += step)
+	{
+		bit = h & (dc->bloom_bits - 1);
+
+		if(!(dc->bloom[bit >> 5] & (1U << (bit & 31))))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Size the filter for the names found while building the map(plus room to grow) and fill it in */
+static void build_bloom(fat_dir_cache_t *dc)
+{
+	unsigned int i;
+	unsigned int bits = DIR_BLOOM_MIN_BITS;
+
+	while(bits < dc->num_hashes*DIR_BLOOM_BITS_PER_NAME*2)
+		bits <<= 1;
+
+	free(dc->bloom);
+	dc->bloom = NULL;
+
+	/* An empty filter would say no name is there at all */
+	if(!dc->no_bloom && (dc->bloom = malloc(bits/8)) != NULL)
+	{
+		memset(dc->bloom, 0, bits/8);
+		dc->bloom_bits = bits;
+		dc->bloom_count = dc->num_hashes;
+
+		for(i = 0; i < dc->num_hashes; i++)
+			bloom_set(dc, dc->hashes[i]);
+	}
+
+	free(dc->hashes);
+	dc->hashes = NULL;
+	dc->num_hashes = 0;
+	dc->max_hashes = 0;
+}
+
+int dir_cache_init(fatfs_t *fat)
+{
+	if(!(fat->dir_cache = malloc(sizeof(fat_dir_cache_t)*DIR_CACHE_SIZE)))
+		return -ENOMEM;
+
+	memset(fat->dir_cache, 0, sizeof(fat_dir_cache_t)*DIR_CACHE_SIZE);
+	fat->dir_cache_stamp = 0;
+
+	return 0;
+}
+
+void dir_cache_shutdown(fatfs_t *fat)
+{
+	int i;
+
+	if(fat->dir_cache == NULL)
+		return;
+
+	for(i = 0; i < DIR_CACHE_SIZE; i++)
+		dir_cache_discard(&fat->dir_cache[i]);
+
+	free(fat->dir_cache);
+	fat->dir_cache = NULL;
+}
+
+/* The map returned is only good while fat->cache_lock is held */
+fat_dir_cache_t *dir_cache_find(fatfs_t *fat, unsigned int cluster)
+{
+	int i;
+
+	for(i = 0; i < DIR_CACHE_SIZE; i++)
+	{
+		if(fat->dir_cache[i].used && fat->dir_cache[i].cluster == cluster)
+		{
+			fat->dir_cache[i].stamp = ++fat->dir_cache_stamp;
+			return &fat->dir_cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Throw away the map of a directory. Used when the clusters of a directory are freed */
+void dir_cache_invalidate(fatfs_t *fat, unsigned int cluster)
+{
+	int i;
+
+	mutex_lock(&fat->cache_lock);
+
+	for(i = 0; i < DIR_CACHE_SIZE; i++)
+	{
+		if(fat->dir_cache[i].used && fat->dir_cache[i].cluster == cluster)
+			dir_cache_discard(&fat->dir_cache[i]);
+	}
+
+	mutex_unlock(&fat->cache_lock);
+}
+
+/* Start building a new map. Sectors are added with dir_cache_add_sector() while the directory is scanned */
+void dir_cache_begin(fat_dir_cache_t *dc, unsigned int cluster)
+{
+	memset(dc, 0, sizeof(fat_dir_cache_t));
+	dc->used = 1;
+	dc->cluster = cluster;
+}
+
+/* Add the next sector of the directory. If buf is NULL the sector is considered empty(freshly cleared cluster) */
+int dir_cache_add_sector(fatfs_t *fat, fat_dir_cache_t *dc, unsigned int sector, const unsigned char *buf)
+{
+	int i;
+	const int entries = fat->boot_sector.bytes_per_sector/ENTRYSIZE;
+	fat_dir_sector_t *ds;
+
+	if(dc->num_sectors == dc->max_sectors)
+	{
+		unsigned int max = (dc->max_sectors == 0) ? 32 : dc->max_sectors*2;
+
+		if(!(ds = realloc(dc->sectors, sizeof(fat_dir_sector_t)*max)))
+			return -ENOMEM;
+
+		dc->sectors = ds;
+		dc->max_sectors = max;
+	}
+
+	ds = &dc->sectors[dc->num_sectors++];
+	ds->sector = sector;
+	ds->free = 0;
+
+	for(i = 0; i < entries; i++)
+	{
+		if(buf == NULL || buf[i*ENTRYSIZE] == EMPTY || buf[i*ENTRYSIZE] == DELETED)
+			ds->free |= (1 << i);
+	}
+
+	summarize_sector(ds, entries);
+
+	return 0;
+}
+
+/* Make a finished map available for lookups. Replaces the old map of the same directory or the least recently used one */
+fat_dir_cache_t *dir_cache_publish(fatfs_t *fat, fat_dir_cache_t *dc)
+{
+	int i;
+	fat_dir_cache_t *slot = NULL;
+
+	mutex_lock(&fat->cache_lock);
+
+	for(i = 0; i < DIR_CACHE_SIZE; i++)
+	{
+		if(fat->dir_cache[i].used && fat->dir_cache[i].cluster == dc->cluster)
+		{
+			slot = &fat->dir_cache[i];
+			break;
+		}
+
+		if(slot == NULL || !fat->dir_cache[i].used || (slot->used && fat->dir_cache[i].stamp < slot->stamp))
+			slot = &fat->dir_cache[i];
+	}
+
+	dir_cache_discard(slot);
+
+	build_bloom(dc);
+
+	memcpy(slot, dc, sizeof(fat_dir_cache_t));
+	slot->stamp = ++fat->dir_cache_stamp;
+
+	/* The map now belongs to the cache */
+	dc->sectors = NULL;
+	dc->bloom = NULL;
+	dc->used = 0;
+
+	mutex_unlock(&fat->cache_lock);
+
+	return slot;
+}
+
+void dir_cache_discard(fat_dir_cache_t *dc)
+{
+	free(dc->sectors);
+	free(dc->bloom);
+	free(dc->hashes);
+	memset(dc, 0, sizeof(fat_dir_cache_t));
+}
+
+/* Find 'num_entries' consecutive free entries. The run may cross sectors and clusters. loc[0]: Sector, loc[1]: Byte in that sector */
+int dir_cache_find_run(fatfs_t *fat, fat_dir_cache_t *dc, int num_entries, int loc[])
+{
+	unsigned int i;
+	int j;
+	int run = 0;
+	int start_slot = 0;
+	unsigned int start = 0;
+	const int entries = fat->boot_sector.bytes_per_sector/ENTRYSIZE;
+	const unsigned short all_free = (unsigned short)((1 << entries) - 1);
+	fat_dir_sector_t *ds;
+
+	/* Skip over the sectors that filled up */
+	while(dc->first_free < dc->num_sectors && dc->sectors[dc->first_free].free == 0)
+		dc->first_free++;
+
+	for(i = dc->first_free; i < dc->num_sectors; i++)
+	{
+		ds = &dc->sectors[i];
+
+		if(ds->free == all_free)
+		{
+			if(run == 0)
+			{
+				start = i;
+				start_slot = 0;
+			}
+
+			run += entries;
+
+			if(run >= num_entries)
+				goto found;
+
+			continue;
+		}
+
+		/* Run from previous sectors plus the start of this one */
+		if(run > 0 && run + ds->head >= num_entries)
+			goto found;
+
+		/* Run inside this sector */
+		if(ds->span >= num_entries)
+		{
+			run = 0;
+
+			for(j = 0; j < entries; j++)
+			{
+				if(ds->free & (1 << j))
+				{
+					if(run++ == 0)
+						start_slot = j;
+
+					if(run == num_entries)
+						break;
+				}
+				else
+					run = 0;
+			}
+
+			start = i;
+			goto found;
+		}
+
+		/* Only the end of this sector can start a new run */
+		run = ds->tail;
+		start = i;
+		start_slot = entries - ds->tail;
+	}
+
+	return -1;
+
+	found:
+
+	loc[0] = dc->sectors[start].sector;
+	loc[1] = start_slot*ENTRYSIZE;
+
+	return 0;
+}
+
+/* Mark 'count' entries starting at sector_loc/ptr as used or free in the map of the directory starting at 'cluster' */
+void dir_cache_mark(fatfs_t *fat, unsigned int cluster, unsigned int sector_loc, int ptr, int count, int is_free)
+{
+	unsigned int i;
+	int slot = ptr/ENTRYSIZE;
+	const int entries = fat->boot_sector.bytes_per_sector/ENTRYSIZE;
+	fat_dir_cache_t *dc;
+
+	mutex_lock(&fat->cache_lock);
+
+	if((dc = dir_cache_find(fat, cluster)) == NULL)
+	{
+		mutex_unlock(&fat->cache_lock);
+		return;
+	}
+
+	for(i = 0; i < dc->num_sectors; i++)
+	{
+		if(dc->sectors[i].sector == sector_loc)
+			break;
+	}
+
+	if(i == dc->num_sectors) /* Sector isnt part of the map. Dont trust it anymore */
+	{
+		dir_cache_discard(dc);
+		mutex_unlock(&fat->cache_lock);
+		return;
+	}
+
+	if(is_free && i < dc->first_free)
+		dc->first_free = i;
+
+	while(count > 0 && i < dc->num_sectors)
+	{
+		if(is_free)
+			dc->sectors[i].free |= (1 << slot);
+		else
+			dc->sectors[i].free &= ~(1 << slot);
+
+		count--;
+
+		if(++slot == entries || count == 0)
+		{
+			summarize_sector(&dc->sectors[i], entries);
+			slot = 0;
+			i++;
+		}
+	}
+
+	mutex_unlock(&fat->cache_lock);
+}
+
+static void note_hash(fat_dir_cache_t *dc, unsigned int h)
+{
+	unsigned int *hashes;
+	unsigned int max;
+
+	if(dc->num_hashes == dc->max_hashes)
+	{
+		max = (dc->max_hashes == 0) ? 64 : dc->max_hashes*2;
+
+		if(!(hashes = realloc(dc->hashes, sizeof(unsigned int)*max)))
+		{
+			dc->used = 0;  /* Out of memory. Dont publish a map without all the names */
+			return;
+		}
+
+		dc->hashes = hashes;
+		dc->max_hashes = max;
+	}
+
+	dc->hashes[dc->num_hashes++] = h;
+}
+
+/* Remember a name of the directory while its map is being built. lfn is NULL if the entry has no long file name */
+void dir_cache_note_name(fat_dir_cache_t *dc, const unsigned char *short_name, const unsigned short *lfn, int len)
+{
+	note_hash(dc, hash_short(short_name));
+
+	if(lfn != NULL)
+		note_hash(dc, hash_long(lfn, len));
+}
+
+/* A file/folder was added to the directory starting at 'cluster' */
+void dir_cache_add_name(fatfs_t *fat, unsigned int cluster, const unsigned char *short_name, const unsigned short *lfn, int len)
+{
+	fat_dir_cache_t *dc;
+
+	mutex_lock(&fat->cache_lock);
+
+	if((dc = dir_cache_find(fat, cluster)) == NULL || dc->bloom == NULL)
+	{
+		mutex_unlock(&fat->cache_lock);
+		return;
+	}
+
+	/* Filter is too full to be of much use. Start over with the next scan */
+	if((dc->bloom_count + 2)*DIR_BLOOM_BITS_PER_NAME > dc->bloom_bits)
+	{
+		dir_cache_discard(dc);
+		mutex_unlock(&fat->cache_lock);
+		return;
+	}
+
+	bloom_set(dc, hash_short(short_name));
+	dc->bloom_count++;
+
+	if(lfn != NULL)
+	{
+		bloom_set(dc, hash_long(lfn, len));
+		dc->bloom_count++;
+	}
+
+	mutex_unlock(&fat->cache_lock);
+}
+
+/* 0 if the directory definitely has no entry with this short name(NULL if the name cant be one) or long name(len < 0 if none).
+   1 if it might */
+int dir_cache_may_contain(fat_dir_cache_t *dc, const unsigned char *short_name, const unsigned short *name, int len)
+{
+	if(dc->bloom == NULL)
+		return 1;
+
+	if(short_name != NULL && bloom_test(dc, hash_short(short_name)))
+		return 1;
+
+	if(len >= 0 && bloom_test(dc, hash_long(name, len)))
+		return 1;
+
+	return 0;
+}
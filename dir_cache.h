@@ -0,0 +1,69 @@
+
+#ifndef _FAT_DIR_CACHE_H_
+#define _FAT_DIR_CACHE_H_
+
+__BEGIN_DECLS
+
+#include "dir_entry.h"
+
+#define DIR_CACHE_SIZE 8   /* Number of directories we keep a free slot map for */
+
+#define DIR_BLOOM_BITS_PER_NAME 10   /* About 1% false positives with 3 hashes */
+#define DIR_BLOOM_MIN_BITS      256
+
+typedef struct fat_dir_sector fat_dir_sector_t;
+
+/* Free slot summary of one directory sector. A slot is free when its first byte is 0x00 or 0xE5 */
+struct fat_dir_sector
+{
+	unsigned int   sector;   /* Sector location */
+	unsigned short free;     /* Bit n is set when the n'th entry in the sector is free */
+	unsigned char  head;     /* Number of free entries at the start of the sector */
+	unsigned char  tail;     /* Number of free entries at the end of the sector */
+	unsigned char  span;     /* Longest run of free entries inside the sector */
+};
+
+typedef struct fat_dir_cache fat_dir_cache_t;
+
+/* Free slot map of a whole directory. Sectors are kept in the order the directory uses them(follows the cluster chain) */
+struct fat_dir_cache
+{
+	int               used;          /* 0 - Not Used, 1 - Used */
+	unsigned int      cluster;       /* First cluster of the directory (0 for the FAT16 root directory). Used as the key */
+	unsigned int      end_cluster;   /* Last cluster of the directory */
+	unsigned int      stamp;         /* When this map was last used. Oldest one gets thrown out first */
+	unsigned int      first_free;    /* No sector before this one has a free entry */
+	unsigned int      num_sectors;   /* Number of sectors in 'sectors' */
+	unsigned int      max_sectors;   /* Number of sectors 'sectors' can hold */
+	fat_dir_sector_t *sectors;
+	
+	unsigned int     *bloom;         /* Bloom filter of the (case folded) long and short names in the directory. NULL if there is none */
+	unsigned int      bloom_bits;    /* Size of bloom in bits. Power of 2 */
+	unsigned int      bloom_count;   /* Number of names that went into bloom */
+	unsigned int     *hashes;        /* Hashes of the names seen while the map is being built. Turned into bloom when it is published */
+	unsigned int      num_hashes;
+	unsigned int      max_hashes;
+	int               no_bloom;      /* 1 if the names weren't noted while the map was built. It is published without a Bloom filter */
+};
+
+int dir_cache_init(fatfs_t *fat);
+void dir_cache_shutdown(fatfs_t *fat);
+
+fat_dir_cache_t *dir_cache_find(fatfs_t *fat, unsigned int cluster);
+void dir_cache_invalidate(fatfs_t *fat, unsigned int cluster);
+
+void dir_cache_begin(fat_dir_cache_t *dc, unsigned int cluster);
+int dir_cache_add_sector(fatfs_t *fat, fat_dir_cache_t *dc, unsigned int sector, const unsigned char *buf);
+fat_dir_cache_t *dir_cache_publish(fatfs_t *fat, fat_dir_cache_t *dc);
+void dir_cache_discard(fat_dir_cache_t *dc);
+
+int dir_cache_find_run(fatfs_t *fat, fat_dir_cache_t *dc, int num_entries, int loc[]);
+void dir_cache_mark(fatfs_t *fat, unsigned int cluster, unsigned int sector_loc, int ptr, int count, int is_free);
+
+void dir_cache_note_name(fat_dir_cache_t *dc, const unsigned char *short_name, const unsigned short *lfn, int len);
+void dir_cache_add_name(fatfs_t *fat, unsigned int cluster, const unsigned char *short_name, const unsigned short *lfn, int len);
+int dir_cache_may_contain(fat_dir_cache_t *dc, const unsigned char *short_name, const unsigned short *name, int len);
+
+__END_DECLS
+
+#endif /* _FAT_DIR_CACHE_H_ */
@@ -1,58 +1,42 @@
 
+#include <time.h>
 #include <errno.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "utils.h"
 #include "fatfs.h"
 
 #include "dir_entry.h"
+#include "dir_cache.h"
+#include "fat_au.h"
 
-unsigned char * extract_long_name(fat_lfn_entry_t *lfn) 
+/* Number of sectors starting at sector 'numOfSector' of file(in cluster 'cluster') that are next to each other on the device. 
+   Stops at 'max'. Runs over into the next clusters as long as they follow on */
+static int contiguous_sectors(fatfs_t *fat, node_entry_t *file, unsigned int cluster, int numOfSector, int max, int alloc)
 {
-	int i;
-	
-	unsigned char temp[2];
-	unsigned char buf[14];
-	unsigned char *final = NULL;
-	
-	memset(temp, 0, sizeof(unsigned char)*2);
-	memset(buf, 0, sizeof(unsigned char)*14);
-	
-	/* Get first five ascii */
-	for(i = 0; i < 5; i++) 
-	{
-		memcpy(temp, &lfn->FNPart1[i*2], 1);
-		strcat(buf, temp);
-	}
+	const int spc = fat->boot_sector.sectors_per_cluster;
+	int n = spc - (numOfSector % spc); /* Rest of this cluster */
+	unsigned int index = numOfSector / spc;
 	
-	/* Next six ascii */
-	for(i = 0; i < 6; i++) 
-	{
-		memcpy(temp, &lfn->FNPart2[i*2], 1);
-		strcat(buf, temp);
-	}
-	
-	/* Last two ascii */
-	for(i = 0; i < 2; i++) 
-	{
-		memcpy(temp, &lfn->FNPart3[i*2], 1);
-		strcat(buf, temp);
-	}
-	
-	buf[13] = '\0';
+	while(n < max && file_cluster(fat, file, ++index, alloc) == ++cluster)
+		n += spc;
 	
-	/* Remove filler chars at end of the long file name */
-	final = remove_all_chars(buf, 0xFF);
-	
-	return final;
+	return (n > max) ? max : n;
 }
 
-int fat_read_data(fatfs_t *fat, node_entry_t *file, unsigned char **buf, int count, int pointer)
+/* Read 'count' bytes of file starting at byte 'pointer' into buf. buf gets exactly what is in the file(no terminator is added).
+   Whole sectors go straight into buf, as many at a time as are next to each other on the device */
+int fat_read_data(fatfs_t *fat, node_entry_t *file, unsigned char *buf, int count, int pointer)
 {
-	int i;
+	unsigned int cluster;
 	int ptr = pointer;
 	int cnt = count;
 	int numOfSector = 0;
@@ -60,12 +44,10 @@ int fat_read_data(fatfs_t *fat, node_entry_t *file, unsigned char **buf, int cou
 	int curSectorPos = 0;
 	int sector_loc = 0;  
 	int numToRead = 0;
+	int numSectors = 0;
 	const int bytes_per_sector = fat->boot_sector.bytes_per_sector;
 	 
-	unsigned char *sector = malloc(512*sizeof(unsigned char)); /* Each sector is 512 bytes long */
-
-	/* Clear */
-	memset(*buf, 0, sizeof(unsigned char)*count);
+	unsigned char sector[512]; /* Each sector is 512 bytes long */
 
 	/* While we still have more to read, do it */
 	while(cnt)
@@ -76,63 +58,61 @@ int fat_read_data(fatfs_t *fat, node_entry_t *file, unsigned char **buf, int cou
 		/* Figure out which cluster we are reading from */
 		clusterNodeNum = numOfSector / fat->boot_sector.sectors_per_cluster;
 
-		/* If new cluster is needed, get it */
-		if(file->NumCluster != clusterNodeNum)
-		{
-			if((file->NumCluster+1) == clusterNodeNum) /* If its just the next cluster, only have to read fat table once */
-			{
-				file->CurrCluster = read_fat_table_value(fat, file->CurrCluster*fat->byte_offset);
-				file->NumCluster++;
-			}
-			else /* Its not the next cluster, find it starting from the beginning */
-			{
-				/* Set to first cluster */
-				file->CurrCluster = file->StartCluster; 
-		
-				/* Advance to the cluster we want to read from. */
-				for(i = 0; i < clusterNodeNum; i++) 
-				{
-					file->CurrCluster = read_fat_table_value(fat, file->CurrCluster*fat->byte_offset);
-				}
-				
-				file->NumCluster = clusterNodeNum;
-			}
-		}
+		/* Find the cluster in the map of the file */
+		if((cluster = file_cluster(fat, file, clusterNodeNum, 0)) == 0)
+			return -1;
 
 		/* Calculate Sector Location from cluster and sector we want to read */
-		sector_loc = fat->data_sec_loc + ((file->CurrCluster - 2) * fat->boot_sector.sectors_per_cluster) + (numOfSector - (clusterNodeNum * fat->boot_sector.sectors_per_cluster)); 
+		sector_loc = fat->data_sec_loc + ((cluster - 2) * fat->boot_sector.sectors_per_cluster) + (numOfSector - (clusterNodeNum * fat->boot_sector.sectors_per_cluster)); 
 
-		/* Read 1 sector */
-		if(fat->dev->read_blocks(fat->dev, sector_loc, 1, sector) != 0)
+		/* Calculate current byte position in the sector we want to start reading from */
+		curSectorPos = ptr - (numOfSector * bytes_per_sector);
+
+		if(curSectorPos == 0 && cnt >= bytes_per_sector) /* Whole sectors. Read them right into buf */
 		{
+			numSectors = contiguous_sectors(fat, file, cluster, numOfSector, cnt / bytes_per_sector, 0);
+			
+			if(fat_read_sectors(fat, FAT_TRACE_DATA, sector_loc, numSectors, buf) != 0)
+			{
 #ifdef FATFS_DEBUG
-			printf("fat_read_data(dir_entry.c): Couldn't read the sector %d\n", sector_loc);
+				printf("fat_read_data(dir_entry.c): Couldn't read %d sectors at %d\n", numSectors, sector_loc);
 #endif
-			return -1;
+				return -1;
+			}
+			
+			numToRead = numSectors * bytes_per_sector;
 		}
+		else /* Part of a sector */
+		{
+			/* Read 1 sector */
+			if(fat_read_sectors(fat, FAT_TRACE_DATA, sector_loc, 1, sector) != 0)
+			{
+#ifdef FATFS_DEBUG
+				printf("fat_read_data(dir_entry.c): Couldn't read the sector %d\n", sector_loc);
+#endif
+				return -1;
+			}
 
-		/* Calculate current byte position in the sector we want to start reading from */
-		curSectorPos = ptr - (numOfSector * bytes_per_sector);
-
-		/* Calculate the number of chars to read */
-		numToRead = ((bytes_per_sector - curSectorPos) > cnt) ? cnt : (bytes_per_sector - curSectorPos);
+			/* Calculate the number of bytes to read */
+			numToRead = ((bytes_per_sector - curSectorPos) > cnt) ? cnt : (bytes_per_sector - curSectorPos);
 
-		/* Concat */
-		strncat(*buf, sector + curSectorPos, numToRead);
+			memcpy(buf, sector + curSectorPos, numToRead);
+		}
 
 		/* Advance variables */
 		ptr += numToRead;  /* Advance file pointer */
+		buf += numToRead;  /* Advance buf pointer */
 		cnt -= numToRead;  /* Decrease bytes left to read */
 	}
-	
-	free(sector);
 
 	return 0;
 }
 
-int fat_write_data(fatfs_t *fat, node_entry_t *file, unsigned char *bbuf, int count, int pointer)
+/* Write 'count' bytes of buf to file starting at byte 'pointer'. Clusters are added to the file as needed.
+   Whole sectors are written straight from buf, partial ones are read first */
+int fat_write_data(fatfs_t *fat, node_entry_t *file, unsigned char *buf, int count, int pointer)
 {
-	int i;
+	unsigned int cluster;
 	int ptr = pointer;
 	int cnt = count;
 	int numOfSector = 0;
@@ -140,10 +120,11 @@ int fat_write_data(fatfs_t *fat, node_entry_t *file, unsigned char *bbuf, int co
 	int curSectorPos = 0;
 	int sector_loc = 0;  
 	int numToWrite = 0;
-	unsigned char *buf = bbuf;
+	int numSectors = 0;
 	const int bytes_per_sector = fat->boot_sector.bytes_per_sector;
+	const int clusters = (pointer + count - 1) / (bytes_per_sector * fat->boot_sector.sectors_per_cluster) + 1; /* The file has at least this many after */
 	
-	unsigned char *sector = malloc(512*sizeof(unsigned char)); /* Each sector is 512 bytes long */ 
+	unsigned char sector[512]; /* Each sector is 512 bytes long */ 
 
 	/* While we still have more to write, do it */
 	while(cnt)
@@ -154,100 +135,55 @@ int fat_write_data(fatfs_t *fat, node_entry_t *file, unsigned char *bbuf, int co
 		/* Figure out which cluster we are writing to */
 		clusterNodeNum = numOfSector / fat->boot_sector.sectors_per_cluster;
 		
-		/* This file has no clusters allocated to it, allocate one */
-		if(file->StartCluster == 0)
-		{
-			file->StartCluster = allocate_cluster(fat, 0);
-			file->EndCluster = file->StartCluster;
-			file->CurrCluster = file->StartCluster;
-			file->NumCluster = 0;
-		}
-		else
+		/* Find the cluster in the map of the file. Clusters get added to the file if it isnt that big yet */
+		if((cluster = file_cluster(fat, file, clusterNodeNum, clusters)) == 0)
+			return -1;
+
+		/* Calculate Sector Location from cluster and sector we want to read and then write to */
+		sector_loc = fat->data_sec_loc + ((cluster - 2) * fat->boot_sector.sectors_per_cluster) + (numOfSector - (clusterNodeNum * fat->boot_sector.sectors_per_cluster)); 
+		
+		/* Calculate current byte position in the sector we want to start writing to */
+		curSectorPos = ptr - (numOfSector * bytes_per_sector);
+
+		if(curSectorPos == 0 && cnt >= bytes_per_sector) /* Whole sectors. Nothing in them has to be kept */
 		{
-			/* If new cluster is needed, get it */
-			if(file->NumCluster != clusterNodeNum)
-			{
-				if((file->NumCluster+1) == clusterNodeNum) /* If its just the next cluster, only have to read fat table once */
-				{
-					file->CurrCluster = read_fat_table_value(fat, file->CurrCluster*fat->byte_offset);
-					
-					/* Check if the next cluster exists. If it doesn't then allocate another cluster for this file and break */
-					if((fat->fat_type == FAT16 && file->CurrCluster >= 0xFFF8)
-					|| (fat->fat_type == FAT32 && file->CurrCluster >= 0xFFFFFF8))
-					{
-						if((file->CurrCluster = allocate_cluster(fat, file->EndCluster)) == 0)
-						{
-#ifdef FATFS_DEBUG
-							printf("fat_write_data(dir_entry.c): All out of clusters to Allocate\n");
-#endif
-							return -1;
-						}
-						file->EndCluster = file->CurrCluster;
-					}
-					
-					file->NumCluster++;
-				}
-				else
-				{
-				
-					/* Set to first cluster */
-					file->CurrCluster = file->StartCluster; 
+			numSectors = contiguous_sectors(fat, file, cluster, numOfSector, cnt / bytes_per_sector, clusters);
 			
-					/* Advance to the cluster we want to write to */
-					for(i = 0; i < clusterNodeNum; i++) 
-					{
-						/* Grab the next cluster */
-						file->CurrCluster = read_fat_table_value(fat, file->CurrCluster*fat->byte_offset);
-						
-						/* Check if the next cluster exists. If it doesn't then allocate another cluster for this file and break */
-						if((fat->fat_type == FAT16 && file->CurrCluster >= 0xFFF8)
-						|| (fat->fat_type == FAT32 && file->CurrCluster >= 0xFFFFFF8))
-						{
-							if((file->CurrCluster = allocate_cluster(fat, file->EndCluster)) == 0)
-							{
+			if(fat_write_sectors(fat, FAT_TRACE_DATA, sector_loc, numSectors, buf) != 0)
+			{
 #ifdef FATFS_DEBUG
-								printf("fat_write_data(dir_entry.c): All out of clusters to Allocate\n");
+				printf("fat_write_data(dir_entry.c): Couldnt write %d sectors at %d\n", numSectors, sector_loc);
 #endif
-								return -1;
-							}
-							file->EndCluster = file->CurrCluster;
-							break;
-						}
-					}
-					
-					file->NumCluster = clusterNodeNum;
-				}
+				return -1;
 			}
+			
+			numToWrite = numSectors * bytes_per_sector;
 		}
-
-		/* Calculate Sector Location from cluster and sector we want to read and then write to */
-		sector_loc = fat->data_sec_loc + ((file->CurrCluster - 2) * fat->boot_sector.sectors_per_cluster) + (numOfSector - (clusterNodeNum * fat->boot_sector.sectors_per_cluster)); 
-		
-		/* Read 1 sector */
-		if(fat->dev->read_blocks(fat->dev, sector_loc, 1, sector) != 0)
+		else /* Part of a sector */
 		{
+			/* Read 1 sector */
+			if(fat_read_sectors(fat, FAT_TRACE_DATA, sector_loc, 1, sector) != 0)
+			{
 #ifdef FATFS_DEBUG
-			printf("fat_write_data(dir_entry.c): Couldn't read the sector %d\n", sector_loc);
+				printf("fat_write_data(dir_entry.c): Couldn't read the sector %d\n", sector_loc);
 #endif
-			return -1;
-		}
-
-		/* Calculate current byte position in the sector we want to start writing to */
-		curSectorPos = ptr - (numOfSector * bytes_per_sector);
+				return -1;
+			}
 
-		/* Calculate the number of chars to write */
-		numToWrite = ((bytes_per_sector - curSectorPos) > cnt) ? cnt : (bytes_per_sector - curSectorPos);
+			/* Calculate the number of bytes to write */
+			numToWrite = ((bytes_per_sector - curSectorPos) > cnt) ? cnt : (bytes_per_sector - curSectorPos);
 
-		/* Memcpy */
-		memcpy(sector + curSectorPos, buf, numToWrite);
+			/* Memcpy */
+			memcpy(sector + curSectorPos, buf, numToWrite);
 
-		/* Write one sector */
-		if(fat->dev->write_blocks(fat->dev, sector_loc, 1, sector) != 0)
-		{
+			/* Write one sector */
+			if(fat_write_sectors(fat, FAT_TRACE_DATA, sector_loc, 1, sector) != 0)
+			{
 #ifdef FATFS_DEBUG
-			printf("fat_write_data(dir_entry.c): Couldnt write the sector %d\n", sector_loc);
+				printf("fat_write_data(dir_entry.c): Couldnt write the sector %d\n", sector_loc);
 #endif
-			return -1;
+				return -1;
+			}
 		}
 
 		/* Advance variables */
@@ -255,8 +191,6 @@ int fat_write_data(fatfs_t *fat, node_entry_t *file, unsigned char *bbuf, int co
 		buf += numToWrite;  /* Advance buf pointer */
 		cnt -= numToWrite;  /* Decrease bytes left to write */
 	}
-	
-	free(sector);
 
 	return 0;
 }
@@ -270,16 +204,17 @@ void update_sd_entry(fatfs_t *fat, node_entry_t *file)
 	time_t rawtime;
 	short tme = 0;
 	short date = 0;
-	struct tm * timeinfo;
+	struct tm timeinfo;
 
+	/* localtime_r(), writers on other mounts run at the same time */
 	time (&rawtime);
-	timeinfo = localtime(&rawtime);
+	localtime_r(&rawtime, &timeinfo);
 	
-	tme = generate_time(timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec/2);
-	date = generate_date(1900 + timeinfo->tm_year, timeinfo->tm_mon+1, timeinfo->tm_mday);
+	tme = generate_time(timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec/2);
+	date = generate_date(1900 + timeinfo.tm_year, timeinfo.tm_mon+1, timeinfo.tm_mday);
 	
 	/* Read sector */
-	if(fat->dev->read_blocks(fat->dev, file->Location[0], 1, sector) != 0)
+	if(fat_read_sectors(fat, FAT_TRACE_DIR, file->Location[0], 1, sector) != 0)
 	{
 #ifdef FATFS_DEBUG
 		printf("update_sd_entry(dir_entry.c): Couldn't read the sector %d\n", file->Location[0]);
@@ -297,9 +232,13 @@ void update_sd_entry(fatfs_t *fat, node_entry_t *file)
 	memcpy(sector + file->Location[1] + LASTACCESSDATE, &(date), 2);
 	memcpy(sector + file->Location[1] + LASTWRITETIME, &(tme), 2);
 	memcpy(sector + file->Location[1] + LASTWRITEDATE, &(date), 2);
+	
+	file->AccDate = date;
+	file->WrtTime = tme;
+	file->WrtDate = date;
 
 	/* Write it back */
-	if(fat->dev->write_blocks(fat->dev, file->Location[0], 1, sector) != 0)
+	if(fat_write_sectors(fat, FAT_TRACE_DIR, file->Location[0], 1, sector) != 0)
 	{
 #ifdef FATFS_DEBUG
 		printf("update_sd_entry(dir_entry.c): Couldn't write the sector %d\n", file->Location[0]);
@@ -310,6 +249,32 @@ void update_sd_entry(fatfs_t *fat, node_entry_t *file)
 	free(sector);
 }
 
+/* Point the entry of file at file->StartCluster. Nothing else in the entry changes(time stamps included), so a file
+   that only got moved doesn't look modified. Returns 0 or -1(errno EIO) */
+int set_sd_start_cluster(fatfs_t *fat, node_entry_t *file)
+{
+	unsigned short clusthi = (file->StartCluster >> 16);
+	unsigned short clustlo = (file->StartCluster & 0xFFFF);
+	unsigned char sector[512];
+	
+	if(fat_read_sectors(fat, FAT_TRACE_DIR, file->Location[0], 1, sector) != 0)
+	{
+		errno = EIO;
+		return -1;
+	}
+	
+	memcpy(sector + file->Location[1] + STARTCLUSTERHI, &(clusthi), 2);
+	memcpy(sector + file->Location[1] + STARTCLUSTERLOW, &(clustlo), 2);
+	
+	if(fat_write_sectors(fat, FAT_TRACE_DIR, file->Location[0], 1, sector) != 0)
+	{
+		errno = EIO;
+		return -1;
+	}
+	
+	return 0;
+}
+
 void delete_struct_entry(node_entry_t * node)
 {
 	if(node == NULL)
@@ -317,21 +282,54 @@ void delete_struct_entry(node_entry_t * node)
 		
     free(node->Name);      /* Free the name */
 	free(node->ShortName); /* Free the shortname */
+	free(node->Extents);
 	free(node);
     
     node = NULL;
 }
 
-unsigned int allocate_cluster(fatfs_t *fat, unsigned int end_clust)
+/* Make a copy of node that has its own Name/ShortName */
+node_entry_t *copy_struct_entry(node_entry_t *node)
+{
+	node_entry_t *rv;
+	
+	if(!(rv = malloc(sizeof(node_entry_t))))
+		return NULL;
+	
+	memcpy(rv, node, sizeof(node_entry_t));
+	
+	rv->Name = malloc(strlen(node->Name)+1);
+	rv->ShortName = malloc(strlen(node->ShortName)+1);
+	strcpy(rv->Name, node->Name);
+	strcpy(rv->ShortName, node->ShortName);
+	
+	/* The copy builds its own cluster map */
+	rv->Extents = NULL;
+	reset_cluster_map(rv);
+	
+	return rv;
+}
+
+/* Take a free cluster and chain it after end_clust(0 for a new chain). size is the number of clusters the file is
+   going to have, which decides where the cluster goes when the AU size of the card is known(see fat_au.c) */
+unsigned int allocate_cluster(fatfs_t *fat, unsigned int end_clust, unsigned int size)
 {
-    unsigned int fat_index = fat->next_free_fat_index;
+    unsigned int fat_index, picked;
+	
+	mutex_lock(&fat->fat_lock);
+	
+	fat_index = fat->next_free_fat_index;
+	
+	/* The cluster fat_au_pick() picked is free, so the search below stops right there */
+	if(fat->au_used != NULL && (picked = fat_au_pick(fat, end_clust, size)) != 0)
+		fat_index = picked;
 	
 	unsigned int cap = fat_index;
 	unsigned int marker = (fat->fat_type == FAT16) ? 0xFFFF : 0x0FFFFFFF;
     unsigned int cluster_num = 0;
 
     /* Search for a free cluster starting at index 2 or the last index where we found a free cluster(makes future calls faster) */
-    while(fat_index < fat->boot_sector.bytes_per_sector*fat->table_size) { /* Go through Table one index at a time */
+    while(fat_index < fat->total_clusters_num + 2) { /* Go through Table one index at a time. The FAT can be bigger than the volume needs */
 	
 		cluster_num = read_fat_table_value(fat, fat_index*fat->byte_offset);
         
@@ -349,6 +347,8 @@ unsigned int allocate_cluster(fatfs_t *fat, unsigned int end_clust)
 			
 			fat->next_free_fat_index = fat_index; /* Save this index for next time */
 			
+			mutex_unlock(&fat->fat_lock);
+			FAT_STAT_ADD(fat, clusters_allocated, 1);
             return fat_index;
         }
       
@@ -374,6 +374,8 @@ unsigned int allocate_cluster(fatfs_t *fat, unsigned int end_clust)
             
 			fat->next_free_fat_index = fat_index; /* Save this index for next time */
 			
+			mutex_unlock(&fat->fat_lock);
+			FAT_STAT_ADD(fat, clusters_allocated, 1);
             return fat_index;
         }
 	}
@@ -383,419 +385,1006 @@ unsigned int allocate_cluster(fatfs_t *fat, unsigned int end_clust)
 #endif
     
     /* Didn't find a free cluster */
+	mutex_unlock(&fat->fat_lock);
     return 0;
 }
 
 
-void delete_cluster_list(fatfs_t *fat, node_entry_t *f)
+/* Get FAT sector 'sector'(from file_alloc_tab_sec_loc) into fat->fat_buf. fat_lock is held. Returns 0 or -1 */
+static int load_fat_sector(fatfs_t *fat, unsigned int sector)
+{
+	if(fat->fat_sector_offset == (int)sector)
+		return 0;
+	
+	fat->fat_sector_offset = sector;
+	FAT_STAT_ADD(fat, fat_misses, 1);
+	
+	if(fat_read_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + sector, 1, fat->fat_buf) != 0)
+	{
+		fat->fat_sector_offset = -1;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* Runs of clusters free_chain() freed, kept until they can be discarded */
+typedef struct freed_runs
+{
+	fat_discard_t *run;
+	unsigned int num;
+	unsigned int max;
+	unsigned int written;              /* run[0 .. written - 1] are free in the FAT on the device */
+} freed_runs_t;
+
+/* Add clust to the runs. Only runs of the FAT sector being changed(after 'written') are made longer */
+static void freed_runs_add(fatfs_t *fat, freed_runs_t *r, unsigned int clust)
 {
-	const short int clear = 0;
-	unsigned int clust = f->StartCluster;
-	unsigned int value;
+	fat_discard_t *tmp;
 	
-	if(clust == 0)
+	if(fat->discard == NULL)
 		return;
 	
-	while((fat->fat_type == FAT16 && clust < 0xFFF8)
-      || (fat->fat_type == FAT32 && clust < 0xFFFFFF8))
+	if(r->num > r->written && clust == r->run[r->num - 1].first + r->run[r->num - 1].count)
 	{
-		value = read_fat_table_value(fat, clust*fat->byte_offset);
-		write_fat_table_value(fat, clust*fat->byte_offset, clear);
-#ifdef FATFS_DEBUG
-		printf("delete_cluster_list(dir_entry.c) Freed Cluster: %d\n", clust);
-#endif
-		clust = value;
+		r->run[r->num - 1].count++;
+		return;
 	}
 	
-	f->StartCluster = 0;
-	f->EndCluster = 0;
+	/* Discards are only a hint to the device, so without memory for more runs the clusters just aren't discarded */
+	if(r->num == r->max)
+	{
+		if(!(tmp = realloc(r->run, (r->max ? r->max * 2 : 16) * sizeof(fat_discard_t))))
+			return;
+		
+		r->run = tmp;
+		r->max = r->max ? r->max * 2 : 16;
+	}
+	
+	r->run[r->num].first = clust;
+	r->run[r->num].count = 1;
+	r->num++;
 }
 
-int generate_and_write_entry(fatfs_t *fat, char *entry_name, node_entry_t *newfile, node_entry_t *parent)
+/* Discard the runs that got written, joining the ones next to each other. Called without fat_lock */
+static void freed_runs_flush(fatfs_t *fat, freed_runs_t *r)
 {
-	int i;
-	int *loc = NULL;
-	int last;
-	unsigned char order = 1;
-	unsigned int offset = 0;
+	fat_discard_t d = { 0, 0 };
+	unsigned int i;
 	
-	char *shortname = NULL;
-	unsigned char checksum;
+	for(i = 0; i < r->written; i++)
+	{
+		if(d.count && r->run[i].first == d.first + d.count)
+		{
+			d.count += r->run[i].count;
+			continue;
+		}
+		
+		fat_discard_flush(fat, &d);
+		d = r->run[i];
+	}
 	
-	int longfilename = 0;
-	unsigned char res = 0x00;
+	fat_discard_flush(fat, &d);
+	free(r->run);
+}
 
-    fat_dir_entry_t entry;
-	fat_lfn_entry_t *lfn_entry_list[20];  /* Can have a maximum of 20 long file name entries */
+/* Free the chain starting at clust. Every FAT sector the chain goes through is read and written once for all of its
+   entries in there instead of once per cluster, so a file in one piece takes one write per 256(FAT16) or 128 clusters.
+   Clusters are only discarded once the sector that frees them is written, after fat_lock is let go. If a sector can't
+   be written the rest of the chain is left alone, since that sector still links to it on the device */
+static void free_chain(fatfs_t *fat, unsigned int clust)
+{
+	const unsigned int bps = fat->boot_sector.bytes_per_sector;
+	const unsigned int end = (fat->fat_type == FAT16) ? 0xFFF8 : 0x0FFFFFF8;
+	unsigned int sector, value, i, freed = 0;
+	unsigned char *p;
+	unsigned char old_buf[sizeof(fat->fat_buf)];
+	freed_runs_t runs = { NULL, 0, 0, 0 };
 	
-	for(i = 0; i < 20; i++)
-		lfn_entry_list[i] = NULL;
-    
-    shortname = generate_short_filename(fat, parent, entry_name, &longfilename, &res);
-	checksum = generate_checksum(shortname);
+	mutex_lock(&fat->fat_lock);
 	
-	newfile->ShortName = malloc(strlen(shortname) + 1);
-	strncpy(newfile->ShortName, shortname, strlen(shortname));
-	newfile->ShortName[strlen(shortname)] = '\0';
-    
-	/* Make lfn entries */
-	if(longfilename)
-    {
-		i = 0;
+	/* A broken chain can lead to 0 or 1, which aren't clusters */
+	while(clust >= 2 && clust < end && clust < fat->total_clusters_num + 2)
+	{
+		sector = clust * fat->byte_offset / bps;
+		
+		if(load_fat_sector(fat, sector) != 0)
+			break;
 		
-		while(offset < strlen(entry_name))
+		memcpy(old_buf, fat->fat_buf, bps);
+		
+		/* Every entry of the chain that is in this sector */
+		while(clust >= 2 && clust < end && clust < fat->total_clusters_num + 2 && clust * fat->byte_offset / bps == sector)
 		{
-			/* Build long name entries */
-			lfn_entry_list[i++] = generate_long_filename_entry(entry_name+offset, checksum, order++);
-			offset += 13;
+			p = &fat->fat_buf[clust * fat->byte_offset % bps];
+			value = 0;
+			memcpy(&value, p, fat->byte_offset);
+			memset(p, 0, (fat->fat_type == FAT16) ? 2 : 3);
+			
+			if(fat->fat_type == FAT32)
+			{
+				p[3] &= 0xF0;   /* The top 4 bits are reserved */
+				value &= 0x0FFFFFFF;
+			}
+			
+			fat_au_update(fat, clust, value, 0);
+			freed_runs_add(fat, &runs, clust);
+#ifdef FATFS_DEBUG
+			printf("free_chain(dir_entry.c) Freed Cluster: %d\n", clust);
+#endif
+			clust = value;
+			freed++;
 		}
 		
-		last = i - 1; /* Refers to last entry in array */
-		
-		lfn_entry_list[last]->Order |= 0x40; /* Set(OR) last one to special value order to signify it is the last lfn entry */
+		if(fat_write_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + sector, 1, fat->fat_buf) == 0)
+		{
+			runs.written = runs.num;
+			continue;
+		}
 		
-		/* Get loc for order amount of entries plus 1(shortname entry). Returns an int array Sector(loc[0]), ptr(loc[1]) */
-		loc = get_free_locations(fat, parent, (int)order);
+		/* The clusters of this sector are still in use on the device, so fat_buf is no good and they count again */
+		fat->fat_sector_offset = -1;
+		runs.num = runs.written;
 		
-		/* Write it(reverse order) */
-		for(i = last; i >= 0; i--)
+		for(i = 0; i < bps; i += fat->byte_offset)
 		{
-			write_entry(fat, lfn_entry_list[i], LONGFILENAME, loc);
-				
-			/* Do calculations for sector if need be */
-			loc[1] += 32;
+			value = 0;
+			memcpy(&value, &old_buf[i], fat->byte_offset);
 			
-			if((loc[1]/fat->boot_sector.bytes_per_sector) >= 1)
+			if(fat->fat_type == FAT32)
+				value &= 0x0FFFFFFF;
+			
+			if(value != 0 && memcmp(&old_buf[i], &fat->fat_buf[i], fat->byte_offset) != 0)
 			{
-				loc[0]++;   /* New sector */
-				loc[1] = 0; /* Reset ptr in new sector */
+				fat_au_update(fat, (sector * bps + i) / fat->byte_offset, 0, value);
+				freed--;
 			}
 		}
-    }
-	
-	/* Allocate a cluster. Folders Only. */
-	if(newfile->Attr & DIRECTORY)
-	{
-		newfile->StartCluster = allocate_cluster(fat, 0);
-		newfile->EndCluster = newfile->StartCluster;
-		clear_cluster(fat, newfile->StartCluster);
 		
-		if(fat->fat_type == FAT32)
-			set_fsinfo_nextfree(fat); /* Write it to FSInfo sector which only exists for Fat32 */
+		break;
 	}
 	
-	/* Make regular entry and write it to SD FAT */
-	strncpy(entry.FileName, shortname, 8);
-	entry.FileName[8] = '\0';
-	strncpy(entry.Ext, shortname+9, 3 ); /* Skip filename and '.' */
-	entry.Ext[3] = '\0';
-	entry.Attr = newfile->Attr;
-	entry.Res = res;
-	entry.FileSize = 0;   /* For both new files and new folders */
+	mutex_unlock(&fat->fat_lock);
 	
-	if(newfile->Attr & DIRECTORY) /* Folder */
-	{
-		entry.FstClusHI = newfile->StartCluster >> 16;
-		entry.FstClusLO = newfile->StartCluster & 0xFFFF; 
-	}
-	else /* File */
-	{
-		entry.FstClusHI = 0;
-		entry.FstClusLO = 0;  
-	}
+	freed_runs_flush(fat, &runs);
+	FAT_STAT_ADD(fat, clusters_freed, freed);
+}
+
+void delete_cluster_list(fatfs_t *fat, node_entry_t *f)
+{
+	if(f->StartCluster == 0)
+		return;
 	
-	/* Write it (after long file name entries) */
-	if(longfilename)
-	{
-		write_entry(fat, &entry, newfile->Attr, loc);
-	} else
-	{
-		loc = get_free_locations(fat, parent, 1);
-		write_entry(fat, &entry, newfile->Attr, loc);
-	}
+	/* The free slot map of a directory is no good once its clusters are gone */
+	if(f->Attr & DIRECTORY)
+		dir_cache_invalidate(fat, f->StartCluster);
 	
-	/* Save the locations */
-	newfile->Location[0] = loc[0];  
-	newfile->Location[1] = loc[1]; 
+	free_chain(fat, f->StartCluster);
 	
-	free(shortname);
-	free(loc);
-    
-    return 0;
+	f->StartCluster = 0;
+	f->EndCluster = 0;
+	reset_cluster_map(f);
 }
 
-void delete_sd_entry(fatfs_t *fat, node_entry_t *file)
+/* Keep the first 'keep' clusters of file and free the rest */
+static void cut_chain(fatfs_t *fat, node_entry_t *file, unsigned int keep)
 {
-	unsigned int sector_loc = file->Location[0];
-	int ptr = file->Location[1];
-	unsigned char sector[512];
+	const unsigned int marker = (fat->fat_type == FAT16) ? 0xFFFF : 0x0FFFFFFF;
+	unsigned int last, next;
 	
-	/* Delete Long file name entries (if any) */
-	ptr -= 32;
-	
-	if(ptr < 0)
+	if(keep == 0)
 	{
-		sector_loc -= 1;
-		ptr = fat->boot_sector.bytes_per_sector - 32;
+		delete_cluster_list(fat, file);
+		return;
 	}
-
-	/* Read fat sector */
-	fat->dev->read_blocks(fat->dev, sector_loc, 1, sector);
-
-	/* Edit Entry */
-	while((sector+ptr)[ATTRIBUTE] == LONGFILENAME && (sector+ptr)[0] != 0xE5)
-	{
-		(sector+ptr)[0] = 0xE5;
-		ptr -= 32;
 	
-		if(ptr < 0)
-		{
-			fat->dev->write_blocks(fat->dev, sector_loc, 1, sector);
-			
-			sector_loc -= 1;
-			ptr = fat->boot_sector.bytes_per_sector - 32;
-			fat->dev->read_blocks(fat->dev, sector_loc, 1, sector);
-		}
-	}
+	mutex_lock(&fat->fat_lock);
 	
-	if(sector_loc != file->Location[0]) /* Dont write and read the same block if we dont have to */
+	/* Nothing to do if it doesn't have that many */
+	if(file->StartCluster == 0 || (last = file_cluster(fat, file, keep - 1, 0)) == 0)
 	{
-		/* Write it back */
-		fat->dev->write_blocks(fat->dev, sector_loc, 1, sector);
-			
-		/* Read a diff sector */
-		fat->dev->read_blocks(fat->dev, file->Location[0], 1, sector);
+		mutex_unlock(&fat->fat_lock);
+		return;
 	}
 	
-	/* Delete file/folder entry */
-	(sector + file->Location[1])[0] = 0xE5;
+	next = read_fat_table_value(fat, last * fat->byte_offset);
 	
-	fat->dev->write_blocks(fat->dev, file->Location[0], 1, sector);
-}
-
-node_entry_t *fat_search_by_path(fatfs_t *fat, const char *fn)
-{	
-	unsigned char *ufn = malloc(strlen(fn)+1);
+	if(fat->fat_type == FAT32)
+		next &= 0x0FFFFFFF;
 	
-	unsigned char *pch = NULL;
-	node_entry_t *temp = NULL;
-	node_entry_t *rv = NULL;
-	unsigned int cluster = fat->root_cluster_num;
+	/* End the chain first. If the rest can't be freed it is only lost, not still part of the file */
+	if(next == 0 || next >= ((fat->fat_type == FAT16) ? 0xFFF8 : 0x0FFFFFF8))
+		next = 0;
+	else
+		write_fat_table_value(fat, last * fat->byte_offset, marker);
 	
-	/* Make sure the files/folders are captialized */
-    strcpy(ufn, fn);
-	ufn[strlen(fn)] = '\0';
+	file->EndCluster = last;
+	reset_cluster_map(file);
 	
-	/* Build Root */
-	temp = malloc(sizeof(node_entry_t));
-	temp->Name = (unsigned char *)remove_all_chars(fat->mount, '/');          /*  */
-	temp->ShortName = (unsigned char *)remove_all_chars(fat->mount, '/');
-	temp->Attr = DIRECTORY;           /* Root directory is obviously a directory */
-	temp->StartCluster = cluster;     /* Root directory has no data clusters associated with it(FAT16). Non-NULL with FAT32 */
-	temp->EndCluster = end_cluster(fat, temp->StartCluster);
+	mutex_unlock(&fat->fat_lock);
 	
-	rv = temp;
+	/* Nothing links to the rest anymore, so it is freed(and discarded) without holding up everyone else */
+	if(next != 0)
+		free_chain(fat, next);
+}
+
+
+/* Forget the cluster map of file. Needed whenever its chain is changed behind file_cluster()'s back */
+void reset_cluster_map(node_entry_t *file)
+{
+	free(file->Extents);
+	file->Extents = NULL;
+	file->NumExtents = 0;
+	file->MaxExtents = 0;
+	file->MappedClusters = 0;
+	file->MapDone = 0;
+}
+
+/* Add 'cluster' as the next cluster of the map of file */
+static int map_append(node_entry_t *file, unsigned int cluster)
+{
+	fat_extent_t *e;
 	
-	pch = strtok(ufn,"/");  /* Grab Root */
+	if(file->NumExtents > 0)
+	{
+		e = &file->Extents[file->NumExtents - 1];
+		
+		/* Most files are in one piece so the last run usually just gets longer */
+		if(e->Cluster + e->Count == cluster)
+		{
+			e->Count++;
+			file->MappedClusters++;
+			return 0;
+		}
+	}
 	
-    if(strcasecmp(pch, temp->Name) == 0) {
-        pch = strtok (NULL, "/"); 
+	if(file->NumExtents == file->MaxExtents)
+	{
+		unsigned int max = file->MaxExtents ? file->MaxExtents*2 : 4;
+		
+		if(!(e = realloc(file->Extents, sizeof(fat_extent_t)*max)))
+			return -1;
+		
+		file->Extents = e;
+		file->MaxExtents = max;
+	}
+	
+	e = &file->Extents[file->NumExtents++];
+	e->FileCluster = file->MappedClusters;
+	e->Cluster = cluster;
+	e->Count = 1;
+	file->MappedClusters++;
+	
+	return 0;
+}
 
-        while(pch != NULL) {
-            if((rv = search_directory(fat, temp, pch)) != NULL) 
-            {
-				pch = strtok (NULL, "/");
-				delete_struct_entry(temp);
-				temp = rv;
+/* Cluster number 'index'(0 is StartCluster) of file. The chain is only followed as far as it has to be and what was
+   found is kept in the map of file, so seeking back never walks the FAT table again. With alloc set the chain is grown
+   until it has that cluster, alloc being the number of clusters the file is going to have(for allocate_cluster()).
+   Returns 0 if there is no such cluster */
+unsigned int file_cluster(fatfs_t *fat, node_entry_t *file, unsigned int index, int alloc)
+{
+	unsigned int lo, hi, mid;
+	unsigned int last, next;
+	fat_extent_t *e;
+	
+	/* The map can be shared by everyone that has the file open */
+	mutex_lock(&fat->fat_lock);
+	
+	/* This file has no clusters allocated to it, allocate one */
+	if(file->StartCluster == 0)
+	{
+		if(!alloc || (file->StartCluster = allocate_cluster(fat, 0, (alloc > index) ? alloc : index + 1)) == 0)
+		{
+			mutex_unlock(&fat->fat_lock);
+			return 0;
+		}
+		
+		file->EndCluster = file->StartCluster;
+		reset_cluster_map(file);
+	}
+	
+	if(file->MappedClusters == 0 && map_append(file, file->StartCluster) != 0)
+	{
+		mutex_unlock(&fat->fat_lock);
+		return 0;
+	}
+	
+	while(index >= file->MappedClusters)
+	{
+		e = &file->Extents[file->NumExtents - 1];
+		last = e->Cluster + e->Count - 1;
+		
+		next = file->MapDone ? 0 : read_fat_table_value(fat, last*fat->byte_offset);
+		
+		/* Hit the end of the chain */
+		if(file->MapDone 
+		|| (fat->fat_type == FAT16 && next >= 0xFFF8)
+		|| (fat->fat_type == FAT32 && next >= 0xFFFFFF8))
+		{
+			file->MapDone = 1;
+			file->EndCluster = last;
+			
+			if(!alloc || (next = allocate_cluster(fat, last, (alloc > index) ? alloc : index + 1)) == 0)
+			{
+#ifdef FATFS_DEBUG
+				if(alloc)
+					printf("file_cluster(dir_entry.c): All out of clusters to Allocate\n");
+#endif
+				mutex_unlock(&fat->fat_lock);
+				return 0;
 			}
-			else 
+			
+			file->EndCluster = next;
+		}
+		
+		if(map_append(file, next) != 0)
+		{
+			mutex_unlock(&fat->fat_lock);
+			return 0;
+		}
+	}
+	
+	/* Find the run that has it */
+	lo = 0;
+	hi = file->NumExtents - 1;
+	
+	while(lo < hi)
+	{
+		mid = (lo + hi + 1)/2;
+		
+		if(file->Extents[mid].FileCluster <= index)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	
+	e = &file->Extents[lo];
+	next = e->Cluster + (index - e->FileCluster);
+	
+	mutex_unlock(&fat->fat_lock);
+	
+	return next;
+}
+
+/* Chain the 'count' free clusters after 'last'(which ends the chain) to it, writing each FAT sector once for all of the
+   entries in it. The run is ended first and linked last, so if it is cut short it is lost, not part of the file.
+   Returns 0 or -1 if a FAT sector couldn't be read or written */
+static int chain_run(fatfs_t *fat, unsigned int last, unsigned int count)
+{
+	const unsigned int bps = fat->boot_sector.bytes_per_sector;
+	const unsigned int marker = (fat->fat_type == FAT16) ? 0xFFFF : 0x0FFFFFFF;
+	unsigned int c = last + 1, end = last + 1 + count, sector, value, first;
+	unsigned char *p;
+	
+	while(c < end)
+	{
+		sector = c * fat->byte_offset / bps;
+		
+		if(load_fat_sector(fat, sector) != 0)
+			return -1;
+		
+		for(first = c; c < end && c * fat->byte_offset / bps == sector; c++)
+		{
+			p = &fat->fat_buf[c * fat->byte_offset % bps];
+			value = (c == end - 1) ? marker : c + 1;
+			
+			p[0] = value & 0xFF;
+			p[1] = (value >> 8) & 0xFF;
+			
+			if(fat->fat_type == FAT32)
+			{
+				p[2] = (value >> 16) & 0xFF;
+				p[3] = (p[3] & 0xF0) | ((value >> 24) & 0x0F);
+			}
+			
+			fat_au_update(fat, c, 0, value);
+		}
+		
+		/* The clusters of this sector are still free on the device, so fat_buf is no good and they don't count */
+		if(fat_write_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + sector, 1, fat->fat_buf) != 0)
+		{
+			fat->fat_sector_offset = -1;
+			
+			for(; first < c; first++)
+				fat_au_update(fat, first, first + 1, 0);
+			
+			return -1;
+		}
+	}
+	
+	write_fat_table_value(fat, last * fat->byte_offset, last + 1);
+	
+	fat->next_free_fat_index = end - 1;
+	FAT_STAT_ADD(fat, clusters_allocated, count);
+	
+	return 0;
+}
+
+/* Make file 'length' bytes long. A shorter file loses the clusters after its new end. A longer one gets its new clusters
+   first: allocate_cluster() picks where a run starts(knowing how big the file gets) and the free clusters after it are
+   taken along in one go. Then the new part is zeroed from fat_zero_buf, as many sectors at a time as are next to each
+   other. The caller writes the entry. Returns 0 or -1 with errno set(ENOSPC, or EIO from the FAT table, leaves the
+   file as it was) */
+int fat_truncate_file(fatfs_t *fat, node_entry_t *file, unsigned int length)
+{
+	const unsigned int cluster_bytes = fat->boot_sector.bytes_per_sector * fat->boot_sector.sectors_per_cluster;
+	const unsigned int need = length / cluster_bytes + (length % cluster_bytes != 0);
+	const unsigned int old = file->FileSize;
+	unsigned int have = old / cluster_bytes + (old % cluster_bytes != 0);
+	unsigned int pos, n, last;
+	
+	if(length <= old)
+	{
+		cut_chain(fat, file, need);
+		file->FileSize = length;
+		return 0;
+	}
+	
+	mutex_lock(&fat->fat_lock);
+	
+	/* A chain can be longer than the size says */
+	while(have < need && file_cluster(fat, file, have, 0) != 0)
+		have++;
+	
+	while(have < need)
+	{
+		if((last = file_cluster(fat, file, have++, need)) == 0)
+		{
+			mutex_unlock(&fat->fat_lock);
+			cut_chain(fat, file, old / cluster_bytes + (old % cluster_bytes != 0));
+			errno = ENOSPC;
+			return -1;
+		}
+		
+		/* The free clusters right after it, as far as the AU policy lets the file go on */
+		for(n = 0; have + n < need; n++)
+		{
+			if(!fat_au_continues(fat, last + n, need))
+				break;
+		}
+		
+		if(n > 0)
+		{
+			if(chain_run(fat, last, n) != 0)
+			{
+				mutex_unlock(&fat->fat_lock);
+				cut_chain(fat, file, old / cluster_bytes + (old % cluster_bytes != 0));
+				errno = EIO;
+				return -1;
+			}
+			
+			for(pos = 1; pos <= n; pos++)
+				map_append(file, last + pos);
+			
+			file->EndCluster = last + n;
+			have += n;
+		}
+	}
+	
+	mutex_unlock(&fat->fat_lock);
+	
+	for(pos = old; pos < length; pos += n)
+	{
+		/* After the first piece every write starts on a sector */
+		n = sizeof(fat_zero_buf) - pos % sizeof(fat_zero_buf);
+		n = (length - pos < n) ? length - pos : n;
+		
+		if(fat_write_data(fat, file, (unsigned char *)fat_zero_buf, n, pos) != 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+	}
+	
+	file->FileSize = length;
+	
+	return 0;
+}
+
+int generate_and_write_entry(fatfs_t *fat, char *entry_name, node_entry_t *newfile, node_entry_t *parent)
+{
+	int i;
+	int *loc = NULL;
+	int last = 0;
+	int num_entries = 1;
+	unsigned char order = 1;
+	int offset = 0;
+	
+	char *shortname = NULL;
+	unsigned char checksum;
+	
+	int longfilename = 0;
+	unsigned char res = 0x00;
+
+    fat_dir_entry_t entry;
+	fat_lfn_entry_t lfn_entry_list[20];  /* Can have a maximum of 20 long file name entries */
+	
+	int ucs_len;
+	unsigned short ucs[255];             /* Long file name in UCS-2 */
+	unsigned char key[11];               /* Short name the way it is on disk */
+	
+	if((ucs_len = utf8_to_ucs2((unsigned char *)entry_name, ucs, 255)) < 0)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+    
+    shortname = generate_short_filename(fat, parent, entry_name, &longfilename, &res);
+	
+	if(shortname == NULL)
+		return -1;
+	
+	checksum = generate_checksum(shortname);
+	
+	newfile->ShortName = malloc(strlen(shortname) + 1);
+	strncpy(newfile->ShortName, shortname, strlen(shortname));
+	newfile->ShortName[strlen(shortname)] = '\0';
+    
+	/* Make lfn entries */
+	if(longfilename)
+    {
+		i = 0;
+		
+		while(offset < ucs_len)
+		{
+			/* Build long name entries */
+			generate_long_filename_entry(&lfn_entry_list[i++], ucs, ucs_len, checksum, order++);
+			offset += 13;
+		}
+		
+		last = i - 1; /* Refers to last entry in array */
+		
+		lfn_entry_list[last].Order |= 0x40; /* Set(OR) last one to special value order to signify it is the last lfn entry */
+		
+		num_entries = (int)order; /* Long file name entries plus 1(shortname entry) */
+	}
+	
+	/* Get loc for all the entries. Returns an int array Sector(loc[0]), ptr(loc[1]) */
+	if((loc = get_free_locations(fat, parent, num_entries)) == NULL)
+	{
+		free(shortname);
+		return -1;
+	}
+	
+	newfile->LfnLocation[0] = loc[0];
+	newfile->LfnLocation[1] = loc[1];
+	newfile->ParentCluster = parent->StartCluster;
+	
+	if(longfilename)
+	{
+		/* Write it(reverse order) */
+		for(i = last; i >= 0; i--)
+		{
+			write_entry(fat, &lfn_entry_list[i], LONGFILENAME, loc);
+				
+			/* Do calculations for sector if need be */
+			loc[1] += 32;
+			
+			if((loc[1]/fat->boot_sector.bytes_per_sector) >= 1)
 			{
+				loc[0] = next_dir_sector(fat, loc[0]);   /* New sector(may be in the next cluster) */
+				loc[1] = 0;                             /* Reset ptr in new sector */
+			}
+		}
+    }
+	
+	/* Allocate a cluster. Folders Only. */
+	if(newfile->Attr & DIRECTORY)
+	{
+		newfile->StartCluster = allocate_cluster(fat, 0, 1);
+		newfile->EndCluster = newfile->StartCluster;
+		clear_cluster(fat, newfile->StartCluster);
+		
+		/* Make sure we dont use an old map for the new folder */
+		dir_cache_invalidate(fat, newfile->StartCluster);
+		
+		if(fat->fat_type == FAT32)
+			set_fsinfo_nextfree(fat); /* Write it to FSInfo sector which only exists for Fat32 */
+	}
+	
+	/* Make regular entry and write it to SD FAT */
+	strncpy(entry.FileName, shortname, 8);
+	entry.FileName[8] = '\0';
+	strncpy(entry.Ext, shortname+9, 3 ); /* Skip filename and '.' */
+	entry.Ext[3] = '\0';
+	entry.Attr = newfile->Attr;
+	entry.Res = res;
+	entry.FileSize = 0;   /* For both new files and new folders */
+	
+	if(newfile->Attr & DIRECTORY) /* Folder */
+	{
+		entry.FstClusHI = newfile->StartCluster >> 16;
+		entry.FstClusLO = newfile->StartCluster & 0xFFFF; 
+	}
+	else /* File */
+	{
+		entry.FstClusHI = 0;
+		entry.FstClusLO = 0;  
+	}
+	
+	/* Write it (after long file name entries) */
+	write_entry(fat, &entry, newfile->Attr, loc);
+	
+	/* write_entry() put the time in all the time stamps */
+	newfile->CrtTimeTenth = 0;
+	newfile->CrtTime = newfile->WrtTime = entry.CrtTime;
+	newfile->CrtDate = newfile->AccDate = newfile->WrtDate = entry.CrtDate;
+	
+	/* Save the locations */
+	newfile->Location[0] = loc[0];  
+	newfile->Location[1] = loc[1]; 
+	
+	/* Those entries are taken now */
+	dir_cache_mark(fat, parent->StartCluster, newfile->LfnLocation[0], newfile->LfnLocation[1], num_entries, 0);
+	
+	/* Let the Bloom filter of the folder know about the new names */
+	memcpy(key, entry.FileName, 8);
+	memcpy(key + 8, entry.Ext, 3);
+	dir_cache_add_name(fat, parent->StartCluster, key, longfilename ? ucs : NULL, ucs_len);
+	
+	free(shortname);
+	free(loc);
+    
+    return 0;
+}
+
+void delete_sd_entry(fatfs_t *fat, node_entry_t *file)
+{
+	unsigned int sector_loc = file->LfnLocation[0];
+	int ptr = file->LfnLocation[1];
+	int count = 1;
+	unsigned char sector[512];
+	
+	/* Read fat sector */
+	fat_read_sectors(fat, FAT_TRACE_DIR, sector_loc, 1, sector);
+
+	/* Mark the long file name entries(if any) and the file/folder entry as deleted. They are back to back
+	   but can cross sectors and clusters */
+	while(count <= 21)  /* 20 long file name entries plus the file/folder entry at most */
+	{
+		(sector + ptr)[0] = DELETED;
+		
+		if(sector_loc == file->Location[0] && ptr == file->Location[1])
+			break;
+			
+		ptr += ENTRYSIZE;
+		count++;
+		
+		if(ptr >= fat->boot_sector.bytes_per_sector)
+		{
+			fat_write_sectors(fat, FAT_TRACE_DIR, sector_loc, 1, sector);
+			
+			if((sector_loc = next_dir_sector(fat, sector_loc)) == 0)
+				return;
 				
+			ptr = 0;
+			fat_read_sectors(fat, FAT_TRACE_DIR, sector_loc, 1, sector);
+		}
+	}
+	
+	fat_write_sectors(fat, FAT_TRACE_DIR, sector_loc, 1, sector);
+	
+	/* Those entries can be used again */
+	dir_cache_mark(fat, file->ParentCluster, file->LfnLocation[0], file->LfnLocation[1], count, 1);
+}
+
+/* Returns the sector that comes after sector_loc in a directory. 0 if there isnt one */
+unsigned int next_dir_sector(fatfs_t *fat, unsigned int sector_loc)
+{
+	unsigned int clust;
+	const unsigned int rel = sector_loc - fat->data_sec_loc;
+	
+	/* The FAT16 root directory is one run of sectors */
+	if(sector_loc < fat->data_sec_loc)
+		return sector_loc + 1;
+	
+	/* Still in the same cluster */
+	if(((rel + 1) % fat->boot_sector.sectors_per_cluster) != 0)
+		return sector_loc + 1;
+	
+	/* Go to the first sector of the next cluster */
+	clust = read_fat_table_value(fat, (rel/fat->boot_sector.sectors_per_cluster + 2)*fat->byte_offset);
+	
+	if((fat->fat_type == FAT16 && clust >= 0xFFF8)
+	|| (fat->fat_type == FAT32 && clust >= 0xFFFFFF8))
+		return 0;
+		
+	return fat->data_sec_loc + (clust - 2) * fat->boot_sector.sectors_per_cluster;
+}
+
+/* Build the node of the root directory. Its name is the mount name */
+node_entry_t *fat_root_entry(fatfs_t *fat)
+{
+	node_entry_t *temp = malloc(sizeof(node_entry_t));
+	
+	memset(temp, 0, sizeof(node_entry_t));
+	temp->Name = (unsigned char *)remove_all_chars(fat->mount, '/');          /*  */
+	temp->ShortName = (unsigned char *)remove_all_chars(fat->mount, '/');
+	temp->Attr = DIRECTORY;                   /* Root directory is obviously a directory */
+	temp->StartCluster = fat->root_cluster_num; /* Root directory has no data clusters associated with it(FAT16). Non-NULL with FAT32 */
+	
+	return temp;
+}
+
+/* Walk 'path'('/' separated, relative) starting at the directory 'dir'. dir is left alone. 
+   Returns a new node(a copy of dir if path is empty) or NULL */
+node_entry_t *fat_search_from(fatfs_t *fat, node_entry_t *dir, const char *path)
+{
+	unsigned char *ufn = malloc(strlen(path)+1);
+	
+	unsigned char *pch = NULL;
+	unsigned char *save = NULL;
+	node_entry_t *temp = dir;
+	node_entry_t *rv = NULL;
+	
+	strcpy(ufn, path);
+	
+	pch = strtok_r(ufn, "/", (char **)&save);
+	
+	while(pch != NULL) 
+	{
+		if(!(temp->Attr & DIRECTORY)) /* Can only look inside of folders */
+		{
+			errno = ENOTDIR;
+			rv = NULL;
+		}
+		else if((rv = search_directory(fat, temp, pch)) == NULL)
+		{
+			errno = ENOENT;
 #ifdef FATFS_DEBUG
-				printf("Couldnt find \"%s\" in \"%s\"\n", pch, temp->Name);
+			printf("Couldnt find \"%s\" in \"%s\"\n", pch, temp->Name);
 #endif
-				delete_struct_entry(temp);
-				free(ufn);
-				return NULL;
-			}
 		}
+		
+		if(temp != dir)
+			delete_struct_entry(temp);
+		
+		if(rv == NULL)
+		{
+			free(ufn);
+			return NULL;
+		}
+		
+		temp = rv;
+		pch = strtok_r(NULL, "/", (char **)&save);
 	}
 	
 	free(ufn);
 	
+	return (temp == dir) ? copy_struct_entry(dir) : temp;
+}
+
+/* fn starts with the mount name(without the '/') */
+node_entry_t *fat_search_by_path(fatfs_t *fat, const char *fn)
+{	
+	node_entry_t *root = fat_root_entry(fat);
+	node_entry_t *rv = NULL;
+	size_t len = strlen(root->Name);
+	
+	/* Skip over the mount name */
+	if(strncasecmp(fn, root->Name, len) == 0 && (fn[len] == '/' || fn[len] == '\0'))
+		fn += len;
+	
+	rv = fat_search_from(fat, root, fn);
+	
+	delete_struct_entry(root);
+	
 	return rv;
 }
 
+/* fn starts with the mount name(without the '/') */
 node_entry_t *create_entry(fatfs_t *fat, const char *fn, unsigned char attr)
+{
+	node_entry_t *root = fat_root_entry(fat);
+	node_entry_t *rv = NULL;
+	size_t len = strlen(root->Name);
+	
+	/* Skip over the mount name. Anything else means the path was invalid from the beginning */
+	if(strncasecmp(fn, root->Name, len) == 0 && fn[len] == '/')
+	{
+		rv = create_entry_at(fat, root, fn + len, attr);
+	}
+	else
+	{
+		errno = ENOTDIR;
+	}
+	
+	delete_struct_entry(root);
+	
+	return rv;
+}
+
+/* Create the file/folder 'path'('/' separated, relative to the directory 'dir'). Every folder on the way has to exist already */
+node_entry_t *create_entry_at(fatfs_t *fat, node_entry_t *dir, const char *path, unsigned char attr)
 {
 	int loc[2];
 
     char *pch;
     char *filename;
-	char *ufn = malloc(strlen(fn)+1);
+	char *ufn = malloc(strlen(path)+1);
     
     node_entry_t *newfile;
 	node_entry_t *temp = NULL;
-	node_entry_t *rv = NULL;
-	unsigned int cluster = fat->root_cluster_num;
 	
 	fat_dir_entry_t entry;
 	
-	/* Make a copy of fn */
-	memcpy(ufn, fn, strlen(fn));
-	ufn[strlen(fn)] = '\0';
+	/* Make a copy of path without the trailing '/'s */
+	strcpy(ufn, path);
 	
-	/* Build Root */
-	temp = malloc(sizeof(node_entry_t));
-	temp->Name = (unsigned char *)remove_all_chars(fat->mount, '/');          /*  */
-	temp->ShortName = (unsigned char *)remove_all_chars(fat->mount, '/');
-	temp->Attr = DIRECTORY;          /* Root directory is obviously a directory */
-	temp->StartCluster = cluster;    /* Root directory has no data clusters associated with it(FAT16). Non-NULL with FAT32 */
-	temp->EndCluster = end_cluster(fat, temp->StartCluster);
+	while(strlen(ufn) > 0 && ufn[strlen(ufn)-1] == '/')
+		ufn[strlen(ufn)-1] = '\0';
 	
-	rv = temp;
+	/* Split it into the folder and the name of the new file/folder */
+	if((pch = strrchr(ufn, '/')) != NULL)
+	{
+		*pch = '\0';
+		filename = pch + 1;
+		temp = fat_search_from(fat, dir, ufn);
+	}
+	else
+	{
+		filename = ufn;
+		temp = copy_struct_entry(dir);
+	}
 	
-	pch = strtok(ufn,"/");  /* Grab Root */
+	/* Return NULL if we encounter a directory that doesn't exist */
+	if(temp == NULL || !(temp->Attr & DIRECTORY))
+	{
+		free(ufn);
+		errno = ENOTDIR;
+		delete_struct_entry(temp);
+		return NULL;
+	}
 	
-    if(strcasecmp(pch, temp->Name) == 0) {
-        pch = strtok (NULL, "/"); 
-
-        while(pch != NULL) {
-            if((rv = search_directory(fat, temp, pch)) != NULL) 
-            {
-				if(rv->Attr & READ_ONLY) /* Check and make sure directory is not read only. */
-				{
-					free(ufn);
-					errno = EROFS;
-					delete_struct_entry(temp);
-					delete_struct_entry(rv);
-					return NULL;
-				}
-				
-                pch = strtok (NULL, "/");
-                delete_struct_entry(temp);
-				temp = rv;
-            }
-            else 
-            {	
-				filename = pch; /* We possibly have the filename */
-                
-                /* Return NULL if we encounter a directory that doesn't exist */
-                if((pch = strtok (NULL, "/"))) { /* See if there is more to parse through */
-					free(ufn);
-                    errno = ENOTDIR;
-					delete_struct_entry(temp);
-                    return NULL;               /* if there is that means we are looking in a directory */
-                }                              /* that doesn't exist. */
-                
-                /* Make sure the filename is valid */
-                if(correct_filename(filename) == -1) {
-					free(ufn);
-					delete_struct_entry(temp);
-                    return NULL;
-                }
-           
-                /* Create file/folder */
-                newfile = (node_entry_t *) malloc(sizeof(node_entry_t));
-				
-                newfile->Name = malloc(strlen(filename)+1); 
-				memcpy(newfile->Name, filename, strlen(filename));
-				newfile->Name[strlen(filename)] = '\0';
-				
-                newfile->Attr = attr;
-                newfile->FileSize = 0;
-                newfile->StartCluster = 0; 
-				newfile->EndCluster = 0;
-                
-                if(generate_and_write_entry(fat, newfile->Name, newfile, temp) == -1)
-                {
+	if(temp->Attr & READ_ONLY) /* Check and make sure directory is not read only. */
+	{
+		free(ufn);
+		errno = EROFS;
+		delete_struct_entry(temp);
+		return NULL;
+	}
+	
+	/* Make sure the filename is valid */
+	if(correct_filename(filename) == -1) {
+		free(ufn);
+		delete_struct_entry(temp);
+		return NULL;
+	}
+	
+	/* Create file/folder */
+	newfile = (node_entry_t *) malloc(sizeof(node_entry_t));
+	memset(newfile, 0, sizeof(node_entry_t));
+	
+	newfile->Name = malloc(strlen(filename)+1); 
+	memcpy(newfile->Name, filename, strlen(filename));
+	newfile->Name[strlen(filename)] = '\0';
+	
+	newfile->Attr = attr;
+	newfile->FileSize = 0;
+	newfile->StartCluster = 0; 
+	newfile->EndCluster = 0;
+	
+	if(generate_and_write_entry(fat, newfile->Name, newfile, temp) == -1)
+	{
 #ifdef FATFS_DEBUG
-					printf("create_entry(dir_entry.c) : Didnt Create file/folder named %s\n", newfile->Name);
+		printf("create_entry(dir_entry.c) : Didnt Create file/folder named %s\n", newfile->Name);
 #endif
-					free(ufn);
-					errno = EDQUOT;
-					delete_struct_entry(temp);
-                    delete_struct_entry(newfile);  /* This doesn't take care of removing clusters from SD card */
-                    
-                    return NULL;  
-                }
-				
-				/* If its a folder, add the hidden files "." and ".." */
-				if(attr & DIRECTORY)
-				{
-					/* Add '.' folder entry */ 
-					strncpy(entry.FileName, ".       ", 8);
-					entry.FileName[8] = '\0';
-					strncpy(entry.Ext, "   ", 3 ); 
-					entry.Ext[3] = '\0';
-					entry.Attr = DIRECTORY;
-					entry.FileSize = 0;   
-					entry.FstClusHI = newfile->StartCluster >> 16;
-					entry.FstClusLO = newfile->StartCluster & 0xFFFF;
-					
-					loc[0] = fat->data_sec_loc + (newfile->StartCluster - 2) * fat->boot_sector.sectors_per_cluster;
-					loc[1] = 0;
-					write_entry(fat, &entry, DIRECTORY, loc);
-
-					/* Add '..' folder entry */
-					strncpy(entry.FileName, "..      ", 8);
-					entry.FileName[8] = '\0';
-					strncpy(entry.Ext, "   ", 3 ); 
-					entry.Ext[3] = '\0';
-					entry.Attr = DIRECTORY;
-					entry.FileSize = 0;   
-					if(strcasecmp(temp->Name, fat->mount) == 0) /* If parent of this folder is the root directory, set first cluster number to 0 */
-					{
-						entry.FstClusHI = 0;
-						entry.FstClusLO = 0;
-					}
-					else 
-					{
-						entry.FstClusHI = temp->StartCluster >> 16;
-						entry.FstClusLO = temp->StartCluster & 0xFFFF; 
-					}
-						
-					loc[1] = 32; /* loc[0] Doesnt change */
-					write_entry(fat, &entry, DIRECTORY, loc);
-				}
-				
-				free(ufn);
-				delete_struct_entry(temp);
-				
-                return newfile;
-            }
+		free(ufn);
+		errno = EDQUOT;
+		delete_struct_entry(temp);
+		delete_struct_entry(newfile);  /* This doesn't take care of removing clusters from SD card */
+		
+		return NULL;  
+	}
+	
+	/* If its a folder, add the hidden files "." and ".." */
+	if(attr & DIRECTORY)
+	{
+		/* Add '.' folder entry */ 
+		strncpy(entry.FileName, ".       ", 8);
+		entry.FileName[8] = '\0';
+		strncpy(entry.Ext, "   ", 3 ); 
+		entry.Ext[3] = '\0';
+		entry.Attr = DIRECTORY;
+		entry.FileSize = 0;   
+		entry.FstClusHI = newfile->StartCluster >> 16;
+		entry.FstClusLO = newfile->StartCluster & 0xFFFF;
+		
+		loc[0] = fat->data_sec_loc + (newfile->StartCluster - 2) * fat->boot_sector.sectors_per_cluster;
+		loc[1] = 0;
+		write_entry(fat, &entry, DIRECTORY, loc);
+
+		/* Add '..' folder entry */
+		strncpy(entry.FileName, "..      ", 8);
+		entry.FileName[8] = '\0';
+		strncpy(entry.Ext, "   ", 3 ); 
+		entry.Ext[3] = '\0';
+		entry.Attr = DIRECTORY;
+		entry.FileSize = 0;   
+		if(temp->StartCluster == fat->root_cluster_num) /* If parent of this folder is the root directory, set first cluster number to 0 */
+		{
+			entry.FstClusHI = 0;
+			entry.FstClusLO = 0;
 		}
+		else 
+		{
+			entry.FstClusHI = temp->StartCluster >> 16;
+			entry.FstClusLO = temp->StartCluster & 0xFFFF; 
+		}
+			
+		loc[1] = 32; /* loc[0] Doesnt change */
+		write_entry(fat, &entry, DIRECTORY, loc);
 	}
 	
 	free(ufn);
 	delete_struct_entry(temp);
 	
-	 /* Path was invalid from the beginning */
-    errno = ENOTDIR;
-    return NULL;
+	return newfile;
+}
+
+/* Count a lookup that went through 'sectors' directory sectors */
+static void lookup_done(fatfs_t *fat, unsigned int sectors)
+{
+	mutex_lock(&fat->stats_lock);
+	
+	fat->stats.lookups++;
+	fat->stats.lookup_sectors += sectors;
+	
+	if(sectors > fat->stats.lookup_sectors_max)
+		fat->stats.lookup_sectors_max = sectors;
+	
+	mutex_unlock(&fat->stats_lock);
 }
 
 node_entry_t *search_directory(fatfs_t *fat, node_entry_t *node, const char *fn)
 {
 	int i;
 	unsigned int sector_loc = 0;
+	unsigned int scanned = 0;
 	
 	unsigned int clust = node->StartCluster;
 	node_entry_t    *rv = NULL;
+	fat_dir_cache_t build;
+	fat_dir_cache_t *fill = NULL;
+	fat_dir_cache_t *dc;
+	fat_scan_ctx_t  ctx;
+	
+	scan_ctx_init(&ctx, fat, fn);
+	
+	mutex_lock(&fat->cache_lock);
+	
+	/* No free slot map for this directory yet? Build one(and its Bloom filter) while we go through all of its sectors */
+	if((dc = dir_cache_find(fat, node->StartCluster)) == NULL)
+	{
+		dir_cache_begin(&build, node->StartCluster);
+		fill = &build;
+	}
+	/* Most lookups are for names that arent there. The Bloom filter answers those without reading anything */
+	else if(!dir_cache_may_contain(dc, ctx.has_key ? ctx.key : NULL, ctx.fn, ctx.fn_len))
+	{
+		mutex_unlock(&fat->cache_lock);
+		lookup_done(fat, 0);
+		return NULL;
+	}
+	
+	/* The directory is read without the lock. Other lookups can fill the cache meanwhile */
+	mutex_unlock(&fat->cache_lock);
 
 	/* If the directory is the root directory and if fat->fat_type = FAT16 consider it a special case */
-	if(fat->fat_type == FAT16 && strcasecmp(node->Name, fat->mount) == 0) /* Go through special(static number) sectors. No clusters. */
+	if(fat->fat_type == FAT16 && node->StartCluster == 0) /* Go through special(static number) sectors. No clusters. */
 	{
 		for(i = 0; i < fat->root_dir_sectors_num; i++) {
 		
 			sector_loc = fat->root_dir_sec_loc + i;
 			
 			/* Search in a sector for fn */
-			rv = browse_sector(fat, sector_loc, 0, fn);
+			rv = browse_sector(fat, &ctx, sector_loc, 0, fn, fill);
+			scanned++;
 			
 			if(rv != NULL) /* If we found it return it, otherwise go to the next sector */
 			{
-				return rv;
+				break;
 			}
 		}
 	}
@@ -810,266 +1399,280 @@ node_entry_t *search_directory(fatfs_t *fat, node_entry_t *node, const char *fn)
 				sector_loc = fat->data_sec_loc + ((clust - 2) * fat->boot_sector.sectors_per_cluster) + i;
 				
 				/* Search in a sector for fn */
-				rv = browse_sector(fat, sector_loc, 0, fn);
+				rv = browse_sector(fat, &ctx, sector_loc, 0, fn, fill);
+				scanned++;
 			
 				if(rv != NULL) /* If we found it return it, otherwise go to the next sector */
 				{
-					return rv;
+					break;
 				}
 			}
 			
+			if(rv != NULL)
+				break;
+			
+			if(fill != NULL)
+				fill->end_cluster = clust;
+			
 			/* Advance to next cluster */
 			clust = read_fat_table_value(fat, clust*fat->byte_offset);
 		}
 	}
 	
-	return NULL;
+	if(fill != NULL)
+	{
+		if(rv == NULL && fill->used) /* Went through the whole directory so the map is complete */
+			dir_cache_publish(fat, fill);
+		else
+			dir_cache_discard(fill);
+	}
+	
+	if(rv != NULL)
+		rv->ParentCluster = node->StartCluster;
+	
+	lookup_done(fat, scanned);
+	
+	return rv;
 }
 
-/* If fn is NULL, then just grab the first entry encountered */
-node_entry_t *browse_sector(fatfs_t *fat, unsigned int sector_loc, unsigned int ptr, const char *fn)
+/* Start a new directory scan for 'fn'(NULL if any entry will do). Nothing is cached yet */
+void scan_ctx_init(fat_scan_ctx_t *ctx, fatfs_t *fat, const char *fn)
 {
-	int j, k;
-	int var = ptr;
-	static int contin = 0;
-	unsigned char *str_temp;
-	static int last_sec = 0;
-	static unsigned char buf[512];
+	ctx->dev = fat->dev;
+	ctx->sector = 0;
+	ctx->valid = 0;
+	ctx->lfn_loc[0] = 0;
+	ctx->lfn_loc[1] = 0;
+	ctx->lfn_len = 0;
+	ctx->lfn_sum = 0;
+	
+	/* Work out the on disk form of fn once instead of building a string for every entry we look at */
+	ctx->has_key = (fn != NULL && make_short_key(fn, ctx->key) == 0);
+	ctx->fn_len = (fn != NULL) ? utf8_to_ucs2((const unsigned char *)fn, ctx->fn, 255) : -1;
+}
+
+/* Compare the 11 byte name of a short entry against a key made by make_short_key() */
+static int short_key_match(const unsigned char *entry, const unsigned char *key)
+{
+#ifdef __SSE2__
+	__m128i a = _mm_loadu_si128((const __m128i *)entry);
+	__m128i b = _mm_loadu_si128((const __m128i *)key);
 	
-	fat_lfn_entry_t lfn;
-	fat_dir_entry_t temp;
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0x7FF) == 0x7FF;
+#else
+	uint32_t a[2], b[2];
 	
-	static unsigned char lfnbuf1[256]; /* Longest a filename can be is 255 chars */
-	static unsigned char lfnbuf2[256]; /* Longest a filename can be is 255 chars */
+	memcpy(a, entry, 8);
+	memcpy(b, key, 8);
 	
-	node_entry_t    *new_entry;
+	return a[0] == b[0] && a[1] == b[1] && entry[8] == key[8] && entry[9] == key[9] && entry[10] == key[10];
+#endif
+}
+
+/* Compare two UCS-2 names. Like strcasecmp() only ASCII letters are case insensitive */
+static int long_name_match(const unsigned short *a, int a_len, const unsigned short *b, int b_len)
+{
+	int i;
+	
+	if(a_len != b_len)
+		return 0;
 	
-	/* Only wipe if there wasnt a long file name entry in the last sector that wasnt attached to a shortname entry */
-	if(contin == 0)
+	for(i = 0; i < a_len; i++)
 	{
-		memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-		memset(lfnbuf2, 0, sizeof(unsigned char)*256);
+		if(a[i] != b[i] && (a[i] >= 0x80 || b[i] >= 0x80 || tolower(a[i]) != tolower(b[i])))
+			return 0;
 	}
+	
+	return 1;
+}
 
-	if(sector_loc != last_sec) /* Only read a new sector when we have to */
+/* Checksum of the 11 byte short name that the long file name entries in front of it carry */
+unsigned char short_name_checksum(const unsigned char *entry)
+{
+	int i;
+	unsigned char sum = 0;
+	
+	for(i = 0; i < 11; i++)
+		sum = (((sum & 1) << 7) | ((sum & 0xfe) >> 1)) + entry[i];
+	
+	return sum;
+}
+
+/* Build "NAME.EXT" out of a short entry without the padding. If lower is set the lowercase flags(Res) are applied.
+   The extension of a volume name is part of the name so it doesnt get a period */
+void short_entry_name(const unsigned char *entry, unsigned char *out, int lower)
+{
+	int i;
+	int n = 0;
+	
+	for(i = 0; i < 8; i++)
 	{
-		/* Read 1 sector */
-		fat->dev->read_blocks(fat->dev, sector_loc, 1, buf);
+		if(entry[FILENAME+i] != ' ')
+			out[n++] = (lower && (entry[RESERVED] & 0x08)) ? tolower((int)entry[FILENAME+i]) : entry[FILENAME+i];
+	}
+	
+	if(entry[EXTENSION] != ' ')
+	{
+		if(entry[ATTRIBUTE] != VOLUME_ID)
+			out[n++] = '.';
 		
-		last_sec = sector_loc;
+		for(i = 0; i < 3; i++)
+		{
+			if(entry[EXTENSION+i] != ' ')
+				out[n++] = (lower && (entry[RESERVED] & 0x10)) ? tolower((int)entry[EXTENSION+i]) : entry[EXTENSION+i];
+		}
 	}
 	
-	for(j = var/32; j < 16; j++) /* How many entries per sector(32 byte entry x 16 = 512 bytes = 1 sector) */
-	{	
-		/* Entry does not exist if it has been deleted(0xE5) or is an empty entry(0) */
-		if((buf+var)[0] == DELETED || (buf+var)[0] == EMPTY) 
-		{ 
-			var += ENTRYSIZE; /* Increment to next entry */
-			continue; 
+	out[n] = '\0';
+}
+
+/* If fn is NULL, then just grab the first entry encountered. Everything that has to survive from one sector
+   to the next(cached sector, partial long file names) lives in ctx, which belongs to the caller */
+node_entry_t *browse_sector(fatfs_t *fat, fat_scan_ctx_t *ctx, unsigned int sector_loc, unsigned int ptr, const char *fn, fat_dir_cache_t *build)
+{
+	int j;
+	int var = ptr;
+	int len;
+	int order;
+	int has_lfn;
+	unsigned char *entry;
+	unsigned char name[260*3 + 1];    /* Longest long file name(20 entries) in UTF-8 */
+	
+	fat_dir_entry_t temp;
+	
+	node_entry_t    *new_entry;
+	
+	/* Only read a new sector when we have to. The sector has to be from the same device too */
+	if(!ctx->valid || ctx->sector != sector_loc || ctx->dev != fat->dev)
+	{
+		/* Read 1 sector */
+		if(fat_read_sectors(fat, FAT_TRACE_DIR, sector_loc, 1, ctx->buf) != 0)
+		{
+			ctx->valid = 0;
+			return NULL;
 		}
 		
-		/* Check if it is a long filename entry */
-		if((buf+var)[ATTRIBUTE] == LONGFILENAME) { 
-			memset(&lfn, 0, sizeof(fat_lfn_entry_t));
-			memcpy(&lfn, buf+var, sizeof(fat_lfn_entry_t));
+		ctx->dev = fat->dev;
+		ctx->sector = sector_loc;
+		ctx->valid = 1;
+	}
+	
+	/* Add this sector to the free slot map being built */
+	if(build != NULL && dir_cache_add_sector(fat, build, sector_loc, ctx->buf) != 0)
+	{
+		build->used = 0;  /* Out of memory. Dont publish a partial map */
+	}
+	
+	for(j = var/32; j < 16; j++, var += ENTRYSIZE) /* How many entries per sector(32 byte entry x 16 = 512 bytes = 1 sector) */
+	{	
+		entry = ctx->buf + var;
 		
-			if(lfnbuf1[0] == '\0') 
-			{
-				str_temp = extract_long_name(&lfn);
-				strcpy(lfnbuf1, str_temp);
-				free(str_temp);
-				
-				if(lfnbuf2[0] != '\0') {
-					strcat(lfnbuf1, lfnbuf2);
-					memset(lfnbuf2, 0, sizeof(unsigned char)*256);
-				}
-			}
-			else if(lfnbuf2[0] == '\0')
-			{
-				str_temp = extract_long_name(&lfn);
-				strcpy(lfnbuf2, str_temp);
-				free(str_temp);
-				
-				if(lfnbuf1[0] != '\0') {
-					strcat(lfnbuf2, lfnbuf1);
-					memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-				}
-			}
-			contin = 1;
-			var += ENTRYSIZE; 
-			continue; /* Continue on to the next entry */
-		}
+		/* Entry does not exist if it has been deleted(0xE5) or is an empty entry(0) */
+		if(entry[0] == DELETED || entry[0] == EMPTY) 
+			continue;
 		
-		/* Its a file/folder entry */
-		else {
-			memset(&temp, 0, sizeof(fat_dir_entry_t));	
-			
-			memcpy(temp.FileName, (buf+var+FILENAME), 8); 
-			memcpy(temp.Ext, (buf+var+EXTENSION), 3);
-			memcpy(&(temp.Attr), (buf+var+ATTRIBUTE), 1);
-			memcpy(&(temp.Res), (buf+var+RESERVED), 1);
-			memcpy(&(temp.FstClusHI), (buf+var+STARTCLUSTERHI), 2);
-			memcpy(&(temp.FstClusLO), (buf+var+STARTCLUSTERLOW), 2);
-			memcpy(&(temp.FileSize), (buf+var+FILESIZE), 4);
-			
-			temp.FileName[8] = '\0';
-			temp.Ext[3] = '\0';
-			
-			contin = 0;
+		/* Check if it is a long filename entry. Each one holds 13 characters of the name, the one with the
+		   highest order(ORed with 0x40) comes first. It may continue in the next sector */
+		if(entry[ATTRIBUTE] == LONGFILENAME)
+		{
+			order = entry[ORDER] & 0x1F;
 			
-			/* Dont care about these hidden entries */
-			if(strcmp(temp.FileName, ".       ") == 0 || strcmp(temp.FileName, "..      ") == 0)
+			if(order == 0 || order > 20)
 			{
-				var += ENTRYSIZE; 
-				continue; /* Continue on to the next entry */
+				ctx->lfn_len = 0;
 			}
-			
-			/* Deal with no long name */
-			if(lfnbuf1[0] == '\0' && lfnbuf2[0] == '\0')
+			else if(entry[ORDER] & 0x40) /* Last long file name entry is stored first */
 			{
-				strcat(lfnbuf1, temp.FileName);
-				strcat(lfnbuf2, temp.FileName);
-				
-				if(temp.Res & 0x08) /* If the filename is supposed to appear lowercase...make it so */
-				{	
-					k = 0;
-					
-					while(lfnbuf2[k])
-					{
-						lfnbuf2[k] = tolower((int)lfnbuf2[k]);
-						k++;
-					}
-				}
-				
-				if(temp.Ext[0] != ' ') {             /* If we actually have an extension....add it in */
-					if(temp.Attr == VOLUME_ID) { /* Extension is part of the VOLUME name(node->FileName) */
-						strcat(lfnbuf1, temp.Ext);
-					}
-					else {
-						strcat(lfnbuf1, ".");
-						strcat(lfnbuf1, temp.Ext);
-						
-						strcat(lfnbuf2, ".");
-						strcat(lfnbuf2, temp.Ext);
-						
-						if(temp.Res & 0x10) /* If the extension is supposed to appear lowercase...make it so */
-						{	
-							k = strlen(temp.FileName) + 1; /* + 1 for period */
-							
-							while(lfnbuf2[k])
-							{
-								lfnbuf2[k] = tolower((int)lfnbuf2[k]);
-								k++;
-							}
-						}
-					}
-				}
-				
-				str_temp = remove_all_chars(lfnbuf1,' '); 
-				strcpy(lfnbuf1, str_temp);
-				free(str_temp);
-				
-				str_temp = remove_all_chars(lfnbuf2,' '); 
-				strcpy(lfnbuf2, str_temp);
-				free(str_temp);
-				
-				if(fn == NULL || strcasecmp(lfnbuf1, fn) == 0) /* We found the file we are looking for */
-				{
-					new_entry = malloc(sizeof(node_entry_t));
-					new_entry->Name = malloc(strlen(lfnbuf2));
-					new_entry->ShortName = malloc(strlen(lfnbuf1));
-					strcpy(new_entry->Name, lfnbuf2);
-					strcpy(new_entry->ShortName, lfnbuf1);  
-					memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-					memset(lfnbuf2, 0, sizeof(unsigned char)*256);
-				}
-				else
-				{
-					var += ENTRYSIZE; 
-					memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-					memset(lfnbuf2, 0, sizeof(unsigned char)*256);
-					continue; /* Continue on to the next entry */
-				}
+				ctx->lfn_loc[0] = sector_loc;
+				ctx->lfn_loc[1] = var;
+				ctx->lfn_sum = entry[CHECKSUM];
+				ctx->lfn_len = (order - 1)*13 + extract_long_name(entry, ctx->lfn + (order - 1)*13);
 			}
-			else if(lfnbuf1[0] != '\0')
+			else if(ctx->lfn_len > 0)
 			{
-				strcat(lfnbuf2, temp.FileName);
-				if(temp.Ext[0] != ' ') {             /* If we actually have an extension....add it in */
-					if(temp.Attr == VOLUME_ID) { /* Extension is part of the VOLUME name(node->FileName) */
-						strcat(lfnbuf2, temp.Ext);
-					}
-					else {
-						strcat(lfnbuf2, ".");
-						strcat(lfnbuf2, temp.Ext);
-					}
-				}
-				
-				if(fn == NULL || strcasecmp(lfnbuf1, fn) == 0 || strcasecmp(lfnbuf2, fn) == 0) 
-				{
-					new_entry = malloc(sizeof(node_entry_t));
-					new_entry->Name = malloc(strlen(lfnbuf1));
-					new_entry->ShortName = malloc(strlen(lfnbuf2));
-					strcpy(new_entry->Name, lfnbuf1);
-					strcpy(new_entry->ShortName, lfnbuf2);  
-					memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-					memset(lfnbuf2, 0, sizeof(unsigned char)*256);
-				}
-				else
-				{
-					var += ENTRYSIZE; 
-					memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-					memset(lfnbuf2, 0, sizeof(unsigned char)*256);
-					continue; /* Continue on to the next entry */
-				}
+				extract_long_name(entry, ctx->lfn + (order - 1)*13);
 			}
-			else {
-				strcat(lfnbuf1, temp.FileName);
-				if(temp.Ext[0] != ' ') {             /* If we actually have an extension....add it in */
-					if(temp.Attr == VOLUME_ID) { /* Extension is part of the VOLUME name(node->FileName) */
-						strcat(lfnbuf1, temp.Ext);
-					}
-					else {
-						strcat(lfnbuf1, ".");
-						strcat(lfnbuf1, temp.Ext);
-					}
-				}
-				
-				if(fn == NULL || strcasecmp(lfnbuf1, fn) == 0 || strcasecmp(lfnbuf2, fn) == 0) 
-				{
-					new_entry = malloc(sizeof(node_entry_t));
-					new_entry->Name = malloc(strlen(lfnbuf2)+1);
-					new_entry->ShortName = malloc(strlen(lfnbuf1)+1);
-					strcpy(new_entry->Name, lfnbuf2);
-					strcpy(new_entry->ShortName, lfnbuf1);  
-					memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-					memset(lfnbuf2, 0, sizeof(unsigned char)*256);
-				}
-				else
-				{
-					var += ENTRYSIZE; 
-					memset(lfnbuf1, 0, sizeof(unsigned char)*256);
-					memset(lfnbuf2, 0, sizeof(unsigned char)*256);
-					continue; /* Continue on to the next entry */
-				}
-			}		
 			
-			new_entry->Attr = temp.Attr;
-			new_entry->FileSize = temp.FileSize;
-			
-			if(fn != NULL)  /* Only grab these when we will actually use them */
+			continue; /* Continue on to the next entry */
+		}
+		
+		/* Its a file/folder entry. The long file name entries before it only belong to it if the checksum agrees */
+		has_lfn = (ctx->lfn_len > 0 && ctx->lfn_sum == short_name_checksum(entry));
+		len = ctx->lfn_len;
+		ctx->lfn_len = 0;
+		
+		/* Dont care about these hidden entries */
+		if(memcmp(entry, ".       ", 8) == 0 || memcmp(entry, "..      ", 8) == 0)
+			continue;
+		
+		/* Names that go into the Bloom filter of the directory */
+		if(build != NULL && entry[ATTRIBUTE] != VOLUME_ID)
+			dir_cache_note_name(build, entry, has_lfn ? ctx->lfn : NULL, len);
+		
+		/* Decide if this is the entry we want straight from the sector bytes. Strings are only built for a hit.
+		   The volume name is not a file/folder so looking up a name never finds it */
+		if(fn != NULL)
+		{
+			if(entry[ATTRIBUTE] == VOLUME_ID
+			|| (!(ctx->has_key && short_key_match(entry, ctx->key))
+			 && !(has_lfn && long_name_match(ctx->lfn, len, ctx->fn, ctx->fn_len))))
 			{
-				new_entry->StartCluster = ((temp.FstClusHI << 16) | temp.FstClusLO);
-				new_entry->EndCluster = end_cluster(fat, new_entry->StartCluster);
+				continue;
 			}
-			
-			new_entry->Location[0] = sector_loc; 
-			new_entry->Location[1] = var; /* Byte in sector */
-			
+		}
+		
+		memset(&temp, 0, sizeof(fat_dir_entry_t));	
+		
+		memcpy(&(temp.Attr), (entry+ATTRIBUTE), 1);
+		memcpy(&(temp.FstClusHI), (entry+STARTCLUSTERHI), 2);
+		memcpy(&(temp.FstClusLO), (entry+STARTCLUSTERLOW), 2);
+		memcpy(&(temp.FileSize), (entry+FILESIZE), 4);
+		
+		new_entry = malloc(sizeof(node_entry_t));
+		memset(new_entry, 0, sizeof(node_entry_t));
+		
+		short_entry_name(entry, name, 0);
+		new_entry->ShortName = malloc(strlen(name)+1);
+		strcpy(new_entry->ShortName, name);
+		
+		if(has_lfn)
+			ucs2_to_utf8(ctx->lfn, len, name);
+		else
+			short_entry_name(entry, name, 1);
+		
+		new_entry->Name = malloc(strlen(name)+1);
+		strcpy(new_entry->Name, name);
+		
+		new_entry->Attr = temp.Attr;
+		new_entry->FileSize = temp.FileSize;
+		new_entry->StartCluster = ((temp.FstClusHI << 16) | temp.FstClusLO); /* EndCluster is found when(if) the file gets read or written */
+		
+		/* Time stamps, so stat() doesn't have to read the entry again */
+		new_entry->CrtTimeTenth = entry[CREATIONTENTH];
+		memcpy(&(new_entry->CrtTime), (entry+CREATIONTIME), 2);
+		memcpy(&(new_entry->CrtDate), (entry+CREATIONDATE), 2);
+		memcpy(&(new_entry->AccDate), (entry+LASTACCESSDATE), 2);
+		memcpy(&(new_entry->WrtTime), (entry+LASTWRITETIME), 2);
+		memcpy(&(new_entry->WrtDate), (entry+LASTWRITEDATE), 2);
+		
+		new_entry->Location[0] = sector_loc; 
+		new_entry->Location[1] = var; /* Byte in sector */
+		
+		if(has_lfn) /* Long file name entries come right before it */
+		{
+			new_entry->LfnLocation[0] = ctx->lfn_loc[0];
+			new_entry->LfnLocation[1] = ctx->lfn_loc[1];
+		}
+		else
+		{
+			new_entry->LfnLocation[0] = sector_loc;
+			new_entry->LfnLocation[1] = var;
+		}
+		
 #ifdef FATFS_DEBUG
-			printf("FileName: %s ShortName: %s Attr: %x Cluster: %d  \n", new_entry->Name, new_entry->ShortName, new_entry->Attr, (temp.FstClusHI << 16) | temp.FstClusLO);
+		printf("FileName: %s ShortName: %s Attr: %x Cluster: %d  \n", new_entry->Name, new_entry->ShortName, new_entry->Attr, (temp.FstClusHI << 16) | temp.FstClusLO);
 #endif	
-			return new_entry;
-		}
+		return new_entry;
 	}
 	
 	return NULL; /* Didnt find file/folder named 'fn' it in this sector */
@@ -1085,6 +1688,9 @@ node_entry_t *get_next_entry(fatfs_t *fat, node_entry_t *dir, node_entry_t *last
 	unsigned int clust = dir->StartCluster;
 	
 	node_entry_t    *rv = NULL;
+	fat_scan_ctx_t  ctx;
+	
+	scan_ctx_init(&ctx, fat, NULL);
 	
 	/* Start from the beginning */
 	if(last_entry == NULL)
@@ -1140,8 +1746,8 @@ node_entry_t *get_next_entry(fatfs_t *fat, node_entry_t *dir, node_entry_t *last
 			sector_loc += 1;
 		}
 		
-		if((fat->fat_type == FAT16 && clust < 0xFFF8)
-	    || (fat->fat_type == FAT32 && clust < 0xFFFFFF8))
+		if(clust != 0 && ((fat->fat_type == FAT16 && clust < 0xFFF8)
+	                   || (fat->fat_type == FAT32 && clust < 0xFFFFFF8)))
 		{
 			clust_sector_loc = fat->data_sec_loc + ((clust - 2) * fat->boot_sector.sectors_per_cluster);
 				
@@ -1180,10 +1786,11 @@ node_entry_t *get_next_entry(fatfs_t *fat, node_entry_t *dir, node_entry_t *last
 		{
 			sector_loc = fat->root_dir_sec_loc + i;
 			
-			rv = browse_sector(fat, sector_loc, ptr, NULL);
+			rv = browse_sector(fat, &ctx, sector_loc, ptr, NULL, NULL);
 			
 			if(rv != NULL) /* If we found one return it, otherwise go to the next sector */
 			{
+				rv->ParentCluster = dir->StartCluster;
 				return rv;
 			}
 			
@@ -1202,10 +1809,11 @@ node_entry_t *get_next_entry(fatfs_t *fat, node_entry_t *dir, node_entry_t *last
 			{
 				sector_loc = clust_sector_loc + i;
 			
-				rv = browse_sector(fat, sector_loc, ptr, NULL);
+				rv = browse_sector(fat, &ctx, sector_loc, ptr, NULL, NULL);
 				
 				if(rv != NULL) /* If we found one return it, otherwise go to the next sector */
 				{
+					rv->ParentCluster = dir->StartCluster;
 					return rv;
 				}
 				
@@ -20,6 +20,7 @@ __BEGIN_DECLS
 #define EXTENSION 0x08
 #define ATTRIBUTE 0x0B
 #define RESERVED  0x0C
+#define CREATIONTENTH 0x0D
 #define CREATIONTIME 0x0E
 #define CREATIONDATE 0x10
 #define LASTACCESSDATE 0x12
@@ -47,6 +48,8 @@ __BEGIN_DECLS
 
 typedef struct fatfs fatfs_t;
 
+struct fat_dir_cache;
+
 typedef struct fat_long_fn_dir_entry fat_lfn_entry_t;
 
 /* FNPart1, FNPart2, and FNPart3 are unicode characters */
@@ -109,6 +112,15 @@ struct fat_dir_entry
     unsigned int FileSize;      /* The size of the file in bytes. This should be 0 if the file type is a folder */
 };
 
+typedef struct fat_extent fat_extent_t;
+
+/* A run of clusters of a file that are next to each other on the device */
+struct fat_extent {
+	unsigned int FileCluster;          /* Which cluster of the file(0 is StartCluster) the run starts at */
+	unsigned int Cluster;              /* First cluster of the run */
+	unsigned int Count;                /* Number of clusters in the run */
+};
+
 typedef struct node_entry node_entry_t;
 
 struct node_entry {
@@ -117,32 +129,73 @@ struct node_entry {
 	unsigned char Attr;                /* Holds the attributes of entry */
 	unsigned int FileSize;             /* Holds the size of the file */
 	unsigned int Location[2];          /* Location in FAT Table. Location[0]: Sector, Location[1]: Byte in that sector */
+	unsigned int LfnLocation[2];       /* Location of the first long file name entry. Same as Location if there are none */
+	unsigned int ParentCluster;        /* First cluster of the directory this entry is in (0 for the FAT16 root directory) */
 	unsigned int StartCluster;		   /* First cluster that belongs to this file/folder */
-	unsigned int EndCluster;		   /* The last cluster that belongs to this file/folder */
+	unsigned int EndCluster;		   /* The last cluster that belongs to this file/folder. 0 if it hasnt been looked up yet */
+	unsigned short CrtTime;            /* Time stamps as they are in the entry(see fat_dir_entry_t) */
+	unsigned short CrtDate;
+	unsigned short AccDate;
+	unsigned short WrtTime;
+	unsigned short WrtDate;
+	unsigned char CrtTimeTenth;
 	
-	unsigned int CurrCluster;          /* The current cluster that is being used by read/write (files only) */
-	unsigned int NumCluster;           /* The number(space/spot) of the cluster	if a file had an array of cluster numbers */
+	fat_extent_t *Extents;             /* Cluster chain of the file as far as read/write have followed it (files only) */
+	unsigned int NumExtents;
+	unsigned int MaxExtents;
+	unsigned int MappedClusters;       /* Number of clusters Extents covers */
+	int MapDone;                       /* 1 if Extents goes all the way to the end of the chain */
+};
+
+typedef struct fat_scan_ctx fat_scan_ctx_t;
+
+/* State of one directory scan. Owned by whoever is scanning so two scans(different mounts or threads) never share anything */
+struct fat_scan_ctx {
+	struct kos_blockdev *dev;          /* Device the cached sector was read from */
+	unsigned int sector;               /* Sector that is in buf */
+	int valid;                         /* 0 - buf holds nothing, 1 - buf holds 'sector' of 'dev' */
+	unsigned int lfn_loc[2];           /* Where the long file name entries of the next file/folder entry start */
+	unsigned char lfn_sum;             /* Checksum the long file name entries carry */
+	int lfn_len;                       /* Number of characters in lfn. 0 if there is no long file name waiting for its short entry */
+	unsigned short lfn[260];           /* Long file name(UCS-2) being put together. 20 entries of 13 characters */
+	int has_key;                       /* 1 if the name being looked for can be a short name(key is valid) */
+	unsigned char key[16];             /* Name being looked for in on disk short name form(see make_short_key). Only 11 bytes are compared */
+	int fn_len;                        /* Number of characters in fn. -1 if any entry will do */
+	unsigned short fn[255];            /* Name being looked for in UCS-2 */
+	unsigned char buf[512] __attribute__((aligned(16)));  /* The cached sector */
 };
 
 /* Prototypes */
 int generate_and_write_entry(fatfs_t *fat, char *filename, node_entry_t *newfile, node_entry_t *parent);
 
 void delete_struct_entry(node_entry_t * node);
+node_entry_t *copy_struct_entry(node_entry_t *node);
 void delete_cluster_list(fatfs_t *fat, node_entry_t *file);
+void reset_cluster_map(node_entry_t *file);
+int fat_truncate_file(fatfs_t *fat, node_entry_t *file, unsigned int length);
+unsigned int file_cluster(fatfs_t *fat, node_entry_t *file, unsigned int index, int alloc);
 
-unsigned int allocate_cluster(fatfs_t *fat, unsigned int start_cluster);
+unsigned int allocate_cluster(fatfs_t *fat, unsigned int end_cluster, unsigned int size);
 
 void update_sd_entry(fatfs_t *fat, node_entry_t *file);
+int set_sd_start_cluster(fatfs_t *fat, node_entry_t *file);
 void delete_sd_entry(fatfs_t *fat, node_entry_t *file);
+unsigned int next_dir_sector(fatfs_t *fat, unsigned int sector_loc);
 
-int fat_read_data(fatfs_t *fat, node_entry_t *file, unsigned char **buf, int cnt, int ptr);
+int fat_read_data(fatfs_t *fat, node_entry_t *file, unsigned char *buf, int cnt, int ptr);
 int fat_write_data(fatfs_t *fat, node_entry_t *file, unsigned char *buf, int count, int ptr);
 
+node_entry_t *fat_root_entry(fatfs_t *fat);
 node_entry_t *fat_search_by_path(fatfs_t *fat, const char *fn);
+node_entry_t *fat_search_from(fatfs_t *fat, node_entry_t *dir, const char *path);
 node_entry_t *search_directory(fatfs_t *fat, node_entry_t *node, const char *fn);
-node_entry_t *browse_sector(fatfs_t *fat, unsigned int sector_loc, unsigned int ptr, const char *fn);
+void scan_ctx_init(fat_scan_ctx_t *ctx, fatfs_t *fat, const char *fn);
+unsigned char short_name_checksum(const unsigned char *entry);
+void short_entry_name(const unsigned char *entry, unsigned char *out, int lower);
+node_entry_t *browse_sector(fatfs_t *fat, fat_scan_ctx_t *ctx, unsigned int sector_loc, unsigned int ptr, const char *fn, struct fat_dir_cache *build);
 node_entry_t *get_next_entry(fatfs_t *fat, node_entry_t *dir, node_entry_t *last_entry);
 node_entry_t *create_entry(fatfs_t *fat, const char *fn, unsigned char attr);
+node_entry_t *create_entry_at(fatfs_t *fat, node_entry_t *dir, const char *path, unsigned char attr);
 
 __END_DECLS
 #endif /* _FAT_DIR_ENTRY_H_ */
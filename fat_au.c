@@ -0,0 +1,293 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fatfs.h"
+#include "fat_defs.h"
+#include "fat_au.h"
+
+/* SD cards erase and program whole allocation units(AUs, 512KB-64MB) at a time and are fastest when each one is
+   written from start to end. The AUs are counted from the start of the device, so the data area can start in the
+   middle of one(au_skew is the number of clusters missing from the first). Every AU has a count of its used
+   clusters, kept up to date by everything that changes the FAT(write_fat_table_value(), fat_table_store()) */
+
+/* AU cluster c is in */
+static unsigned int au_of(fatfs_t *fat, unsigned int c)
+{
+	return (c - 2 + fat->au_skew) / fat->au_clusters;
+}
+
+/* First cluster of AU k */
+static unsigned int au_start(fatfs_t *fat, unsigned int k)
+{
+	return (k == 0) ? 2 : k * fat->au_clusters - fat->au_skew + 2;
+}
+
+/* One past the last cluster of AU k */
+static unsigned int au_end(fatfs_t *fat, unsigned int k)
+{
+	unsigned int end = (k + 1) * fat->au_clusters - fat->au_skew + 2;
+	
+	return (end > fat->total_clusters_num + 2) ? fat->total_clusters_num + 2 : end;
+}
+
+/* AUs the volume only has part of(the first and last one) are never handed out whole */
+static int au_whole(fatfs_t *fat, unsigned int k)
+{
+	return au_end(fat, k) - au_start(fat, k) == fat->au_clusters;
+}
+
+static int cluster_free(fatfs_t *fat, unsigned int c)
+{
+	unsigned int value = read_fat_table_value(fat, c * fat->byte_offset);
+	
+	if(fat->fat_type == FAT32)
+		value &= 0x0FFFFFFF;
+	
+	return value == 0;
+}
+
+/* A free cluster in AU k, searched from 'from'(if it is in k) to the end and then from the start. 0 if full */
+static unsigned int au_find_free(fatfs_t *fat, unsigned int k, unsigned int from)
+{
+	unsigned int start = au_start(fat, k), end = au_end(fat, k), c;
+	
+	if(fat->au_used[k] >= end - start)
+		return 0;
+	
+	if(from < start || from >= end)
+		from = start;
+	
+	for(c = from; c < end; c++)
+	{
+		if(cluster_free(fat, c))
+			return c;
+	}
+	
+	for(c = start; c < from; c++)
+	{
+		if(cluster_free(fat, c))
+			return c;
+	}
+	
+	return 0;
+}
+
+/* Turn the AU policy on for fat. au_bytes is the AU size of the card(power of 2, at least a cluster), files of at
+   least stream_bytes(0 for a quarter AU) are big. Reads the whole FAT once. Returns 0 or -1 with errno set */
+int fat_au_init(fatfs_t *fat, unsigned int au_bytes, unsigned int stream_bytes)
+{
+	const unsigned int bps = fat->boot_sector.bytes_per_sector;
+	const unsigned int spc = fat->boot_sector.sectors_per_cluster;
+	const unsigned int entries = fat->total_clusters_num + 2;
+	unsigned int au_sectors = au_bytes / bps;
+	unsigned int sectors, done, n, i, c, value;
+	unsigned char *buf;
+	
+	if(au_bytes == 0 || (au_bytes & (au_bytes - 1)) || au_sectors < spc)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	
+	fat->au_clusters = au_sectors / spc;
+	fat->au_skew = (fat->data_sec_loc % au_sectors) / spc;
+	fat->au_count = au_of(fat, entries - 1) + 1;
+	fat->au_stream = (stream_bytes ? stream_bytes : au_bytes / 4) / (spc * bps);
+	fat->au_open = 0;
+	fat->au_cursor = 0;
+	fat->au_next = 0;
+	
+	if(fat->au_stream == 0)
+		fat->au_stream = 1;
+	
+	fat->au_used = (unsigned int *)calloc(fat->au_count, sizeof(unsigned int));
+	buf = (unsigned char *)malloc(AU_READ_SECTORS * bps);
+	
+	if(fat->au_used == NULL || buf == NULL)
+	{
+		free(buf);
+		fat_au_shutdown(fat);
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	mutex_lock(&fat->fat_lock);
+	
+	sectors = (entries * fat->byte_offset + bps - 1) / bps;
+	
+	for(done = 0; done < sectors; done += n)
+	{
+		n = (sectors - done < AU_READ_SECTORS) ? sectors - done : AU_READ_SECTORS;
+		
+		if(fat_read_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + done, n, buf) != 0)
+		{
+			mutex_unlock(&fat->fat_lock);
+			free(buf);
+			fat_au_shutdown(fat);
+			errno = EIO;
+			return -1;
+		}
+		
+		for(i = 0; i < n * bps / fat->byte_offset; i++)
+		{
+			c = done * bps / fat->byte_offset + i;
+			
+			if(c < 2 || c >= entries)
+				continue;
+			
+			value = 0;
+			memcpy(&value, buf + i * fat->byte_offset, fat->byte_offset);
+			
+			if(fat->fat_type == FAT32)
+				value &= 0x0FFFFFFF;
+			
+			if(value != 0)
+				fat->au_used[au_of(fat, c)]++;
+		}
+	}
+	
+	fat->au_total = fat->au_free = 0;
+	
+	for(i = 0; i < fat->au_count; i++)
+	{
+		if(au_whole(fat, i))
+		{
+			fat->au_total++;
+			fat->au_free += (fat->au_used[i] == 0);
+		}
+	}
+	
+	mutex_unlock(&fat->fat_lock);
+	free(buf);
+	
+	return 0;
+}
+
+void fat_au_shutdown(fatfs_t *fat)
+{
+	free(fat->au_used);
+	fat->au_used = NULL;
+	fat->au_clusters = 0;
+}
+
+/* The FAT entry of cluster went from old to value. fat_lock is held */
+void fat_au_update(fatfs_t *fat, unsigned int cluster, unsigned int old, unsigned int value)
+{
+	unsigned int k;
+	
+	if(fat->au_used == NULL || cluster < 2 || cluster >= fat->total_clusters_num + 2)
+		return;
+	
+	if(fat->fat_type == FAT32)
+	{
+		old &= 0x0FFFFFFF;
+		value &= 0x0FFFFFFF;
+	}
+	
+	if((old == 0) == (value == 0))
+		return;
+	
+	k = au_of(fat, cluster);
+	
+	if(value == 0)
+	{
+		fat->au_used[k]--;
+		
+		if(fat->au_used[k] == 0 && au_whole(fat, k))
+			fat->au_free++;
+	}
+	else
+	{
+		if(fat->au_used[k] == 0 && au_whole(fat, k))
+			fat->au_free--;
+		
+		fat->au_used[k]++;
+	}
+}
+
+/* May a file with 'size' clusters that ends at end_clust go on into the cluster right after it? Same rule fat_au_pick()
+   starts with, but nothing changes, so it can be asked for cluster after cluster. Without AUs any free cluster will do.
+   fat_lock is held */
+int fat_au_continues(fatfs_t *fat, unsigned int end_clust, unsigned int size)
+{
+	unsigned int k;
+	
+	if(end_clust < 2 || end_clust + 1 >= fat->total_clusters_num + 2 || !cluster_free(fat, end_clust + 1))
+		return 0;
+	
+	if(fat->au_used == NULL)
+		return 1;
+	
+	k = au_of(fat, end_clust + 1);
+	
+	return k == au_of(fat, end_clust) || (size >= fat->au_stream && fat->au_used[k] == 0);
+}
+
+/* Where the next cluster of a file with 'size' clusters(counting the new one) that ends at end_clust(0 for none yet)
+   should go. Files keep going in their AU. Big ones get whole free AUs, small ones are packed into the AU that is
+   open for them, then into other AUs that are already in use. Returns a free cluster(not taken yet) or 0 to fall
+   back to the first free one. fat_lock is held */
+unsigned int fat_au_pick(fatfs_t *fat, unsigned int end_clust, unsigned int size)
+{
+	const int big = size >= fat->au_stream;
+	unsigned int i, k, c;
+	
+	if(fat->au_used == NULL)
+		return 0;
+	
+	/* Right after the end of the file, if that's in the same AU or(for big files) an AU nothing uses */
+	if(fat_au_continues(fat, end_clust, size))
+		return end_clust + 1;
+	
+	if(big)
+	{
+		for(i = 0; i < fat->au_count; i++)
+		{
+			k = (fat->au_next + i) % fat->au_count;
+			
+			if(fat->au_used[k] == 0 && au_whole(fat, k))
+			{
+				fat->au_next = k + 1;
+				return au_start(fat, k);
+			}
+		}
+		
+		/* No free AU left. Fill the gaps like a small file would */
+	}
+	
+	if(fat->au_open < fat->au_count && (c = au_find_free(fat, fat->au_open, fat->au_cursor)) != 0)
+	{
+		fat->au_cursor = c + 1;
+		return c;
+	}
+	
+	/* The open AU is full. Go on with the next one something already uses, a free one if there is none */
+	for(i = 1; i <= fat->au_count; i++)
+	{
+		k = (fat->au_open + i) % fat->au_count;
+		
+		if(fat->au_used[k] > 0 && (c = au_find_free(fat, k, 0)) != 0)
+		{
+			fat->au_open = k;
+			fat->au_cursor = c + 1;
+			return c;
+		}
+	}
+	
+	for(i = 1; i <= fat->au_count; i++)
+	{
+		k = (fat->au_open + i) % fat->au_count;
+		
+		if(fat->au_used[k] == 0 && (c = au_find_free(fat, k, 0)) != 0)
+		{
+			fat->au_open = k;
+			fat->au_cursor = c + 1;
+			return c;
+		}
+	}
+	
+	return 0;
+}
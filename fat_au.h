@@ -0,0 +1,19 @@
+
+#ifndef _FAT_AU_H_
+#define _FAT_AU_H_
+
+__BEGIN_DECLS
+
+#include "fat_defs.h"
+
+#define AU_READ_SECTORS 64   /* Sectors of the FAT read per request while counting the used clusters of every AU */
+
+/* Prototypes */
+int fat_au_init(fatfs_t *fat, unsigned int au_bytes, unsigned int stream_bytes);
+void fat_au_shutdown(fatfs_t *fat);
+void fat_au_update(fatfs_t *fat, unsigned int cluster, unsigned int old, unsigned int value);
+int fat_au_continues(fatfs_t *fat, unsigned int end_clust, unsigned int size);
+unsigned int fat_au_pick(fatfs_t *fat, unsigned int end_clust, unsigned int size);
+
+__END_DECLS
+#endif /* _FAT_AU_H_ */
@@ -0,0 +1,682 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/thread.h>
+
+#include "fatfs.h"
+#include "fat_defs.h"
+#include "fat_scan.h"
+#include "fat_check.h"
+#include "utils.h"
+
+#define BIT_GET(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define BIT_SET(map, n) ((map)[(n) >> 3] |= (1 << ((n) & 7)))
+
+/* A file/folder entry one of the readers found */
+typedef struct check_entry
+{
+	char *path;
+	unsigned int sector;       /* Where its 32 byte entry is on the device */
+	unsigned int offset;
+	unsigned int start;        /* First cluster */
+	unsigned int size;
+	unsigned char attr;
+} check_entry_t;
+
+/* A folder waiting to be read */
+typedef struct check_dir
+{
+	struct check_dir *next;
+	char *path;
+	unsigned int cluster;      /* 0 - FAT16 root directory */
+	int depth;
+} check_dir_t;
+
+/* Long name being put together while a folder is read */
+typedef struct check_lfn
+{
+	unsigned short name[260];
+	int len;                   /* 0 - none */
+	int order;                 /* Order of the last long name entry seen */
+	unsigned char sum;         /* Checksum of the short name it belongs to */
+} check_lfn_t;
+
+typedef struct check_ctx
+{
+	fatfs_t *fat;
+	fs_fat_check_t *c;
+	fat_table_t t;
+	int problems;
+
+	mutex_t lock;              /* Everything below */
+	condvar_t work;            /* Signaled when a folder gets queued or the last busy reader is done */
+	check_dir_t *queue;
+	int busy;                  /* Readers that are reading a folder */
+	int error;                 /* errno of the first reader that failed */
+	unsigned char *seen;       /* Bit per cluster. Set when a folder that starts there got queued */
+	check_entry_t *entries;
+	unsigned int num, max;
+} check_ctx_t;
+
+/* Queue the folder path(which now belongs to the queue) for reading. ctx->lock must be held */
+static int queue_dir(check_ctx_t *ctx, char *path, unsigned int cluster, int depth)
+{
+	check_dir_t *dir;
+
+	if(!(dir = (check_dir_t *)malloc(sizeof(check_dir_t))))
+	{
+		free(path);
+		return ENOMEM;
+	}
+
+	dir->path = path;
+	dir->cluster = cluster;
+	dir->depth = depth;
+	dir->next = ctx->queue;
+	ctx->queue = dir;
+
+	if(cluster >= 2)
+		BIT_SET(ctx->seen, cluster);
+
+	cond_signal(&ctx->work);
+
+	return 0;
+}
+
+/* Keep the entry at byte 'offset' of 'sector'. Folders get queued. Returns 0 or an errno */
+static int add_entry(check_ctx_t *ctx, check_dir_t *dir, const unsigned char *entry, const char *name, unsigned int sector, unsigned int offset)
+{
+	check_entry_t *e, *tmp;
+	char *path, *sub;
+	int rv = 0;
+
+	if(!(path = (char *)malloc(strlen(dir->path) + strlen(name) + 2)))
+		return ENOMEM;
+
+	sprintf(path, "%s/%s", dir->path, name);
+
+	mutex_lock(&ctx->lock);
+
+	if(ctx->num == ctx->max)
+	{
+		if(!(tmp = (check_entry_t *)realloc(ctx->entries, (ctx->max ? ctx->max * 2 : 256) * sizeof(check_entry_t))))
+		{
+			mutex_unlock(&ctx->lock);
+			free(path);
+			return ENOMEM;
+		}
+
+		ctx->entries = tmp;
+		ctx->max = ctx->max ? ctx->max * 2 : 256;
+	}
+
+	e = &ctx->entries[ctx->num++];
+	e->path = path;
+	e->sector = sector;
+	e->offset = offset;
+	e->attr = entry[ATTRIBUTE];
+	e->start = entry[STARTCLUSTERLOW] | (entry[STARTCLUSTERLOW + 1] << 8);
+	e->size = entry[FILESIZE] | (entry[FILESIZE + 1] << 8) | (entry[FILESIZE + 2] << 16) | ((unsigned int)entry[FILESIZE + 3] << 24);
+
+	if(ctx->fat->fat_type == FAT32)
+		e->start |= (entry[STARTCLUSTERHI] | (entry[STARTCLUSTERHI + 1] << 8)) << 16;
+
+	/* A folder someone else already queued is cross-linked, the chain check finds that */
+	if((e->attr & DIRECTORY) && e->start >= 2 && e->start < ctx->t.clusters + 2 && !BIT_GET(ctx->seen, e->start)
+	&& dir->depth + 1 < FAT_WALK_MAX_DEPTH)
+	{
+		if(!(sub = strdup(path)))
+			rv = ENOMEM;
+		else
+			rv = queue_dir(ctx, sub, e->start, dir->depth + 1);
+	}
+
+	mutex_unlock(&ctx->lock);
+
+	return rv;
+}
+
+/* Go through 'count' sectors of folder entries in buf. Returns 1 at the end of the folder, 0 to go on or an errno */
+static int parse_entries(check_ctx_t *ctx, check_dir_t *dir, check_lfn_t *lfn, const unsigned char *buf, unsigned int sector, unsigned int count)
+{
+	const unsigned int bps = ctx->fat->boot_sector.bytes_per_sector;
+	const unsigned char *entry;
+	unsigned char name[260 * 3 + 1];
+	unsigned int i;
+	int order, rv;
+
+	for(i = 0; i < count * bps / ENTRYSIZE; i++)
+	{
+		entry = buf + i * ENTRYSIZE;
+
+		if(entry[0] == EMPTY)
+			return 1;
+
+		if(entry[0] == DELETED)
+		{
+			lfn->len = 0;
+			continue;
+		}
+
+		if(entry[ATTRIBUTE] == LONGFILENAME)
+		{
+			order = entry[ORDER] & 0x1F;
+
+			if(order < 1 || order > 20)
+				lfn->len = 0;
+			else if(entry[ORDER] & 0x40)   /* Last part, comes first */
+			{
+				lfn->sum = entry[CHECKSUM];
+				lfn->len = (order - 1) * 13 + extract_long_name(entry, lfn->name + (order - 1) * 13);
+			}
+			else if(lfn->len > 0 && order == lfn->order - 1 && entry[CHECKSUM] == lfn->sum)
+				extract_long_name(entry, lfn->name + (order - 1) * 13);
+			else
+				lfn->len = 0;
+
+			lfn->order = order;
+			continue;
+		}
+
+		if((entry[ATTRIBUTE] & VOLUME_ID) || entry[0] == '.')
+		{
+			lfn->len = 0;
+			continue;
+		}
+
+		if(lfn->len > 0 && lfn->order == 1 && lfn->sum == short_name_checksum(entry))
+			ucs2_to_utf8(lfn->name, lfn->len, name);
+		else
+			short_entry_name(entry, name, 1);
+
+		lfn->len = 0;
+
+		if((rv = add_entry(ctx, dir, entry, (const char *)name, sector + i * ENTRYSIZE / bps, (i * ENTRYSIZE) % bps)) != 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+/* Read 'count' sectors from 'sector' on, CHECK_READ_SECTORS at a time */
+static int read_run(check_ctx_t *ctx, check_dir_t *dir, check_lfn_t *lfn, unsigned char *buf, unsigned int sector, unsigned int count)
+{
+	unsigned int n;
+	int rv;
+
+	for(; count > 0; sector += n, count -= n)
+	{
+		n = (count < CHECK_READ_SECTORS) ? count : CHECK_READ_SECTORS;
+
+		if(fat_read_sectors(ctx->fat, FAT_TRACE_DIR, sector, n, buf) != 0)
+			return EIO;
+
+		if((rv = parse_entries(ctx, dir, lfn, buf, sector, n)) != 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+/* Read every entry of dir. Follows its chain in the in-memory FAT a run of clusters at a time and stops
+   where the chain breaks(the chain check reports that). Returns 0 or an errno */
+static int read_dir(check_ctx_t *ctx, check_dir_t *dir, unsigned char *buf)
+{
+	fatfs_t *fat = ctx->fat;
+	const fat_table_t *t = &ctx->t;
+	const unsigned int spc = fat->boot_sector.sectors_per_cluster;
+	unsigned int clust = dir->cluster, steps = 0, run;
+	check_lfn_t lfn;
+	int rv;
+
+	lfn.len = 0;
+	lfn.order = 0;
+
+	if(clust == 0)
+	{
+		rv = read_run(ctx, dir, &lfn, buf, fat->root_dir_sec_loc, fat->root_dir_sectors_num);
+		return (rv == 1) ? 0 : rv;
+	}
+
+	while(clust >= 2 && clust < t->clusters + 2 && steps < t->clusters)
+	{
+		for(run = 1; clust + run < t->clusters + 2 && t->next[clust + run - 1] == clust + run && steps + run < t->clusters; run++)
+			;
+
+		if((rv = read_run(ctx, dir, &lfn, buf, fat->data_sec_loc + (clust - 2) * spc, run * spc)) != 0)
+			return (rv == 1) ? 0 : rv;
+
+		steps += run;
+		clust = t->next[clust + run - 1];
+	}
+
+	return 0;
+}
+
+/* Reads queued folders until there are none left and nobody is reading one that could add more */
+static void *check_reader(void *arg)
+{
+	check_ctx_t *ctx = (check_ctx_t *)arg;
+	check_dir_t *dir;
+	unsigned char *buf;
+	int rv;
+
+	buf = (unsigned char *)malloc(CHECK_READ_SECTORS * ctx->fat->boot_sector.bytes_per_sector);
+
+	mutex_lock(&ctx->lock);
+
+	if(buf == NULL)
+		ctx->error = ENOMEM;
+
+	for(;;)
+	{
+		while(ctx->queue == NULL && ctx->busy > 0 && !ctx->error)
+			cond_wait(&ctx->work, &ctx->lock);
+
+		if(ctx->queue == NULL || ctx->error)
+			break;
+
+		dir = ctx->queue;
+		ctx->queue = dir->next;
+		ctx->busy++;
+		mutex_unlock(&ctx->lock);
+
+		rv = read_dir(ctx, dir, buf);
+		free(dir->path);
+		free(dir);
+
+		mutex_lock(&ctx->lock);
+		ctx->busy--;
+
+		if(rv != 0 && !ctx->error)
+			ctx->error = rv;
+
+		if(ctx->busy == 0 || ctx->error)
+			cond_broadcast(&ctx->work);
+	}
+
+	cond_broadcast(&ctx->work);
+	mutex_unlock(&ctx->lock);
+	free(buf);
+
+	return NULL;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+	const check_entry_t *x = (const check_entry_t *)a, *y = (const check_entry_t *)b;
+
+	if(x->sector != y->sector)
+		return (x->sector > y->sector) - (x->sector < y->sector);
+
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static void problem(check_ctx_t *ctx, const char *path, const char *text, int fixable)
+{
+	ctx->problems++;
+
+	if(ctx->c->fix && fixable)
+		ctx->c->fixed++;
+
+	if(ctx->c->report != NULL)
+		ctx->c->report(path[0] ? path : "/", text, ctx->c->arg);
+}
+
+/* Change the FAT entry of cluster in memory and remember which FAT sector has to be written */
+static void set_next(check_ctx_t *ctx, unsigned char *dirty, unsigned int cluster, unsigned int value)
+{
+	ctx->t.next[cluster] = value;
+	BIT_SET(dirty, cluster * ctx->fat->byte_offset / ctx->fat->boot_sector.bytes_per_sector);
+}
+
+/* Put the fixed start cluster and size of e in its entry on the device */
+static int write_entry_fix(check_ctx_t *ctx, const check_entry_t *e, unsigned int start, unsigned int size)
+{
+	unsigned char sec[512];
+	unsigned char *entry = sec + e->offset;
+
+	if(fat_read_sectors(ctx->fat, FAT_TRACE_DIR, e->sector, 1, sec) != 0)
+		return -1;
+
+	entry[STARTCLUSTERLOW] = start & 0xFF;
+	entry[STARTCLUSTERLOW + 1] = (start >> 8) & 0xFF;
+
+	if(ctx->fat->fat_type == FAT32)
+	{
+		entry[STARTCLUSTERHI] = (start >> 16) & 0xFF;
+		entry[STARTCLUSTERHI + 1] = (start >> 24) & 0xFF;
+	}
+
+	entry[FILESIZE] = size & 0xFF;
+	entry[FILESIZE + 1] = (size >> 8) & 0xFF;
+	entry[FILESIZE + 2] = (size >> 16) & 0xFF;
+	entry[FILESIZE + 3] = (size >> 24) & 0xFF;
+
+	return fat_write_sectors(ctx->fat, FAT_TRACE_DIR, e->sector, 1, sec);
+}
+
+/* Follow the chain of e(or the FAT32 root directory if e is NULL), marking its clusters used. The chain is
+   cut where it breaks, runs into a cluster that is already used or goes past the size of the file */
+static int check_chain(check_ctx_t *ctx, check_entry_t *e, unsigned char *used, unsigned char *dirty)
+{
+	fatfs_t *fat = ctx->fat;
+	fat_table_t *t = &ctx->t;
+	const unsigned int cbytes = fat->boot_sector.sectors_per_cluster * fat->boot_sector.bytes_per_sector;
+	const unsigned int marker = (fat->fat_type == FAT16) ? 0xFFFF : 0x0FFFFFFF;
+	const char *path = e ? e->path : "";
+	int dir = e ? (e->attr & DIRECTORY) : 1;
+	unsigned int start = e ? e->start : fat->root_cluster_num;
+	unsigned int size = e ? e->size : 0;
+	unsigned int need = size / cbytes + (size % cbytes != 0);
+	unsigned int clust, next, prev = 0, n = 0;
+	const char *cut = NULL;
+
+	if(dir && size != 0)
+	{
+		problem(ctx, path, "folder has a size", 1);
+		ctx->c->bad_sizes++;
+		size = 0;
+	}
+
+	if(!dir && need == 0 && start != 0)
+	{
+		problem(ctx, path, "empty file has clusters", 1);
+		ctx->c->bad_sizes++;
+		start = 0;
+	}
+
+	for(clust = start; clust != 0; clust = next)
+	{
+		if(clust < 2 || clust >= t->clusters + 2 || t->next[clust] == 0 || t->next[clust] == t->bad)
+		{
+			cut = "cluster chain is broken";
+			ctx->c->bad_chains++;
+			break;
+		}
+
+		if(BIT_GET(used, clust))
+		{
+			cut = "cross-linked";
+			ctx->c->cross_links++;
+			break;
+		}
+
+		if(!dir && n == need)
+		{
+			cut = "file has more clusters than its size needs";
+			ctx->c->bad_sizes++;
+			break;
+		}
+
+		BIT_SET(used, clust);
+		prev = clust;
+		n++;
+
+		if((next = t->next[clust]) >= t->eoc)
+			break;
+	}
+
+	/* Folders that lost their first cluster can't be fixed here, a start of 0 would make them the root directory */
+	if(cut != NULL)
+	{
+		problem(ctx, path, cut, prev != 0 || !dir);
+
+		if(prev != 0)
+			set_next(ctx, dirty, prev, marker);
+		else if(!dir)
+			start = 0;
+	}
+
+	if(dir && e != NULL && start == 0)
+	{
+		problem(ctx, path, "folder has no clusters", 0);
+		ctx->c->bad_chains++;
+	}
+
+	if(!dir && n < need)
+	{
+		problem(ctx, path, "file is bigger than its clusters", 1);
+		ctx->c->bad_sizes++;
+		size = n * cbytes;
+	}
+
+	if(e != NULL && ctx->c->fix && (start != e->start || size != e->size) && write_entry_fix(ctx, e, start, size) != 0)
+		return -1;
+
+	return 0;
+}
+
+/* Everything after the folders are read: chains, lost clusters, writing the fixes */
+static int check_clusters(check_ctx_t *ctx)
+{
+	fatfs_t *fat = ctx->fat;
+	fat_table_t *t = &ctx->t;
+	fs_fat_check_t *c = ctx->c;
+	const unsigned int eps = fat->boot_sector.bytes_per_sector / fat->byte_offset;   /* FAT entries per sector */
+	unsigned int sectors = (t->clusters + 2 + eps - 1) / eps;
+	unsigned char *used, *dirty, *ref, *lost;
+	fat_discard_t discard = { 0, 0 };
+	unsigned int i, clust, first, next;
+	char text[80];
+	int rv = -1;
+
+	used = (unsigned char *)calloc((t->clusters + 2 + 7) / 8, 1);
+	ref = (unsigned char *)calloc((t->clusters + 2 + 7) / 8, 1);
+	lost = (unsigned char *)calloc((t->clusters + 2 + 7) / 8, 1);
+	dirty = (unsigned char *)calloc((sectors + 7) / 8, 1);
+
+	if(used == NULL || ref == NULL || lost == NULL || dirty == NULL)
+	{
+		errno = ENOMEM;
+		goto done;
+	}
+
+	if(fat->fat_type == FAT32 && check_chain(ctx, NULL, used, dirty) != 0)
+		goto io_error;
+
+	qsort(ctx->entries, ctx->num, sizeof(check_entry_t), cmp_entries);
+
+	for(i = 0; i < ctx->num; i++)
+	{
+		if(ctx->entries[i].attr & DIRECTORY)
+			c->folders++;
+		else
+			c->files++;
+
+		if(check_chain(ctx, &ctx->entries[i], used, dirty) != 0)
+			goto io_error;
+	}
+
+	/* Lost clusters. A chain starts at a lost cluster no other lost cluster points to */
+	for(clust = 2; clust < t->clusters + 2; clust++)
+	{
+		next = t->next[clust];
+
+		if(next != 0 && next != t->bad && !BIT_GET(used, clust))
+		{
+			c->lost_clusters++;
+
+			if(next >= 2 && next < t->clusters + 2)
+				BIT_SET(ref, next);
+		}
+	}
+
+	if(c->lost_clusters > 0)
+	{
+		for(clust = 2; clust < t->clusters + 2; clust++)
+		{
+			next = t->next[clust];
+
+			if(next != 0 && next != t->bad && !BIT_GET(used, clust))
+			{
+				if(!BIT_GET(ref, clust))
+					c->lost_chains++;
+
+				set_next(ctx, dirty, clust, 0);
+				BIT_SET(lost, clust);
+			}
+		}
+
+		/* Chains that loop back onto themselves have no start */
+		if(c->lost_chains == 0)
+			c->lost_chains = 1;
+
+		sprintf(text, "%u lost clusters in %u chains", c->lost_clusters, c->lost_chains);
+		problem(ctx, "", text, 1);
+	}
+
+	for(clust = 2; clust < t->clusters + 2; clust++)
+	{
+		if(t->next[clust] == 0)
+			c->free_clusters++;
+	}
+
+	if(c->fix)
+	{
+		/* Write the FAT sectors that changed, runs of them at a time */
+		for(i = 0; i < sectors; i = next)
+		{
+			if(!BIT_GET(dirty, i))
+			{
+				next = i + 1;
+				continue;
+			}
+
+			for(next = i + 1; next < sectors && BIT_GET(dirty, next); next++)
+				;
+
+			first = i * eps;
+			clust = next * eps - 1;
+
+			if(fat_table_store(fat, t, first, (clust < t->clusters + 2) ? clust : t->clusters + 1) != 0)
+				goto done;
+		}
+
+		/* The lost clusters are free on the device now */
+		for(clust = 2; clust < t->clusters + 2; clust++)
+		{
+			if(BIT_GET(lost, clust))
+				fat_discard_add(fat, &discard, clust);
+		}
+
+		fat_discard_flush(fat, &discard);
+
+		if(fat->fat_type == FAT32)
+		{
+			mutex_lock(&fat->fat_lock);
+			memcpy(fat->fsinfo_buf + FREECOUNT, &c->free_clusters, 4);
+
+			if(fat_write_sectors(fat, FAT_TRACE_FSINFO, fat->fsinfo_sector, 1, fat->fsinfo_buf) != 0)
+			{
+				mutex_unlock(&fat->fat_lock);
+				goto io_error;
+			}
+
+			mutex_unlock(&fat->fat_lock);
+		}
+	}
+
+	rv = 0;
+	goto done;
+
+io_error:
+	errno = EIO;
+
+done:
+	free(used);
+	free(ref);
+	free(lost);
+	free(dirty);
+
+	return rv;
+}
+
+/* Check(and with c->fix set repair) the volume. The caller makes sure nothing changes it meanwhile.
+   Returns the number of problems found or -1 with errno set */
+int fat_check(fatfs_t *fat, fs_fat_check_t *c)
+{
+	check_ctx_t ctx;
+	kthread_t *threads[CHECK_MAX_THREADS];
+	int num_threads = (c->threads > 1) ? c->threads : 1;
+	int i, started = 0;
+	char *root;
+
+	if(num_threads > CHECK_MAX_THREADS)
+		num_threads = CHECK_MAX_THREADS;
+
+	c->files = c->folders = c->bad_chains = c->cross_links = c->bad_sizes = 0;
+	c->lost_chains = c->lost_clusters = c->free_clusters = c->fixed = 0;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fat = fat;
+	ctx.c = c;
+
+	if(fat_table_load(fat, &ctx.t) != 0)
+		return -1;
+
+	if(!(ctx.seen = (unsigned char *)calloc((ctx.t.clusters + 2 + 7) / 8, 1)) || !(root = strdup("")))
+	{
+		free(ctx.seen);
+		fat_table_free(&ctx.t);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	mutex_init(&ctx.lock, MUTEX_TYPE_NORMAL);
+	cond_init(&ctx.work);
+
+	mutex_lock(&ctx.lock);
+	ctx.error = queue_dir(&ctx, root, (fat->fat_type == FAT16) ? 0 : fat->root_cluster_num, 0);
+	mutex_unlock(&ctx.lock);
+
+	/* The folders are read by num_threads readers, this thread being one of them */
+	for(i = 0; i < num_threads - 1; i++)
+	{
+		if((threads[started] = thd_create(0, check_reader, &ctx)) != NULL)
+			started++;
+	}
+
+	check_reader(&ctx);
+
+	for(i = 0; i < started; i++)
+		thd_join(threads[i], NULL);
+
+	while(ctx.queue != NULL)
+	{
+		check_dir_t *dir = ctx.queue;
+		ctx.queue = dir->next;
+		free(dir->path);
+		free(dir);
+	}
+
+	cond_destroy(&ctx.work);
+	mutex_destroy(&ctx.lock);
+	free(ctx.seen);
+
+	if(ctx.error)
+		errno = ctx.error;
+	else if(check_clusters(&ctx) == 0)
+		ctx.error = 0;
+	else
+		ctx.error = errno;
+
+	for(i = 0; i < (int)ctx.num; i++)
+		free(ctx.entries[i].path);
+
+	free(ctx.entries);
+	fat_table_free(&ctx.t);
+
+	if(ctx.error)
+	{
+		errno = ctx.error;
+		return -1;
+	}
+
+	return ctx.problems;
+}
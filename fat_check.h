@@ -0,0 +1,17 @@
+
+#ifndef _FAT_CHECK_H_
+#define _FAT_CHECK_H_
+
+__BEGIN_DECLS
+
+#include "include/fs_fat.h"
+#include "dir_entry.h"
+
+#define CHECK_READ_SECTORS  64    /* Folder sectors read per request */
+#define CHECK_MAX_THREADS   32
+
+/* Prototypes */
+int fat_check(fatfs_t *fat, fs_fat_check_t *c);
+
+__END_DECLS
+#endif /* _FAT_CHECK_H_ */
@@ -0,0 +1,124 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fatfs.h"
+#include "fat_defs.h"
+#include "fat_defrag.h"
+
+/* Give the run of 'count' clusters starting at 'first' back to the free space(in t and on the device) */
+static void release_run(fatfs_t *fat, fat_table_t *t, unsigned int first, unsigned int count)
+{
+	fat_discard_t discard = { first, count };
+	unsigned int i;
+	
+	for(i = 0; i < count; i++)
+		t->next[first + i] = 0;
+	
+	if(fat_table_store(fat, t, first, first + count - 1) == 0)
+		fat_discard_flush(fat, &discard);
+}
+
+/* Move the clusters of file into one run of free clusters. buf has to hold DEFRAG_BUF_SECTORS sectors.
+   The new chain is put in the FAT first, then the data is copied, then the entry is pointed at the new
+   chain and only then the old chain is freed, so a crash at any point leaves the file as it was or moved
+   (plus clusters nothing uses). Stops before any transfer once *cancel is set(cancel can be NULL).
+   Returns the number of clusters moved(0 if the file already was in one piece) or -1 with errno set:
+   ENOSPC(no free run big enough), ECANCELED or EIO. t is kept up to date. The caller makes sure nothing
+   else uses the file or the FAT meanwhile */
+int fat_move_file(fatfs_t *fat, fat_table_t *t, node_entry_t *file, unsigned char *buf, volatile int *cancel)
+{
+	const unsigned int spc = fat->boot_sector.sectors_per_cluster;
+	const unsigned int marker = (fat->fat_type == FAT16) ? 0xFFFF : 0x0FFFFFFF;
+	unsigned int count, dest, old, clust, next, run, i;
+	unsigned int done = 0;       /* Clusters copied */
+	unsigned int src, dst, sectors, n;
+	
+	if(fat_chain_extents(t, file->StartCluster, &count) < 2)
+		return 0;
+	
+	if((dest = fat_find_free_run(t, count)) == 0)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+	
+	/* New chain */
+	for(i = 0; i < count; i++)
+		t->next[dest + i] = (i == count - 1) ? marker : dest + i + 1;
+	
+	if(fat_table_store(fat, t, dest, dest + count - 1) != 0)
+	{
+		release_run(fat, t, dest, count);
+		return -1;
+	}
+	
+	/* Copy one run of the old chain at a time, DEFRAG_BUF_SECTORS at most per transfer */
+	clust = file->StartCluster;
+	
+	while(done < count)
+	{
+		for(run = 1; done + run < count && t->next[clust + run - 1] == clust + run; run++)
+			;
+		
+		src = fat->data_sec_loc + (clust - 2) * spc;
+		dst = fat->data_sec_loc + (dest + done - 2) * spc;
+		sectors = run * spc;
+		
+		for(i = 0; i < sectors; i += n)
+		{
+			n = (sectors - i < DEFRAG_BUF_SECTORS) ? sectors - i : DEFRAG_BUF_SECTORS;
+			
+			if(cancel != NULL && *cancel)
+			{
+				release_run(fat, t, dest, count);
+				errno = ECANCELED;
+				return -1;
+			}
+			
+			if(fat_read_sectors(fat, FAT_TRACE_DATA, src + i, n, buf) != 0
+			|| fat_write_sectors(fat, FAT_TRACE_DATA, dst + i, n, buf) != 0)
+			{
+				release_run(fat, t, dest, count);
+				errno = EIO;
+				return -1;
+			}
+		}
+		
+		done += run;
+		clust = t->next[clust + run - 1];
+	}
+	
+	/* Switch the file over. If the entry can't be written it still has the old chain */
+	old = file->StartCluster;
+	file->StartCluster = dest;
+	
+	if(set_sd_start_cluster(fat, file) != 0)
+	{
+		file->StartCluster = old;
+		release_run(fat, t, dest, count);
+		return -1;
+	}
+	
+	file->EndCluster = dest + count - 1;
+	reset_cluster_map(file);
+	
+	/* Free the old chain one run at a time */
+	for(clust = old, i = 0; clust >= 2 && clust < t->clusters + 2 && i < count; )
+	{
+		for(run = 1; i + run < count && t->next[clust + run - 1] == clust + run; run++)
+			;
+		
+		next = t->next[clust + run - 1];
+		release_run(fat, t, clust, run);
+		i += run;
+		clust = next;
+	}
+	
+	FAT_STAT_ADD(fat, clusters_allocated, count);
+	FAT_STAT_ADD(fat, clusters_freed, count);
+	
+	return count;
+}
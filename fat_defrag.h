@@ -0,0 +1,16 @@
+
+#ifndef _FAT_DEFRAG_H_
+#define _FAT_DEFRAG_H_
+
+__BEGIN_DECLS
+
+#include "dir_entry.h"
+#include "fat_scan.h"
+
+#define DEFRAG_BUF_SECTORS 128   /* Sectors moved per read/write(64KB) */
+
+/* Prototypes */
+int fat_move_file(fatfs_t *fat, fat_table_t *t, node_entry_t *file, unsigned char *buf, volatile int *cancel);
+
+__END_DECLS
+#endif /* _FAT_DEFRAG_H_ */
@@ -5,10 +5,12 @@
 
 __BEGIN_DECLS
 
+#include <kos/mutex.h>
 #include <kos/blockdev.h>
 
 #include "dir_entry.h"
 #include "boot_sector.h"
+#include "include/fs_fat.h"
 
 #define FAT16 0
 #define FAT32 1
@@ -21,22 +23,48 @@ __BEGIN_DECLS
 struct fatfs
 {
     kos_blockdev_t   *dev;
+    fs_fat_discard_fn discard;                 /* Called for freed clusters when mounted with FS_FAT_MOUNT_DISCARD. NULL otherwise */
     fat_BS_t         boot_sector;
 
     /* Filesystem globals */ 
 	unsigned char    *mount;                   /* Save what the user mounts the sd card to e.g. "/sd" so I can add it back when certain functions(open, unlink, mkdir) are called */
 	unsigned short   fat_type;                 /* 0 - Fat16, 1 - Fat32 */
-	unsigned short   table_size;               /* Number of sectors the FAT table uses */
+	unsigned int     table_size;               /* Number of sectors the FAT table uses */
 	unsigned short   byte_offset;              /* 2 - Fat16. 4 - Fat32 */
 	unsigned int     root_cluster_num;         /* Fat32 only */
 	unsigned short   fsinfo_sector;            /* Fat32 only */ 
 	unsigned int     next_free_fat_index;      /* Holds the last cluster index that was allocated */
     unsigned short   root_dir_sectors_num;     /* The number of sectors the root directory consists of. Should be zero for Fat32 */
-    unsigned short   root_dir_sec_loc;         /* The first sector where the root directory starts */
-    unsigned short   file_alloc_tab_sec_loc;   /* The first sector where the fat allocation table starts */
-    unsigned short   data_sec_loc;             /* The first sector where the data starts(Location of cluster 2) */
+    unsigned int     root_dir_sec_loc;         /* The first sector where the root directory starts */
+    unsigned int     file_alloc_tab_sec_loc;   /* The first sector where the fat allocation table starts */
+    unsigned int     data_sec_loc;             /* The first sector where the data starts(Location of cluster 2) */
     unsigned int     data_sectors_num;         /* The number of data sectors. Data sectors are sectors that exist after the boot sector, fat tables, and root directory */
     unsigned int     total_clusters_num;       /* The total number of data clusters. */
+
+    /* Allocation units of the card(see fat_au.c). Protected by fat_lock */
+    unsigned int     au_clusters;              /* Clusters per AU. 0 - clusters are allocated first free first */
+    unsigned int     au_skew;                  /* Clusters of the first AU that are before the data area */
+    unsigned int     au_count;                 /* AUs the data area has(part of) */
+    unsigned int     au_total;                 /* AUs the data area has all of */
+    unsigned int     au_free;                  /* Of those, the ones without a used cluster */
+    unsigned int     au_stream;                /* Files with this many clusters get whole free AUs */
+    unsigned int     au_open;                  /* AU small files are packed into */
+    unsigned int     au_cursor;                /* Where the search for a free cluster in au_open starts */
+    unsigned int     au_next;                  /* Where the search for a free AU starts */
+    unsigned int     *au_used;                 /* Used clusters of every AU */
+
+    mutex_t          fat_lock;                 /* Protects the FAT table sector cache, next_free_fat_index, the AU counts and the FSInfo sector */
+    mutex_t          cache_lock;               /* Protects dir_cache. Lookups on one mount can run at the same time */
+
+    int              fat_sector_offset;        /* Sector(from file_alloc_tab_sec_loc) of the FAT table that is in fat_buf. -1 if none */
+    unsigned char    fat_buf[512];             /* One sector of the FAT table */
+    unsigned char    fsinfo_buf[512];          /* The FSInfo sector. Fat32 only */
+
+    struct fat_dir_cache *dir_cache;           /* Free slot maps of recently scanned directories(DIR_CACHE_SIZE of them) */
+    unsigned int     dir_cache_stamp;          /* Incremented every time a map is used. Used to find the least recently used map */
+
+    mutex_t          stats_lock;               /* Protects stats */
+    fs_fat_stats_t   stats;                    /* See FS_FAT_IOCTL_GET_STATS */
 };
 
 __END_DECLS
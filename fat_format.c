@@ -0,0 +1,344 @@
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arch/timer.h>
+
+#include "fatfs.h"
+#include "fat_defs.h"
+#include "fat_format.h"
+
+/* Cluster counts the FAT type decides on. Anything else gets taken for the other type */
+#define FAT16_MIN_CLUSTERS  4085
+#define FAT16_MAX_CLUSTERS  65524
+#define FAT32_MIN_CLUSTERS  65525
+#define FAT32_MAX_CLUSTERS  0x0FFFFFF4
+
+/* Cluster size for a volume of 'total' sectors if the caller didn't ask for one. Big clusters mean fewer FAT
+   lookups and longer runs, what matters on a card. 16KB up to 1GB, 32KB above */
+static unsigned int default_cluster_size(unsigned int total)
+{
+	return (total > 2097152) ? 64 : 32;
+}
+
+/* Work out where everything goes. The FAT starts on the first alignment boundary after the reserved
+   sectors and the FATs are padded so the data area starts on one too. Because clusters are a power of 2
+   sectors that puts every cluster, and so every erase block, in line. Returns -1 if it doesn't fit */
+static int fat_format_layout(unsigned int total, int fat32, unsigned int spc, unsigned int align, fs_fat_format_t *fmt)
+{
+	const unsigned int root = fat32 ? 0 : 32;   /* FAT16 root directory: 512 entries */
+	unsigned int reserved, fat_size, data, clusters, need;
+	
+	reserved = fat32 ? 32 : 1;
+	reserved = (reserved + align - 1) & ~(align - 1);
+	
+	for(fat_size = 1; ; fat_size = need)
+	{
+		while((reserved + 2 * fat_size + root) % align)
+			fat_size++;
+		
+		data = reserved + 2 * fat_size + root;
+		
+		if(data >= total || (total - data) / spc < 2)
+			return -1;
+		
+		clusters = (total - data) / spc;
+		need = ((clusters + 2) * (fat32 ? 4 : 2) + 511) / 512;
+		
+		if(need <= fat_size)
+			break;
+	}
+	
+	fmt->fat_type = fat32 ? 32 : 16;
+	fmt->sectors_per_cluster = spc;
+	fmt->align_bytes = align * 512;
+	fmt->fat_start = reserved;
+	fmt->fat_sectors = fat_size;
+	fmt->root_start = reserved + 2 * fat_size;
+	fmt->data_start = data;
+	fmt->clusters = clusters;
+	
+	return 0;
+}
+
+/* Pick the FAT type, cluster size and alignment. What the caller asked for stays, what it left at 0 gets
+   changed until the cluster count suits the type */
+static int fat_format_plan(unsigned int total, fs_fat_format_t *fmt)
+{
+	int fat32 = fmt->fat_type ? (fmt->fat_type == 32) : (total > FORMAT_FAT32_SECTORS);
+	unsigned int spc = fmt->sectors_per_cluster ? fmt->sectors_per_cluster : default_cluster_size(total);
+	unsigned int align = fmt->align_bytes ? fmt->align_bytes / 512 : FORMAT_DEFAULT_ALIGN / 512;
+	unsigned int min, max;
+	fs_fat_format_t l;
+	
+	if((fmt->fat_type && fmt->fat_type != 16 && fmt->fat_type != 32)
+	|| spc == 0 || spc > 128 || (spc & (spc - 1))
+	|| align == 0 || (align & (align - 1)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	
+	/* The default alignment is for cards. Small volumes get less of it so the layout doesn't eat them */
+	if(!fmt->align_bytes)
+	{
+		while(align > 1 && align * 16 > total)
+			align >>= 1;
+	}
+	
+	for(;;)
+	{
+		min = fat32 ? FAT32_MIN_CLUSTERS : FAT16_MIN_CLUSTERS;
+		max = fat32 ? FAT32_MAX_CLUSTERS : FAT16_MAX_CLUSTERS;
+		
+		if(fat_format_layout(total, fat32, spc, align, &l) != 0 || l.clusters < min)
+		{
+			if(!fmt->sectors_per_cluster && spc > 1)
+				spc >>= 1;
+			else if(!fmt->fat_type && fat32)
+			{
+				fat32 = 0;
+				spc = default_cluster_size(total);
+			}
+			else
+			{
+				errno = EINVAL;
+				return -1;
+			}
+		}
+		else if(l.clusters > max)
+		{
+			if(!fmt->sectors_per_cluster && spc < 128)
+				spc <<= 1;
+			else if(!fmt->fat_type && !fat32)
+			{
+				fat32 = 1;
+				spc = default_cluster_size(total);
+			}
+			else
+			{
+				errno = EINVAL;
+				return -1;
+			}
+		}
+		else
+			break;
+	}
+	
+	l.label = fmt->label;
+	*fmt = l;
+	
+	return 0;
+}
+
+/* Write 'count' zeroed sectors from 'sector' on, FORMAT_BUF_SECTORS at a time */
+static int zero_sectors(kos_blockdev_t *dev, int tag, unsigned int sector, unsigned int count, const unsigned char *zero)
+{
+	unsigned int n;
+	
+	for(; count > 0; sector += n, count -= n)
+	{
+		n = (count < FORMAT_BUF_SECTORS) ? count : FORMAT_BUF_SECTORS;
+		
+		if(fat_dev_write(dev, tag, sector, n, zero))
+			return -1;
+	}
+	
+	return 0;
+}
+
+static void fill_boot_sector(unsigned char *buf, unsigned int total, const fs_fat_format_t *fmt)
+{
+	fat_BS_t bs;
+	fat_extBS_16_t ext16;
+	fat_extBS_32_t ext32;
+	unsigned char label[11];
+	unsigned int volume_id = (unsigned int)timer_ms_gettime64();
+	int i;
+	
+	memset(label, ' ', sizeof(label));
+	memcpy(label, "NO NAME", 7);
+	
+	if(fmt->label != NULL)
+	{
+		memset(label, ' ', sizeof(label));
+		
+		for(i = 0; i < 11 && fmt->label[i]; i++)
+			label[i] = toupper((unsigned char)fmt->label[i]);
+	}
+	
+	memset(&bs, 0, sizeof(fat_BS_t));
+	bs.bootjmp[0] = 0xEB;
+	bs.bootjmp[1] = (fmt->fat_type == 32) ? 0x58 : 0x3C;
+	bs.bootjmp[2] = 0x90;
+	memcpy(bs.oem_name, "LIBFATFS", 8);
+	bs.bytes_per_sector = 512;
+	bs.sectors_per_cluster = fmt->sectors_per_cluster;
+	bs.reserved_sector_count = fmt->fat_start;
+	bs.table_count = 2;
+	bs.root_entry_count = (fmt->fat_type == 32) ? 0 : 512;
+	bs.media_type = 0xF8;
+	bs.sectors_per_track = 63;
+	bs.head_side_count = 255;
+	
+	if(fmt->fat_type == 16 && total < 65536)
+		bs.total_sectors_16 = total;
+	else
+		bs.total_sectors_32 = total;
+	
+	if(fmt->fat_type == 32)
+	{
+		memset(&ext32, 0, sizeof(fat_extBS_32_t));
+		ext32.table_size_32 = fmt->fat_sectors;
+		ext32.root_cluster = 2;
+		ext32.fat_info = 1;
+		ext32.backup_BS_sector = 6;
+		ext32.drive_number = 0x80;
+		ext32.boot_signature = 0x29;
+		ext32.volume_id = volume_id;
+		memcpy(ext32.volume_label, label, 11);
+		memcpy(ext32.fat_type_label, "FAT32   ", 8);
+		memcpy(bs.extended_section, &ext32, sizeof(fat_extBS_32_t));
+	}
+	else
+	{
+		bs.table_size_16 = fmt->fat_sectors;
+		
+		memset(&ext16, 0, sizeof(fat_extBS_16_t));
+		ext16.bios_drive_num = 0x80;
+		ext16.boot_signature = 0x29;
+		ext16.volume_id = volume_id;
+		memcpy(ext16.volume_label, label, 11);
+		memcpy(ext16.fat_type_label, "FAT16   ", 8);
+		memcpy(bs.extended_section, &ext16, sizeof(fat_extBS_16_t));
+	}
+	
+	memset(buf, 0, 512);
+	memcpy(buf, &bs, sizeof(fat_BS_t));
+	buf[510] = 0x55;
+	buf[511] = 0xAA;
+}
+
+/* Put a new FAT16/FAT32 volume on dev. Everything up to the end of the root directory is zeroed with big
+   writes first, then the first entries of both FATs and the FSInfo sector(plus the backups) are written and
+   the boot sector goes last, so a format that got interrupted doesn't leave something that looks mountable.
+   fmt is filled in with the layout that was used. The caller makes sure dev isn't mounted */
+int fat_format(kos_blockdev_t *dev, fs_fat_format_t *fmt)
+{
+	unsigned char *buf;
+	unsigned char sec[512];
+	uint64_t blocks;
+	unsigned int total, end, i, entry;
+	int rv = -1;
+	
+	if(dev == NULL || fmt == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	
+	if(dev->init(dev))
+	{
+		errno = EIO;
+		return -1;
+	}
+	
+	/* The library only does 512 byte sectors */
+	blocks = dev->count_blocks(dev);
+	
+	if(dev->l_block_size != 9 || blocks > 0xFFFFFFFFULL)
+	{
+		dev->shutdown(dev);
+		errno = EINVAL;
+		return -1;
+	}
+	
+	total = (unsigned int)blocks;
+	
+	if(fat_format_plan(total, fmt) != 0)
+	{
+		dev->shutdown(dev);
+		return -1;
+	}
+	
+	if(!(buf = calloc(FORMAT_BUF_SECTORS, 512)))
+	{
+		dev->shutdown(dev);
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	/* Reserved sectors, both FATs, the root directory(FAT16) or root cluster(FAT32) */
+	end = fmt->data_start + ((fmt->fat_type == 32) ? fmt->sectors_per_cluster : 0);
+	
+	if(zero_sectors(dev, FAT_TRACE_BOOT, 0, fmt->fat_start, buf)
+	|| zero_sectors(dev, FAT_TRACE_FAT, fmt->fat_start, fmt->root_start - fmt->fat_start, buf)
+	|| zero_sectors(dev, FAT_TRACE_DIR, fmt->root_start, end - fmt->root_start, buf))
+		goto done;
+	
+	/* Media byte and end of chain in entries 0 and 1. On FAT32 cluster 2 is the root directory */
+	memset(sec, 0, sizeof(sec));
+	
+	if(fmt->fat_type == 32)
+	{
+		entry = 0x0FFFFFF8;
+		memcpy(sec, &entry, 4);
+		entry = 0x0FFFFFFF;
+		memcpy(sec + 4, &entry, 4);
+		memcpy(sec + 8, &entry, 4);
+	}
+	else
+	{
+		sec[0] = 0xF8;
+		sec[1] = 0xFF;
+		sec[2] = 0xFF;
+		sec[3] = 0xFF;
+	}
+	
+	for(i = 0; i < 2; i++)
+	{
+		if(fat_dev_write(dev, FAT_TRACE_FAT, fmt->fat_start + i * fmt->fat_sectors, 1, sec))
+			goto done;
+	}
+	
+	fill_boot_sector(buf, total, fmt);
+	
+	if(fmt->fat_type == 32)
+	{
+		memset(sec, 0, sizeof(sec));
+		entry = 0x41615252;
+		memcpy(sec, &entry, 4);
+		entry = 0x61417272;
+		memcpy(sec + 484, &entry, 4);
+		entry = fmt->clusters - 1;
+		memcpy(sec + FREECOUNT, &entry, 4);
+		entry = 3;
+		memcpy(sec + NEXTFREE, &entry, 4);
+		sec[510] = 0x55;
+		sec[511] = 0xAA;
+		
+		if(fat_dev_write(dev, FAT_TRACE_FSINFO, 1, 1, sec)
+		|| fat_dev_write(dev, FAT_TRACE_BOOT, 6, 1, buf)
+		|| fat_dev_write(dev, FAT_TRACE_FSINFO, 7, 1, sec))
+			goto done;
+	}
+	
+	if(fat_dev_write(dev, FAT_TRACE_BOOT, 0, 1, buf))
+		goto done;
+	
+	if(dev->flush != NULL && dev->flush(dev))
+		goto done;
+	
+	rv = 0;
+	
+done:
+	if(rv != 0)
+		errno = EIO;
+	
+	free(buf);
+	dev->shutdown(dev);
+	
+	return rv;
+}
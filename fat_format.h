@@ -0,0 +1,19 @@
+
+#ifndef _FAT_FORMAT_H_
+#define _FAT_FORMAT_H_
+
+__BEGIN_DECLS
+
+#include <kos/blockdev.h>
+
+#include "include/fs_fat.h"
+
+#define FORMAT_BUF_SECTORS    256                /* Sectors zeroed per write(128KB) */
+#define FORMAT_DEFAULT_ALIGN  (4 * 1024 * 1024)  /* Erase block size most SD cards have */
+#define FORMAT_FAT32_SECTORS  4194304            /* Volumes over 2GB get FAT32, like SDHC cards come */
+
+/* Prototypes */
+int fat_format(kos_blockdev_t *dev, fs_fat_format_t *fmt);
+
+__END_DECLS
+#endif /* _FAT_FORMAT_H_ */
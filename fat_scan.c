@@ -0,0 +1,286 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fatfs.h"
+#include "fat_defs.h"
+#include "fat_scan.h"
+#include "fat_au.h"
+#include "utils.h"
+
+#define TABLE_READ_SECTORS 64   /* Sectors of the FAT read per request by fat_table_load() */
+
+/* Read the first copy of the FAT into t, TABLE_READ_SECTORS at a time instead of a sector per lookup like
+   read_fat_table_value(). Returns 0 or -1 with errno set. Free t with fat_table_free() */
+int fat_table_load(fatfs_t *fat, fat_table_t *t)
+{
+	const unsigned int bps = fat->boot_sector.bytes_per_sector;
+	unsigned char *buf;
+	unsigned int entries, sectors, done, n, i, first, last;
+	unsigned int index = 0;
+	
+	t->clusters = fat->total_clusters_num;
+	t->eoc = (fat->fat_type == FAT16) ? 0xFFF8 : 0x0FFFFFF8;
+	t->bad = t->eoc - 1;
+	entries = t->clusters + 2;
+	sectors = (entries * fat->byte_offset + bps - 1) / bps;
+	
+	if(sectors > fat->table_size)
+	{
+		sectors = fat->table_size;
+		entries = sectors * bps / fat->byte_offset;
+		t->clusters = entries - 2;
+	}
+	
+	if(!(t->next = (unsigned int *)malloc(entries * sizeof(unsigned int))))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	if(!(buf = (unsigned char *)malloc(TABLE_READ_SECTORS * bps)))
+	{
+		free(t->next);
+		t->next = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	/* Nothing can allocate or free clusters while we read */
+	mutex_lock(&fat->fat_lock);
+	
+	for(done = 0; done < sectors; done += n)
+	{
+		n = (sectors - done < TABLE_READ_SECTORS) ? sectors - done : TABLE_READ_SECTORS;
+		
+		if(fat_read_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + done, n, buf) != 0)
+		{
+			mutex_unlock(&fat->fat_lock);
+			free(buf);
+			fat_table_free(t);
+			errno = EIO;
+			return -1;
+		}
+		
+		/* Entries that are in these sectors */
+		first = done * bps / fat->byte_offset;
+		last = (done + n) * bps / fat->byte_offset;
+		
+		for(i = first; i < last && index < entries; i++, index++)
+		{
+			if(fat->fat_type == FAT16)
+				t->next[index] = buf[(i - first) * 2] | (buf[(i - first) * 2 + 1] << 8);
+			else
+				t->next[index] = (buf[(i - first) * 4] | (buf[(i - first) * 4 + 1] << 8) | (buf[(i - first) * 4 + 2] << 16)
+				               | ((unsigned int)buf[(i - first) * 4 + 3] << 24)) & 0x0FFFFFFF;
+		}
+	}
+	
+	mutex_unlock(&fat->fat_lock);
+	free(buf);
+	
+	return 0;
+}
+
+/* Write entries first to last of t back to the FAT(first copy, like write_fat_table_value()). The sectors are
+   read first so the top 4 bits of FAT32 entries and whatever else is in them stays. Returns 0 or -1 with errno set */
+int fat_table_store(fatfs_t *fat, const fat_table_t *t, unsigned int first, unsigned int last)
+{
+	const unsigned int bps = fat->boot_sector.bytes_per_sector;
+	const unsigned int per_sector = bps / fat->byte_offset;
+	unsigned char *buf, *p;
+	unsigned int sector, end, n, i;
+	int rv = 0;
+	
+	if(!(buf = (unsigned char *)malloc(TABLE_READ_SECTORS * bps)))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	mutex_lock(&fat->fat_lock);
+	
+	end = last / per_sector + 1;
+	
+	for(sector = first / per_sector; sector < end && rv == 0; sector += n)
+	{
+		n = (end - sector < TABLE_READ_SECTORS) ? end - sector : TABLE_READ_SECTORS;
+		
+		if(fat_read_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + sector, n, buf) != 0)
+		{
+			rv = -1;
+			break;
+		}
+		
+		for(i = sector * per_sector; i < (sector + n) * per_sector; i++)
+		{
+			if(i < first || i > last)
+				continue;
+			
+			p = buf + (i - sector * per_sector) * fat->byte_offset;
+			
+			fat_au_update(fat, i, (fat->fat_type == FAT16) ? p[0] | (p[1] << 8)
+			                      : p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24), t->next[i]);
+			
+			p[0] = t->next[i] & 0xFF;
+			p[1] = (t->next[i] >> 8) & 0xFF;
+			
+			if(fat->fat_type == FAT32)
+			{
+				p[2] = (t->next[i] >> 16) & 0xFF;
+				p[3] = (p[3] & 0xF0) | ((t->next[i] >> 24) & 0x0F);
+			}
+		}
+		
+		if(fat_write_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + sector, n, buf) != 0)
+			rv = -1;
+	}
+	
+	/* The sector read_fat_table_value() has cached can be out of date now */
+	fat->fat_sector_offset = -1;
+	
+	mutex_unlock(&fat->fat_lock);
+	free(buf);
+	
+	if(rv != 0)
+		errno = EIO;
+	
+	return rv;
+}
+
+void fat_table_free(fat_table_t *t)
+{
+	free(t->next);
+	t->next = NULL;
+}
+
+/* Number of runs of clusters next to each other the chain starting at 'start' is made of. *clusters gets the
+   length of the chain. Stops at anything that isn't a cluster of the volume and after as many clusters as the
+   volume has(a loop) */
+unsigned int fat_chain_extents(const fat_table_t *t, unsigned int start, unsigned int *clusters)
+{
+	unsigned int clust = start;
+	unsigned int extents = 0;
+	unsigned int count = 0;
+	unsigned int prev = 0;
+	
+	while(clust >= 2 && clust < t->clusters + 2 && count < t->clusters)
+	{
+		if(clust != prev + 1)
+			extents++;
+		
+		count++;
+		prev = clust;
+		clust = t->next[clust];
+	}
+	
+	if(clusters != NULL)
+		*clusters = count;
+	
+	return extents;
+}
+
+/* First cluster of the first run of 'count' free clusters in t. 0 if there isn't one that long */
+unsigned int fat_find_free_run(const fat_table_t *t, unsigned int count)
+{
+	unsigned int clust;
+	unsigned int run = 0;
+	
+	if(count == 0)
+		return 0;
+	
+	for(clust = 2; clust < t->clusters + 2; clust++)
+	{
+		run = (t->next[clust] == 0) ? run + 1 : 0;
+		
+		if(run == count)
+			return clust - count + 1;
+	}
+	
+	return 0;
+}
+
+static int walk_dir(fatfs_t *fat, node_entry_t *dir, char *path, int depth, fat_walk_fn fn, void *arg)
+{
+	node_entry_t *entry = NULL;
+	node_entry_t *sub;
+	char *tmp;
+	size_t len = strlen(path);
+	int rv = 0;
+	
+	while(rv == 0 && (entry = get_next_entry(fat, dir, entry)) != NULL)
+	{
+		/* The volume name isn't a file/folder */
+		if((entry->Attr & VOLUME_ID) && !(entry->Attr & DIRECTORY))
+			continue;
+		
+		if(!(tmp = (char *)realloc(path, len + strlen(entry->Name) + 2)))
+		{
+			errno = ENOMEM;
+			rv = -1;
+			break;
+		}
+		
+		path = tmp;
+		sprintf(path + len, "/%s", entry->Name);
+		
+		if((rv = fn(fat, entry, path, arg)) != 0)
+			break;
+		
+		/* A folder without clusters has nothing in it(or is broken). Going any deeper means the folders loop */
+		if((entry->Attr & DIRECTORY) && entry->StartCluster != 0 && depth < FAT_WALK_MAX_DEPTH)
+		{
+			if(!(sub = copy_struct_entry(entry)) || !(tmp = strdup(path)))
+			{
+				if(sub != NULL)
+					delete_struct_entry(sub);
+				
+				errno = ENOMEM;
+				rv = -1;
+				break;
+			}
+			
+			rv = walk_dir(fat, sub, tmp, depth + 1, fn, arg);
+			delete_struct_entry(sub);
+		}
+		
+		path[len] = '\0';
+	}
+	
+	if(entry != NULL)
+		delete_struct_entry(entry);
+	
+	free(path);
+	
+	return rv;
+}
+
+/* Call fn for every file and folder on the volume, depth first. Folders come before what is in them.
+   Returns 0 once everything was seen, whatever fn returned if it stopped the walk or -1 with errno set */
+int fat_walk_tree(fatfs_t *fat, fat_walk_fn fn, void *arg)
+{
+	node_entry_t *root;
+	char *path;
+	int rv;
+	
+	if(!(root = fat_root_entry(fat)))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	if(!(path = (char *)malloc(1)))
+	{
+		delete_struct_entry(root);
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	path[0] = '\0';
+	rv = walk_dir(fat, root, path, 0, fn, arg);
+	delete_struct_entry(root);
+	
+	return rv;
+}
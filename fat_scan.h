@@ -0,0 +1,35 @@
+
+#ifndef _FAT_SCAN_H_
+#define _FAT_SCAN_H_
+
+__BEGIN_DECLS
+
+#include "dir_entry.h"
+
+#define FAT_WALK_MAX_DEPTH 128   /* Deepest directory fat_walk_tree() goes into. A FAT path can't be longer anyway */
+
+typedef struct fat_table fat_table_t;
+
+/* The whole FAT in memory, for tools that look at every cluster(fragmentation, defrag, fsck) */
+struct fat_table
+{
+	unsigned int *next;        /* next[c] is the FAT entry of cluster c: 0 - free, >= eoc - last of its chain. next[0], next[1] are reserved */
+	unsigned int clusters;     /* Data clusters on the volume. next has clusters + 2 entries */
+	unsigned int eoc;          /* Entries from this up end a chain(0xFFF8 or 0x0FFFFFF8) */
+	unsigned int bad;          /* Bad cluster marker(0xFFF7 or 0x0FFFFFF7) */
+};
+
+/* Called for every file/folder fat_walk_tree() finds. path starts at the mount. node belongs to the walk.
+   Return non-zero to stop the walk */
+typedef int (*fat_walk_fn)(fatfs_t *fat, node_entry_t *node, const char *path, void *arg);
+
+/* Prototypes */
+int fat_table_load(fatfs_t *fat, fat_table_t *t);
+int fat_table_store(fatfs_t *fat, const fat_table_t *t, unsigned int first, unsigned int last);
+void fat_table_free(fat_table_t *t);
+unsigned int fat_chain_extents(const fat_table_t *t, unsigned int start, unsigned int *clusters);
+unsigned int fat_find_free_run(const fat_table_t *t, unsigned int count);
+int fat_walk_tree(fatfs_t *fat, fat_walk_fn fn, void *arg);
+
+__END_DECLS
+#endif /* _FAT_SCAN_H_ */
@@ -0,0 +1,444 @@
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arch/timer.h>
+#include <kos/mutex.h>
+
+#include "include/fat_trace.h"
+
+#include "fatfs.h"
+
+#define TRACE_MAGIC     "FATTRC01"
+#define TRACE_REC_SIZE  32   /* Size of one record in a binary dump */
+
+typedef struct fat_trace fat_trace_t;
+
+struct fat_trace
+{
+	kos_blockdev_t  *dev;       /* Device the requests go to */
+	mutex_t          lock;      /* Covers the ring */
+	fat_trace_rec_t *ring;
+	size_t           size;      /* Records ring can hold */
+	size_t           head;      /* Next record goes here */
+	size_t           count;     /* Records in ring */
+	uint64_t         dropped;   /* Records overwritten since the last clear */
+	uint64_t         start;     /* timer_us_gettime64() when the trace was created */
+};
+
+static const char *tag_names[FAT_TRACE_NUM_TAGS] = { "boot", "fsinfo", "fat", "dir", "data", "other" };
+
+static int trace_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count, void *buf);
+
+const char *fat_trace_tag_name(int tag)
+{
+	return (tag >= 0 && tag < FAT_TRACE_NUM_TAGS) ? tag_names[tag] : "other";
+}
+
+/* Pass a request on to the device under the trace and record it */
+static int trace_io(kos_blockdev_t *d, int tag, int write, uint64_t block, size_t count, void *buf)
+{
+	fat_trace_t *t = (fat_trace_t *)d->dev_data;
+	fat_trace_rec_t *rec;
+	uint64_t begin;
+	int rv;
+	
+	begin = timer_us_gettime64();
+	
+	/* Keep the tag if there is another trace underneath */
+	if(write)
+		rv = fat_dev_write(t->dev, tag, block, count, buf);
+	else
+		rv = fat_dev_read(t->dev, tag, block, count, buf);
+	
+	mutex_lock(&t->lock);
+	
+	rec = &t->ring[t->head];
+	rec->time_us = begin - t->start;
+	rec->latency_us = (uint32_t)(timer_us_gettime64() - begin);
+	rec->block = block;
+	rec->count = (uint32_t)count;
+	rec->write = write;
+	rec->tag = tag;
+	rec->error = (rv != 0);
+	
+	t->head = (t->head + 1) % t->size;
+	
+	if(t->count < t->size)
+		t->count++;
+	else
+		t->dropped++;
+	
+	mutex_unlock(&t->lock);
+	
+	return rv;
+}
+
+/* Every block libfatfs reads or writes goes through these two so a trace device can tell who asked for it */
+int fat_dev_read(kos_blockdev_t *dev, int tag, uint64_t block, size_t count, void *buf)
+{
+	if(dev->read_blocks == trace_read_blocks)
+		return trace_io(dev, tag, 0, block, count, buf);
+	
+	return dev->read_blocks(dev, block, count, buf);
+}
+
+int fat_dev_write(kos_blockdev_t *dev, int tag, uint64_t block, size_t count, const void *buf)
+{
+	if(dev->read_blocks == trace_read_blocks)
+		return trace_io(dev, tag, 1, block, count, (void *)buf);
+	
+	return dev->write_blocks(dev, block, count, buf);
+}
+
+static int trace_init(kos_blockdev_t *d)
+{
+	fat_trace_t *t = (fat_trace_t *)d->dev_data;
+	
+	return t->dev->init(t->dev);
+}
+
+static int trace_shutdown(kos_blockdev_t *d)
+{
+	fat_trace_t *t = (fat_trace_t *)d->dev_data;
+	
+	return t->dev->shutdown(t->dev);
+}
+
+/* Requests that come in as plain block device calls weren't made by libfatfs */
+static int trace_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count, void *buf)
+{
+	return trace_io(d, FAT_TRACE_OTHER, 0, block, count, buf);
+}
+
+static int trace_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count, const void *buf)
+{
+	return trace_io(d, FAT_TRACE_OTHER, 1, block, count, (void *)buf);
+}
+
+static uint64_t trace_count_blocks(kos_blockdev_t *d)
+{
+	fat_trace_t *t = (fat_trace_t *)d->dev_data;
+	
+	return t->dev->count_blocks(t->dev);
+}
+
+static int trace_flush(kos_blockdev_t *d)
+{
+	fat_trace_t *t = (fat_trace_t *)d->dev_data;
+	
+	return t->dev->flush ? t->dev->flush(t->dev) : 0;
+}
+
+int fat_trace_create(kos_blockdev_t *trace, kos_blockdev_t *dev, size_t ring_size)
+{
+	fat_trace_t *t;
+	
+	if(trace == NULL || dev == NULL || ring_size == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	
+	if(!(t = (fat_trace_t *)malloc(sizeof(fat_trace_t))))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	if(!(t->ring = (fat_trace_rec_t *)malloc(ring_size * sizeof(fat_trace_rec_t))))
+	{
+		free(t);
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	t->dev = dev;
+	t->size = ring_size;
+	t->head = 0;
+	t->count = 0;
+	t->dropped = 0;
+	t->start = timer_us_gettime64();
+	mutex_init(&t->lock, MUTEX_TYPE_NORMAL);
+	
+	memset(trace, 0, sizeof(kos_blockdev_t));
+	trace->dev_data = t;
+	trace->l_block_size = dev->l_block_size;
+	trace->init = trace_init;
+	trace->shutdown = trace_shutdown;
+	trace->read_blocks = trace_read_blocks;
+	trace->write_blocks = trace_write_blocks;
+	trace->count_blocks = trace_count_blocks;
+	trace->flush = trace_flush;
+	
+	return 0;
+}
+
+void fat_trace_destroy(kos_blockdev_t *trace)
+{
+	fat_trace_t *t = (fat_trace_t *)trace->dev_data;
+	
+	if(t == NULL)
+		return;
+	
+	mutex_destroy(&t->lock);
+	free(t->ring);
+	free(t);
+	trace->dev_data = NULL;
+}
+
+size_t fat_trace_get(kos_blockdev_t *trace, fat_trace_rec_t *recs, size_t max)
+{
+	fat_trace_t *t = (fat_trace_t *)trace->dev_data;
+	size_t i, n, first;
+	
+	mutex_lock(&t->lock);
+	
+	n = (t->count < max) ? t->count : max;
+	first = (t->head + t->size - t->count) % t->size;
+	
+	for(i = 0; i < n; i++)
+		recs[i] = t->ring[(first + i) % t->size];
+	
+	mutex_unlock(&t->lock);
+	
+	return n;
+}
+
+size_t fat_trace_count(kos_blockdev_t *trace, uint64_t *dropped)
+{
+	fat_trace_t *t = (fat_trace_t *)trace->dev_data;
+	size_t n;
+	
+	mutex_lock(&t->lock);
+	
+	n = t->count;
+	
+	if(dropped)
+		*dropped = t->dropped;
+	
+	mutex_unlock(&t->lock);
+	
+	return n;
+}
+
+void fat_trace_clear(kos_blockdev_t *trace)
+{
+	fat_trace_t *t = (fat_trace_t *)trace->dev_data;
+	
+	mutex_lock(&t->lock);
+	t->head = 0;
+	t->count = 0;
+	t->dropped = 0;
+	mutex_unlock(&t->lock);
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+	int i;
+	
+	for(i = 0; i < bytes; i++)
+		p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+	uint64_t v = 0;
+	int i;
+	
+	for(i = bytes - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+	
+	return v;
+}
+
+/* Binary dump: the magic, record count(4 bytes), record size(4 bytes) then the records. All little endian */
+int fat_trace_dump(kos_blockdev_t *trace, const char *path, int format)
+{
+	fat_trace_rec_t *recs;
+	unsigned char raw[TRACE_REC_SIZE];
+	size_t i, n;
+	FILE *fp;
+	int ok = 1;
+	
+	/* Copy the ring first so the file isn't written with the lock held(it could be on a traced device) */
+	n = fat_trace_count(trace, NULL);
+	
+	if(!(recs = (fat_trace_rec_t *)malloc((n ? n : 1) * sizeof(fat_trace_rec_t))))
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	
+	n = fat_trace_get(trace, recs, n);
+	
+	if(!(fp = fopen(path, (format == FAT_TRACE_BINARY) ? "wb" : "w")))
+	{
+		free(recs);
+		return -1;
+	}
+	
+	if(format == FAT_TRACE_BINARY)
+	{
+		memset(raw, 0, sizeof(raw));
+		memcpy(raw, TRACE_MAGIC, 8);
+		put_le(raw + 8, n, 4);
+		put_le(raw + 12, TRACE_REC_SIZE, 4);
+		ok = (fwrite(raw, 16, 1, fp) == 1);
+		
+		for(i = 0; i < n && ok; i++)
+		{
+			memset(raw, 0, sizeof(raw));
+			put_le(raw, recs[i].time_us, 8);
+			put_le(raw + 8, recs[i].block, 8);
+			put_le(raw + 16, recs[i].latency_us, 4);
+			put_le(raw + 20, recs[i].count, 4);
+			raw[24] = recs[i].write;
+			raw[25] = recs[i].tag;
+			raw[26] = recs[i].error;
+			ok = (fwrite(raw, TRACE_REC_SIZE, 1, fp) == 1);
+		}
+	}
+	else
+	{
+		ok = (fprintf(fp, "time_us,latency_us,op,block,count,tag,error\n") > 0);
+		
+		for(i = 0; i < n && ok; i++)
+		{
+			ok = (fprintf(fp, "%llu,%lu,%c,%llu,%lu,%s,%d\n", (unsigned long long)recs[i].time_us,
+			              (unsigned long)recs[i].latency_us, recs[i].write ? 'W' : 'R',
+			              (unsigned long long)recs[i].block, (unsigned long)recs[i].count,
+			              fat_trace_tag_name(recs[i].tag), recs[i].error) > 0);
+		}
+	}
+	
+	free(recs);
+	
+	if(fclose(fp) != 0 || !ok)
+	{
+		errno = EIO;
+		return -1;
+	}
+	
+	return 0;
+}
+
+static int tag_from_name(const char *name)
+{
+	int i;
+	
+	for(i = 0; i < FAT_TRACE_NUM_TAGS; i++)
+	{
+		if(!strcmp(name, tag_names[i]))
+			return i;
+	}
+	
+	return FAT_TRACE_OTHER;
+}
+
+/* Add rec to *recs(which has room for *max), growing it if need be */
+static int append_rec(fat_trace_rec_t **recs, int *n, int *max, const fat_trace_rec_t *rec)
+{
+	fat_trace_rec_t *tmp;
+	
+	if(*n == *max)
+	{
+		*max = *max ? *max * 2 : 1024;
+		
+		if(!(tmp = (fat_trace_rec_t *)realloc(*recs, *max * sizeof(fat_trace_rec_t))))
+			return -1;
+		
+		*recs = tmp;
+	}
+	
+	(*recs)[(*n)++] = *rec;
+	
+	return 0;
+}
+
+int fat_trace_load(const char *path, fat_trace_rec_t **recs)
+{
+	unsigned char raw[TRACE_REC_SIZE];
+	char line[256], op, tag[16];
+	unsigned long long time_us, block;
+	unsigned long latency, count;
+	fat_trace_rec_t rec;
+	int n = 0, max = 0, err;
+	uint32_t rec_size, i, total;
+	FILE *fp;
+	
+	*recs = NULL;
+	
+	if(!(fp = fopen(path, "rb")))
+		return -1;
+	
+	if(fread(raw, 16, 1, fp) == 1 && !memcmp(raw, TRACE_MAGIC, 8))
+	{
+		total = (uint32_t)get_le(raw + 8, 4);
+		rec_size = (uint32_t)get_le(raw + 12, 4);
+		
+		if(rec_size < 27 || rec_size > TRACE_REC_SIZE)
+			goto bad;
+		
+		for(i = 0; i < total; i++)
+		{
+			if(fread(raw, rec_size, 1, fp) != 1)
+				goto bad;
+			
+			rec.time_us = get_le(raw, 8);
+			rec.block = get_le(raw + 8, 8);
+			rec.latency_us = (uint32_t)get_le(raw + 16, 4);
+			rec.count = (uint32_t)get_le(raw + 20, 4);
+			rec.write = raw[24];
+			rec.tag = raw[25];
+			rec.error = raw[26];
+			
+			if(append_rec(recs, &n, &max, &rec) < 0)
+				goto nomem;
+		}
+	}
+	else  /* CSV. The first line is the header */
+	{
+		rewind(fp);
+		
+		if(!fgets(line, sizeof(line), fp))
+			goto bad;
+		
+		while(fgets(line, sizeof(line), fp))
+		{
+			if(sscanf(line, "%llu,%lu,%c,%llu,%lu,%15[^,],%d", &time_us, &latency, &op, &block, &count, tag, &err) != 7)
+				goto bad;
+			
+			rec.time_us = time_us;
+			rec.latency_us = (uint32_t)latency;
+			rec.write = (op == 'W');
+			rec.block = block;
+			rec.count = (uint32_t)count;
+			rec.tag = tag_from_name(tag);
+			rec.error = (err != 0);
+			
+			if(append_rec(recs, &n, &max, &rec) < 0)
+				goto nomem;
+		}
+	}
+	
+	fclose(fp);
+	
+	return n;
+	
+bad:
+	fclose(fp);
+	free(*recs);
+	*recs = NULL;
+	errno = EINVAL;
+	return -1;
+	
+nomem:
+	fclose(fp);
+	free(*recs);
+	*recs = NULL;
+	errno = ENOMEM;
+	return -1;
+}
@@ -7,13 +7,85 @@
 #include <stdlib.h>
 #include <inttypes.h>
 
+#include <arch/timer.h>
+
 #include "utils.h"
 #include "fat_defs.h"
 #include "dir_entry.h"
+#include "dir_cache.h"
+#include "fat_au.h"
 #include "boot_sector.h"
+#include "fatfs.h"
+
+int fat_read_sectors(fatfs_t *fat, int tag, unsigned int sector, int count, void *buf)
+{
+	uint64 start = timer_us_gettime64();
+	int rv = fat_dev_read(fat->dev, tag, sector, count, buf);
+	
+	mutex_lock(&fat->stats_lock);
+	fat->stats.dev_reads++;
+	fat->stats.dev_blocks_read += count;
+	fat->stats.dev_errors += (rv != 0);
+	fat->stats.dev_us += timer_us_gettime64() - start;
+	mutex_unlock(&fat->stats_lock);
+	
+	return rv;
+}
 
-static short sector_offset = -1; /* Makes sure we always have to read a sector (FAT table) first */
-static unsigned char buffer[512];
+int fat_write_sectors(fatfs_t *fat, int tag, unsigned int sector, int count, const void *buf)
+{
+	uint64 start = timer_us_gettime64();
+	int rv = fat_dev_write(fat->dev, tag, sector, count, buf);
+	
+	mutex_lock(&fat->stats_lock);
+	fat->stats.dev_writes++;
+	fat->stats.dev_blocks_written += count;
+	fat->stats.dev_errors += (rv != 0);
+	fat->stats.dev_us += timer_us_gettime64() - start;
+	mutex_unlock(&fat->stats_lock);
+	
+	return rv;
+}
+
+void fat_discard_flush(fatfs_t *fat, fat_discard_t *d)
+{
+	uint64 start;
+	unsigned int sector, count;
+	int rv;
+	
+	if(d->count == 0 || fat->discard == NULL)
+		return;
+	
+	sector = fat->data_sec_loc + (d->first - 2) * fat->boot_sector.sectors_per_cluster;
+	count = d->count * fat->boot_sector.sectors_per_cluster;
+	d->count = 0;
+	
+	start = timer_us_gettime64();
+	rv = fat->discard(fat->dev, sector, count);
+	
+	mutex_lock(&fat->stats_lock);
+	fat->stats.dev_discards++;
+	fat->stats.dev_blocks_discarded += (rv == 0) ? count : 0;
+	fat->stats.dev_errors += (rv != 0);
+	fat->stats.dev_us += timer_us_gettime64() - start;
+	mutex_unlock(&fat->stats_lock);
+}
+
+void fat_discard_add(fatfs_t *fat, fat_discard_t *d, unsigned int cluster)
+{
+	if(fat->discard == NULL || cluster < 2 || cluster >= fat->total_clusters_num + 2)
+		return;
+	
+	if(d->count && cluster == d->first + d->count)
+	{
+		d->count++;
+		return;
+	}
+	
+	fat_discard_flush(fat, d);
+	d->first = cluster;
+	d->count = 1;
+}
 
 /* Read the Fat table from the SD card and stores it in table(cache: 512 bytes) */
 unsigned int read_fat_table_value(fatfs_t *fat, int byte_index) 
@@ -21,19 +93,28 @@ unsigned int read_fat_table_value(fatfs_t *fat, int byte_index)
 	short ptr_offset;
 	unsigned int read_value = 0;
 	
+	mutex_lock(&fat->fat_lock);
+	
 	/* Check if we have to read a new sector */
-	if(sector_offset != (byte_index / fat->boot_sector.bytes_per_sector))
+	if(fat->fat_sector_offset != (byte_index / fat->boot_sector.bytes_per_sector))
 	{
 		/* Calculate sector offset from file_alloc_tab_sec_loc */
-		sector_offset = byte_index / fat->boot_sector.bytes_per_sector;
+		fat->fat_sector_offset = byte_index / fat->boot_sector.bytes_per_sector;
 	
 		/* Read new sector */
-		fat->dev->read_blocks(fat->dev, fat->file_alloc_tab_sec_loc + sector_offset, 1, buffer);
+		fat_read_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + fat->fat_sector_offset, 1, fat->fat_buf);
+		FAT_STAT_ADD(fat, fat_misses, 1);
+	}
+	else
+	{
+		FAT_STAT_ADD(fat, fat_hits, 1);
 	}
 	
 	ptr_offset = byte_index % fat->boot_sector.bytes_per_sector;
 	
-	memcpy(&read_value, &buffer[ptr_offset], fat->byte_offset);
+	memcpy(&read_value, &fat->fat_buf[ptr_offset], fat->byte_offset);
+	
+	mutex_unlock(&fat->fat_lock);
 	
 	return read_value;
 }
@@ -41,22 +122,41 @@ unsigned int read_fat_table_value(fatfs_t *fat, int byte_index)
 void write_fat_table_value(fatfs_t *fat, int byte_index, int value) 
 {
 	short ptr_offset;
+	unsigned int old = 0;
+	
+	mutex_lock(&fat->fat_lock);
 	
 	/* Check if we have to read a new sector */
-	if(sector_offset != (byte_index / fat->boot_sector.bytes_per_sector))
+	if(fat->fat_sector_offset != (byte_index / fat->boot_sector.bytes_per_sector))
 	{
 		/* Calculate sector offset from file_alloc_tab_sec_loc */
-		sector_offset = byte_index / fat->boot_sector.bytes_per_sector;
+		fat->fat_sector_offset = byte_index / fat->boot_sector.bytes_per_sector;
 	
 		/* Read new sector */
-		fat->dev->read_blocks(fat->dev, fat->file_alloc_tab_sec_loc + sector_offset, 1, buffer);
+		fat_read_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + fat->fat_sector_offset, 1, fat->fat_buf);
+		FAT_STAT_ADD(fat, fat_misses, 1);
+	}
+	else
+	{
+		FAT_STAT_ADD(fat, fat_hits, 1);
 	}
 	
 	ptr_offset = byte_index % fat->boot_sector.bytes_per_sector;
 	
-	memcpy(&buffer[ptr_offset], &(value), fat->byte_offset);
+	memcpy(&old, &fat->fat_buf[ptr_offset], fat->byte_offset);
+	memcpy(&fat->fat_buf[ptr_offset], &(value), fat->byte_offset);
+	fat_au_update(fat, byte_index / fat->byte_offset, old, value);
     
-    fat->dev->write_blocks(fat->dev, fat->file_alloc_tab_sec_loc + sector_offset, 1, buffer);
+    fat_write_sectors(fat, FAT_TRACE_FAT, fat->file_alloc_tab_sec_loc + fat->fat_sector_offset, 1, fat->fat_buf);
+	
+	mutex_unlock(&fat->fat_lock);
+}
+
+static void fat_fs_destroy_locks(fatfs_t *fs)
+{
+	mutex_destroy(&fs->fat_lock);
+	mutex_destroy(&fs->cache_lock);
+	mutex_destroy(&fs->stats_lock);
 }
 
 fatfs_t *fat_fs_init(const char *mp, kos_blockdev_t *bd) {
@@ -75,8 +175,16 @@ fatfs_t *fat_fs_init(const char *mp, kos_blockdev_t *bd) {
 
 	memset(rv, 0, sizeof(fatfs_t));
 	rv->dev = bd;
+	rv->fat_sector_offset = -1; /* Makes sure we always have to read a sector (FAT table) first */
+	rv->stats.since_us = timer_us_gettime64();
+	
+	/* The FAT table and FSInfo sector are read below */
+	mutex_init(&rv->fat_lock, MUTEX_TYPE_RECURSIVE);
+	mutex_init(&rv->cache_lock, MUTEX_TYPE_RECURSIVE);
+	mutex_init(&rv->stats_lock, MUTEX_TYPE_NORMAL);
 
 	if(fat_read_bootsector(bd, &(rv->boot_sector))) {
+		fat_fs_destroy_locks(rv);
 		free(rv);
 		bd->shutdown(bd);
 		return NULL;
@@ -153,11 +261,24 @@ fatfs_t *fat_fs_init(const char *mp, kos_blockdev_t *bd) {
 	
 	rv->mount = remove_all_chars(mp, '/'); 
 	
+	if(dir_cache_init(rv)) {
+		fat_fs_destroy_locks(rv);
+		free(rv->mount);
+		free(rv);
+		bd->shutdown(bd);
+		return NULL;
+	}
+	
 	return rv;
 }
 
 void fat_fs_shutdown(fatfs_t *fs) {
 
+    dir_cache_shutdown(fs);
+    fat_au_shutdown(fs);
+
+    fat_fs_destroy_locks(fs);
+
     fs->dev->shutdown(fs->dev);
 
     free(fs);
@@ -8,6 +8,7 @@ __BEGIN_DECLS
 #include <kos/blockdev.h>
 
 #include "fat_defs.h"
+#include "include/fat_trace.h"
 
 fatfs_t *fat_fs_init(const char *mp, kos_blockdev_t *bd);
 void fat_fs_shutdown(fatfs_t  *fs);
@@ -15,6 +16,25 @@ void fat_fs_shutdown(fatfs_t  *fs);
 unsigned int read_fat_table_value(fatfs_t *fat, int byte_index);
 void write_fat_table_value(fatfs_t *fat, int byte_index, int value); 
 
+/* Sector reads/writes of a mount. Counted in fat->stats */
+int fat_read_sectors(fatfs_t *fat, int tag, unsigned int sector, int count, void *buf);
+int fat_write_sectors(fatfs_t *fat, int tag, unsigned int sector, int count, const void *buf);
+
+/* Freed clusters that haven't been discarded yet. Runs of clusters next to each other go to the device in one
+   discard. Start with count 0 and flush once the clusters are free in the FAT. Does nothing without fat->discard */
+typedef struct fat_discard
+{
+	unsigned int first;
+	unsigned int count;
+} fat_discard_t;
+
+void fat_discard_add(fatfs_t *fat, fat_discard_t *d, unsigned int cluster);
+void fat_discard_flush(fatfs_t *fat, fat_discard_t *d);
+
+/* Add n to a counter in fat->stats */
+#define FAT_STAT_ADD(fat, field, n) \
+	do { mutex_lock(&(fat)->stats_lock); (fat)->stats.field += (n); mutex_unlock(&(fat)->stats_lock); } while(0)
+
 __END_DECLS
 
 #endif /* _FAT_FATFS_H_ */
@@ -4,10 +4,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/queue.h>
+#include <poll.h>
 
+#include <arch/timer.h>
 #include <kos/fs.h>
 #include <kos/mutex.h>
+#include <kos/rwsem.h>
+#include <kos/cond.h>
+#include <kos/thread.h>
 
 #include "include/fs_fat.h"
 
@@ -15,8 +21,20 @@
 #include "utils.h"
 #include "fat_defs.h"
 #include "dir_entry.h"
+#include "fat_scan.h"
+#include "fat_defrag.h"
+#include "fat_format.h"
+#include "fat_check.h"
+#include "fat_au.h"
 
-#define MAX_FAT_FILES 16
+#define FAT_HANDLE_CHUNK   32   /* File handles are added this many at a time */
+#define FAT_OPEN_BUCKETS   64   /* Hash buckets for the open node table. Power of 2 */
+
+#ifndef FS_FAT_AIO_WORKERS
+#define FS_FAT_AIO_WORKERS  2   /* Threads doing async requests */
+#endif
+#define FS_FAT_AIO_BATCH    8   /* Most requests a worker takes at once */
+#define FAT_MAX_DISCARD     8   /* Devices fs_fat_set_discard() can remember */
 
 typedef struct fs_fat_fs {
     LIST_ENTRY(fs_fat_fs) entry;
@@ -24,6 +42,12 @@ typedef struct fs_fat_fs {
     vfs_handler_t *vfsh;
     fatfs_t *fs;
     uint32_t mount_flags;
+
+    /* Held for reading by lookups, reads and readdir. Held for writing by
+       anything that changes directories or the FAT(creates, writes, rename,
+       unlink, mkdir, rmdir) */
+    rw_semaphore_t ns_lock;
+    int unmounting;
 } fs_fat_fs_t;
 
 LIST_HEAD(fat_list, fs_fat_fs);
@@ -31,26 +55,264 @@ LIST_HEAD(fat_list, fs_fat_fs);
 /* Global list of mounted FAT16/FAT32 partitions */
 static struct fat_list fat_fses;
 
-/* Mutex for file handles */
+/* Mutex for the file handle table, the open node table and the list of mounts.
+   Never held while talking to a device or while waiting for any other lock */
 static mutex_t fat_mutex;
 
-/* File handles */
+static int initted = 0;
+
+/* Discard functions set with fs_fat_set_discard(). Protected by fat_mutex */
 static struct {
+    kos_blockdev_t *dev;
+    fs_fat_discard_fn fn;
+} fat_discards[FAT_MAX_DISCARD];
+
+/* One of these for every file/folder that is open, shared by all of its
+   handles so they agree on its size and clusters. Keyed by where its entry is
+   on the device. The node only changes with the namespace lock of the mount
+   held for writing, except for its cluster map which fat_lock covers */
+typedef struct fat_open_node {
+    struct fat_open_node *next;
+    fs_fat_fs_t   *mnt;
+    uint32        sector;     /* node->Location[0] */
+    uint32        offset;     /* node->Location[1] */
+    int           refs;       /* Number of handles using it */
+    node_entry_t  *node;
+} fat_open_node_t;
+
+static fat_open_node_t *open_nodes[FAT_OPEN_BUCKETS];
+
+/* Parts of a file handle only readdir needs */
+typedef struct fat_handle_cold {
+    dirent_t      dirent;     /* A static dirent to pass back to clients */
+    node_entry_t  *dir;       /* Used by opendir */
+} fat_handle_cold_t;
+
+/* Parts of a file handle every call uses. Kept apart from the(big) dirent so
+   they share as few cache lines as possible */
+typedef struct fat_handle {
     int           used;       /* 0 - Not Used, 1 - Used */
+    int           refs;       /* Number of calls using the handle right now */
+    int           closing;    /* Closed while in use. Freed when refs drops to 0 */
     int           mode;       /* O_RDONLY, O_WRONLY, O_RDWR, O_TRUNC, O_DIR, etc */
     uint32        ptr;        /* Current read position in bytes */
-    dirent_t      dirent;     /* A static dirent to pass back to clients */
-    node_entry_t  *node;	  /* Pointer to node */
-    node_entry_t  *dir;       /* Used by opendir */
+    node_entry_t  *node;	  /* Pointer to node. Belongs to 'on' */
+    fat_open_node_t *on;      /* Shared state of the file/folder */
     fs_fat_fs_t   *mnt;       /* Which mount instance are we using? */
-} fh[MAX_FAT_FILES];
+    file_t        next_free;  /* Next handle in the free list. -1 at the end */
+    file_t        index;      /* Position in the table. The KOS handle is index + 1 */
+    mutex_t       lock;       /* Serializes calls on this handle(ptr, node, dir) */
+    int           aio_pending; /* Async requests queued or running. Each one pins the handle */
+    ssize_t       aio_result; /* Result of the last async request that finished */
+    fat_handle_cold_t *cold;
+} fat_handle_t;
 
-/* Open a file or directory */
-static void *fs_fat_open(vfs_handler_t *vfs, const char *fn, int mode) {
+/* File handles. Allocated in chunks that never move so a handle can be used
+   without fat_mutex once it is pinned, even while the table grows */
+static fat_handle_t      **fh_hot;
+static fat_handle_cold_t **fh_cold;
+static int                 fh_chunks;
+static file_t              fh_free;    /* First free handle. -1 if all are in use */
+
+#define FH(fd) (&fh_hot[(fd) / FAT_HANDLE_CHUNK][(fd) % FAT_HANDLE_CHUNK])
+
+
+static int fs_fat_close(void * h);
+
+/* Count a call to op that started at 'start'(timer_us_gettime64()) */
+static void fat_stat_op(fs_fat_fs_t *mnt, int op, uint64 start, int failed) {
+    fs_fat_op_stats_t *s = &mnt->fs->stats.ops[op];
+    uint64 us = timer_us_gettime64() - start;
+    int bucket = 0;
+
+    while(bucket < FS_FAT_HIST_BUCKETS - 1 && (us >> bucket))
+        bucket++;
+
+    mutex_lock(&mnt->fs->stats_lock);
+
+    s->count++;
+    s->errors += failed;
+    s->total_us += us;
+    s->hist[bucket]++;
+
+    if(us > s->max_us)
+        s->max_us = us > UINT32_MAX ? UINT32_MAX : (uint32)us;
+
+    mutex_unlock(&mnt->fs->stats_lock);
+}
+
+static fat_open_node_t **fat_open_bucket(fs_fat_fs_t *mnt, node_entry_t *node) {
+    uint32 h = (node->Location[0] * 16) + (node->Location[1] / ENTRYSIZE) + (uint32)((uintptr_t)mnt >> 4);
+
+    return &open_nodes[h & (FAT_OPEN_BUCKETS - 1)];
+}
+
+/* The open node of the entry of node. NULL if it isnt open. fat_mutex must be held */
+static fat_open_node_t *fat_find_open(fs_fat_fs_t *mnt, node_entry_t *node) {
+    fat_open_node_t *on;
+
+    for(on = *fat_open_bucket(mnt, node); on != NULL; on = on->next) {
+        if(on->mnt == mnt && on->sector == node->Location[0] && on->offset == node->Location[1])
+            return on;
+    }
+
+    return NULL;
+}
+
+/* Get a reference on the open node of the entry of found. found becomes the
+   shared node if the entry wasnt open yet, otherwise it is freed. fat_mutex
+   must be held */
+static fat_open_node_t *fat_attach_node(fs_fat_fs_t *mnt, node_entry_t *found) {
+    fat_open_node_t **bucket;
+    fat_open_node_t *on;
+
+    /* Already open. Its node has the size other handles see and the clusters they already looked up */
+    if((on = fat_find_open(mnt, found)) != NULL) {
+        on->refs++;
+        delete_struct_entry(found);
+        return on;
+    }
+
+    if(!(on = (fat_open_node_t *)malloc(sizeof(fat_open_node_t))))
+        return NULL;
+
+    bucket = fat_open_bucket(mnt, found);
+
+    on->mnt = mnt;
+    on->sector = found->Location[0];
+    on->offset = found->Location[1];
+    on->refs = 1;
+    on->node = found;
+    on->next = *bucket;
+    *bucket = on;
+
+    return on;
+}
+
+/* Drop a reference. fat_mutex must be held */
+static void fat_detach_node(fat_open_node_t *on) {
+    fat_open_node_t **pp;
+
+    if(--on->refs > 0)
+        return;
+
+    for(pp = fat_open_bucket(on->mnt, on->node); *pp != on; pp = &(*pp)->next)
+        ;
+
+    *pp = on->next;
+
+    delete_struct_entry(on->node);
+    free(on);
+}
+
+/* Add another chunk of handles to the table and put them on the free list. fat_mutex must be held */
+static int fat_grow_handles(void) {
+    fat_handle_t **hot;
+    fat_handle_cold_t **cold;
+    int i;
     file_t fd;
-    fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
-	
-	char *ufn = NULL; 
+
+    if(!(hot = (fat_handle_t **)realloc(fh_hot, sizeof(fat_handle_t *) * (fh_chunks + 1))))
+        return -1;
+
+    fh_hot = hot;
+
+    if(!(cold = (fat_handle_cold_t **)realloc(fh_cold, sizeof(fat_handle_cold_t *) * (fh_chunks + 1))))
+        return -1;
+
+    fh_cold = cold;
+
+    if(!(fh_hot[fh_chunks] = (fat_handle_t *)calloc(FAT_HANDLE_CHUNK, sizeof(fat_handle_t))))
+        return -1;
+
+    if(!(fh_cold[fh_chunks] = (fat_handle_cold_t *)calloc(FAT_HANDLE_CHUNK, sizeof(fat_handle_cold_t)))) {
+        free(fh_hot[fh_chunks]);
+        return -1;
+    }
+
+    /* Lowest numbers come off the free list first */
+    for(i = FAT_HANDLE_CHUNK - 1; i >= 0; i--) {
+        fd = fh_chunks * FAT_HANDLE_CHUNK + i;
+
+        fh_hot[fh_chunks][i].index = fd;
+        fh_hot[fh_chunks][i].cold = &fh_cold[fh_chunks][i];
+        fh_hot[fh_chunks][i].next_free = fh_free;
+        mutex_init(&fh_hot[fh_chunks][i].lock, MUTEX_TYPE_NORMAL);
+
+        fh_free = fd;
+    }
+
+    fh_chunks++;
+
+    return 0;
+}
+
+/* Take a handle off the free list. fat_mutex must be held */
+static fat_handle_t *fat_alloc_handle(void) {
+    fat_handle_t *f;
+
+    if(fh_free < 0 && fat_grow_handles() != 0)
+        return NULL;
+
+    f = FH(fh_free);
+    fh_free = f->next_free;
+    f->used = 1;
+
+    return f;
+}
+
+/* Free the handle f. fat_mutex must be held and nobody can be using it */
+static void fat_release_handle(fat_handle_t *f) {
+    fat_detach_node(f->on);
+
+    f->used = 0;
+    f->refs = 0;
+    f->closing = 0;
+    f->ptr = 0;
+    f->mode = 0;
+    f->aio_result = 0;
+    f->mnt = NULL;
+    f->on = NULL;
+    f->node = NULL;
+    delete_struct_entry(f->cold->dir);
+    f->cold->dir = NULL;
+
+    f->next_free = fh_free;
+    fh_free = f->index;
+}
+
+/* Make sure the handle h stays around until fat_put_handle() */
+static fat_handle_t *fat_get_handle(void *h) {
+    file_t fd = (file_t)((uintptr_t)h) - 1;
+    fat_handle_t *f;
+
+    mutex_lock(&fat_mutex);
+
+    if(fd < 0 || fd >= fh_chunks * FAT_HANDLE_CHUNK || !(f = FH(fd))->used || f->closing) {
+        mutex_unlock(&fat_mutex);
+        errno = EBADF;
+        return NULL;
+    }
+
+    f->refs++;
+
+    mutex_unlock(&fat_mutex);
+
+    return f;
+}
+
+static void fat_put_handle(fat_handle_t *f) {
+    mutex_lock(&fat_mutex);
+
+    if(--f->refs == 0 && f->closing)
+        fat_release_handle(f);
+
+    mutex_unlock(&fat_mutex);
+}
+
+/* Open a file or directory. fn is relative to the directory dir. The namespace lock of mnt must be held */
+static void *fat_open_locked(fs_fat_fs_t *mnt, node_entry_t *dir, const char *fn, int mode) {
+    fat_handle_t *f;
     node_entry_t *found = NULL;
 
     /* Make sure if we're going to be writing to the file that the fs is mounted
@@ -60,344 +322,1082 @@ static void *fs_fat_open(vfs_handler_t *vfs, const char *fn, int mode) {
         errno = EROFS;
         return NULL;
     }
-	
-	/* Make sure to add the root directory to the fn */
-	ufn = malloc(strlen(fn)+strlen(mnt->fs->mount)+1); 
-	memset(ufn, 0, strlen(fn)+strlen(mnt->fs->mount)+1);
-    strcat(ufn, mnt->fs->mount);
-    strcat(ufn, fn);
 
-	found = fat_search_by_path(mnt->fs, ufn);
+    found = fat_search_from(mnt->fs, dir, fn);
 
     /* Handle a few errors */
     if(found == NULL && !(mode & O_CREAT)) {
         errno = ENOENT;
-		free(ufn);
         return NULL;
     }
     else if(found != NULL && (mode & O_CREAT) && (mode & O_EXCL)) {
         errno = EEXIST;
-		delete_struct_entry(found);
-		free(ufn);
+        delete_struct_entry(found);
         return NULL;
     }
     else if(found == NULL && (mode & O_CREAT)) {
-		found = create_entry(mnt->fs, ufn, ARCHIVE);
-		
+        found = create_entry_at(mnt->fs, dir, fn, ARCHIVE);
+
         if(found == NULL)
-		{
-			free(ufn);
             return NULL;
-		}
     }
     else if(found != NULL && (found->Attr & READ_ONLY) && ((mode & O_WRONLY) || (mode & O_RDWR))) {
-		errno = EROFS;
-		delete_struct_entry(found);
-		free(ufn);
-		return NULL;
+        errno = EROFS;
+        delete_struct_entry(found);
+        return NULL;
     }
-    
-    /* Set filesize to 0 if we set mode to O_TRUNC */
+
+    /* Make sure we're not trying to open a directory for writing */
+    if((found->Attr & DIRECTORY) && (mode & (O_WRONLY | O_RDWR))) {
+        errno = EISDIR;
+        delete_struct_entry(found);
+        return NULL;
+    }
+
+    /* Make sure if we're trying to open a directory that we have a directory */
+    if((mode & O_DIR) && !(found->Attr & DIRECTORY)) {
+        errno = ENOTDIR;
+        delete_struct_entry(found);
+        return NULL;
+    }
+
+    /* Find a free file handle */
+    mutex_lock(&fat_mutex);
+
+    if(mnt->unmounting) {
+        mutex_unlock(&fat_mutex);
+        errno = ENOENT;
+        delete_struct_entry(found);
+        return NULL;
+    }
+
+    if(!(f = fat_alloc_handle())) {
+        mutex_unlock(&fat_mutex);
+        errno = ENFILE;
+        delete_struct_entry(found);
+        return NULL;
+    }
+
+    if(!(f->on = fat_attach_node(mnt, found))) {
+        f->used = 0;
+        f->next_free = fh_free;
+        fh_free = f->index;
+        mutex_unlock(&fat_mutex);
+        errno = ENOMEM;
+        delete_struct_entry(found);
+        return NULL;
+    }
+
+    /* Fill in the rest of the handle */
+    f->refs = 0;
+    f->closing = 0;
+    f->mode = mode;
+    f->ptr = 0;
+    f->mnt = mnt;
+    f->node = f->on->node;
+    f->cold->dir = NULL;
+
+    mutex_unlock(&fat_mutex);
+
+    /* Set filesize to 0 if we set mode to O_TRUNC. Other handles on the file see it too */
     if((mode & O_TRUNC) && ((mode & O_WRONLY) || (mode & O_RDWR)))
     {
-        found->FileSize = 0;
-        delete_cluster_list(mnt->fs, found);
-		update_sd_entry(mnt->fs, found);
+        f->node->FileSize = 0;
+        delete_cluster_list(mnt->fs, f->node);
+        update_sd_entry(mnt->fs, f->node);
+    }
+
+    return (void *)((uintptr_t)(f->index + 1));
+}
+
+static void *fat_open_at(fs_fat_fs_t *mnt, node_entry_t *dir, const char *fn, int mode) {
+    void *rv;
+
+    /* Only opens that can change the directory or the FAT need it to themselves */
+    if((mode & O_CREAT) || ((mode & O_TRUNC) && (mode & (O_WRONLY | O_RDWR)))) {
+        rwsem_write_lock(&mnt->ns_lock);
+        rv = fat_open_locked(mnt, dir, fn, mode);
+        rwsem_write_unlock(&mnt->ns_lock);
+    }
+    else {
+        rwsem_read_lock(&mnt->ns_lock);
+        rv = fat_open_locked(mnt, dir, fn, mode);
+        rwsem_read_unlock(&mnt->ns_lock);
+    }
+
+    return rv;
+}
+
+/* Open a file or directory */
+static void *fs_fat_open(vfs_handler_t *vfs, const char *fn, int mode) {
+    fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
+    uint64 start = timer_us_gettime64();
+    node_entry_t *root;
+    void *rv;
+
+    if(!(root = fat_root_entry(mnt->fs))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    rv = fat_open_at(mnt, root, fn, mode);
+
+    delete_struct_entry(root);
+
+    fat_stat_op(mnt, FS_FAT_OP_OPEN, start, rv == NULL);
+
+    return rv;
+}
+
+/* Grab a copy of the directory node behind the KOS file descriptor dirfd. It has to be a directory opened on one of our mounts.
+   The handle stays pinned(so the mount cant go away) until the caller does fat_put_handle(*pinned) */
+static node_entry_t *fat_dir_from_fd(file_t dirfd, fs_fat_fs_t **mnt, fat_handle_t **pinned) {
+    vfs_handler_t *vfs = fs_get_handler(dirfd);
+    node_entry_t *rv;
+    fat_handle_t *f;
+
+    if(vfs == NULL || !(f = fat_get_handle(fs_get_handle(dirfd)))) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if(f->mnt->vfsh != vfs) {
+        fat_put_handle(f);
+        errno = EBADF;
+        return NULL;
+    }
+
+    if(!(f->mode & O_DIR)) {
+        fat_put_handle(f);
+        errno = ENOTDIR;
+        return NULL;
+    }
+
+    mutex_lock(&f->lock);
+    rv = copy_struct_entry(f->node);
+    mutex_unlock(&f->lock);
+
+    if(rv == NULL) {
+        fat_put_handle(f);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *mnt = f->mnt;
+    *pinned = f;
+
+    return rv;
+}
+
+/* Open fn relative to the directory dirfd(opened with O_DIR) instead of walking the whole path from the root */
+file_t fs_fat_openat(file_t dirfd, const char *fn, int mode) {
+    fs_fat_fs_t *mnt;
+    node_entry_t *dir;
+    fat_handle_t *pinned;
+    void *h;
+    file_t rv;
+
+    if(!(dir = fat_dir_from_fd(dirfd, &mnt, &pinned)))
+        return -1;
+
+    h = fat_open_at(mnt, dir, fn, mode);
+
+    delete_struct_entry(dir);
+
+    if(h == NULL) {
+        fat_put_handle(pinned);
+        return -1;
+    }
+
+    /* Hand it to the VFS so it can be used like any other file descriptor */
+    if((rv = fs_open_handle(mnt->vfsh, h)) < 0) {
+        fs_fat_close(h);
+        fat_put_handle(pinned);
+        return -1;
+    }
+
+    fat_put_handle(pinned);
+
+    return rv;
+}
+
+/* Fill in a struct stat for node */
+static void fat_fill_stat(fs_fat_fs_t *mnt, node_entry_t *node, struct stat *st) {
+    const uint32 cluster_size = mnt->fs->boot_sector.bytes_per_sector * mnt->fs->boot_sector.sectors_per_cluster;
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_dev = (dev_t)((uintptr_t)mnt);
+    /* Where the entry is, since the start cluster is 0 for every empty file and changes when a file is moved. The root
+       directory has no entry(sector 0 is the boot sector, so no entry gets 1) */
+    st->st_ino = node->Location[0] ? (node->Location[0] * 16) + (node->Location[1] / ENTRYSIZE) : 1;
+    st->st_nlink = 1;
+    st->st_size = node->FileSize;
+    st->st_blksize = cluster_size;
+    st->st_blocks = ((node->FileSize + cluster_size - 1) / cluster_size) * (cluster_size / 512);
+
+    if(node->Attr & DIRECTORY)
+        st->st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH;
+    else
+        st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+
+    if(!(node->Attr & READ_ONLY) && (mnt->mount_flags & FS_FAT_MOUNT_READWRITE))
+        st->st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+
+    /* FAT has no change time, the creation time stands in for it. The root directory has no entry and stays at 0 */
+    st->st_mtime = fat_entry_time(node->WrtDate, node->WrtTime);
+    st->st_atime = fat_entry_time(node->AccDate, 0);
+    st->st_ctime = fat_entry_time(node->CrtDate, node->CrtTime) + node->CrtTimeTenth / 100;
+}
+
+/* stat() a path on the mount. Everything comes from the entry the lookup found, no cluster chain is followed */
+static int fs_fat_stat(vfs_handler_t *vfs, const char *path, struct stat *st, int flag) {
+    fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
+    node_entry_t *root;
+    node_entry_t *found;
+
+    (void)flag;
+
+    if(!(root = fat_root_entry(mnt->fs))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rwsem_read_lock(&mnt->ns_lock);
+    found = fat_search_from(mnt->fs, root, path);
+    rwsem_read_unlock(&mnt->ns_lock);
+
+    delete_struct_entry(root);
+
+    if(found == NULL)
+        return -1;
+
+    fat_fill_stat(mnt, found, st);
+    delete_struct_entry(found);
+
+    return 0;
+}
+
+/* stat() the file or directory behind fd. Its node is already in memory, so nothing gets read */
+int fs_fat_fstat(file_t fd, struct stat *st) {
+    vfs_handler_t *vfs;
+    fat_handle_t *f;
+
+    if(!(vfs = fs_get_handler(fd)) || !(f = fat_get_handle(fs_get_handle(fd)))) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(f->mnt->vfsh != vfs) {
+        fat_put_handle(f);
+        errno = EBADF;
+        return -1;
+    }
+
+    mutex_lock(&f->lock);
+    fat_fill_stat(f->mnt, f->node, st);
+    mutex_unlock(&f->lock);
+
+    fat_put_handle(f);
+
+    return 0;
+}
+
+/* stat() fn relative to the directory dirfd(opened with O_DIR) */
+int fs_fat_fstatat(file_t dirfd, const char *fn, struct stat *st, int flag) {
+    fs_fat_fs_t *mnt;
+    node_entry_t *dir;
+    node_entry_t *found;
+    fat_handle_t *pinned;
+
+    (void)flag;
+
+    if(!(dir = fat_dir_from_fd(dirfd, &mnt, &pinned)))
+        return -1;
+
+    rwsem_read_lock(&mnt->ns_lock);
+    found = fat_search_from(mnt->fs, dir, fn);
+    rwsem_read_unlock(&mnt->ns_lock);
+
+    delete_struct_entry(dir);
+
+    if(found == NULL) {
+        fat_put_handle(pinned);
+        return -1;
+    }
+
+    fat_fill_stat(mnt, found, st);
+    delete_struct_entry(found);
+
+    fat_put_handle(pinned);
+
+    return 0;
+}
+
+static int fs_fat_close(void * h) {
+    file_t fd = (file_t)((uintptr_t)h) - 1;
+    fat_handle_t *f;
+	
+    mutex_lock(&fat_mutex);
+
+    if(fd >= 0 && fd < fh_chunks * FAT_HANDLE_CHUNK && (f = FH(fd))->used && !f->closing) {
+        /* Someone is still in a call on it. Whoever finishes last frees it */
+        if(f->refs > 0)
+            f->closing = 1;
+        else
+            fat_release_handle(f);
+    }
+
+    mutex_unlock(&fat_mutex);
+
+    return 0;
+}
+
+/* Read up to cnt bytes of f starting at offset. Doesn't touch f->ptr.
+   The caller holds mnt->ns_lock for reading */
+static ssize_t fat_read_at(fat_handle_t *f, void *buf, size_t cnt, uint32 offset) {
+    /* Nothing left past the end of the file */
+    if(offset >= f->node->FileSize)
+        return 0;
+
+    /* Do we have enough left? */
+    if(cnt > f->node->FileSize - offset)
+        cnt = f->node->FileSize - offset;
+
+    if(fat_read_data(f->mnt->fs, f->node, (unsigned char *)buf, (int)cnt, (int)offset) != 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return (ssize_t)cnt;
+}
+
+/* Write cnt bytes of buf to f starting at offset and update the directory entry. Doesn't touch f->ptr.
+   The caller holds mnt->ns_lock for writing */
+static ssize_t fat_write_at(fat_handle_t *f, const void *buf, size_t cnt, uint32 offset) {
+    fatfs_t *fs = f->mnt->fs;
+    unsigned int last_free;
+
+    if(cnt == 0)
+        return 0;
+
+    /* FileSize is 32 bits */
+    if((uint64)offset + cnt > 0xFFFFFFFFULL) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    last_free = fs->next_free_fat_index; /* Used later to determine if a cluster was allocated for this file */
+
+    /* Writing past the end. The gap gets zeros first, the clusters it takes could still have the data of deleted files */
+    if(offset > f->node->FileSize && fat_truncate_file(fs, f->node, offset) != 0) {
+        if(fs->fat_type == FAT32 && (fs->next_free_fat_index != last_free))
+            set_fsinfo_nextfree(fs);
+
+        update_sd_entry(fs, f->node);
+        return -1;
+    }
+
+    if(fat_write_data(fs, f->node, (unsigned char *)buf, (int)cnt, (int)offset) != 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    /* Write it to FSInfo sector(Fat32 only) */
+    if(fs->fat_type == FAT32 && (fs->next_free_fat_index != last_free))
+        set_fsinfo_nextfree(fs);
+
+    /* Increase the file size if need be(which ever is bigger) */
+    if(offset + cnt > f->node->FileSize)
+        f->node->FileSize = offset + cnt;
+
+    /* Write it to the FAT */
+    update_sd_entry(fs, f->node);
+
+    return (ssize_t)cnt;
+}
+
+static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
+    fat_handle_t *f;
+    fs_fat_fs_t *mnt;
+    ssize_t rv;
+    uint64 start;
+
+    if(!(f = fat_get_handle(h)))
+        return -1;
+
+    /* Check that the fd is valid */
+    if(f->mode & O_WRONLY) {
+        fat_put_handle(f);
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Check and make sure it is not a directory */
+    if(f->mode & O_DIR) {
+        fat_put_handle(f);
+        errno = EISDIR;
+        return -1;
+    }
+
+    mnt = f->mnt;
+    start = timer_us_gettime64();
+
+    /* Reads only need the namespace to hold still. Any number of them can run at once */
+    rwsem_read_lock(&mnt->ns_lock);
+    mutex_lock(&f->lock);
+
+    if((rv = fat_read_at(f, buf, cnt, f->ptr)) > 0)
+        f->ptr += rv;
+
+    /* We're done, clean up and return. */
+    mutex_unlock(&f->lock);
+    rwsem_read_unlock(&mnt->ns_lock);
+    fat_stat_op(mnt, FS_FAT_OP_READ, start, rv < 0);
+    fat_put_handle(f);
+
+    return rv;
+}
+
+static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt)
+{
+    fat_handle_t *f;
+    fs_fat_fs_t *mnt;
+    ssize_t rv;
+    uint64 start;
+
+    if(!(f = fat_get_handle(h)))
+        return -1;
+
+    /* Check that the fd is valid */
+    if((f->mode & O_DIR) || (f->mode & O_RDONLY)) {
+        fat_put_handle(f);
+        errno = EBADF;
+        return -1;
+    }
+
+    mnt = f->mnt;
+    start = timer_us_gettime64();
+
+    /* Writes can allocate clusters and always update the directory entry */
+    rwsem_write_lock(&mnt->ns_lock);
+    mutex_lock(&f->lock);
+    
+    /* If we set mode to O_APPEND, then make sure we write to end of file */
+    if(f->mode & O_APPEND)
+    {
+        f->ptr = f->node->FileSize;
     }
 
-    /* Find a free file handle */
-    mutex_lock(&fat_mutex);
+    if((rv = fat_write_at(f, buf, cnt, f->ptr)) > 0)
+        f->ptr += rv;
+
+    mutex_unlock(&f->lock);
+    rwsem_write_unlock(&mnt->ns_lock);
+    fat_stat_op(mnt, FS_FAT_OP_WRITE, start, rv < 0);
+    fat_put_handle(f);
+
+    return rv;
+}
+
+/* Look up the handle behind fd for pread/pwrite/async requests and pin it. Only regular files on a FAT mount
+   that were opened for reading(write == 0) or writing(write == 1) qualify */
+static fat_handle_t *fat_file_from_fd(file_t fd, int write) {
+    vfs_handler_t *vfs;
+    fat_handle_t *f;
 
-    for(fd = 0; fd < MAX_FAT_FILES; ++fd) {
-        if(fh[fd].used == 0) {
-            fh[fd].used = 1;
-            break;
-        }
+    if(!(vfs = fs_get_handler(fd)) || !(f = fat_get_handle(fs_get_handle(fd)))) {
+        errno = EBADF;
+        return NULL;
     }
 
-    if(fd >= MAX_FAT_FILES) {
-        errno = ENFILE;
-		free(ufn);
-		delete_struct_entry(found);
-        mutex_unlock(&fat_mutex);
+    if(f->mnt->vfsh != vfs) {
+        fat_put_handle(f);
+        errno = EBADF;
         return NULL;
     }
 
-    /* Make sure we're not trying to open a directory for writing */
-    if((found->Attr & DIRECTORY) && (mode & (O_WRONLY | O_RDWR))) {
+    if(f->mode & O_DIR) {
+        fat_put_handle(f);
         errno = EISDIR;
-		free(ufn);
-		delete_struct_entry(found);
-        mutex_unlock(&fat_mutex);
         return NULL;
     }
 
-    /* Make sure if we're trying to open a directory that we have a directory */
-    if((mode & O_DIR) && !(found->Attr & DIRECTORY)) {
-        errno = ENOTDIR;
-		free(ufn);
-		delete_struct_entry(found);
-        mutex_unlock(&fat_mutex);
+    if(write ? !(f->mode & (O_WRONLY | O_RDWR)) : (f->mode & O_WRONLY)) {
+        fat_put_handle(f);
+        errno = EBADF;
         return NULL;
     }
 
-    /* Fill in the rest of the handle */
-    fh[fd].mode = mode;
-    fh[fd].ptr = 0;
-    fh[fd].mnt = mnt;
-    fh[fd].node = found;
-	fh[fd].node->CurrCluster = fh[fd].node->StartCluster;
-	fh[fd].node->NumCluster = 0;
-    fh[fd].dir = NULL;
-
-    mutex_unlock(&fat_mutex);
-	
-	free(ufn);
-
-    return (void *)(fd + 1);
+    return f;
 }
 
-static int fs_fat_close(void * h) {
-    file_t fd = ((file_t)h) - 1;
-	
-    mutex_lock(&fat_mutex);
+/* Read up to cnt bytes from fd at offset without using or moving the file pointer.
+   Doesn't take the handle lock, so reads like this on the same fd run side by side */
+ssize_t fs_fat_pread(file_t fd, void *buf, size_t cnt, off_t offset) {
+    fat_handle_t *f;
+    fs_fat_fs_t *mnt;
+    ssize_t rv;
+    uint64 start;
 
-    if(fd < MAX_FAT_FILES && fh[fd].used) {
-        fh[fd].used = 0;
-        fh[fd].ptr = 0;
-		fh[fd].mode = 0;
-		
-		delete_struct_entry(fh[fd].node);
-		fh[fd].node = NULL;
-		delete_struct_entry(fh[fd].dir);
-		fh[fd].dir = NULL;
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
     }
 
-    mutex_unlock(&fat_mutex);
+    if(!(f = fat_file_from_fd(fd, 0)))
+        return -1;
 
-    return 0;
+    mnt = f->mnt;
+    start = timer_us_gettime64();
+
+    /* No file gets past 4GB - 1, so offsets from there on are past the end of any file */
+    rwsem_read_lock(&mnt->ns_lock);
+    rv = fat_read_at(f, buf, cnt, ((uint64)offset > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (uint32)offset);
+    rwsem_read_unlock(&mnt->ns_lock);
+    fat_stat_op(mnt, FS_FAT_OP_READ, start, rv < 0);
+
+    fat_put_handle(f);
+
+    return rv;
 }
 
-static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
-    file_t fd = ((file_t)h) - 1;
-    fatfs_t *fs;
-    unsigned char *bbuf = (unsigned char *)buf;
+/* Write cnt bytes to fd at offset without using or moving the file pointer. O_APPEND is ignored */
+ssize_t fs_fat_pwrite(file_t fd, const void *buf, size_t cnt, off_t offset) {
+    fat_handle_t *f;
+    fs_fat_fs_t *mnt;
     ssize_t rv;
+    uint64 start;
 
-    mutex_lock(&fat_mutex);
-
-    /* Check that the fd is valid */
-    if(fd >= MAX_FAT_FILES || !fh[fd].used || (fh[fd].mode & O_WRONLY)) {
-        mutex_unlock(&fat_mutex);
-        errno = EBADF;
+    if(offset < 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    /* Check and make sure it is not a directory */
-    if(fh[fd].mode & O_DIR) {
-        mutex_unlock(&fat_mutex);
-        errno = EISDIR;
+    if((uint64)offset + cnt > 0xFFFFFFFFULL) {
+        errno = EFBIG;
         return -1;
     }
 
-    /* Do we have enough left? */
-    if((fh[fd].ptr + cnt) > fh[fd].node->FileSize)
-    {
-        cnt = fh[fd].node->FileSize - fh[fd].ptr;
+    if(!(f = fat_file_from_fd(fd, 1)))
+        return -1;
+
+    mnt = f->mnt;
+    start = timer_us_gettime64();
+
+    rwsem_write_lock(&mnt->ns_lock);
+    rv = fat_write_at(f, buf, cnt, (uint32)offset);
+    rwsem_write_unlock(&mnt->ns_lock);
+    fat_stat_op(mnt, FS_FAT_OP_WRITE, start, rv < 0);
+
+    fat_put_handle(f);
+
+    return rv;
+}
+
+/* Set the size of the file behind fd(opened for writing) to length. Growing it fills the new part with zeros */
+int fs_fat_ftruncate(file_t fd, off_t length) {
+    fat_handle_t *f;
+    fs_fat_fs_t *mnt;
+    unsigned int last_free;
+    int rv;
+    uint64 start;
+
+    if(length < 0) {
+        errno = EINVAL;
+        return -1;
     }
 
-    fs = fh[fd].mnt->fs;
-    rv = (ssize_t)cnt;
-	
-    if((fat_read_data(fs, fh[fd].node, &bbuf, (int)cnt, fh[fd].ptr)) != 0) { 
-        mutex_unlock(&fat_mutex);
-        errno = EBADF;
+    if((uint64)length > 0xFFFFFFFFULL) {
+        errno = EFBIG;
         return -1;
     }
-	
-    bbuf[cnt] = '\0';
-    fh[fd].ptr += cnt;
 
-    /* We're done, clean up and return. */
-    mutex_unlock(&fat_mutex);
+    if(!(f = fat_file_from_fd(fd, 1)))
+        return -1;
+
+    mnt = f->mnt;
+    start = timer_us_gettime64();
+
+    rwsem_write_lock(&mnt->ns_lock);
+
+    last_free = mnt->fs->next_free_fat_index;
+    rv = fat_truncate_file(mnt->fs, f->node, (uint32)length);
+
+    if(mnt->fs->fat_type == FAT32 && mnt->fs->next_free_fat_index != last_free)
+        set_fsinfo_nextfree(mnt->fs);
+
+    /* The start cluster can change too(to or from 0), even when it failed */
+    update_sd_entry(mnt->fs, f->node);
+
+    rwsem_write_unlock(&mnt->ns_lock);
+    fat_stat_op(mnt, FS_FAT_OP_WRITE, start, rv < 0);
+
+    fat_put_handle(f);
 
     return rv;
 }
 
-static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt)
-{
-    file_t fd = ((file_t)h) - 1;
-    fatfs_t *fs;
-    ssize_t rv;
-	
-	unsigned int last_end;
+/* Async requests. Waiting requests are kept in submission order. Each worker takes a batch of requests for
+   the same mount and direction at a time so the namespace lock is only taken once for all of them */
+static mutex_t       aio_mutex;    /* Covers everything below, the aio_* fields of handles and 'done' of requests */
+static condvar_t     aio_work;     /* Signalled when requests are queued or the workers have to stop */
+static condvar_t     aio_done;     /* Broadcast when a request is done */
+static fs_fat_aio_t *aio_head;
+static fs_fat_aio_t *aio_tail;
+static kthread_t    *aio_threads[FS_FAT_AIO_WORKERS];
+static int           aio_running;  /* Workers have been started */
+static int           aio_quit;
+
+/* Take the oldest request and up to FS_FAT_AIO_BATCH - 1 more for the same mount and op off the queue.
+   Reads are sorted by file and offset. aio_mutex must be held and the queue cant be empty */
+static int aio_take_batch(fs_fat_aio_t *batch[]) {
+    fs_fat_aio_t **link = &aio_head;
+    fs_fat_aio_t *req, *prev = NULL, *tmp;
+    fs_fat_fs_t *mnt = ((fat_handle_t *)aio_head->hnd)->mnt;
+    int op = aio_head->op;
+    int n = 0, i;
+
+    while((req = *link) != NULL && n < FS_FAT_AIO_BATCH) {
+        if(req->op != op || ((fat_handle_t *)req->hnd)->mnt != mnt) {
+            prev = req;
+            link = &req->next;
+            continue;
+        }
 
-    mutex_lock(&fat_mutex);
+        *link = req->next;
 
-    /* Check that the fd is valid */
-    if(fd >= MAX_FAT_FILES || !fh[fd].used || (fh[fd].mode & O_DIR) || (fh[fd].mode & O_RDONLY)) {
-        mutex_unlock(&fat_mutex);
-        errno = EBADF;
+        if(aio_tail == req)
+            aio_tail = prev;
+
+        /* Insertion sort. Writes keep the order they came in */
+        for(i = n++; op == FS_FAT_AIO_READ && i > 0; i--) {
+            tmp = batch[i - 1];
+
+            if((uintptr_t)tmp->hnd < (uintptr_t)req->hnd || (tmp->hnd == req->hnd && tmp->offset <= req->offset))
+                break;
+
+            batch[i] = tmp;
+        }
+
+        batch[i] = req;
+    }
+
+    return n;
+}
+
+static void *aio_worker(void *param) {
+    fs_fat_aio_t *batch[FS_FAT_AIO_BATCH];
+    fs_fat_fs_t *mnt;
+    fat_handle_t *f;
+    int n, i;
+
+    (void)param;
+
+    mutex_lock(&aio_mutex);
+
+    for(;;) {
+        /* Whatever is still queued gets done before we stop */
+        while(aio_head == NULL && !aio_quit)
+            cond_wait(&aio_work, &aio_mutex);
+
+        if(aio_head == NULL)
+            break;
+
+        n = aio_take_batch(batch);
+        mutex_unlock(&aio_mutex);
+
+        mnt = ((fat_handle_t *)batch[0]->hnd)->mnt;
+
+        if(batch[0]->op == FS_FAT_AIO_READ)
+            rwsem_read_lock(&mnt->ns_lock);
+        else
+            rwsem_write_lock(&mnt->ns_lock);
+
+        for(i = 0; i < n; i++) {
+            f = (fat_handle_t *)batch[i]->hnd;
+            errno = 0;
+
+            if(batch[i]->op == FS_FAT_AIO_READ)
+                batch[i]->result = fat_read_at(f, batch[i]->buf, batch[i]->cnt,
+                                               ((uint64)batch[i]->offset > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (uint32)batch[i]->offset);
+            else
+                batch[i]->result = fat_write_at(f, batch[i]->buf, batch[i]->cnt, (uint32)batch[i]->offset);
+
+            batch[i]->error = (batch[i]->result < 0) ? errno : 0;
+        }
+
+        if(batch[0]->op == FS_FAT_AIO_READ)
+            rwsem_read_unlock(&mnt->ns_lock);
+        else
+            rwsem_write_unlock(&mnt->ns_lock);
+
+        for(i = 0; i < n; i++) {
+            f = (fat_handle_t *)batch[i]->hnd;
+
+            mutex_lock(&aio_mutex);
+            f->aio_pending--;
+            f->aio_result = batch[i]->result;
+            mutex_unlock(&aio_mutex);
+
+            fat_put_handle(f);
+
+            /* The callback still owns the request. It is only done(and can be reused/freed) after this */
+            if(batch[i]->callback)
+                batch[i]->callback(batch[i]);
+
+            mutex_lock(&aio_mutex);
+            batch[i]->done = 1;
+            cond_broadcast(&aio_done);
+            mutex_unlock(&aio_mutex);
+        }
+
+        mutex_lock(&aio_mutex);
+    }
+
+    mutex_unlock(&aio_mutex);
+
+    return NULL;
+}
+
+/* Queue cnt requests. Either all of them are queued or(on error) none */
+int fs_fat_aio_submit(fs_fat_aio_t *reqs, int cnt) {
+    fat_handle_t *f;
+    int i, j;
+
+    if(!initted || cnt < 0) {
+        errno = EINVAL;
         return -1;
     }
-    
-    /* If we set mode to O_APPEND, then make sure we write to end of file */
-    if(fh[fd].mode & O_APPEND)
-    {
-        fh[fd].ptr = fh[fd].node->FileSize;
+
+    /* Check all of them and pin their handles before any is queued */
+    for(i = 0; i < cnt; i++) {
+        if((reqs[i].op != FS_FAT_AIO_READ && reqs[i].op != FS_FAT_AIO_WRITE) || reqs[i].offset < 0) {
+            errno = EINVAL;
+            break;
+        }
+
+        /* Writes that would take the file past 4GB - 1 fail like fs_fat_pwrite(). Reads from there on return 0 */
+        if(reqs[i].op == FS_FAT_AIO_WRITE && (uint64)reqs[i].offset + reqs[i].cnt > 0xFFFFFFFFULL) {
+            errno = EFBIG;
+            break;
+        }
+
+        if(!(f = fat_file_from_fd(reqs[i].fd, reqs[i].op == FS_FAT_AIO_WRITE)))
+            break;
+
+        reqs[i].hnd = f;
     }
-	
-	/* If we want to write more than we have, set it to write the whole thing */
-	if(cnt > strlen((unsigned char*)buf))
-	{
-		cnt = strlen((unsigned char*)buf);
-	}
-	
-	fs = fh[fd].mnt->fs;
-    rv = (ssize_t)cnt;
-	last_end = fh[fd].node->EndCluster; /* Used later to determine if a cluster was allocated for this file */
-	
-    if(fat_write_data(fs, fh[fd].node, (unsigned char*)buf, cnt, fh[fd].ptr) != 0) {
-        mutex_unlock(&fat_mutex);
-        errno = EBADF;
+
+    if(i < cnt) {
+        for(j = 0; j < i; j++)
+            fat_put_handle((fat_handle_t *)reqs[j].hnd);
+
         return -1;
     }
 
-    fh[fd].ptr += cnt;
-	
-	/* Write it to FSInfo sector(Fat32 only) */
-	if(fs->fat_type == FAT32 && (fh[fd].node->EndCluster != last_end))
-		set_fsinfo_nextfree(fs); 
+    mutex_lock(&aio_mutex);
 
-    fh[fd].node->FileSize = (fh[fd].ptr > fh[fd].node->FileSize) ? fh[fd].ptr : fh[fd].node->FileSize; /* Increase the file size if need be(which ever is bigger) */
-				
-    /* Write it to the FAT */
-    update_sd_entry(fs, fh[fd].node);
+    /* Start the workers the first time they are needed */
+    if(!aio_running) {
+        for(j = 0; j < FS_FAT_AIO_WORKERS; j++) {
+            if(!(aio_threads[j] = thd_create(0, aio_worker, NULL)))
+                break;
+        }
 
-    mutex_unlock(&fat_mutex);
+        if(j == 0) {
+            mutex_unlock(&aio_mutex);
+
+            for(j = 0; j < cnt; j++)
+                fat_put_handle((fat_handle_t *)reqs[j].hnd);
+
+            errno = ENOMEM;
+            return -1;
+        }
+
+        aio_running = j;
+    }
+
+    for(i = 0; i < cnt; i++) {
+        f = (fat_handle_t *)reqs[i].hnd;
+        f->aio_pending++;
+
+        reqs[i].done = 0;
+        reqs[i].result = 0;
+        reqs[i].error = 0;
+        reqs[i].next = NULL;
+
+        if(aio_tail)
+            aio_tail->next = &reqs[i];
+        else
+            aio_head = &reqs[i];
+
+        aio_tail = &reqs[i];
+    }
+
+    cond_broadcast(&aio_work);
+    mutex_unlock(&aio_mutex);
+
+    return 0;
+}
+
+/* 1 if req is done, 0 if it is still queued or running */
+int fs_fat_aio_done(fs_fat_aio_t *req) {
+    int rv;
+
+    mutex_lock(&aio_mutex);
+    rv = req->done;
+    mutex_unlock(&aio_mutex);
+
+    return rv;
+}
+
+/* Block until req is done and return its result. errno is set from req->error on failure */
+ssize_t fs_fat_aio_wait(fs_fat_aio_t *req) {
+    mutex_lock(&aio_mutex);
+
+    while(!req->done)
+        cond_wait(&aio_done, &aio_mutex);
+
+    mutex_unlock(&aio_mutex);
+
+    if(req->result < 0)
+        errno = req->error;
+
+    return req->result;
+}
+
+/* Result of the last async request on the file that finished. Fails with EAGAIN while some are still queued or running */
+static int fs_fat_complete(void *h, ssize_t *rv) {
+    fat_handle_t *f;
+    int ret = 0;
+
+    if(!(f = fat_get_handle(h)))
+        return -1;
+
+    mutex_lock(&aio_mutex);
+
+    if(f->aio_pending > 0) {
+        errno = EAGAIN;
+        ret = -1;
+    }
+    else if(rv) {
+        *rv = f->aio_result;
+    }
+
+    mutex_unlock(&aio_mutex);
+
+    fat_put_handle(f);
+
+    return ret;
+}
+
+/* A file is always ready for reading/writing, except while async requests on it are still queued or running */
+static short fs_fat_poll(void *h, short events) {
+    fat_handle_t *f;
+    short rv = 0;
+
+    if(!(f = fat_get_handle(h)))
+        return POLLNVAL;
+
+    mutex_lock(&aio_mutex);
+
+    if(f->aio_pending == 0)
+        rv = events & (POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+
+    mutex_unlock(&aio_mutex);
+
+    fat_put_handle(f);
 
     return rv;
 }
 
 static _off64_t fs_fat_seek64(void *h, _off64_t offset, int whence) {
-    file_t fd = ((file_t)h) - 1;
+    fat_handle_t *f;
     _off64_t rv;
 	
-    mutex_lock(&fat_mutex);
+    if(!(f = fat_get_handle(h)))
+        return -1;
 
     /* Check that the fd is valid */
-    if(fd >= MAX_FAT_FILES || !fh[fd].used || (fh[fd].mode & O_DIR)) {
-        mutex_unlock(&fat_mutex);
+    if(f->mode & O_DIR) {
+        fat_put_handle(f);
         errno = EBADF;
         return -1;
     }
 
+    mutex_lock(&f->lock);
+
     /* Update current position according to arguments */
     switch(whence) {
         case SEEK_SET:
-            fh[fd].ptr = offset;
+            f->ptr = offset;
             break;
 
         case SEEK_CUR:
-            fh[fd].ptr += offset;
+            f->ptr += offset;
             break;
 
         case SEEK_END:
-            fh[fd].ptr = fh[fd].node->FileSize;// + offset;
+            f->ptr = f->node->FileSize;// + offset;
             break;
 
         default:
-            mutex_unlock(&fat_mutex);
+            mutex_unlock(&f->lock);
+            fat_put_handle(f);
 	    errno = EINVAL;
             return -1;
     }
 
-    rv =  (_off64_t)fh[fd].ptr;
-    mutex_unlock(&fat_mutex);
+    rv =  (_off64_t)f->ptr;
+    mutex_unlock(&f->lock);
+    fat_put_handle(f);
 	
     return rv;
 }
 
 static _off64_t fs_fat_tell64(void *h) {
-    file_t fd = ((file_t)h) - 1;
+    fat_handle_t *f;
     _off64_t rv;
 	
-    mutex_lock(&fat_mutex);
-
-    if(fd >= MAX_FAT_FILES || !fh[fd].used || (fh[fd].mode & O_DIR)) {
-        mutex_unlock(&fat_mutex);
+    if(!(f = fat_get_handle(h)) || (f->mode & O_DIR)) {
+        if(f != NULL)
+            fat_put_handle(f);
         errno = EINVAL;
         return -1;
     }
 
-    rv = (_off64_t)fh[fd].ptr;
+    mutex_lock(&f->lock);
+    rv = (_off64_t)f->ptr;
+    mutex_unlock(&f->lock);
 
-    mutex_unlock(&fat_mutex);
+    fat_put_handle(f);
 	
     return rv;
 }
 
 static uint64 fs_fat_total64(void *h) {
-    file_t fd = ((file_t)h) - 1;
+    fat_handle_t *f;
     size_t rv;
 
-    mutex_lock(&fat_mutex);
-
-    if(fd >= MAX_FAT_FILES || !fh[fd].used || (fh[fd].mode & O_DIR)) {
-        mutex_unlock(&fat_mutex);
+    if(!(f = fat_get_handle(h)) || (f->mode & O_DIR)) {
+        if(f != NULL)
+            fat_put_handle(f);
         errno = EINVAL;
         return -1;
     }
 
-    rv = fh[fd].node->FileSize;
-    mutex_unlock(&fat_mutex);
+    mutex_lock(&f->lock);
+    rv = f->node->FileSize;
+    mutex_unlock(&f->lock);
+
+    fat_put_handle(f);
 	
     return rv;
 }
 
 static dirent_t *fs_fat_readdir(void *h) {
-    file_t fd = ((file_t)h) - 1;
+    fat_handle_t *f;
+    fs_fat_fs_t *mnt;
+    size_t len;
+    uint64 start;
 
-    mutex_lock(&fat_mutex);
+    if(!(f = fat_get_handle(h)))
+        return NULL;
 
     /* Check that the fd is valid */
-    if(fd >= MAX_FAT_FILES || !fh[fd].used || !(fh[fd].mode & O_DIR)) {
-        mutex_unlock(&fat_mutex);
+    if(!(f->mode & O_DIR)) {
+        fat_put_handle(f);
         errno = EBADF;
         return NULL;
     }
 
+    mnt = f->mnt;
+    start = timer_us_gettime64();
+
+    rwsem_read_lock(&mnt->ns_lock);
+    mutex_lock(&f->lock);
+
     /* Get the first child of this folder if NULL */
-    if(fh[fd].dir == NULL) 
+    if(f->cold->dir == NULL) 
     {
-		fh[fd].dir = get_next_entry(fh[fd].mnt->fs, fh[fd].node, NULL);
+		f->cold->dir = get_next_entry(mnt->fs, f->node, NULL);
     } 
     /* Move on to the next child */
     else  
     {
-		fh[fd].dir = get_next_entry(fh[fd].mnt->fs, fh[fd].node, fh[fd].dir);
+		f->cold->dir = get_next_entry(mnt->fs, f->node, f->cold->dir);
     }
 	
     /* Make sure we're not at the end of the directory */
-    if(fh[fd].dir == NULL) {
-        mutex_unlock(&fat_mutex);
+    if(f->cold->dir == NULL) {
+        mutex_unlock(&f->lock);
+        rwsem_read_unlock(&mnt->ns_lock);
+        fat_stat_op(mnt, FS_FAT_OP_READDIR, start, 0);
+        fat_put_handle(f);
         return NULL;
     }
 	
     /* Fill in the static directory entry */
-    fh[fd].dirent.size = fh[fd].dir->FileSize;
-    memcpy(fh[fd].dirent.name, fh[fd].dir->Name, strlen(fh[fd].dir->Name));
-    fh[fd].dirent.name[strlen(fh[fd].dir->Name)] = '\0';
-    fh[fd].dirent.attr = fh[fd].dir->Attr;
-    fh[fd].dirent.time = 0; 
+    f->cold->dirent.size = f->cold->dir->FileSize;
+    len = strlen(f->cold->dir->Name);
 
+    /* Long names can be longer(in UTF-8) than dirent.name. Cut them without splitting a character */
+    if(len > sizeof(f->cold->dirent.name) - 1) {
+        len = sizeof(f->cold->dirent.name) - 1;
+
+        while(len > 0 && (f->cold->dir->Name[len] & 0xC0) == 0x80)
+            len--;
+    }
+
+    memcpy(f->cold->dirent.name, f->cold->dir->Name, len);
+    f->cold->dirent.name[len] = '\0';
+    f->cold->dirent.attr = f->cold->dir->Attr;
+    f->cold->dirent.time = fat_entry_time(f->cold->dir->WrtDate, f->cold->dir->WrtTime);
+
+    mutex_unlock(&f->lock);
+    rwsem_read_unlock(&mnt->ns_lock);
+    fat_stat_op(mnt, FS_FAT_OP_READDIR, start, 0);
+    fat_put_handle(f);
+
+    return &f->cold->dirent;
+}
+
+/* Is the entry of node open through any file handle? */
+static int fat_in_use(fs_fat_fs_t *mnt, node_entry_t *node) {
+    int rv;
+
+    mutex_lock(&fat_mutex);
+    rv = fat_find_open(mnt, node) != NULL;
     mutex_unlock(&fat_mutex);
 
-    return &fh[fd].dirent;
+    return rv;
 }
 
-static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
-	int i;
+/* Is there an entry at fn(relative to the mount) that is open? 1 if so, 0 if not(or there is none), -1 when out
+   of memory. ns_lock must be held */
+static int fat_dest_in_use(fs_fat_fs_t *mnt, const char *fn) {
+    node_entry_t *found;
+    node_entry_t *root;
+    int rv;
+
+    if(!(root = fat_root_entry(mnt->fs))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    found = fat_search_from(mnt->fs, root, fn);
+    delete_struct_entry(root);
+
+    if(found == NULL)
+        return 0;
+
+    rv = fat_in_use(mnt, found);
+    delete_struct_entry(found);
+
+    return rv;
+}
+
+static int fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
     fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
     node_entry_t *found = NULL;
 	char *cpy;
@@ -405,6 +1405,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 	unsigned char attr;
 	unsigned int start_cluster;
 	unsigned int filesize;
+	int busy;
 
     /* Make sure we get valid filenames. */
     if(!fn1 || !fn2) {
@@ -430,23 +1431,20 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
         return -1;
     }
 	
+	rwsem_write_lock(&mnt->ns_lock);
+	
 	found = fat_search_by_path(mnt->fs, cpy);
 	
 	free(cpy);
-		
-	mutex_lock(&fat_mutex);
 	
 	if(found) {
-        /* Make sure it's not in use */
-		for(i=0;i<MAX_FAT_FILES; i++)
-		{
-			if(fh[i].used == 1 && fh[i].node == found)
-			{
-				errno = EBUSY;
-				delete_struct_entry(found);
-				mutex_unlock(&fat_mutex);
-				return -1;
-			}
+        /* Make sure it's not in use */
+		if(fat_in_use(mnt, found))
+		{
+			errno = EBUSY;
+			delete_struct_entry(found);
+			rwsem_write_unlock(&mnt->ns_lock);
+			return -1;
 		}
 		
 		/* Make sure its not Read Only */
@@ -454,7 +1452,18 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 		{
 			errno = EROFS;
 			delete_struct_entry(found);
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
+			return -1;
+		}
+       
+		/* Nor the file/folder it replaces. Its clusters get freed below, while the open node of its entry would
+		   keep pointing at them. Checked before the old entry goes away so a failed rename changes nothing */
+		if((busy = fat_dest_in_use(mnt, fn2)) != 0)
+		{
+			if(busy > 0)
+				errno = EBUSY;
+			delete_struct_entry(found);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return -1;
 		}
        
@@ -471,7 +1480,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 	else /* Not found */
 	{
 		errno = ENOENT;
-		mutex_unlock(&fat_mutex);
+		rwsem_write_unlock(&mnt->ns_lock);
 		return -1;
 	}
 	
@@ -495,7 +1504,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 			{
 				errno = ENOTEMPTY;
 				delete_struct_entry(found);
-				mutex_unlock(&fat_mutex);
+				rwsem_write_unlock(&mnt->ns_lock);
 				return -1;
 			}
 			/* If this is a directory then old one must be too */
@@ -503,7 +1512,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 			{
 				errno = EISDIR;
 				delete_struct_entry(found);
-				mutex_unlock(&fat_mutex);
+				rwsem_write_unlock(&mnt->ns_lock);
 				return -1;
 			}
 			
@@ -514,7 +1523,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 			
 			delete_struct_entry(found);
 			
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return 0;
 		}
 		else 
@@ -523,7 +1532,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 			{
 				errno = EISDIR;
 				delete_struct_entry(found);
-				mutex_unlock(&fat_mutex);
+				rwsem_write_unlock(&mnt->ns_lock);
 				return -1;
 			}
 			
@@ -535,7 +1544,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 			
 			delete_struct_entry(found);
 			
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return 0;
 		}
 	}
@@ -543,7 +1552,7 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 	if((found = create_entry(mnt->fs, cpy, attr)) == NULL)
 	{
 		free(cpy);
-		mutex_unlock(&fat_mutex);
+		rwsem_write_unlock(&mnt->ns_lock);
 		return -1;
 	}
 	
@@ -562,14 +1571,13 @@ static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
 	
 	free(cpy);
 	delete_struct_entry(found);
-    mutex_unlock(&fat_mutex);
+    rwsem_write_unlock(&mnt->ns_lock);
 	
     return 0;
 }
 
-static int fs_fat_unlink(vfs_handler_t * vfs, const char *fn) {
+static int fat_unlink(vfs_handler_t * vfs, const char *fn) {
 
-	int i;
 	node_entry_t *f = NULL;
 	fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
 	char *ufn = NULL;
@@ -579,7 +1587,7 @@ static int fs_fat_unlink(vfs_handler_t * vfs, const char *fn) {
     strcat(ufn, mnt->fs->mount);
     strcat(ufn, fn);
 
-    mutex_lock(&fat_mutex);
+    rwsem_write_lock(&mnt->ns_lock);
 	
 	f = fat_search_by_path(mnt->fs, ufn);
 	
@@ -587,15 +1595,12 @@ static int fs_fat_unlink(vfs_handler_t * vfs, const char *fn) {
 
     if(f) {
         /* Make sure it's not in use */
-		for(i=0;i<MAX_FAT_FILES; i++)
+		if(fat_in_use(mnt, f))
 		{
-			if(fh[i].used == 1 && fh[i].node == f)
-			{
-				errno = EBUSY;
-				delete_struct_entry(f);
-				mutex_unlock(&fat_mutex);
-				return -1;
-			}
+			errno = EBUSY;
+			delete_struct_entry(f);
+			rwsem_write_unlock(&mnt->ns_lock);
+			return -1;
 		}
 		
 		/* Make sure it isnt a directory(files only) */
@@ -603,7 +1608,7 @@ static int fs_fat_unlink(vfs_handler_t * vfs, const char *fn) {
 		{
 			errno = EISDIR;
 			delete_struct_entry(f);
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return -1;
 		}
 		
@@ -612,7 +1617,7 @@ static int fs_fat_unlink(vfs_handler_t * vfs, const char *fn) {
 		{
 			errno = EROFS;
 			delete_struct_entry(f);
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return -1;
 		}
        
@@ -628,16 +1633,16 @@ static int fs_fat_unlink(vfs_handler_t * vfs, const char *fn) {
 	else /* Not found */
 	{
 		errno = ENOENT;
-		mutex_unlock(&fat_mutex);
+		rwsem_write_unlock(&mnt->ns_lock);
 		return -1;
 	}
 
-    mutex_unlock(&fat_mutex);
+    rwsem_write_unlock(&mnt->ns_lock);
     
 	return 0;
 }
 
-static int fs_fat_mkdir(vfs_handler_t *vfs, const char *fn)
+static int fat_mkdir(vfs_handler_t *vfs, const char *fn)
 {
     char *ufn = NULL;
     fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
@@ -662,6 +1667,8 @@ static int fs_fat_mkdir(vfs_handler_t *vfs, const char *fn)
         return -1;
     }
 
+	rwsem_write_lock(&mnt->ns_lock);
+
 	found = fat_search_by_path(mnt->fs, ufn);
 
     /* Handle a few errors */
@@ -669,10 +1676,13 @@ static int fs_fat_mkdir(vfs_handler_t *vfs, const char *fn)
         errno = EEXIST;  
 		delete_struct_entry(found);
 		free(ufn);
+		rwsem_write_unlock(&mnt->ns_lock);
         return -1;
     }
 
 	found = create_entry(mnt->fs, ufn, DIRECTORY);
+
+	rwsem_write_unlock(&mnt->ns_lock);
  
     if(found == NULL)
 	{
@@ -687,9 +1697,35 @@ static int fs_fat_mkdir(vfs_handler_t *vfs, const char *fn)
     return 0;
 }
 
+static int fs_fat_rename(vfs_handler_t *vfs, const char *fn1, const char *fn2) {
+    uint64 start = timer_us_gettime64();
+    int rv = fat_rename(vfs, fn1, fn2);
+
+    fat_stat_op((fs_fat_fs_t *)vfs->privdata, FS_FAT_OP_RENAME, start, rv < 0);
+
+    return rv;
+}
+
+static int fs_fat_unlink(vfs_handler_t *vfs, const char *fn) {
+    uint64 start = timer_us_gettime64();
+    int rv = fat_unlink(vfs, fn);
+
+    fat_stat_op((fs_fat_fs_t *)vfs->privdata, FS_FAT_OP_UNLINK, start, rv < 0);
+
+    return rv;
+}
+
+static int fs_fat_mkdir(vfs_handler_t *vfs, const char *fn) {
+    uint64 start = timer_us_gettime64();
+    int rv = fat_mkdir(vfs, fn);
+
+    fat_stat_op((fs_fat_fs_t *)vfs->privdata, FS_FAT_OP_MKDIR, start, rv < 0);
+
+    return rv;
+}
+
 static int fs_fat_rmdir(vfs_handler_t *vfs, const char *fn)
 {
-	int i;
 	node_entry_t *f = NULL;
 	char *ufn = NULL;
 	fs_fat_fs_t *mnt = (fs_fat_fs_t *)vfs->privdata;
@@ -699,7 +1735,7 @@ static int fs_fat_rmdir(vfs_handler_t *vfs, const char *fn)
     strcat(ufn, mnt->fs->mount);
     strcat(ufn, fn);
 
-    mutex_lock(&fat_mutex);
+    rwsem_write_lock(&mnt->ns_lock);
 
 	f = fat_search_by_path(mnt->fs, ufn);
 	
@@ -707,15 +1743,12 @@ static int fs_fat_rmdir(vfs_handler_t *vfs, const char *fn)
 
     if(f) {
         /* Make sure it's not in use */
-		for(i=0;i<MAX_FAT_FILES; i++)
+		if(fat_in_use(mnt, f))
 		{
-			if(fh[i].used == 1 && fh[i].node == f)
-			{
-				errno = EBUSY;
-				delete_struct_entry(f);
-				mutex_unlock(&fat_mutex);
-				return -1;
-			}
+			errno = EBUSY;
+			delete_struct_entry(f);
+			rwsem_write_unlock(&mnt->ns_lock);
+			return -1;
 		}
 		
 		/* Make sure it isnt a file */
@@ -723,7 +1756,7 @@ static int fs_fat_rmdir(vfs_handler_t *vfs, const char *fn)
 		{
 			errno = ENOTDIR;
 			delete_struct_entry(f);
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return -1;
 		}
 		
@@ -732,7 +1765,7 @@ static int fs_fat_rmdir(vfs_handler_t *vfs, const char *fn)
 		{
 			errno = EROFS;
 			delete_struct_entry(f);
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return -1;
 		}
 		
@@ -740,7 +1773,7 @@ static int fs_fat_rmdir(vfs_handler_t *vfs, const char *fn)
 	   {
 			errno = ENOTEMPTY;
 			delete_struct_entry(f);
-			mutex_unlock(&fat_mutex);
+			rwsem_write_unlock(&mnt->ns_lock);
 			return -1;
 	   }
 	   
@@ -756,32 +1789,27 @@ static int fs_fat_rmdir(vfs_handler_t *vfs, const char *fn)
 	else /* Not found */
 	{
 		errno = ENOENT;
-		mutex_unlock(&fat_mutex);
+		rwsem_write_unlock(&mnt->ns_lock);
 		return -1;
 	}
 
-    mutex_unlock(&fat_mutex);
+    rwsem_write_unlock(&mnt->ns_lock);
 	
 	return 0;
 }
 
 static int fs_fat_fcntl(void *h, int cmd, va_list ap) {
-    file_t fd = ((file_t)h) - 1;
+    fat_handle_t *f;
     int rv = -1;
 
     (void)ap;
 
-    mutex_lock(&fat_mutex);
-
-    if(fd >= MAX_FAT_FILES || !fh[fd].used) {
-        mutex_unlock(&fat_mutex);
-        errno = EBADF;
+    if(!(f = fat_get_handle(h)))
         return -1;
-    }
 
     switch(cmd) {
         case F_GETFL:
-            rv = fh[fd].mode;
+            rv = f->mode;
             break;
 
         case F_SETFL:
@@ -794,10 +1822,218 @@ static int fs_fat_fcntl(void *h, int cmd, va_list ap) {
             errno = EINVAL;
     }
 
-    mutex_unlock(&fat_mutex);
+    fat_put_handle(f);
+    return rv;
+}
+
+static int fs_fat_ioctl(void *h, int cmd, va_list ap) {
+    fat_handle_t *f;
+    fatfs_t *fs;
+    fs_fat_stats_t *st;
+    int rv = 0;
+
+    if(!(f = fat_get_handle(h)))
+        return -1;
+
+    fs = f->mnt->fs;
+
+    switch(cmd) {
+        case FS_FAT_IOCTL_GET_STATS:
+            if(!(st = va_arg(ap, fs_fat_stats_t *))) {
+                errno = EFAULT;
+                rv = -1;
+                break;
+            }
+
+            mutex_lock(&fs->stats_lock);
+            *st = fs->stats;
+            mutex_unlock(&fs->stats_lock);
+
+            mutex_lock(&fs->fat_lock);
+            st->au_total = fs->au_total;
+            st->au_free = fs->au_free;
+            mutex_unlock(&fs->fat_lock);
+            break;
+
+        case FS_FAT_IOCTL_RESET_STATS:
+            mutex_lock(&fs->stats_lock);
+            memset(&fs->stats, 0, sizeof(fs_fat_stats_t));
+            fs->stats.since_us = timer_us_gettime64();
+            mutex_unlock(&fs->stats_lock);
+            break;
+
+        default:
+            errno = EINVAL;
+            rv = -1;
+    }
+
+    fat_put_handle(f);
     return rv;
 }
 
+/* The mount mp(its name, like "/sd") is on. It stays pinned until fat_put_handle(*pinned) */
+static fs_fat_fs_t *fat_pin_mount(const char *mp, fat_handle_t **pinned) {
+    fs_fat_fs_t *mnt;
+    node_entry_t *root;
+    file_t fd;
+
+    if((fd = fs_open(mp, O_RDONLY | O_DIR)) < 0)
+        return NULL;
+
+    root = fat_dir_from_fd(fd, &mnt, pinned);
+    fs_close(fd);
+
+    if(!root)
+        return NULL;
+
+    delete_struct_entry(root);
+
+    return mnt;
+}
+
+/* A fragmented file fs_fat_defrag() found */
+typedef struct fat_defrag_file {
+    node_entry_t *node;
+    unsigned int extents;
+    unsigned int clusters;
+} fat_defrag_file_t;
+
+typedef struct fat_defrag_scan {
+    fat_table_t table;
+    unsigned int min_extents;
+    fat_defrag_file_t *files;
+    unsigned int num, max;
+} fat_defrag_scan_t;
+
+static int fat_defrag_add(fatfs_t *fat, node_entry_t *node, const char *path, void *arg) {
+    fat_defrag_scan_t *s = (fat_defrag_scan_t *)arg;
+    fat_defrag_file_t *tmp;
+    unsigned int extents, clusters;
+
+    (void)fat;
+    (void)path;
+
+    /* Folders stay where they are, their clusters are in the ".." entries of their subfolders */
+    if(node->Attr & DIRECTORY)
+        return 0;
+
+    extents = fat_chain_extents(&s->table, node->StartCluster, &clusters);
+
+    if(extents < s->min_extents)
+        return 0;
+
+    if(s->num == s->max) {
+        if(!(tmp = realloc(s->files, (s->max + 64) * sizeof(fat_defrag_file_t))))
+            return -1;
+
+        s->files = tmp;
+        s->max += 64;
+    }
+
+    if(!(s->files[s->num].node = copy_struct_entry(node)))
+        return -1;
+
+    s->files[s->num].extents = extents;
+    s->files[s->num].clusters = clusters;
+    s->num++;
+
+    return 0;
+}
+
+static int fat_defrag_cmp(const void *a, const void *b) {
+    const fat_defrag_file_t *x = (const fat_defrag_file_t *)a, *y = (const fat_defrag_file_t *)b;
+
+    return (x->extents < y->extents) - (x->extents > y->extents);
+}
+
+int fs_fat_defrag(const char *mp, fs_fat_defrag_t *d) {
+    fat_defrag_scan_t s;
+    fs_fat_fs_t *mnt;
+    fat_handle_t *pinned;
+    unsigned char *buf;
+    unsigned int i, min_extents;
+    int moved, rv = 0;
+
+    if(!d) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    min_extents = d->min_extents > 2 ? d->min_extents : 2;
+    d->files_fragmented = d->files_moved = d->files_skipped = d->clusters_moved = d->extents_before = 0;
+
+    if(!(mnt = fat_pin_mount(mp, &pinned)))
+        return -1;
+
+    if(!(mnt->mount_flags & FS_FAT_MOUNT_READWRITE)) {
+        fat_put_handle(pinned);
+        errno = EROFS;
+        return -1;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.min_extents = min_extents;
+
+    if(!(buf = malloc(DEFRAG_BUF_SECTORS * mnt->fs->boot_sector.bytes_per_sector))) {
+        fat_put_handle(pinned);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Nothing else changes the FAT or any directory until we are done */
+    rwsem_write_lock(&mnt->ns_lock);
+
+    if(fat_table_load(mnt->fs, &s.table) < 0 || fat_walk_tree(mnt->fs, fat_defrag_add, &s) != 0) {
+        rv = -1;
+        goto done;
+    }
+
+    qsort(s.files, s.num, sizeof(fat_defrag_file_t), fat_defrag_cmp);
+
+    for(i = 0; i < s.num; i++) {
+        fat_defrag_file_t *f = &s.files[i];
+
+        d->files_fragmented++;
+        d->extents_before += f->extents;
+
+        if((d->max_files && d->files_moved >= d->max_files) ||
+           (d->max_clusters && d->clusters_moved + f->clusters > d->max_clusters) ||
+           fat_in_use(mnt, f->node)) {
+            d->files_skipped++;
+            continue;
+        }
+
+        if((moved = fat_move_file(mnt->fs, &s.table, f->node, buf, d->cancel)) < 0) {
+            if(errno == ENOSPC) {
+                d->files_skipped++;
+                continue;
+            }
+
+            rv = -1;
+            break;
+        }
+
+        d->files_moved++;
+        d->clusters_moved += moved;
+    }
+
+done:
+    rwsem_write_unlock(&mnt->ns_lock);
+
+    for(i = 0; i < s.num; i++)
+        delete_struct_entry(s.files[i].node);
+
+    free(s.files);
+    fat_table_free(&s.table);
+    free(buf);
+    fat_put_handle(pinned);
+
+    if(rv < 0)
+        return -1;
+
+    return d->files_fragmented - d->files_moved;
+}
+
 /* This is a template that will be used for each mount */
 static vfs_handler_t vh = {
     /* Name Handler */
@@ -820,16 +2056,16 @@ static vfs_handler_t vh = {
     NULL,              		   /* tell */
     NULL,            		   /* total */
     fs_fat_readdir,            /* readdir */
-    NULL,                      /* ioctl */
+    fs_fat_ioctl,              /* ioctl */
     fs_fat_rename,             /* rename */
     fs_fat_unlink,             /* unlink */
     NULL,                      /* mmap */
-    NULL,                      /* complete */
-    NULL,                      /* stat */
+    fs_fat_complete,           /* complete */
+    fs_fat_stat,               /* stat */
     fs_fat_mkdir,              /* mkdir */
     fs_fat_rmdir,              /* rmdir */
     fs_fat_fcntl,              /* fcntl */
-    NULL,                      /* poll */
+    fs_fat_poll,               /* poll */
     NULL,                      /* link */
     NULL,                      /* symlink */
     fs_fat_seek64,             /* seek64 */
@@ -838,43 +2074,63 @@ static vfs_handler_t vh = {
     NULL                       /* readlink */
 };
 
-static int initted = 0;
 
 /* These two functions borrow heavily from the same functions in fs_romdisk */
 int fs_fat_mount(const char *mp, kos_blockdev_t *dev, uint32_t flags) {
+    return fs_fat_mount_ex(mp, dev, flags, NULL);
+}
+
+int fs_fat_mount_ex(const char *mp, kos_blockdev_t *dev, uint32_t flags, const fs_fat_mount_opts_t *opts) {
     fatfs_t *fs;
     fs_fat_fs_t *mnt;
     vfs_handler_t *vfsh;
+    int i;
 
     if(!initted)
         return -1;
 
-    mutex_lock(&fat_mutex);
-
     /* Try to initialize the filesystem */
     if(!(fs = fat_fs_init(mp, dev))) {
-        mutex_unlock(&fat_mutex);
         printf("fs_fat: device does not contain a valid fatfs.\n");
         return -1;
     }
 
+    if(opts && opts->au_bytes && fat_au_init(fs, opts->au_bytes, opts->stream_bytes) < 0) {
+        printf("fs_fat: can't use allocation units of %u bytes\n", (unsigned int)opts->au_bytes);
+        free(fs->mount);   /* fat_fs_shutdown() leaves it to the unmount */
+        fat_fs_shutdown(fs);
+        return -1;
+    }
+
     /* Create a mount structure */
     if(!(mnt = (fs_fat_fs_t *)malloc(sizeof(fs_fat_fs_t)))) {
         printf("fs_fat: out of memory creating fs structure\n");
+        free(fs->mount);
         fat_fs_shutdown(fs);
-        mutex_unlock(&fat_mutex);
         return -1;
     }
 
+    if(flags & FS_FAT_MOUNT_DISCARD) {
+        mutex_lock(&fat_mutex);
+        for(i = 0; i < FAT_MAX_DISCARD; i++) {
+            if(fat_discards[i].dev == dev)
+                fs->discard = fat_discards[i].fn;
+        }
+        mutex_unlock(&fat_mutex);
+    }
+
     mnt->fs = fs;
     mnt->mount_flags = flags;
+    mnt->unmounting = 0;
+    rwsem_init(&mnt->ns_lock);
 
     /* Create a VFS structure */
     if(!(vfsh = (vfs_handler_t *)malloc(sizeof(vfs_handler_t)))) {
         printf("fs_fat: out of memory creating vfs handler\n");
+        rwsem_destroy(&mnt->ns_lock);
         free(mnt);
+        free(fs->mount);
         fat_fs_shutdown(fs);
-        mutex_unlock(&fat_mutex);
         return -1;
     }
 
@@ -883,19 +2139,57 @@ int fs_fat_mount(const char *mp, kos_blockdev_t *dev, uint32_t flags) {
     vfsh->privdata = mnt;
     mnt->vfsh = vfsh;
 
+    mutex_lock(&fat_mutex);
+
     /* Add it to our list */
     LIST_INSERT_HEAD(&fat_fses, mnt, entry);
 
     /* Register with the VFS */
     if(nmmgr_handler_add(&vfsh->nmmgr)) {
         printf("fs_fat: couldn't add fs to nmmgr\n");
+        LIST_REMOVE(mnt, entry);
+        mutex_unlock(&fat_mutex);
         free(vfsh);
+        rwsem_destroy(&mnt->ns_lock);
         free(mnt);
+        free(fs->mount);
         fat_fs_shutdown(fs);
+        return -1;
+    }
+
+    mutex_unlock(&fat_mutex);
+
+    return 0;
+}
+
+int fs_fat_set_discard(kos_blockdev_t *dev, fs_fat_discard_fn fn) {
+    int i, slot = -1;
+
+    if(!initted || !dev) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&fat_mutex);
+
+    for(i = 0; i < FAT_MAX_DISCARD; i++) {
+        if(fat_discards[i].dev == dev || (slot < 0 && fat_discards[i].dev == NULL && fn))
+            slot = i;
+        if(fat_discards[i].dev == dev)
+            break;
+    }
+
+    if(slot < 0) {
         mutex_unlock(&fat_mutex);
+        if(!fn)
+            return 0;
+        errno = ENOMEM;
         return -1;
     }
 
+    fat_discards[slot].dev = fn ? dev : NULL;
+    fat_discards[slot].fn = fn;
+
     mutex_unlock(&fat_mutex);
 
     return 0;
@@ -904,7 +2198,7 @@ int fs_fat_mount(const char *mp, kos_blockdev_t *dev, uint32_t flags) {
 int fs_fat_unmount(const char *mp) {
     fs_fat_fs_t *i;
 	int j;
-    int found = 0, rv = 0;
+    int found = 0;
 
     /* Find the fs in question */
     mutex_lock(&fat_mutex);
@@ -916,43 +2210,132 @@ int fs_fat_unmount(const char *mp) {
         }
     }
 
-    if(found) {
-		
-		free(i->fs->mount); /* Free str mem */
-		
-		/* Handle dealloc all the open files */
-		for(j=0;j<MAX_FAT_FILES; j++)
-		{
-			if(fh[j].used == 1)
-			{
-				fh[j].used = 0;
-				fh[j].ptr = 0;
-				fh[j].mode = 0;
-
-				delete_struct_entry(fh[j].node);
-				fh[j].node = NULL;
-				delete_struct_entry(fh[j].dir);
-				fh[j].dir = NULL;
-			}
-		}
-		
-        LIST_REMOVE(i, entry);
+    if(!found) {
+        mutex_unlock(&fat_mutex);
+        errno = ENOENT;
+        return -1;
+    }
 
-        /* XXXX: We should probably do something with open files... */
-        nmmgr_handler_remove(&i->vfsh->nmmgr);
-        free(i->vfsh);
-        free(i);
+    /* Cant pull the mount out from under a call that is using one of its files */
+    for(j=0;j<fh_chunks * FAT_HANDLE_CHUNK; j++)
+    {
+        if(FH(j)->used == 1 && FH(j)->mnt == i && FH(j)->refs > 0)
+        {
+            mutex_unlock(&fat_mutex);
+            errno = EBUSY;
+            return -1;
+        }
     }
-    else {
-        errno = ENOENT;
-        rv = -1;
+
+    /* Handle dealloc the open files of this mount */
+    for(j=0;j<fh_chunks * FAT_HANDLE_CHUNK; j++)
+    {
+        if(FH(j)->used == 1 && FH(j)->mnt == i)
+            fat_release_handle(FH(j));
     }
 
+    /* Opens still in progress wont get a handle anymore */
+    i->unmounting = 1;
+
+    LIST_REMOVE(i, entry);
+    nmmgr_handler_remove(&i->vfsh->nmmgr);
+
     mutex_unlock(&fat_mutex);
-	
+
+    /* Wait for calls that already got in(open, rename, etc) to finish */
+    rwsem_write_lock(&i->ns_lock);
+    rwsem_write_unlock(&i->ns_lock);
+    rwsem_destroy(&i->ns_lock);
+
+    free(i->fs->mount); /* Free str mem */
+    fat_fs_shutdown(i->fs);
+    free(i->vfsh);
+    free(i);
+
+    return 0;
+}
+
+/* Does anything but 'pinned' have a handle on mnt? */
+static int fat_mount_busy(fs_fat_fs_t *mnt, fat_handle_t *pinned) {
+    int j, rv = 0;
+
+    mutex_lock(&fat_mutex);
+
+    for(j = 0; j < fh_chunks * FAT_HANDLE_CHUNK && !rv; j++) {
+        if(FH(j)->used && FH(j)->mnt == mnt && !FH(j)->closing && FH(j) != pinned)
+            rv = 1;
+    }
+
+    mutex_unlock(&fat_mutex);
+
+    return rv;
+}
+
+int fs_fat_check(const char *mp, fs_fat_check_t *c) {
+    fs_fat_fs_t *mnt;
+    fat_handle_t *pinned;
+    int rv;
+
+    if(!c) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(!(mnt = fat_pin_mount(mp, &pinned)))
+        return -1;
+
+    if(c->fix && !(mnt->mount_flags & FS_FAT_MOUNT_READWRITE)) {
+        fat_put_handle(pinned);
+        errno = EROFS;
+        return -1;
+    }
+
+    /* Nothing else changes the FAT or any directory until we are done */
+    rwsem_write_lock(&mnt->ns_lock);
+
+    /* Fixes would go behind the back of open files */
+    if(c->fix && fat_mount_busy(mnt, pinned)) {
+        rwsem_write_unlock(&mnt->ns_lock);
+        fat_put_handle(pinned);
+        errno = EBUSY;
+        return -1;
+    }
+
+    rv = fat_check(mnt->fs, c);
+
+    rwsem_write_unlock(&mnt->ns_lock);
+    fat_put_handle(pinned);
+
     return rv;
 }
 
+int fs_fat_format(kos_blockdev_t *dev, fs_fat_format_t *fmt) {
+    fs_fat_format_t defaults;
+    fs_fat_fs_t *i;
+
+    if(!fmt) {
+        memset(&defaults, 0, sizeof(defaults));
+        fmt = &defaults;
+    }
+
+    /* Not while a mount is using it */
+    if(initted) {
+        mutex_lock(&fat_mutex);
+
+        LIST_FOREACH(i, &fat_fses, entry) {
+            if(i->fs->dev == dev) {
+                mutex_unlock(&fat_mutex);
+                errno = EBUSY;
+                return -1;
+            }
+        }
+
+        mutex_unlock(&fat_mutex);
+    }
+
+    return fat_format(dev, fmt);
+}
+
 int fs_fat_init(void) {
     if(initted)
         return 0;
@@ -960,11 +2343,22 @@ int fs_fat_init(void) {
 	/* Init our list of mounted entries */	
     LIST_INIT(&fat_fses);
 	
-	/* Reset fd's */
-	memset(fh, 0, sizeof(fh));
+	/* Reset fd's. The table grows on the first open */
+	fh_hot = NULL;
+	fh_cold = NULL;
+	fh_chunks = 0;
+	fh_free = -1;
+	memset(open_nodes, 0, sizeof(open_nodes));
+	memset(fat_discards, 0, sizeof(fat_discards));
 	
 	/* Init thread mutexes */
     mutex_init(&fat_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&aio_mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&aio_work);
+    cond_init(&aio_done);
+    aio_head = aio_tail = NULL;
+    aio_running = 0;
+    aio_quit = 0;
 	
     initted = 1;
 
@@ -973,10 +2367,25 @@ int fs_fat_init(void) {
 
 int fs_fat_shutdown(void) {
     fs_fat_fs_t *i, *next;
+    int j;
 
     if(!initted)
         return 0;
 
+    /* Let the async workers finish what is queued and stop them */
+    mutex_lock(&aio_mutex);
+    aio_quit = 1;
+    cond_broadcast(&aio_work);
+    mutex_unlock(&aio_mutex);
+
+    for(j = 0; j < aio_running; j++)
+        thd_join(aio_threads[j], NULL);
+
+    aio_running = 0;
+    cond_destroy(&aio_work);
+    cond_destroy(&aio_done);
+    mutex_destroy(&aio_mutex);
+
     /* Clean up the mounted filesystems */
     i = LIST_FIRST(&fat_fses);
 	
@@ -985,12 +2394,34 @@ int fs_fat_shutdown(void) {
 
         /* XXXX: We should probably do something with open files... */
         nmmgr_handler_remove(&i->vfsh->nmmgr);
+        rwsem_destroy(&i->ns_lock);
+        free(i->fs->mount);
+        fat_fs_shutdown(i->fs);
         free(i->vfsh);
         free(i);
 
         i = next;
     }
 
+    for(j = 0; j < fh_chunks * FAT_HANDLE_CHUNK; j++) {
+        if(FH(j)->used)
+            fat_release_handle(FH(j));
+
+        mutex_destroy(&FH(j)->lock);
+    }
+
+    for(j = 0; j < fh_chunks; j++) {
+        free(fh_hot[j]);
+        free(fh_cold[j]);
+    }
+
+    free(fh_hot);
+    free(fh_cold);
+    fh_hot = NULL;
+    fh_cold = NULL;
+    fh_chunks = 0;
+    fh_free = -1;
+
     mutex_destroy(&fat_mutex);
     initted = 0;
 
@@ -0,0 +1,480 @@
+/* libfatfs host build
+
+   fat_bench.c
+   Data path benchmark. Creates FAT16/FAT32 images with different sizes and cluster sizes(or uses an
+   existing image) and measures sequential read/write throughput, small append rate, random read IOPS
+   and seek + read latency for a range of request sizes. One result per line as CSV or JSON so runs
+   can be diffed/plotted. With -s the volume sits on a simulated SD card(see fat_sdsim.h) and all times
+   are the card's virtual time instead of the wall clock. -a mounts with the card's AU size so clusters are
+   allocated AU by AU(see fs_fat_mount_ex()).
+
+   make -f Makefile.host bench
+   ./fat_bench [-f csv|json] [-m file_mb] [-d dir] [-i image] [-o out] [-s params] [-a] [-q] [-k]
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kos/fs.h>
+#include <fat_image.h>
+#include <fat_sdsim.h>
+
+#include "include/fs_fat.h"
+
+#define MOUNT       "/bench"
+#define SEQ_FILE    MOUNT "/seq.bin"
+#define APPEND_FILE MOUNT "/append.log"
+
+#define MAX_REQ     (256 * 1024)
+#define LAT_OPS     2000   /* Reads timed one by one for the latency numbers */
+#define IOPS_OPS    4000
+#define APPEND_OPS  4000
+#define APPEND_SIZE 64
+
+typedef struct bench_config {
+    const char *name;
+    uint32_t size_mb;
+    int fat32;
+    int spc;                /* Sectors per cluster */
+} bench_config_t;
+
+/* FAT16 needs <= 65524 clusters, FAT32 should have more than that to be one */
+static const bench_config_t configs[] = {
+    { "fat16-64m-2k",   64,   0, 4   },
+    { "fat16-256m-8k",  256,  0, 16  },
+    { "fat16-1g-32k",   1024, 0, 64  },
+    { "fat32-256m-512", 256,  1, 1   },
+    { "fat32-1g-4k",    1024, 1, 8   },
+    { "fat32-2g-32k",   2048, 1, 64  },
+};
+
+#define NUM_CONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+static const size_t req_sizes[] = { 512, 4096, 32768, 262144 };
+
+#define NUM_REQ_SIZES (sizeof(req_sizes) / sizeof(req_sizes[0]))
+
+static FILE *out;
+static int json;
+static unsigned char *buf;
+static fat_sdsim_params_t sim_params;
+static int au_alloc;
+static kos_blockdev_t *sim;     /* The simulated card while a volume is being benchmarked with -s */
+static uint32_t rng = 2463534242u;
+
+static uint32_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    if(sim)
+        return fat_sdsim_elapsed_us(sim) / 1e6;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void report_header(void) {
+    if(!json)
+        fprintf(out, "config,fat,size_mb,cluster_bytes,test,req_bytes,ops,bytes,seconds,mb_per_s,ops_per_s,lat_avg_us,lat_p50_us,lat_p99_us\n");
+}
+
+/* lat can be NULL when single operations weren't timed */
+static void report(const char *config, int fat32, uint32_t size_mb, int cluster, const char *test, size_t req,
+                   long ops, double bytes, double secs, double *lat, int nlat) {
+    double avg = 0, p50 = 0, p99 = 0;
+    int fat = (fat32 < 0) ? 0 : (fat32 ? 32 : 16);   /* 0 - existing image, type not checked */
+    int i;
+
+    if(lat && nlat > 0) {
+        for(i = 0; i < nlat; i++)
+            avg += lat[i];
+
+        avg = avg / nlat * 1e6;
+        qsort(lat, nlat, sizeof(double), cmp_double);
+        p50 = lat[nlat / 2] * 1e6;
+        p99 = lat[(nlat * 99) / 100] * 1e6;
+    }
+
+    if(json)
+        fprintf(out, "{\"config\":\"%s\",\"fat\":%d,\"size_mb\":%u,\"cluster_bytes\":%d,\"test\":\"%s\",\"req_bytes\":%lu,"
+                "\"ops\":%ld,\"bytes\":%.0f,\"seconds\":%.6f,\"mb_per_s\":%.2f,\"ops_per_s\":%.1f,"
+                "\"lat_avg_us\":%.2f,\"lat_p50_us\":%.2f,\"lat_p99_us\":%.2f}\n",
+                config, fat, size_mb, cluster, test, (unsigned long)req, ops, bytes, secs,
+                bytes / secs / (1024.0 * 1024.0), ops / secs, avg, p50, p99);
+    else
+        fprintf(out, "%s,%d,%u,%d,%s,%lu,%ld,%.0f,%.6f,%.2f,%.1f,%.2f,%.2f,%.2f\n",
+                config, fat, size_mb, cluster, test, (unsigned long)req, ops, bytes, secs,
+                bytes / secs / (1024.0 * 1024.0), ops / secs, avg, p50, p99);
+
+    fflush(out);
+}
+
+/* Write file_bytes to SEQ_FILE in req sized pieces. Each run starts from an empty file */
+static double bench_seq_write(size_t req, size_t file_bytes) {
+    size_t done;
+    double t;
+    file_t fd;
+
+    fs_unlink(SEQ_FILE);
+
+    if((fd = fs_open(SEQ_FILE, O_WRONLY | O_CREAT | O_TRUNC)) < 0)
+        return -1;
+
+    t = now();
+
+    for(done = 0; done < file_bytes; done += req) {
+        if(fs_write(fd, buf, req) != (ssize_t)req) {
+            fs_close(fd);
+            return -1;
+        }
+    }
+
+    t = now() - t;
+    fs_close(fd);
+
+    return t;
+}
+
+static double bench_seq_read(size_t req, size_t file_bytes) {
+    size_t done;
+    double t;
+    file_t fd;
+
+    if((fd = fs_open(SEQ_FILE, O_RDONLY)) < 0)
+        return -1;
+
+    t = now();
+
+    for(done = 0; done < file_bytes; done += req) {
+        if(fs_read(fd, buf, req) != (ssize_t)req) {
+            fs_close(fd);
+            return -1;
+        }
+    }
+
+    t = now() - t;
+    fs_close(fd);
+
+    return t;
+}
+
+/* Like a log: open once with O_APPEND and add small records */
+static double bench_append(int ops) {
+    double t;
+    file_t fd;
+    int i;
+
+    fs_unlink(APPEND_FILE);
+
+    if((fd = fs_open(APPEND_FILE, O_WRONLY | O_CREAT | O_APPEND)) < 0)
+        return -1;
+
+    t = now();
+
+    for(i = 0; i < ops; i++) {
+        if(fs_write(fd, buf, APPEND_SIZE) != APPEND_SIZE) {
+            fs_close(fd);
+            return -1;
+        }
+    }
+
+    t = now() - t;
+    fs_close(fd);
+
+    return t;
+}
+
+/* req sized reads at random req aligned offsets with fs_fat_pread() */
+static double bench_random_read(size_t req, size_t file_bytes, int ops) {
+    size_t slots = file_bytes / req;
+    double t;
+    file_t fd;
+    int i;
+
+    if((fd = fs_open(SEQ_FILE, O_RDONLY)) < 0)
+        return -1;
+
+    t = now();
+
+    for(i = 0; i < ops; i++) {
+        if(fs_fat_pread(fd, buf, req, (off_t)(xorshift() % slots) * req) != (ssize_t)req) {
+            fs_close(fd);
+            return -1;
+        }
+    }
+
+    t = now() - t;
+    fs_close(fd);
+
+    return t;
+}
+
+/* fs_seek() to a random(unaligned) offset then fs_read(). Every pair is timed */
+static double bench_seek_read(size_t req, size_t file_bytes, double *lat, int ops) {
+    double t, total = 0;
+    file_t fd;
+    int i;
+
+    if((fd = fs_open(SEQ_FILE, O_RDONLY)) < 0)
+        return -1;
+
+    for(i = 0; i < ops; i++) {
+        off_t pos = xorshift() % (file_bytes - req);
+
+        t = now();
+
+        if(fs_seek(fd, pos, SEEK_SET) != pos || fs_read(fd, buf, req) != (ssize_t)req) {
+            fs_close(fd);
+            return -1;
+        }
+
+        lat[i] = now() - t;
+        total += lat[i];
+    }
+
+    fs_close(fd);
+
+    return total;
+}
+
+static void close_volume(kos_blockdev_t *dev) {
+    fs_fat_unmount(MOUNT);
+
+    if(sim) {
+        fat_sdsim_destroy(sim);
+        sim = NULL;
+    }
+
+    fat_image_close(dev);
+}
+
+static int run_volume(const char *name, const char *image, int fat32, uint32_t size_mb, int cluster, size_t file_bytes,
+                      int quick, int simulate) {
+    static kos_blockdev_t card;
+    kos_blockdev_t dev;
+    fs_fat_mount_opts_t opts = { 0, 0 };
+    double *lat;
+    double t;
+    size_t r;
+    int ops;
+
+    if(fat_image_open(&dev, image, 1) < 0) {
+        fprintf(stderr, "fat_bench: can't open %s: %s\n", image, strerror(errno));
+        return -1;
+    }
+
+    if(simulate) {
+        if(fat_sdsim_create(&card, &dev, &sim_params) < 0) {
+            fprintf(stderr, "fat_bench: can't simulate a card: %s\n", strerror(errno));
+            fat_image_close(&dev);
+            return -1;
+        }
+
+        sim = &card;
+    }
+
+    opts.au_bytes = au_alloc ? sim_params.au_sectors * 512 : 0;
+
+    if(fs_fat_mount_ex(MOUNT, sim ? sim : &dev, FS_FAT_MOUNT_READWRITE, &opts) < 0) {
+        fprintf(stderr, "fat_bench: can't mount %s\n", image);
+        close_volume(&dev);
+        return -1;
+    }
+
+    if(!(lat = (double *)malloc(sizeof(double) * LAT_OPS))) {
+        close_volume(&dev);
+        return -1;
+    }
+
+    for(r = 0; r < NUM_REQ_SIZES; r++) {
+        size_t req = req_sizes[r];
+
+        if(quick && req == 512)
+            continue;
+
+        if((t = bench_seq_write(req, file_bytes)) < 0)
+            goto fail;
+
+        report(name, fat32, size_mb, cluster, "seq_write", req, (long)(file_bytes / req), file_bytes, t, NULL, 0);
+
+        if((t = bench_seq_read(req, file_bytes)) < 0)
+            goto fail;
+
+        report(name, fat32, size_mb, cluster, "seq_read", req, (long)(file_bytes / req), file_bytes, t, NULL, 0);
+    }
+
+    ops = quick ? APPEND_OPS / 4 : APPEND_OPS;
+
+    if((t = bench_append(ops)) < 0)
+        goto fail;
+
+    report(name, fat32, size_mb, cluster, "append", APPEND_SIZE, ops, (double)ops * APPEND_SIZE, t, NULL, 0);
+
+    /* The read tests below use whatever the last sequential write left */
+    for(r = 0; r < NUM_REQ_SIZES; r++) {
+        size_t req = req_sizes[r];
+
+        if(req > 32768)
+            continue;
+
+        ops = quick ? IOPS_OPS / 4 : IOPS_OPS;
+
+        if((t = bench_random_read(req, file_bytes, ops)) < 0)
+            goto fail;
+
+        report(name, fat32, size_mb, cluster, "random_read", req, ops, (double)ops * req, t, NULL, 0);
+
+        ops = quick ? LAT_OPS / 4 : LAT_OPS;
+
+        if((t = bench_seek_read(req, file_bytes, lat, ops)) < 0)
+            goto fail;
+
+        report(name, fat32, size_mb, cluster, "seek_read", req, ops, (double)ops * req, t, lat, ops);
+    }
+
+    free(lat);
+    close_volume(&dev);
+
+    return 0;
+
+fail:
+    fprintf(stderr, "fat_bench: %s failed: %s\n", name, strerror(errno));
+    free(lat);
+    close_volume(&dev);
+
+    return -1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: fat_bench [-f csv|json] [-m file_mb] [-d dir] [-i image] [-o out] [-s params] [-a] [-q] [-k]\n"
+                    "  -f  output format(default csv)\n"
+                    "  -m  size of the file the sequential/random tests use in MB(default 16)\n"
+                    "  -d  where to create the images(default /tmp)\n"
+                    "  -i  benchmark this existing image(mkfs.fat, SD card dump) instead. Files are created in its root\n"
+                    "  -o  write the results to out instead of stdout\n"
+                    "  -s  time a simulated SD card. params is \"default\" or name=value,... (see fat_sdsim.h)\n"
+                    "  -a  allocate clusters by the AU size of the card(au_sectors of -s)\n"
+                    "  -q  quick run: fewer operations, no 512 byte sequential tests\n"
+                    "  -k  keep the created images\n");
+}
+
+int main(int argc, char **argv) {
+    const char *dir = "/tmp", *image = NULL;
+    char path[1024];
+    size_t file_bytes = 16 * 1024 * 1024;
+    int quick = 0, keep = 0, simulate = 0, rv = 0, c;
+    size_t i;
+
+    out = stdout;
+
+    fat_sdsim_default_params(&sim_params);
+
+    while((c = getopt(argc, argv, "f:m:d:i:o:s:aqkh")) != -1) {
+        switch(c) {
+            case 'f':
+                json = !strcmp(optarg, "json");
+                break;
+            case 'm':
+                file_bytes = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'i':
+                image = optarg;
+                break;
+            case 'o':
+                if(!(out = fopen(optarg, "w"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                if(fat_sdsim_parse_params(&sim_params, optarg) < 0) {
+                    fprintf(stderr, "fat_bench: bad card parameters %s\n", optarg);
+                    return 1;
+                }
+
+                simulate = 1;
+                break;
+            case 'a':
+                au_alloc = 1;
+                break;
+            case 'q':
+                quick = 1;
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(file_bytes < MAX_REQ) {
+        usage();
+        return 1;
+    }
+
+    if(!(buf = (unsigned char *)malloc(MAX_REQ)))
+        return 1;
+
+    for(i = 0; i < MAX_REQ; i++)
+        buf[i] = (unsigned char)(i * 31 + 7);
+
+    fs_fat_init();
+    report_header();
+
+    if(image) {
+        rv = run_volume(image, image, -1, 0, 0, file_bytes, quick, simulate);
+    }
+    else {
+        for(i = 0; i < NUM_CONFIGS; i++) {
+            const bench_config_t *cfg = &configs[i];
+
+            /* The file has to fit with room to spare */
+            if((uint64_t)cfg->size_mb * 1024 * 1024 / 2 < file_bytes)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/fat_bench-%s.img", dir, cfg->name);
+
+            if(fat_image_create(path, cfg->size_mb, cfg->fat32, cfg->spc) < 0) {
+                fprintf(stderr, "fat_bench: can't create %s: %s\n", path, strerror(errno));
+                rv = -1;
+                continue;
+            }
+
+            if(run_volume(cfg->name, path, cfg->fat32, cfg->size_mb, cfg->spc * 512, file_bytes, quick, simulate) < 0)
+                rv = -1;
+
+            if(!keep)
+                unlink(path);
+        }
+    }
+
+    fs_fat_shutdown();
+    free(buf);
+
+    if(out != stdout)
+        fclose(out);
+
+    return rv ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+/* libfatfs host build
+
+   fat_defrag.c
+   Defragments a FAT image(or SD card dump) with fs_fat_defrag(), the same online defragmenter a game can
+   run on a mounted card between levels. Moves the most fragmented files first, a few at a time, until
+   every file is in one piece or there is no free run left big enough for the rest. Ctrl-C stops it
+   between two transfers and leaves the image consistent. -d punches holes in the image where the files were.
+
+   make -f Makefile.host bench
+   ./fat_defrag [-n files] [-m clusters] [-e min_extents] [-d] [-q] image
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <kos/fs.h>
+#include <fat_image.h>
+
+#include "include/fs_fat.h"
+
+#define MOUNT "/defrag"
+
+static volatile int cancel;
+
+static void on_signal(int sig) {
+    (void)sig;
+    cancel = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: fat_defrag [-n files] [-m clusters] [-e min_extents] [-d] [-q] image\n"
+                    "  -n  files moved per step(default 16)\n"
+                    "  -m  clusters moved per step(default 4096, 0 for no limit)\n"
+                    "  -e  only move files with at least this many extents(default 2)\n"
+                    "  -d  discard the clusters files are moved out of\n"
+                    "  -q  don't print every step\n");
+}
+
+int main(int argc, char **argv) {
+    kos_blockdev_t dev;
+    fs_fat_defrag_t d;
+    uint32_t max_files = 16, max_clusters = 4096, min_extents = 2;
+    uint32_t before = 0, extents = 0, moved = 0, clusters = 0, step = 0;
+    uint32_t flags = FS_FAT_MOUNT_READWRITE;
+    fat_image_counters_t ic;
+    int quiet = 0, c, left = -1;
+
+    while((c = getopt(argc, argv, "n:m:e:dqh")) != -1) {
+        switch(c) {
+            case 'n':
+                max_files = (uint32_t)atoi(optarg);
+                break;
+            case 'm':
+                max_clusters = (uint32_t)atoi(optarg);
+                break;
+            case 'e':
+                min_extents = (uint32_t)atoi(optarg);
+                break;
+            case 'd':
+                flags |= FS_FAT_MOUNT_DISCARD;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(argc - optind != 1) {
+        usage();
+        return 1;
+    }
+
+    if(fat_image_open(&dev, argv[optind], 1) < 0) {
+        fprintf(stderr, "fat_defrag: can't open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    fs_fat_init();
+    fs_fat_set_discard(&dev, fat_image_discard);
+
+    if(fs_fat_mount(MOUNT, &dev, flags) < 0) {
+        fprintf(stderr, "fat_defrag: %s isn't a FAT16/FAT32 volume\n", argv[optind]);
+        fs_fat_shutdown();
+        fat_image_close(&dev);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+
+    /* One step at a time, like a game would between levels. Stop when a step gets nothing done */
+    for(;;) {
+        memset(&d, 0, sizeof(d));
+        d.max_files = max_files;
+        d.max_clusters = max_clusters;
+        d.min_extents = min_extents;
+        d.cancel = &cancel;
+
+        if((left = fs_fat_defrag(MOUNT, &d)) < 0) {
+            if(errno == ECANCELED)
+                fprintf(stderr, "fat_defrag: stopped\n");
+            else
+                fprintf(stderr, "fat_defrag: %s\n", strerror(errno));
+
+            moved += d.files_moved;
+            clusters += d.clusters_moved;
+            break;
+        }
+
+        if(step++ == 0) {
+            before = d.files_fragmented;
+            extents = d.extents_before;
+        }
+
+        moved += d.files_moved;
+        clusters += d.clusters_moved;
+
+        if(!quiet)
+            printf("step %u: %u fragmented, %u moved(%u clusters), %u skipped\n", step, d.files_fragmented,
+                   d.files_moved, d.clusters_moved, d.files_skipped);
+
+        if(left == 0 || d.files_moved == 0)
+            break;
+    }
+
+    printf("fragmented files: %u(%u extents) before, %d after\n", before, extents, left);
+    printf("moved:            %u files, %u clusters\n", moved, clusters);
+
+    if(flags & FS_FAT_MOUNT_DISCARD) {
+        fat_image_get_counters(&dev, &ic);
+        printf("discarded:        %llu KB in %llu requests\n", (unsigned long long)ic.blocks_discarded / 2,
+               (unsigned long long)ic.discards);
+    }
+
+    fs_fat_unmount(MOUNT);
+    fs_fat_shutdown();
+    fat_image_close(&dev);
+
+    return left < 0 ? 1 : 0;
+}
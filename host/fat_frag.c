@@ -0,0 +1,268 @@
+/* libfatfs host build
+
+   fat_frag.c
+   Fragmentation report of a FAT image(or SD card dump). Loads the FAT in one go, walks every file and
+   folder and reports how many extents(runs of clusters next to each other) they are made of, how
+   fragmented the free space is and which files are the worst. The number of device commands and seeks
+   reading each file from start to end would take is estimated too, so a card that has become too
+   fragmented to stream from shows up before it is noticed in a game.
+
+   make -f Makefile.host bench
+   ./fat_frag [-n worst] [-r request_kb] [-c files.csv] image
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fat_image.h>
+
+#include "fatfs.h"
+#include "fat_defs.h"
+#include "fat_scan.h"
+
+#define FREE_BUCKETS 24    /* Free runs of 1, 2-3, 4-7, ... clusters */
+
+typedef struct frag_file {
+    char *path;
+    int dir;
+    uint32_t size;
+    uint32_t clusters;
+    uint32_t extents;
+    uint32_t commands;      /* Requests reading it from start to end takes */
+    uint32_t ideal;         /* Same if it were in one piece */
+} frag_file_t;
+
+typedef struct frag_scan {
+    fat_table_t table;
+    uint32_t cluster_bytes;
+    uint32_t req_bytes;     /* Size of the reads the estimates are for */
+    frag_file_t *files;
+    size_t num, max;
+} frag_scan_t;
+
+static uint32_t div_up(uint64_t a, uint32_t b) {
+    return (uint32_t)((a + b - 1) / b);
+}
+
+static int add_file(fatfs_t *fat, node_entry_t *node, const char *path, void *arg) {
+    frag_scan_t *s = (frag_scan_t *)arg;
+    frag_file_t *f;
+
+    if(s->num == s->max) {
+        s->max = s->max ? s->max * 2 : 1024;
+
+        if(!(f = (frag_file_t *)realloc(s->files, s->max * sizeof(frag_file_t))))
+            return -1;
+
+        s->files = f;
+    }
+
+    f = &s->files[s->num];
+
+    if(!(f->path = strdup(path)))
+        return -1;
+
+    f->dir = (node->Attr & DIRECTORY) != 0;
+    f->size = node->FileSize;
+    f->extents = fat_chain_extents(&s->table, node->StartCluster, &f->clusters);
+
+    /* Folders are read a cluster at a time. Files in requests of req_bytes, and every extent boundary can
+       split one of those in two */
+    if(f->dir) {
+        f->ideal = f->clusters;
+        f->commands = f->clusters;
+    }
+    else {
+        f->ideal = div_up(f->size, s->req_bytes);
+        f->commands = f->ideal + (f->extents > 1 ? f->extents - 1 : 0);
+    }
+
+    s->num++;
+
+    return 0;
+}
+
+/* Same as fs_fat_unmount() does */
+static void close_volume(fatfs_t *fat, kos_blockdev_t *dev) {
+    free(fat->mount);
+    fat_fs_shutdown(fat);
+    fat_image_close(dev);
+}
+
+static int cmp_extents(const void *a, const void *b) {
+    const frag_file_t *x = (const frag_file_t *)a, *y = (const frag_file_t *)b;
+
+    if(x->extents != y->extents)
+        return (x->extents < y->extents) - (x->extents > y->extents);
+
+    return (x->clusters < y->clusters) - (x->clusters > y->clusters);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: fat_frag [-n worst] [-r request_kb] [-c files.csv] image\n"
+                    "  -n  list this many of the most fragmented files(default 10)\n"
+                    "  -r  size of the reads the command estimates are for in KB(default 64)\n"
+                    "  -c  write every file/folder to files.csv\n");
+}
+
+int main(int argc, char **argv) {
+    kos_blockdev_t dev;
+    fatfs_t *fat;
+    frag_scan_t s;
+    const char *csv = NULL;
+    FILE *fp;
+    int worst = 10, c;
+    size_t i;
+    uint32_t clust, run, free_clusters = 0, free_runs = 0, largest = 0, b;
+    uint64_t free_hist[FREE_BUCKETS][2];
+    uint64_t files = 0, dirs = 0, fragmented = 0, extents = 0, used = 0, commands = 0, ideal = 0, seeks = 0;
+
+    memset(&s, 0, sizeof(s));
+    memset(free_hist, 0, sizeof(free_hist));
+    s.req_bytes = 64 * 1024;
+
+    while((c = getopt(argc, argv, "n:r:c:h")) != -1) {
+        switch(c) {
+            case 'n':
+                worst = atoi(optarg);
+                break;
+            case 'r':
+                s.req_bytes = (uint32_t)atoi(optarg) * 1024;
+                break;
+            case 'c':
+                csv = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(argc - optind != 1 || s.req_bytes == 0) {
+        usage();
+        return 1;
+    }
+
+    if(fat_image_open(&dev, argv[optind], 0) < 0) {
+        fprintf(stderr, "fat_frag: can't open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if(!(fat = fat_fs_init("/frag", &dev))) {
+        fprintf(stderr, "fat_frag: %s isn't a FAT16/FAT32 volume\n", argv[optind]);
+        fat_image_close(&dev);
+        return 1;
+    }
+
+    s.cluster_bytes = fat->boot_sector.sectors_per_cluster * fat->boot_sector.bytes_per_sector;
+
+    if(fat_table_load(fat, &s.table) < 0 || fat_walk_tree(fat, add_file, &s) != 0) {
+        fprintf(stderr, "fat_frag: can't read %s: %s\n", argv[optind], strerror(errno));
+        fat_table_free(&s.table);
+        close_volume(fat, &dev);
+        return 1;
+    }
+
+    /* Free space: runs of free clusters */
+    for(clust = 2; clust < s.table.clusters + 2; clust += run) {
+        for(run = 0; clust + run < s.table.clusters + 2 && s.table.next[clust + run] == 0; run++)
+            ;
+
+        if(run == 0) {
+            run = 1;
+            continue;
+        }
+
+        for(b = 0; b < FREE_BUCKETS - 1 && (run >> (b + 1)); b++)
+            ;
+
+        free_hist[b][0]++;
+        free_hist[b][1] += run;
+        free_runs++;
+        free_clusters += run;
+
+        if(run > largest)
+            largest = run;
+    }
+
+    for(i = 0; i < s.num; i++) {
+        frag_file_t *f = &s.files[i];
+
+        if(f->dir) {
+            dirs++;
+        }
+        else {
+            files++;
+            commands += f->commands;
+            ideal += f->ideal;
+        }
+
+        fragmented += (f->extents > 1);
+        extents += f->extents;
+        used += f->clusters;
+        seeks += f->extents > 1 ? f->extents - 1 : 0;
+    }
+
+    printf("Volume: FAT%d, %u byte clusters, %u clusters, %u free(%.1f%%)\n", fat->fat_type == FAT16 ? 16 : 32,
+           s.cluster_bytes, s.table.clusters, free_clusters, s.table.clusters ? 100.0 * free_clusters / s.table.clusters : 0);
+    printf("Files: %llu, folders: %llu, fragmented: %llu(%.1f%%)\n", (unsigned long long)files, (unsigned long long)dirs,
+           (unsigned long long)fragmented, s.num ? 100.0 * fragmented / s.num : 0);
+    printf("Extents: %llu, %.2f per file/folder, %.1f clusters(%.1f KB) long on average\n", (unsigned long long)extents,
+           s.num ? (double)extents / s.num : 0, extents ? (double)used / extents : 0,
+           extents ? (double)used / extents * s.cluster_bytes / 1024 : 0);
+    printf("Reading every file in %u KB requests: %llu commands(%llu in one piece, %+.1f%%), %llu seeks\n",
+           s.req_bytes / 1024, (unsigned long long)commands, (unsigned long long)ideal,
+           ideal ? 100.0 * ((double)commands - ideal) / ideal : 0, (unsigned long long)seeks);
+    printf("Free space: %u runs, largest %u clusters(%.1f MB), %.1f%% fragmented\n", free_runs, largest,
+           (double)largest * s.cluster_bytes / (1024 * 1024), free_clusters ? 100.0 * (1 - (double)largest / free_clusters) : 0);
+
+    printf("\nFree runs(clusters)        runs    clusters\n");
+
+    for(b = 0; b < FREE_BUCKETS; b++) {
+        if(!free_hist[b][0])
+            continue;
+
+        if(b == FREE_BUCKETS - 1)
+            printf("  %10u+          %8llu  %10llu\n", 1u << b, (unsigned long long)free_hist[b][0], (unsigned long long)free_hist[b][1]);
+        else
+            printf("  %10u - %-10u %8llu  %10llu\n", 1u << b, (2u << b) - 1, (unsigned long long)free_hist[b][0],
+                   (unsigned long long)free_hist[b][1]);
+    }
+
+    if(csv) {
+        if(!(fp = fopen(csv, "w"))) {
+            perror(csv);
+        }
+        else {
+            fprintf(fp, "path,type,size,clusters,extents,commands,ideal_commands\n");
+
+            for(i = 0; i < s.num; i++)
+                fprintf(fp, "\"%s\",%s,%u,%u,%u,%u,%u\n", s.files[i].path, s.files[i].dir ? "dir" : "file",
+                        s.files[i].size, s.files[i].clusters, s.files[i].extents, s.files[i].commands, s.files[i].ideal);
+
+            fclose(fp);
+        }
+    }
+
+    qsort(s.files, s.num, sizeof(frag_file_t), cmp_extents);
+
+    if(worst > 0 && s.num > 0 && s.files[0].extents > 1) {
+        printf("\nMost fragmented    extents   clusters   commands(ideal)  path\n");
+
+        for(i = 0; i < s.num && i < (size_t)worst && s.files[i].extents > 1; i++)
+            printf("                  %8u %10u %10u(%u)  %s%s\n", s.files[i].extents, s.files[i].clusters,
+                   s.files[i].commands, s.files[i].ideal, s.files[i].path, s.files[i].dir ? "/" : "");
+    }
+
+    for(i = 0; i < s.num; i++)
+        free(s.files[i].path);
+
+    free(s.files);
+    fat_table_free(&s.table);
+    close_volume(fat, &dev);
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* libfatfs host build
+
+   fat_fsck.c
+   Consistency check of a FAT image(or SD card dump) with fs_fat_check(). Folders are read by -j threads at
+   the same time, the FAT in big requests. Lists every problem found: broken and cross-linked chains, file
+   sizes that don't match their clusters and lost clusters. -f repairs them, -d also punches holes in the
+   image where the lost clusters were.
+
+   make -f Makefile.host bench
+   ./fat_fsck [-f] [-d] [-j threads] [-q] image
+
+   Exits with 0 if the volume is clean, 1 if problems were found(and fixed with -f) and 2 on errors.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kos/fs.h>
+#include <fat_image.h>
+
+#include "include/fs_fat.h"
+
+#define MOUNT "/fsck"
+
+static void report(const char *path, const char *problem, void *arg) {
+    if(!*(int *)arg)
+        printf("%s: %s\n", path, problem);
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: fat_fsck [-f] [-d] [-j threads] [-q] image\n"
+                    "  -f  fix the problems found\n"
+                    "  -d  discard the lost clusters freed by -f\n"
+                    "  -j  folders read at the same time(default number of CPUs)\n"
+                    "  -q  only print the summary\n");
+}
+
+int main(int argc, char **argv) {
+    kos_blockdev_t dev;
+    fs_fat_check_t c;
+    fat_image_counters_t ic;
+    int quiet = 0, discard = 0, c_opt, rv;
+    double t;
+
+    memset(&c, 0, sizeof(c));
+    c.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    while((c_opt = getopt(argc, argv, "fdj:qh")) != -1) {
+        switch(c_opt) {
+            case 'f':
+                c.fix = 1;
+                break;
+            case 'd':
+                discard = 1;
+                break;
+            case 'j':
+                c.threads = atoi(optarg);
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+
+    if(argc - optind != 1) {
+        usage();
+        return 2;
+    }
+
+    if(fat_image_open(&dev, argv[optind], c.fix) < 0) {
+        fprintf(stderr, "fat_fsck: can't open %s: %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+
+    fs_fat_init();
+    fs_fat_set_discard(&dev, fat_image_discard);
+
+    if(fs_fat_mount(MOUNT, &dev, c.fix ? FS_FAT_MOUNT_READWRITE | (discard ? FS_FAT_MOUNT_DISCARD : 0)
+                                       : FS_FAT_MOUNT_READONLY) < 0) {
+        fprintf(stderr, "fat_fsck: %s isn't a FAT16/FAT32 volume\n", argv[optind]);
+        fs_fat_shutdown();
+        fat_image_close(&dev);
+        return 2;
+    }
+
+    c.report = report;
+    c.arg = &quiet;
+    t = now();
+
+    if((rv = fs_fat_check(MOUNT, &c)) < 0)
+        fprintf(stderr, "fat_fsck: %s\n", strerror(errno));
+    else {
+        printf("%u files, %u folders, %u free clusters, %.2f seconds\n", c.files, c.folders, c.free_clusters, now() - t);
+        printf("%d problems: %u broken chains, %u cross-links, %u wrong sizes, %u lost clusters(%u chains)",
+               rv, c.bad_chains, c.cross_links, c.bad_sizes, c.lost_clusters, c.lost_chains);
+
+        if(c.fix)
+            printf(", %u fixed", c.fixed);
+
+        printf("\n");
+
+        if(c.fix && discard) {
+            fat_image_get_counters(&dev, &ic);
+            printf("discarded %llu KB in %llu requests\n", (unsigned long long)ic.blocks_discarded / 2,
+                   (unsigned long long)ic.discards);
+        }
+    }
+
+    fs_fat_unmount(MOUNT);
+    fs_fat_shutdown();
+    fat_image_close(&dev);
+
+    return rv < 0 ? 2 : rv > 0;
+}
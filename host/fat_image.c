@@ -0,0 +1,318 @@
+/* libfatfs host build
+
+   fat_image.c
+   A kos_blockdev_t that reads and writes a FAT image file with pread()/pwrite(),
+   so a whole image can be mounted with fs_fat_mount() on a workstation.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fat_image.h>
+
+#define IMAGE_BLOCK_SHIFT   9   /* 512 byte blocks, same as an SD card */
+
+typedef struct fat_image {
+    int fd;
+    int writable;
+    uint64_t blocks;
+    fat_image_counters_t counters;   /* Updated atomically, async workers can do I/O at the same time */
+} fat_image_t;
+
+#define COUNT(img, field, n) __atomic_fetch_add(&(img)->counters.field, (n), __ATOMIC_RELAXED)
+
+static int image_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int image_shutdown(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+/* pread()/pwrite() can stop short(signals, huge requests), so keep going until all of it is done */
+static int image_io(fat_image_t *img, uint64_t block, size_t count, void *buf, int write) {
+    size_t left = count << IMAGE_BLOCK_SHIFT;
+    off_t pos = (off_t)(block << IMAGE_BLOCK_SHIFT);
+    unsigned char *p = (unsigned char *)buf;
+    ssize_t n;
+
+    if(block + count > img->blocks) {
+        errno = EIO;
+        return -1;
+    }
+
+    while(left > 0) {
+        n = write ? pwrite(img->fd, p, left, pos) : pread(img->fd, p, left, pos);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n <= 0) {
+            if(n == 0)
+                errno = EIO;
+
+            return -1;
+        }
+
+        p += n;
+        pos += n;
+        left -= (size_t)n;
+    }
+
+    return 0;
+}
+
+static int image_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count, void *buf) {
+    fat_image_t *img = (fat_image_t *)d->dev_data;
+
+    COUNT(img, reads, 1);
+    COUNT(img, blocks_read, count);
+
+    return image_io(img, block, count, buf, 0);
+}
+
+static int image_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count, const void *buf) {
+    fat_image_t *img = (fat_image_t *)d->dev_data;
+
+    if(!img->writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    COUNT(img, writes, 1);
+    COUNT(img, blocks_written, count);
+
+    return image_io(img, block, count, (void *)buf, 1);
+}
+
+static uint64_t image_count_blocks(kos_blockdev_t *d) {
+    return ((fat_image_t *)d->dev_data)->blocks;
+}
+
+static int image_flush(kos_blockdev_t *d) {
+    fat_image_t *img = (fat_image_t *)d->dev_data;
+
+    COUNT(img, flushes, 1);
+
+    return img->writable ? fsync(img->fd) : 0;
+}
+
+int fat_image_discard(kos_blockdev_t *dev, uint64_t block, size_t count) {
+    fat_image_t *img = (fat_image_t *)dev->dev_data;
+
+    if(!img->writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    if(block + count > img->blocks) {
+        errno = EIO;
+        return -1;
+    }
+
+    COUNT(img, discards, 1);
+    COUNT(img, blocks_discarded, count);
+
+    return fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t)(block << IMAGE_BLOCK_SHIFT), (off_t)(count << IMAGE_BLOCK_SHIFT));
+}
+
+int fat_image_open(kos_blockdev_t *dev, const char *path, int writable) {
+    fat_image_t *img;
+    struct stat st;
+
+    if(!(img = (fat_image_t *)malloc(sizeof(fat_image_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if((img->fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0) {
+        free(img);
+        return -1;
+    }
+
+    if(fstat(img->fd, &st) < 0) {
+        close(img->fd);
+        free(img);
+        return -1;
+    }
+
+    img->writable = writable;
+    memset(&img->counters, 0, sizeof(fat_image_counters_t));
+    img->blocks = (uint64_t)st.st_size >> IMAGE_BLOCK_SHIFT;
+
+    memset(dev, 0, sizeof(kos_blockdev_t));
+    dev->dev_data = img;
+    dev->l_block_size = IMAGE_BLOCK_SHIFT;
+    dev->init = image_init;
+    dev->shutdown = image_shutdown;
+    dev->read_blocks = image_read_blocks;
+    dev->write_blocks = image_write_blocks;
+    dev->count_blocks = image_count_blocks;
+    dev->flush = image_flush;
+
+    return 0;
+}
+
+void fat_image_get_counters(kos_blockdev_t *dev, fat_image_counters_t *c) {
+    fat_image_t *img = (fat_image_t *)dev->dev_data;
+
+    c->reads = __atomic_load_n(&img->counters.reads, __ATOMIC_RELAXED);
+    c->writes = __atomic_load_n(&img->counters.writes, __ATOMIC_RELAXED);
+    c->blocks_read = __atomic_load_n(&img->counters.blocks_read, __ATOMIC_RELAXED);
+    c->blocks_written = __atomic_load_n(&img->counters.blocks_written, __ATOMIC_RELAXED);
+    c->flushes = __atomic_load_n(&img->counters.flushes, __ATOMIC_RELAXED);
+    c->discards = __atomic_load_n(&img->counters.discards, __ATOMIC_RELAXED);
+    c->blocks_discarded = __atomic_load_n(&img->counters.blocks_discarded, __ATOMIC_RELAXED);
+}
+
+void fat_image_reset_counters(kos_blockdev_t *dev) {
+    fat_image_t *img = (fat_image_t *)dev->dev_data;
+
+    __atomic_store_n(&img->counters.reads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&img->counters.writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&img->counters.blocks_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&img->counters.blocks_written, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&img->counters.flushes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&img->counters.discards, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&img->counters.blocks_discarded, 0, __ATOMIC_RELAXED);
+}
+
+static void put16(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+/* Same layout mkfs.fat uses: 1(FAT16)/32(FAT32) reserved sectors, 2 FATs, 512 root entries on FAT16 and the
+   root directory in cluster 2 on FAT32. Everything that isn't written here is zero */
+int fat_image_create(const char *path, uint32_t size_mb, int fat32, int sectors_per_cluster) {
+    unsigned char bs[512], sec[512];
+    uint32_t total = size_mb * 2048;
+    uint32_t reserved = fat32 ? 32 : 1;
+    uint32_t root_sectors = fat32 ? 0 : 32;
+    uint32_t clusters, fat_size, i;
+    int fd;
+    int ok = 1;
+
+    if(sectors_per_cluster < 1 || sectors_per_cluster > 128 || (sectors_per_cluster & (sectors_per_cluster - 1)) || total < 4096) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Size the FAT for every cluster that could fit, it comes out a little bigger than it has to be */
+    clusters = (total - reserved - root_sectors) / sectors_per_cluster;
+    fat_size = ((clusters + 2) * (fat32 ? 4 : 2) + 511) / 512;
+
+    /* FAT16 can't have more than 65524 clusters */
+    if(!fat32 && clusters > 65524) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(bs, 0, sizeof(bs));
+    bs[0] = 0xEB; bs[1] = 0x3C; bs[2] = 0x90;
+    memcpy(bs + 3, "LIBFATFS", 8);
+    put16(bs + 11, 512);
+    bs[13] = sectors_per_cluster;
+    put16(bs + 14, reserved);
+    bs[16] = 2;                                   /* FATs */
+    put16(bs + 17, fat32 ? 0 : 512);              /* Root entries */
+    bs[21] = 0xF8;                                /* Media */
+    put16(bs + 24, 32);                           /* Sectors per track */
+    put16(bs + 26, 64);                           /* Heads */
+
+    if(!fat32 && total < 65536)
+        put16(bs + 19, total);
+    else
+        put32(bs + 32, total);
+
+    if(fat32) {
+        put32(bs + 36, fat_size);
+        put32(bs + 44, 2);                        /* Root cluster */
+        put16(bs + 48, 1);                        /* FSInfo sector */
+        put16(bs + 50, 6);                        /* Backup boot sector */
+        bs[64] = 0x80;
+        bs[66] = 0x29;
+        put32(bs + 67, 0x12345678);
+        memcpy(bs + 71, "NO NAME    FAT32   ", 19);
+    }
+    else {
+        put16(bs + 22, fat_size);
+        bs[36] = 0x80;
+        bs[38] = 0x29;
+        put32(bs + 39, 0x12345678);
+        memcpy(bs + 43, "NO NAME    FAT16   ", 19);
+    }
+
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+
+    if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+
+    if(ftruncate(fd, (off_t)total * 512) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    ok = ok && pwrite(fd, bs, 512, 0) == 512;
+
+    /* First entries of both FATs. On FAT32 cluster 2(root directory) is a one cluster chain */
+    memset(sec, 0, sizeof(sec));
+
+    if(fat32) {
+        put32(sec, 0x0FFFFFF8);
+        put32(sec + 4, 0x0FFFFFFF);
+        put32(sec + 8, 0x0FFFFFFF);
+    }
+    else {
+        put16(sec, 0xFFF8);
+        put16(sec + 2, 0xFFFF);
+    }
+
+    for(i = 0; i < 2; i++)
+        ok = ok && pwrite(fd, sec, 512, (off_t)(reserved + i * fat_size) * 512) == 512;
+
+    if(fat32) {
+        ok = ok && pwrite(fd, bs, 512, 6 * 512) == 512;
+
+        memset(sec, 0, sizeof(sec));
+        put32(sec, 0x41615252);
+        put32(sec + 484, 0x61417272);
+        put32(sec + 488, 0xFFFFFFFF);             /* Free count unknown */
+        put32(sec + 492, 3);                      /* Next free cluster */
+        sec[510] = 0x55;
+        sec[511] = 0xAA;
+        ok = ok && pwrite(fd, sec, 512, 512) == 512;
+    }
+
+    if(!ok) {
+        close(fd);
+        errno = EIO;
+        return -1;
+    }
+
+    return close(fd);
+}
+
+void fat_image_close(kos_blockdev_t *dev) {
+    fat_image_t *img = (fat_image_t *)dev->dev_data;
+
+    if(img == NULL)
+        return;
+
+    close(img->fd);
+    free(img);
+    dev->dev_data = NULL;
+}
@@ -0,0 +1,359 @@
+/* libfatfs host build
+
+   fat_meta_bench.c
+   Metadata benchmark. Fills a directory(FAT16 root, FAT16 subdirectory, FAT32 subdirectory) with 10 to
+   50000 entries using 8.3 or long names and times create, open by path(hit and miss), a full readdir,
+   rename and unlink. Device requests are counted for every operation so super-linear costs show up
+   as growing I/O per operation, not just time. One result per line as CSV or JSON, plot us_per_op or
+   reads_per_op against entries to see the curves.
+
+   make -f Makefile.host bench
+   ./fat_meta_bench [-f csv|json] [-n max_entries] [-d dir] [-o out] [-t secs] [-q] [-k]
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kos/fs.h>
+#include <fat_image.h>
+
+#include "include/fs_fat.h"
+
+#define MOUNT       "/meta"
+
+#define SAMPLE_OPS  200    /* Open/rename/unlink are timed on this many entries so big directories don't take forever */
+
+typedef struct meta_config {
+    const char *name;
+    uint32_t size_mb;
+    int fat32;
+    int spc;                /* Sectors per cluster */
+    const char *dir;        /* Directory that gets filled, relative to MOUNT */
+    uint32_t max_slots;     /* 32 byte entries the directory can have */
+} meta_config_t;
+
+static const meta_config_t configs[] = {
+    { "fat16-root",   256,  0, 16, "",     512   },
+    { "fat16-subdir", 256,  0, 16, "/dir", 65535 },
+    { "fat32-subdir", 1024, 1, 8,  "/dir", 65535 },
+};
+
+#define NUM_CONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+static const int entry_counts[] = { 10, 100, 500, 1000, 5000, 10000, 20000, 50000 };
+
+#define NUM_COUNTS (sizeof(entry_counts) / sizeof(entry_counts[0]))
+
+static FILE *out;
+static int json;
+static kos_blockdev_t dev;
+static uint32_t rng = 2463534242u;
+
+static uint32_t xorshift(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 8.3 names never collide. Long names all start the same so generate_short_filename() has to add ~N tails */
+static void entry_name(char *buf, size_t len, const char *dir, int longnames, int i, int renamed) {
+    if(longnames)
+        snprintf(buf, len, MOUNT "%s/%s %05d.dat", dir, renamed ? "moved file" : "level asset", i);
+    else
+        snprintf(buf, len, MOUNT "%s/%c%07d.DAT", dir, renamed ? 'R' : 'F', i);
+}
+
+/* 32 byte entries one name takes: the short entry plus one per 13 characters of a long name */
+static uint32_t entry_slots(int longnames) {
+    return longnames ? 1 + (strlen("level asset 00000.dat") + 12) / 13 : 1;
+}
+
+static void report_header(void) {
+    if(!json)
+        fprintf(out, "config,fat,names,entries,op,ops,seconds,us_per_op,reads_per_op,writes_per_op,blocks_read_per_op,blocks_written_per_op\n");
+}
+
+static void report(const meta_config_t *cfg, int longnames, int entries, const char *op, long ops, double secs,
+                   const fat_image_counters_t *c) {
+    double n = ops > 0 ? (double)ops : 1;
+
+    if(json)
+        fprintf(out, "{\"config\":\"%s\",\"fat\":%d,\"names\":\"%s\",\"entries\":%d,\"op\":\"%s\",\"ops\":%ld,"
+                "\"seconds\":%.6f,\"us_per_op\":%.2f,\"reads_per_op\":%.2f,\"writes_per_op\":%.2f,"
+                "\"blocks_read_per_op\":%.2f,\"blocks_written_per_op\":%.2f}\n",
+                cfg->name, cfg->fat32 ? 32 : 16, longnames ? "long" : "short", entries, op, ops, secs,
+                secs * 1e6 / n, c->reads / n, c->writes / n, c->blocks_read / n, c->blocks_written / n);
+    else
+        fprintf(out, "%s,%d,%s,%d,%s,%ld,%.6f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+                cfg->name, cfg->fat32 ? 32 : 16, longnames ? "long" : "short", entries, op, ops, secs,
+                secs * 1e6 / n, c->reads / n, c->writes / n, c->blocks_read / n, c->blocks_written / n);
+
+    fflush(out);
+}
+
+/* Time 'ops' operations that already ran between start() and stop() */
+static double t_start;
+
+static void start(void) {
+    fat_image_reset_counters(&dev);
+    t_start = now();
+}
+
+static double stop(fat_image_counters_t *c) {
+    double t = now() - t_start;
+
+    fat_image_get_counters(&dev, c);
+
+    return t;
+}
+
+/* *secs is how long the whole run took */
+static int run_one(const meta_config_t *cfg, const char *image, int longnames, int entries, double *secs) {
+    fat_image_counters_t c;
+    char name[256], name2[256];
+    dirent_t *d;
+    double t;
+    file_t fd;
+    int i, k, sample, listed;
+    double t_run = now();
+
+    if(fat_image_open(&dev, image, 1) < 0) {
+        fprintf(stderr, "fat_meta_bench: can't open %s: %s\n", image, strerror(errno));
+        return -1;
+    }
+
+    if(fs_fat_mount(MOUNT, &dev, FS_FAT_MOUNT_READWRITE) < 0) {
+        fprintf(stderr, "fat_meta_bench: can't mount %s\n", image);
+        fat_image_close(&dev);
+        return -1;
+    }
+
+    if(cfg->dir[0]) {
+        snprintf(name, sizeof(name), MOUNT "%s", cfg->dir);
+
+        if(fs_mkdir(name) < 0)
+            goto fail;
+    }
+
+    /* create: every entry, the directory grows as it goes */
+    start();
+
+    for(i = 0; i < entries; i++) {
+        entry_name(name, sizeof(name), cfg->dir, longnames, i, 0);
+
+        if((fd = fs_open(name, O_WRONLY | O_CREAT)) < 0)
+            goto fail;
+
+        fs_close(fd);
+    }
+
+    t = stop(&c);
+    report(cfg, longnames, entries, "create", entries, t, &c);
+
+    sample = entries < SAMPLE_OPS ? entries : SAMPLE_OPS;
+
+    /* open: existing names picked at random */
+    start();
+
+    for(k = 0; k < sample; k++) {
+        entry_name(name, sizeof(name), cfg->dir, longnames, xorshift() % entries, 0);
+
+        if((fd = fs_open(name, O_RDONLY)) < 0)
+            goto fail;
+
+        fs_close(fd);
+    }
+
+    t = stop(&c);
+    report(cfg, longnames, entries, "open", sample, t, &c);
+
+    /* open_miss: names that aren't there */
+    start();
+
+    for(k = 0; k < sample; k++) {
+        entry_name(name, sizeof(name), cfg->dir, longnames, entries + k, 1);
+
+        if((fd = fs_open(name, O_RDONLY)) >= 0) {
+            fs_close(fd);
+            goto fail;
+        }
+    }
+
+    t = stop(&c);
+    report(cfg, longnames, entries, "open_miss", sample, t, &c);
+
+    /* readdir: the whole directory once. Reported per entry */
+    snprintf(name, sizeof(name), MOUNT "%s", cfg->dir[0] ? cfg->dir : "/");
+    start();
+
+    if((fd = fs_open(name, O_RDONLY | O_DIR)) < 0)
+        goto fail;
+
+    for(listed = 0; (d = fs_readdir(fd)) != NULL; )
+        listed++;
+
+    fs_close(fd);
+    t = stop(&c);
+    report(cfg, longnames, entries, "readdir", listed, t, &c);
+
+    if(listed < entries) {
+        fprintf(stderr, "fat_meta_bench: readdir found %d of %d entries\n", listed, entries);
+        goto fail;
+    }
+
+    /* rename: the first 'sample' entries get a new name in the same directory */
+    start();
+
+    for(k = 0; k < sample; k++) {
+        entry_name(name, sizeof(name), cfg->dir, longnames, k, 0);
+        entry_name(name2, sizeof(name2), cfg->dir, longnames, k, 1);
+
+        if(fs_rename(name, name2) < 0)
+            goto fail;
+    }
+
+    t = stop(&c);
+    report(cfg, longnames, entries, "rename", sample, t, &c);
+
+    /* unlink: the renamed ones */
+    start();
+
+    for(k = 0; k < sample; k++) {
+        entry_name(name, sizeof(name), cfg->dir, longnames, k, 1);
+
+        if(fs_unlink(name) < 0)
+            goto fail;
+    }
+
+    t = stop(&c);
+    report(cfg, longnames, entries, "unlink", sample, t, &c);
+
+    fs_fat_unmount(MOUNT);
+    fat_image_close(&dev);
+
+    *secs = now() - t_run;
+
+    return 0;
+
+fail:
+    fprintf(stderr, "fat_meta_bench: %s %s names, %d entries: failed at %s: %s\n", cfg->name,
+            longnames ? "long" : "short", entries, name, strerror(errno));
+    fs_fat_unmount(MOUNT);
+    fat_image_close(&dev);
+
+    return -1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: fat_meta_bench [-f csv|json] [-n max_entries] [-d dir] [-o out] [-t secs] [-q] [-k]\n"
+                    "  -f  output format(default csv)\n"
+                    "  -n  skip directory sizes above this(default 50000)\n"
+                    "  -d  where to create the images(default /tmp)\n"
+                    "  -o  write the results to out instead of stdout\n"
+                    "  -t  don't go on to bigger directories once one took longer than this many seconds(default 60)\n"
+                    "  -q  quick run: up to 1000 entries\n"
+                    "  -k  keep the created images\n");
+}
+
+int main(int argc, char **argv) {
+    const char *dir = "/tmp";
+    char path[1024];
+    int max_entries = 50000;
+    double limit = 60, secs;
+    int keep = 0, rv = 0, c, longnames;
+    size_t i, j;
+
+    out = stdout;
+
+    while((c = getopt(argc, argv, "f:n:d:o:t:qkh")) != -1) {
+        switch(c) {
+            case 'f':
+                json = !strcmp(optarg, "json");
+                break;
+            case 'n':
+                max_entries = atoi(optarg);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'o':
+                if(!(out = fopen(optarg, "w"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                limit = atof(optarg);
+                break;
+            case 'q':
+                max_entries = 1000;
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    fs_fat_init();
+    report_header();
+
+    for(i = 0; i < NUM_CONFIGS; i++) {
+        const meta_config_t *cfg = &configs[i];
+
+        for(longnames = 0; longnames < 2; longnames++) {
+            for(j = 0; j < NUM_COUNTS; j++) {
+                int entries = entry_counts[j];
+
+                /* Has to fit in the directory, a FAT directory can't have more than 65535 entries */
+                if(entries > max_entries || (uint32_t)entries * entry_slots(longnames) + 2 > cfg->max_slots)
+                    continue;
+
+                snprintf(path, sizeof(path), "%s/fat_meta_bench-%s-%s-%d.img", dir, cfg->name, longnames ? "long" : "short", entries);
+
+                if(fat_image_create(path, cfg->size_mb, cfg->fat32, cfg->spc) < 0) {
+                    fprintf(stderr, "fat_meta_bench: can't create %s: %s\n", path, strerror(errno));
+                    rv = -1;
+                    continue;
+                }
+
+                secs = 0;
+
+                if(run_one(cfg, path, longnames, entries, &secs) < 0)
+                    rv = -1;
+
+                if(!keep)
+                    unlink(path);
+
+                /* Next size up would take much longer still. The curve so far shows it */
+                if(secs > limit) {
+                    fprintf(stderr, "fat_meta_bench: %s %s names stopped after %d entries(%.1f seconds)\n",
+                            cfg->name, longnames ? "long" : "short", entries, secs);
+                    break;
+                }
+            }
+        }
+    }
+
+    fs_fat_shutdown();
+
+    if(out != stdout)
+        fclose(out);
+
+    return rv ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+/* libfatfs host build
+
+   fat_mkfs.c
+   Formats an image(or SD card dump) with fs_fat_format(), the same formatter a program can run on the
+   device itself. With -s the image is created(sparse) first. Prints the layout it picked so it can be
+   checked against the card's erase block size.
+
+   make -f Makefile.host bench
+   ./fat_mkfs [-s size_mb] [-t 16|32] [-c sectors_per_cluster] [-a align_kb] [-l label] image
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fat_image.h>
+
+#include "include/fs_fat.h"
+
+static void usage(void) {
+    fprintf(stderr, "usage: fat_mkfs [-s size_mb] [-t 16|32] [-c sectors_per_cluster] [-a align_kb] [-l label] image\n"
+                    "  -s  create the image with this size first\n"
+                    "  -t  FAT type(default FAT32 over 2GB, FAT16 below)\n"
+                    "  -c  sectors per cluster(default 32 up to 1GB, 64 above)\n"
+                    "  -a  erase block size the layout is aligned to in KB(default 4096)\n"
+                    "  -l  volume label\n");
+}
+
+int main(int argc, char **argv) {
+    kos_blockdev_t dev;
+    fs_fat_format_t fmt;
+    uint32_t size_mb = 0;
+    int c, fd;
+
+    memset(&fmt, 0, sizeof(fmt));
+
+    while((c = getopt(argc, argv, "s:t:c:a:l:h")) != -1) {
+        switch(c) {
+            case 's':
+                size_mb = (uint32_t)atoi(optarg);
+                break;
+            case 't':
+                fmt.fat_type = (uint32_t)atoi(optarg);
+                break;
+            case 'c':
+                fmt.sectors_per_cluster = (uint32_t)atoi(optarg);
+                break;
+            case 'a':
+                fmt.align_bytes = (uint32_t)atoi(optarg) * 1024;
+                break;
+            case 'l':
+                fmt.label = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(argc - optind != 1) {
+        usage();
+        return 1;
+    }
+
+    if(size_mb) {
+        if((fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+           ftruncate(fd, (off_t)size_mb * 1024 * 1024) < 0) {
+            fprintf(stderr, "fat_mkfs: can't create %s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+
+        close(fd);
+    }
+
+    if(fat_image_open(&dev, argv[optind], 1) < 0) {
+        fprintf(stderr, "fat_mkfs: can't open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if(fs_fat_format(&dev, &fmt) < 0) {
+        fprintf(stderr, "fat_mkfs: can't format %s: %s\n", argv[optind], strerror(errno));
+        fat_image_close(&dev);
+        return 1;
+    }
+
+    printf("FAT%u, %u byte clusters, %u clusters, aligned to %u KB\n", fmt.fat_type, fmt.sectors_per_cluster * 512,
+           fmt.clusters, fmt.align_bytes / 1024);
+    printf("FATs at sector %u(%u sectors each), root directory at %u, data at %u\n", fmt.fat_start, fmt.fat_sectors,
+           fmt.root_start, fmt.data_start);
+
+    fat_image_close(&dev);
+
+    return 0;
+}
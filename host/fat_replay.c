@@ -0,0 +1,222 @@
+/* libfatfs host build
+
+   fat_replay.c
+   Reissues a block trace(see include/fat_trace.h) against an image file and prints the request count,
+   blocks and latency for each tag. Traces can come from the host build or be dumped on a Dreamcast and
+   copied over, so the same workload can be rerun while changing the library or the device. With -s the
+   image sits on a simulated SD card(see fat_sdsim.h) and the time the card would have taken is printed too.
+
+   make -f Makefile.host bench
+   ./fat_replay [-r] [-t] [-o out] [-s params] trace image
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arch/timer.h>
+#include <fat_image.h>
+#include <fat_sdsim.h>
+
+#include "include/fat_trace.h"
+
+#define BUF_BLOCKS 256     /* Largest request that fits in buf, bigger ones are split */
+
+typedef struct tag_stats {
+    unsigned long reads, writes, errors;
+    uint64_t blocks_read, blocks_written;
+    uint64_t latency_us;   /* Total of the replayed requests */
+    uint64_t orig_latency_us;   /* Total of the traced ones */
+} tag_stats_t;
+
+static void usage(void) {
+    fprintf(stderr, "usage: fat_replay [-r] [-t] [-o out] [-s params] trace image\n"
+                    "  -r  skip the writes(the image is opened read only)\n"
+                    "  -t  keep the original timing between requests instead of issuing them back to back\n"
+                    "  -o  trace the replay too and dump it to out(.bin for the binary format, CSV otherwise)\n"
+                    "  -s  replay on a simulated SD card. params is \"default\" or name=value,... (see fat_sdsim.h)\n");
+}
+
+int main(int argc, char **argv) {
+    kos_blockdev_t image, trace, card, *dev;
+    fat_sdsim_params_t params;
+    fat_sdsim_stats_t st;
+    fat_trace_rec_t *recs;
+    tag_stats_t stats[FAT_TRACE_NUM_TAGS];
+    const char *out = NULL;
+    unsigned char *buf;
+    uint64_t base, total_blocks;
+    int readonly = 0, timing = 0, simulate = 0, c, n, i, rv, fmt;
+    uint32_t done, cnt;
+
+    fat_sdsim_default_params(&params);
+
+    while((c = getopt(argc, argv, "rto:s:h")) != -1) {
+        switch(c) {
+            case 'r':
+                readonly = 1;
+                break;
+            case 't':
+                timing = 1;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 's':
+                if(fat_sdsim_parse_params(&params, optarg) < 0) {
+                    fprintf(stderr, "fat_replay: bad card parameters %s\n", optarg);
+                    return 1;
+                }
+
+                simulate = 1;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    if((n = fat_trace_load(argv[optind], &recs)) < 0) {
+        fprintf(stderr, "fat_replay: can't load %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if(fat_image_open(&image, argv[optind + 1], !readonly) < 0) {
+        fprintf(stderr, "fat_replay: can't open %s: %s\n", argv[optind + 1], strerror(errno));
+        free(recs);
+        return 1;
+    }
+
+    dev = &image;
+
+    if(simulate) {
+        if(fat_sdsim_create(&card, &image, &params) < 0) {
+            perror("fat_replay");
+            return 1;
+        }
+
+        dev = &card;
+    }
+
+    if(out) {
+        if(fat_trace_create(&trace, dev, n ? n : 1) < 0) {
+            perror("fat_replay");
+            return 1;
+        }
+
+        dev = &trace;
+    }
+
+    if(!(buf = malloc(BUF_BLOCKS * (1 << image.l_block_size)))) {
+        perror("fat_replay");
+        return 1;
+    }
+
+    memset(buf, 0, BUF_BLOCKS * (1 << image.l_block_size));
+    memset(stats, 0, sizeof(stats));
+    total_blocks = dev->count_blocks(dev);
+    base = timer_us_gettime64();
+
+    for(i = 0; i < n; i++) {
+        fat_trace_rec_t *r = &recs[i];
+        tag_stats_t *s = &stats[r->tag < FAT_TRACE_NUM_TAGS ? r->tag : FAT_TRACE_OTHER];
+        uint64_t begin;
+
+        if(r->write && readonly)
+            continue;
+
+        if(r->block + r->count > total_blocks) {
+            s->errors++;
+            continue;
+        }
+
+        if(timing) {
+            uint64_t now = timer_us_gettime64() - base;
+
+            if(r->time_us > now)
+                usleep(r->time_us - now);
+        }
+
+        begin = timer_us_gettime64();
+
+        /* Writes put zeros back, a trace only has where the data went */
+        for(done = 0, rv = 0; done < r->count && rv == 0; done += cnt) {
+            cnt = r->count - done < BUF_BLOCKS ? r->count - done : BUF_BLOCKS;
+
+            if(r->write)
+                rv = fat_dev_write(dev, r->tag, r->block + done, cnt, buf);
+            else
+                rv = fat_dev_read(dev, r->tag, r->block + done, cnt, buf);
+        }
+
+        s->latency_us += timer_us_gettime64() - begin;
+        s->orig_latency_us += r->latency_us;
+
+        if(rv != 0)
+            s->errors++;
+
+        if(r->write) {
+            s->writes++;
+            s->blocks_written += r->count;
+        }
+        else {
+            s->reads++;
+            s->blocks_read += r->count;
+        }
+    }
+
+    if(dev->flush)
+        dev->flush(dev);
+
+    printf("tag,reads,writes,blocks_read,blocks_written,errors,avg_latency_us,orig_avg_latency_us\n");
+
+    for(i = 0; i < FAT_TRACE_NUM_TAGS; i++) {
+        tag_stats_t *s = &stats[i];
+        unsigned long ops = s->reads + s->writes;
+
+        if(!ops && !s->errors)
+            continue;
+
+        printf("%s,%lu,%lu,%llu,%llu,%lu,%.2f,%.2f\n", fat_trace_tag_name(i), s->reads, s->writes,
+               (unsigned long long)s->blocks_read, (unsigned long long)s->blocks_written, s->errors,
+               ops ? (double)s->latency_us / ops : 0, ops ? (double)s->orig_latency_us / ops : 0);
+    }
+
+    if(simulate) {
+        fat_sdsim_get_stats(&card, &st);
+        printf("card: %.3f s(reads %.3f s, writes %.3f s), %llu random reads, %llu random writes, "
+               "%llu AU crossings, %llu AU switches\n", st.elapsed_us / 1e6, st.read_us / 1e6, st.write_us / 1e6,
+               (unsigned long long)st.random_reads, (unsigned long long)st.random_writes,
+               (unsigned long long)st.au_crossings, (unsigned long long)st.au_switches);
+    }
+
+    rv = 0;
+
+    if(out) {
+        fmt = (strlen(out) > 4 && !strcmp(out + strlen(out) - 4, ".bin")) ? FAT_TRACE_BINARY : FAT_TRACE_CSV;
+
+        if(fat_trace_dump(&trace, out, fmt) < 0) {
+            fprintf(stderr, "fat_replay: can't write %s: %s\n", out, strerror(errno));
+            rv = 1;
+        }
+
+        fat_trace_destroy(&trace);
+    }
+
+    if(simulate)
+        fat_sdsim_destroy(&card);
+
+    fat_image_close(&image);
+    free(buf);
+    free(recs);
+
+    return rv;
+}
@@ -0,0 +1,316 @@
+/* libfatfs host build
+
+   fat_sdsim.c
+   Simulated SD card. Requests go to the device underneath unchanged, the cost model in fat_sdsim.h
+   decides how long they would have taken on a card.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fat_sdsim.h>
+
+#define MAX_OPEN_AUS 16
+
+typedef struct fat_sdsim {
+    kos_blockdev_t *dev;
+    fat_sdsim_params_t p;
+    pthread_mutex_t lock;           /* Async workers can do I/O at the same time */
+    uint64_t next_read;             /* Block after the last read */
+    uint64_t next_write;            /* Block after the last write */
+    uint64_t open_au[MAX_OPEN_AUS]; /* Most recently written AUs, most recent first */
+    uint32_t num_open;
+    fat_sdsim_stats_t stats;
+} fat_sdsim_t;
+
+void fat_sdsim_default_params(fat_sdsim_params_t *p) {
+    memset(p, 0, sizeof(fat_sdsim_params_t));
+    p->cmd_us = 150;
+    p->read_sector_us = 330;
+    p->write_sector_us = 350;
+    p->random_read_us = 100;
+    p->random_write_us = 2000;
+    p->au_sectors = 8192;           /* 4MB */
+    p->au_cross_us = 3000;
+    p->open_aus = 2;
+    p->au_open_us = 20000;
+    p->flush_us = 0;
+}
+
+static const struct {
+    const char *name;
+    size_t offset;
+} param_names[] = {
+    { "cmd_us",          offsetof(fat_sdsim_params_t, cmd_us) },
+    { "read_sector_us",  offsetof(fat_sdsim_params_t, read_sector_us) },
+    { "write_sector_us", offsetof(fat_sdsim_params_t, write_sector_us) },
+    { "random_read_us",  offsetof(fat_sdsim_params_t, random_read_us) },
+    { "random_write_us", offsetof(fat_sdsim_params_t, random_write_us) },
+    { "au_sectors",      offsetof(fat_sdsim_params_t, au_sectors) },
+    { "au_cross_us",     offsetof(fat_sdsim_params_t, au_cross_us) },
+    { "open_aus",        offsetof(fat_sdsim_params_t, open_aus) },
+    { "au_open_us",      offsetof(fat_sdsim_params_t, au_open_us) },
+    { "flush_us",        offsetof(fat_sdsim_params_t, flush_us) },
+};
+
+#define NUM_PARAMS (sizeof(param_names) / sizeof(param_names[0]))
+
+int fat_sdsim_parse_params(fat_sdsim_params_t *p, const char *spec) {
+    char name[32], *end;
+    const char *s = spec;
+    unsigned long v;
+    size_t len, i;
+
+    while(*s) {
+        len = strcspn(s, "=,");
+
+        if(len == 7 && !strncmp(s, "default", 7) && (s[7] == ',' || !s[7])) {
+            s += len + (s[len] == ',');
+            continue;
+        }
+
+        if(s[len] != '=' || len >= sizeof(name)) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        memcpy(name, s, len);
+        name[len] = '\0';
+        v = strtoul(s + len + 1, &end, 0);
+
+        if(end == s + len + 1 || (*end && *end != ',')) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if(!strcmp(name, "sleep")) {
+            p->sleep = (v != 0);
+        }
+        else {
+            for(i = 0; i < NUM_PARAMS && strcmp(name, param_names[i].name); i++)
+                ;
+
+            if(i == NUM_PARAMS) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            *(uint32_t *)((char *)p + param_names[i].offset) = (uint32_t)v;
+        }
+
+        s = *end ? end + 1 : end;
+    }
+
+    if(p->au_sectors == 0 || p->open_aus > MAX_OPEN_AUS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Move au to the front of the open AU list. Returns 1 if it wasn't open */
+static int open_au(fat_sdsim_t *s, uint64_t au) {
+    uint32_t i;
+    int miss;
+
+    if(s->p.open_aus == 0)
+        return 1;
+
+    for(i = 0; i < s->num_open && s->open_au[i] != au; i++)
+        ;
+
+    miss = (i == s->num_open);
+
+    if(miss) {
+        if(s->num_open < s->p.open_aus)
+            s->num_open++;
+
+        i = s->num_open - 1;
+    }
+
+    memmove(&s->open_au[1], &s->open_au[0], i * sizeof(uint64_t));
+    s->open_au[0] = au;
+
+    return miss;
+}
+
+/* Cost of a request in us. Also moves the card state along */
+static uint64_t model(fat_sdsim_t *s, uint64_t block, size_t count, int write) {
+    const fat_sdsim_params_t *p = &s->p;
+    uint64_t us = p->cmd_us, au, last_au;
+
+    if(!write) {
+        us += (uint64_t)count * p->read_sector_us;
+
+        if(block != s->next_read) {
+            us += p->random_read_us;
+            s->stats.random_reads++;
+        }
+
+        s->next_read = block + count;
+        s->stats.reads++;
+        s->stats.sectors_read += count;
+        s->stats.read_us += us;
+        return us;
+    }
+
+    us += (uint64_t)count * p->write_sector_us;
+
+    if(block != s->next_write) {
+        us += p->random_write_us;
+        s->stats.random_writes++;
+    }
+
+    last_au = (block + count - 1) / p->au_sectors;
+
+    for(au = block / p->au_sectors; au <= last_au; au++) {
+        if(open_au(s, au)) {
+            us += p->au_open_us;
+            s->stats.au_switches++;
+        }
+
+        if(au != last_au) {
+            us += p->au_cross_us;
+            s->stats.au_crossings++;
+        }
+    }
+
+    s->next_write = block + count;
+    s->stats.writes++;
+    s->stats.sectors_written += count;
+    s->stats.write_us += us;
+    return us;
+}
+
+static int sdsim_io(kos_blockdev_t *d, uint64_t block, size_t count, void *buf, int write) {
+    fat_sdsim_t *s = (fat_sdsim_t *)d->dev_data;
+    uint64_t us;
+    int rv;
+
+    rv = write ? s->dev->write_blocks(s->dev, block, count, buf) : s->dev->read_blocks(s->dev, block, count, buf);
+
+    /* Failed requests still went to the card */
+    pthread_mutex_lock(&s->lock);
+    us = model(s, block, count, write);
+    s->stats.elapsed_us += us;
+    pthread_mutex_unlock(&s->lock);
+
+    if(s->p.sleep)
+        usleep(us);
+
+    return rv;
+}
+
+static int sdsim_init(kos_blockdev_t *d) {
+    fat_sdsim_t *s = (fat_sdsim_t *)d->dev_data;
+
+    return s->dev->init(s->dev);
+}
+
+static int sdsim_shutdown(kos_blockdev_t *d) {
+    fat_sdsim_t *s = (fat_sdsim_t *)d->dev_data;
+
+    return s->dev->shutdown(s->dev);
+}
+
+static int sdsim_read_blocks(kos_blockdev_t *d, uint64_t block, size_t count, void *buf) {
+    return sdsim_io(d, block, count, buf, 0);
+}
+
+static int sdsim_write_blocks(kos_blockdev_t *d, uint64_t block, size_t count, const void *buf) {
+    return sdsim_io(d, block, count, (void *)buf, 1);
+}
+
+static uint64_t sdsim_count_blocks(kos_blockdev_t *d) {
+    fat_sdsim_t *s = (fat_sdsim_t *)d->dev_data;
+
+    return s->dev->count_blocks(s->dev);
+}
+
+static int sdsim_flush(kos_blockdev_t *d) {
+    fat_sdsim_t *s = (fat_sdsim_t *)d->dev_data;
+    int rv = s->dev->flush ? s->dev->flush(s->dev) : 0;
+
+    pthread_mutex_lock(&s->lock);
+    s->stats.flushes++;
+    s->stats.elapsed_us += s->p.flush_us;
+    pthread_mutex_unlock(&s->lock);
+
+    if(s->p.sleep && s->p.flush_us)
+        usleep(s->p.flush_us);
+
+    return rv;
+}
+
+int fat_sdsim_create(kos_blockdev_t *sim, kos_blockdev_t *dev, const fat_sdsim_params_t *p) {
+    fat_sdsim_t *s;
+
+    if(!sim || !dev || !p || p->au_sectors == 0 || p->open_aus > MAX_OPEN_AUS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(s = (fat_sdsim_t *)calloc(1, sizeof(fat_sdsim_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    s->dev = dev;
+    s->p = *p;
+    pthread_mutex_init(&s->lock, NULL);
+
+    memset(sim, 0, sizeof(kos_blockdev_t));
+    sim->dev_data = s;
+    sim->l_block_size = dev->l_block_size;
+    sim->init = sdsim_init;
+    sim->shutdown = sdsim_shutdown;
+    sim->read_blocks = sdsim_read_blocks;
+    sim->write_blocks = sdsim_write_blocks;
+    sim->count_blocks = sdsim_count_blocks;
+    sim->flush = sdsim_flush;
+
+    return 0;
+}
+
+void fat_sdsim_destroy(kos_blockdev_t *sim) {
+    fat_sdsim_t *s = (fat_sdsim_t *)sim->dev_data;
+
+    if(!s)
+        return;
+
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+    sim->dev_data = NULL;
+}
+
+void fat_sdsim_get_stats(kos_blockdev_t *sim, fat_sdsim_stats_t *st) {
+    fat_sdsim_t *s = (fat_sdsim_t *)sim->dev_data;
+
+    pthread_mutex_lock(&s->lock);
+    *st = s->stats;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void fat_sdsim_reset_stats(kos_blockdev_t *sim) {
+    fat_sdsim_t *s = (fat_sdsim_t *)sim->dev_data;
+
+    pthread_mutex_lock(&s->lock);
+    memset(&s->stats, 0, sizeof(fat_sdsim_stats_t));
+    pthread_mutex_unlock(&s->lock);
+}
+
+uint64_t fat_sdsim_elapsed_us(kos_blockdev_t *sim) {
+    fat_sdsim_t *s = (fat_sdsim_t *)sim->dev_data;
+    uint64_t us;
+
+    pthread_mutex_lock(&s->lock);
+    us = s->stats.elapsed_us;
+    pthread_mutex_unlock(&s->lock);
+
+    return us;
+}
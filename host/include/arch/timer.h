@@ -0,0 +1,20 @@
+/* libfatfs host build
+
+   arch/timer.h
+   The KallistiOS microsecond timer on top of CLOCK_MONOTONIC.
+*/
+
+#ifndef __ARCH_TIMER_H
+#define __ARCH_TIMER_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <arch/types.h>
+
+uint64 timer_us_gettime64(void);
+uint64 timer_ms_gettime64(void);
+
+__END_DECLS
+
+#endif /* __ARCH_TIMER_H */
@@ -0,0 +1,25 @@
+/* libfatfs host build
+
+   arch/types.h
+   Minimal stand-in for the KallistiOS integer typedefs.
+*/
+
+#ifndef __ARCH_TYPES_H
+#define __ARCH_TYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef uint8_t  uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef int8_t   int8;
+typedef int16_t  int16;
+typedef int32_t  int32;
+typedef int64_t  int64;
+
+typedef long long _off64_t;
+
+#endif /* __ARCH_TYPES_H */
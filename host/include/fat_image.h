@@ -0,0 +1,49 @@
+/* libfatfs host build
+
+   fat_image.h
+   A kos_blockdev_t backed by a FAT image file(mkfs.fat, dd of an SD card, etc).
+*/
+
+#ifndef __FAT_IMAGE_H
+#define __FAT_IMAGE_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <kos/blockdev.h>
+
+/* Number of device requests and blocks that went through a device since it was opened(or reset) */
+typedef struct fat_image_counters {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t flushes;
+    uint64_t discards;
+    uint64_t blocks_discarded;
+} fat_image_counters_t;
+
+/* Fill in dev so it reads/writes the image file at path in 512 byte blocks.
+   Returns 0 on success or -1 with errno set */
+int fat_image_open(kos_blockdev_t *dev, const char *path, int writable);
+
+/* Create(or overwrite) path as a blank FAT16(fat32 == 0) or FAT32 image of size_mb megabytes with
+   sectors_per_cluster sectors per cluster. The file is sparse so big images are cheap.
+   Returns 0 on success or -1 with errno set */
+int fat_image_create(const char *path, uint32_t size_mb, int fat32, int sectors_per_cluster);
+
+/* Discard for fs_fat_set_discard(): punches a hole in the image file where the blocks are, so they read back as
+   zeros and take no space on the disk. Returns 0 on success or -1 with errno set(EOPNOTSUPP if the filesystem
+   the image is on can't do it) */
+int fat_image_discard(kos_blockdev_t *dev, uint64_t block, size_t count);
+
+void fat_image_get_counters(kos_blockdev_t *dev, fat_image_counters_t *c);
+
+void fat_image_reset_counters(kos_blockdev_t *dev);
+
+/* Close the image file. dev can't be used(or be mounted) after this */
+void fat_image_close(kos_blockdev_t *dev);
+
+__END_DECLS
+
+#endif /* __FAT_IMAGE_H */
@@ -0,0 +1,77 @@
+/* libfatfs host build
+
+   fat_sdsim.h
+   A kos_blockdev_t that passes requests on to another device(usually an image, see fat_image.h) and
+   charges each one the time a real SD card would take for it. The time is kept on a virtual clock, so
+   runs are repeatable and show how a change to libfatfs would do on the card instead of on the page cache.
+*/
+
+#ifndef __FAT_SDSIM_H
+#define __FAT_SDSIM_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <kos/blockdev.h>
+
+/* Cost model. Every request costs cmd_us plus a per sector cost. On top of that:
+   - a read that doesn't start where the last one ended costs random_read_us
+   - a write that doesn't start where the last one ended costs random_write_us(the card has to
+     read-modify-write a flash page)
+   - a write costs au_cross_us for every allocation unit(erase block) boundary it crosses
+   - a write to an AU that isn't one of the open_aus most recently written ones costs au_open_us(the
+     card has to close/garbage collect one) */
+typedef struct fat_sdsim_params {
+    uint32_t cmd_us;
+    uint32_t read_sector_us;
+    uint32_t write_sector_us;
+    uint32_t random_read_us;
+    uint32_t random_write_us;
+    uint32_t au_sectors;        /* Allocation unit size in 512 byte sectors */
+    uint32_t au_cross_us;
+    uint32_t open_aus;          /* AUs the card can write to without a switch. At most 16 */
+    uint32_t au_open_us;
+    uint32_t flush_us;
+    int      sleep;             /* 1 - also sleep for the modeled time so wall clock time(and async overlap) shows it */
+} fat_sdsim_params_t;
+
+typedef struct fat_sdsim_stats {
+    uint64_t elapsed_us;        /* Virtual time all requests took */
+    uint64_t read_us;
+    uint64_t write_us;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t random_reads;
+    uint64_t random_writes;
+    uint64_t au_crossings;
+    uint64_t au_switches;
+    uint64_t flushes;
+} fat_sdsim_stats_t;
+
+/* A ballpark consumer card behind the Dreamcast's SPI link. Measure yours and override what differs */
+void fat_sdsim_default_params(fat_sdsim_params_t *p);
+
+/* Override fields of p from a "name=value,name=value" list(names as in fat_sdsim_params_t, "default"
+   leaves p as it is). Returns 0 or -1 with errno set if a name or value is bad */
+int fat_sdsim_parse_params(fat_sdsim_params_t *p, const char *spec);
+
+/* Make sim a device that passes requests on to dev and models them with p. Mount sim instead of dev.
+   Returns 0 or -1 with errno set */
+int fat_sdsim_create(kos_blockdev_t *sim, kos_blockdev_t *dev, const fat_sdsim_params_t *p);
+
+/* Doesn't touch the device underneath. Unmount first */
+void fat_sdsim_destroy(kos_blockdev_t *sim);
+
+void fat_sdsim_get_stats(kos_blockdev_t *sim, fat_sdsim_stats_t *st);
+
+/* Virtual clock and counters back to 0. The card state(last position, open AUs) is kept */
+void fat_sdsim_reset_stats(kos_blockdev_t *sim);
+
+/* Virtual time so far. Shorthand for fat_sdsim_get_stats()'s elapsed_us */
+uint64_t fat_sdsim_elapsed_us(kos_blockdev_t *sim);
+
+__END_DECLS
+
+#endif /* __FAT_SDSIM_H */
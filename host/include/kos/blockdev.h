@@ -0,0 +1,32 @@
+/* libfatfs host build
+
+   kos/blockdev.h
+   Same layout as the KallistiOS block device interface so the library
+   sources compile unchanged on a workstation.
+*/
+
+#ifndef __KOS_BLOCKDEV_H
+#define __KOS_BLOCKDEV_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <arch/types.h>
+
+typedef struct kos_blockdev {
+    void *dev_data;
+    uint32_t l_block_size;
+
+    int (*init)(struct kos_blockdev *d);
+    int (*shutdown)(struct kos_blockdev *d);
+    int (*read_blocks)(struct kos_blockdev *d, uint64_t block, size_t count,
+                       void *buf);
+    int (*write_blocks)(struct kos_blockdev *d, uint64_t block, size_t count,
+                        const void *buf);
+    uint64_t (*count_blocks)(struct kos_blockdev *d);
+    int (*flush)(struct kos_blockdev *d);
+} kos_blockdev_t;
+
+__END_DECLS
+
+#endif /* __KOS_BLOCKDEV_H */
@@ -0,0 +1,28 @@
+/* libfatfs host build
+
+   kos/cond.h
+   KallistiOS condition variables mapped onto pthreads.
+*/
+
+#ifndef __KOS_COND_H
+#define __KOS_COND_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <pthread.h>
+#include <kos/mutex.h>
+
+typedef struct condvar {
+    pthread_cond_t c;
+} condvar_t;
+
+int cond_init(condvar_t *cv);
+int cond_destroy(condvar_t *cv);
+int cond_wait(condvar_t *cv, mutex_t *m);
+int cond_signal(condvar_t *cv);
+int cond_broadcast(condvar_t *cv);
+
+__END_DECLS
+
+#endif /* __KOS_COND_H */
@@ -0,0 +1,100 @@
+/* libfatfs host build
+
+   kos/fs.h
+   The subset of the KallistiOS VFS that libfatfs registers with and that
+   host programs use to drive it (fs_open(), fs_read(), ...).
+*/
+
+#ifndef __KOS_FS_H
+#define __KOS_FS_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arch/types.h>
+#include <kos/nmmgr.h>
+
+typedef int file_t;
+
+#define FILEHND_INVALID ((file_t)-1)
+
+/* Open a directory. Picked so it does not collide with any host O_* bit. */
+#define O_DIR       0x10000000
+#define O_META      0x20000000
+
+typedef struct kos_dirent {
+    int      size;
+    char     name[NAME_MAX];
+    time_t   time;
+    uint32   attr;
+} dirent_t;
+
+typedef struct vfs_handler {
+    nmmgr_handler_t nmmgr;
+
+    int     cache;
+    void    *privdata;
+
+    void *(*open)(struct vfs_handler *vfs, const char *fn, int mode);
+    int (*close)(void *hnd);
+    ssize_t (*read)(void *hnd, void *buffer, size_t cnt);
+    ssize_t (*write)(void *hnd, const void *buffer, size_t cnt);
+    off_t (*seek)(void *hnd, off_t offset, int whence);
+    off_t (*tell)(void *hnd);
+    size_t (*total)(void *hnd);
+    dirent_t *(*readdir)(void *hnd);
+    int (*ioctl)(void *hnd, int cmd, va_list ap);
+    int (*rename)(struct vfs_handler *vfs, const char *fn1, const char *fn2);
+    int (*unlink)(struct vfs_handler *vfs, const char *fn);
+    void *(*mmap)(void *hnd);
+    int (*complete)(void *hnd, ssize_t *rv);
+    int (*stat)(struct vfs_handler *vfs, const char *path, struct stat *buf,
+                int flag);
+    int (*mkdir)(struct vfs_handler *vfs, const char *fn);
+    int (*rmdir)(struct vfs_handler *vfs, const char *fn);
+    int (*fcntl)(void *hnd, int cmd, va_list ap);
+    short (*poll)(void *hnd, short events);
+    int (*link)(struct vfs_handler *vfs, const char *path1, const char *path2);
+    int (*symlink)(struct vfs_handler *vfs, const char *path1,
+                   const char *path2);
+    _off64_t (*seek64)(void *hnd, _off64_t offset, int whence);
+    _off64_t (*tell64)(void *hnd);
+    uint64 (*total64)(void *hnd);
+    ssize_t (*readlink)(struct vfs_handler *vfs, const char *path, char *buf,
+                        size_t bufsize);
+} vfs_handler_t;
+
+file_t fs_open(const char *fn, int mode);
+int fs_close(file_t hnd);
+ssize_t fs_read(file_t hnd, void *buffer, size_t cnt);
+ssize_t fs_write(file_t hnd, const void *buffer, size_t cnt);
+off_t fs_seek(file_t hnd, off_t offset, int whence);
+_off64_t fs_seek64(file_t hnd, _off64_t offset, int whence);
+off_t fs_tell(file_t hnd);
+_off64_t fs_tell64(file_t hnd);
+size_t fs_total(file_t hnd);
+uint64 fs_total64(file_t hnd);
+dirent_t *fs_readdir(file_t hnd);
+int fs_ioctl(file_t hnd, int cmd, ...);
+int fs_rename(const char *fn1, const char *fn2);
+int fs_unlink(const char *fn);
+int fs_mkdir(const char *fn);
+int fs_rmdir(const char *fn);
+int fs_fcntl(file_t fd, int cmd, ...);
+int fs_complete(file_t fd, ssize_t *rv);
+int fs_stat(const char *path, struct stat *buf, int flag);
+
+void *fs_get_handle(file_t fd);
+vfs_handler_t *fs_get_handler(file_t fd);
+file_t fs_open_handle(vfs_handler_t *vfs, void *hnd);
+
+__END_DECLS
+
+#endif /* __KOS_FS_H */
@@ -0,0 +1,33 @@
+/* libfatfs host build
+
+   kos/mutex.h
+   KallistiOS mutexes mapped onto pthreads.
+*/
+
+#ifndef __KOS_MUTEX_H
+#define __KOS_MUTEX_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <pthread.h>
+
+typedef struct kos_mutex {
+    pthread_mutex_t m;
+    int type;
+} mutex_t;
+
+#define MUTEX_TYPE_NORMAL       1
+#define MUTEX_TYPE_ERRORCHECK   2
+#define MUTEX_TYPE_RECURSIVE    3
+#define MUTEX_TYPE_DEFAULT      MUTEX_TYPE_NORMAL
+
+int mutex_init(mutex_t *m, int mtype);
+int mutex_destroy(mutex_t *m);
+int mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);
+int mutex_unlock(mutex_t *m);
+
+__END_DECLS
+
+#endif /* __KOS_MUTEX_H */
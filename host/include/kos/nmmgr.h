@@ -0,0 +1,37 @@
+/* libfatfs host build
+
+   kos/nmmgr.h
+   Name manager: the registry of mounted VFS handlers.
+*/
+
+#ifndef __KOS_NMMGR_H
+#define __KOS_NMMGR_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <limits.h>
+#include <sys/queue.h>
+#include <arch/types.h>
+
+#define NMMGR_FLAGS_NEEDSFREE   0x00000001
+#define NMMGR_TYPE_VFS          0x00010000
+
+typedef struct nmmgr_handler {
+    char    pathname[NAME_MAX];
+    int     pid;
+    uint32  version;
+    uint32  flags;
+    uint32  type;
+    LIST_ENTRY(nmmgr_handler) list_ent;
+} nmmgr_handler_t;
+
+#define NMMGR_LIST_INIT { NULL, NULL }
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd);
+int nmmgr_handler_remove(nmmgr_handler_t *hnd);
+nmmgr_handler_t *nmmgr_lookup(const char *name);
+
+__END_DECLS
+
+#endif /* __KOS_NMMGR_H */
@@ -0,0 +1,30 @@
+/* libfatfs host build
+
+   kos/rwsem.h
+   KallistiOS reader/writer semaphores mapped onto pthread rwlocks.
+*/
+
+#ifndef __KOS_RWSEM_H
+#define __KOS_RWSEM_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <pthread.h>
+
+typedef struct rw_semaphore {
+    pthread_rwlock_t l;
+} rw_semaphore_t;
+
+#define RWSEM_INITIALIZER { PTHREAD_RWLOCK_INITIALIZER }
+
+int rwsem_init(rw_semaphore_t *s);
+int rwsem_destroy(rw_semaphore_t *s);
+int rwsem_read_lock(rw_semaphore_t *s);
+int rwsem_read_unlock(rw_semaphore_t *s);
+int rwsem_write_lock(rw_semaphore_t *s);
+int rwsem_write_unlock(rw_semaphore_t *s);
+
+__END_DECLS
+
+#endif /* __KOS_RWSEM_H */
@@ -0,0 +1,25 @@
+/* libfatfs host build
+
+   kos/thread.h
+   KallistiOS threads mapped onto pthreads.
+*/
+
+#ifndef __KOS_THREAD_H
+#define __KOS_THREAD_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <pthread.h>
+
+typedef struct kthread {
+    pthread_t t;
+} kthread_t;
+
+kthread_t *thd_create(int detach, void *(*routine)(void *param), void *param);
+int thd_join(kthread_t *thd, void **value_ptr);
+void thd_pass(void);
+
+__END_DECLS
+
+#endif /* __KOS_THREAD_H */
@@ -0,0 +1,386 @@
+/* libfatfs host build
+
+   kos_compat.c
+   Just enough of the KallistiOS name manager, VFS dispatch and threading
+   primitives to run libfatfs in a normal Linux process.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <arch/timer.h>
+
+#include <kos/fs.h>
+#include <kos/cond.h>
+#include <kos/mutex.h>
+#include <kos/nmmgr.h>
+#include <kos/rwsem.h>
+#include <kos/thread.h>
+
+#define MAX_HOST_FDS 1024
+
+/* Registered handlers */
+static LIST_HEAD(nmmgr_list, nmmgr_handler) nmmgr_handlers =
+    LIST_HEAD_INITIALIZER(nmmgr_handlers);
+static pthread_mutex_t nmmgr_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Global file descriptor table, like the one in kernel/fs/fs.c */
+static struct {
+    vfs_handler_t *vfs;
+    void *hnd;
+} fds[MAX_HOST_FDS];
+static pthread_mutex_t fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int mutex_init(mutex_t *m, int mtype) {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+
+    if(mtype == MUTEX_TYPE_RECURSIVE)
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    else if(mtype == MUTEX_TYPE_ERRORCHECK)
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+
+    m->type = mtype;
+    pthread_mutex_init(&m->m, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return 0;
+}
+
+int mutex_destroy(mutex_t *m) {
+    return pthread_mutex_destroy(&m->m);
+}
+
+int mutex_lock(mutex_t *m) {
+    return pthread_mutex_lock(&m->m);
+}
+
+int mutex_trylock(mutex_t *m) {
+    if(pthread_mutex_trylock(&m->m)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mutex_unlock(mutex_t *m) {
+    return pthread_mutex_unlock(&m->m);
+}
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    pthread_mutex_lock(&nmmgr_mutex);
+    LIST_INSERT_HEAD(&nmmgr_handlers, hnd, list_ent);
+    pthread_mutex_unlock(&nmmgr_mutex);
+
+    return 0;
+}
+
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    pthread_mutex_lock(&nmmgr_mutex);
+    LIST_REMOVE(hnd, list_ent);
+    pthread_mutex_unlock(&nmmgr_mutex);
+
+    return 0;
+}
+
+/* Longest registered prefix of 'name' that ends on a path boundary */
+nmmgr_handler_t *nmmgr_lookup(const char *name) {
+    nmmgr_handler_t *cur, *best = NULL;
+    size_t len, best_len = 0;
+
+    pthread_mutex_lock(&nmmgr_mutex);
+
+    LIST_FOREACH(cur, &nmmgr_handlers, list_ent) {
+        len = strlen(cur->pathname);
+
+        if(!strncmp(cur->pathname, name, len) &&
+           (name[len] == '\0' || name[len] == '/') && len > best_len) {
+            best = cur;
+            best_len = len;
+        }
+    }
+
+    pthread_mutex_unlock(&nmmgr_mutex);
+
+    return best;
+}
+
+static vfs_handler_t *fs_resolve(const char *fn, const char **rel) {
+    nmmgr_handler_t *nm = nmmgr_lookup(fn);
+
+    if(!nm || nm->type != NMMGR_TYPE_VFS) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    *rel = fn + strlen(nm->pathname);
+    return (vfs_handler_t *)nm;
+}
+
+file_t fs_open_handle(vfs_handler_t *vfs, void *hnd) {
+    file_t fd;
+
+    pthread_mutex_lock(&fd_mutex);
+
+    for(fd = 0; fd < MAX_HOST_FDS; fd++) {
+        if(!fds[fd].vfs) {
+            fds[fd].vfs = vfs;
+            fds[fd].hnd = hnd;
+            pthread_mutex_unlock(&fd_mutex);
+            return fd;
+        }
+    }
+
+    pthread_mutex_unlock(&fd_mutex);
+    errno = EMFILE;
+    return FILEHND_INVALID;
+}
+
+file_t fs_open(const char *fn, int mode) {
+    const char *rel;
+    vfs_handler_t *vfs = fs_resolve(fn, &rel);
+    void *hnd;
+    file_t fd;
+
+    if(!vfs || !vfs->open)
+        return FILEHND_INVALID;
+
+    if(!(hnd = vfs->open(vfs, rel, mode)))
+        return FILEHND_INVALID;
+
+    if((fd = fs_open_handle(vfs, hnd)) == FILEHND_INVALID)
+        vfs->close(hnd);
+
+    return fd;
+}
+
+void *fs_get_handle(file_t fd) {
+    if(fd < 0 || fd >= MAX_HOST_FDS || !fds[fd].vfs) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    return fds[fd].hnd;
+}
+
+vfs_handler_t *fs_get_handler(file_t fd) {
+    if(fd < 0 || fd >= MAX_HOST_FDS || !fds[fd].vfs) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    return fds[fd].vfs;
+}
+
+int fs_close(file_t fd) {
+    vfs_handler_t *vfs = fs_get_handler(fd);
+    int rv = 0;
+
+    if(!vfs)
+        return -1;
+
+    if(vfs->close)
+        rv = vfs->close(fds[fd].hnd);
+
+    pthread_mutex_lock(&fd_mutex);
+    fds[fd].vfs = NULL;
+    fds[fd].hnd = NULL;
+    pthread_mutex_unlock(&fd_mutex);
+
+    return rv;
+}
+
+#define FS_DISPATCH(fd, slot, fail, ...) \
+    do { \
+        vfs_handler_t *vfs = fs_get_handler(fd); \
+        if(!vfs) return fail; \
+        if(!vfs->slot) { errno = EINVAL; return fail; } \
+        return vfs->slot(fds[fd].hnd, ##__VA_ARGS__); \
+    } while(0)
+
+ssize_t fs_read(file_t fd, void *buffer, size_t cnt) {
+    FS_DISPATCH(fd, read, -1, buffer, cnt);
+}
+
+ssize_t fs_write(file_t fd, const void *buffer, size_t cnt) {
+    FS_DISPATCH(fd, write, -1, buffer, cnt);
+}
+
+_off64_t fs_seek64(file_t fd, _off64_t offset, int whence) {
+    FS_DISPATCH(fd, seek64, -1, offset, whence);
+}
+
+off_t fs_seek(file_t fd, off_t offset, int whence) {
+    return (off_t)fs_seek64(fd, offset, whence);
+}
+
+_off64_t fs_tell64(file_t fd) {
+    FS_DISPATCH(fd, tell64, -1);
+}
+
+off_t fs_tell(file_t fd) {
+    return (off_t)fs_tell64(fd);
+}
+
+uint64 fs_total64(file_t fd) {
+    FS_DISPATCH(fd, total64, (uint64)-1);
+}
+
+size_t fs_total(file_t fd) {
+    return (size_t)fs_total64(fd);
+}
+
+dirent_t *fs_readdir(file_t fd) {
+    FS_DISPATCH(fd, readdir, NULL);
+}
+
+int fs_complete(file_t fd, ssize_t *rv) {
+    FS_DISPATCH(fd, complete, -1, rv);
+}
+
+int fs_ioctl(file_t fd, int cmd, ...) {
+    vfs_handler_t *vfs = fs_get_handler(fd);
+    va_list ap;
+    int rv;
+
+    if(!vfs)
+        return -1;
+
+    if(!vfs->ioctl) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    va_start(ap, cmd);
+    rv = vfs->ioctl(fds[fd].hnd, cmd, ap);
+    va_end(ap);
+
+    return rv;
+}
+
+int fs_fcntl(file_t fd, int cmd, ...) {
+    vfs_handler_t *vfs = fs_get_handler(fd);
+    va_list ap;
+    int rv;
+
+    if(!vfs)
+        return -1;
+
+    if(!vfs->fcntl) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    va_start(ap, cmd);
+    rv = vfs->fcntl(fds[fd].hnd, cmd, ap);
+    va_end(ap);
+
+    return rv;
+}
+
+#define FS_PATH_DISPATCH(fn, slot, ...) \
+    do { \
+        const char *rel; \
+        vfs_handler_t *vfs = fs_resolve(fn, &rel); \
+        if(!vfs) return -1; \
+        if(!vfs->slot) { errno = ENOSYS; return -1; } \
+        return vfs->slot(vfs, rel, ##__VA_ARGS__); \
+    } while(0)
+
+int fs_unlink(const char *fn) {
+    FS_PATH_DISPATCH(fn, unlink);
+}
+
+int fs_mkdir(const char *fn) {
+    FS_PATH_DISPATCH(fn, mkdir);
+}
+
+int fs_rmdir(const char *fn) {
+    FS_PATH_DISPATCH(fn, rmdir);
+}
+
+int fs_stat(const char *fn, struct stat *buf, int flag) {
+    FS_PATH_DISPATCH(fn, stat, buf, flag);
+}
+
+int fs_rename(const char *fn1, const char *fn2) {
+    const char *rel1, *rel2;
+    vfs_handler_t *vfs1 = fs_resolve(fn1, &rel1);
+    vfs_handler_t *vfs2 = fs_resolve(fn2, &rel2);
+
+    if(!vfs1 || !vfs2)
+        return -1;
+
+    if(vfs1 != vfs2) {
+        errno = EXDEV;
+        return -1;
+    }
+
+    if(!vfs1->rename) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return vfs1->rename(vfs1, rel1, rel2);
+}
+
+/* Reader/writer semaphores */
+int rwsem_init(rw_semaphore_t *s) { return pthread_rwlock_init(&s->l, NULL) ? -1 : 0; }
+int rwsem_destroy(rw_semaphore_t *s) { return pthread_rwlock_destroy(&s->l) ? -1 : 0; }
+int rwsem_read_lock(rw_semaphore_t *s) { return pthread_rwlock_rdlock(&s->l) ? -1 : 0; }
+int rwsem_read_unlock(rw_semaphore_t *s) { return pthread_rwlock_unlock(&s->l) ? -1 : 0; }
+int rwsem_write_lock(rw_semaphore_t *s) { return pthread_rwlock_wrlock(&s->l) ? -1 : 0; }
+int rwsem_write_unlock(rw_semaphore_t *s) { return pthread_rwlock_unlock(&s->l) ? -1 : 0; }
+
+/* Condition variables */
+int cond_init(condvar_t *cv) { return pthread_cond_init(&cv->c, NULL) ? -1 : 0; }
+int cond_destroy(condvar_t *cv) { return pthread_cond_destroy(&cv->c) ? -1 : 0; }
+int cond_wait(condvar_t *cv, mutex_t *m) { return pthread_cond_wait(&cv->c, &m->m) ? -1 : 0; }
+int cond_signal(condvar_t *cv) { return pthread_cond_signal(&cv->c) ? -1 : 0; }
+int cond_broadcast(condvar_t *cv) { return pthread_cond_broadcast(&cv->c) ? -1 : 0; }
+
+/* Threads. A detached thread keeps its kthread_t, nothing ever joins it */
+kthread_t *thd_create(int detach, void *(*routine)(void *param), void *param) {
+    kthread_t *thd = (kthread_t *)malloc(sizeof(kthread_t));
+
+    if(!thd)
+        return NULL;
+
+    if(pthread_create(&thd->t, NULL, routine, param)) {
+        free(thd);
+        return NULL;
+    }
+
+    if(detach)
+        pthread_detach(thd->t);
+
+    return thd;
+}
+
+int thd_join(kthread_t *thd, void **value_ptr) {
+    int rv = pthread_join(thd->t, value_ptr) ? -1 : 0;
+
+    free(thd);
+    return rv;
+}
+
+void thd_pass(void) { sched_yield(); }
+
+/* Timer */
+uint64 timer_us_gettime64(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64 timer_ms_gettime64(void) {
+    return timer_us_gettime64() / 1000;
+}
@@ -0,0 +1,66 @@
+
+#ifndef _FAT_TRACE_H_
+#define _FAT_TRACE_H_
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kos/blockdev.h>
+
+/* Who asked for a block. libfatfs tags everything it reads/writes, anything else is FAT_TRACE_OTHER */
+#define FAT_TRACE_BOOT      0   /* Boot sector */
+#define FAT_TRACE_FSINFO    1   /* FSInfo sector(FAT32) */
+#define FAT_TRACE_FAT       2   /* File allocation table */
+#define FAT_TRACE_DIR       3   /* Directory entries */
+#define FAT_TRACE_DATA      4   /* File contents */
+#define FAT_TRACE_OTHER     5
+#define FAT_TRACE_NUM_TAGS  6
+
+/* Formats for fat_trace_dump() */
+#define FAT_TRACE_CSV       0
+#define FAT_TRACE_BINARY    1
+
+typedef struct fat_trace_rec {
+    uint64_t time_us;       /* When the request was issued. Microseconds since the trace was created */
+    uint64_t block;         /* First block(LBA) */
+    uint32_t latency_us;    /* How long the device took */
+    uint32_t count;         /* Number of blocks */
+    uint8_t  write;         /* 0 - read, 1 - write */
+    uint8_t  tag;           /* FAT_TRACE_* */
+    uint8_t  error;         /* 1 if the device returned an error */
+} fat_trace_rec_t;
+
+/* Make trace a block device that passes every request on to dev and records it in a ring buffer of
+   ring_size records(oldest are overwritten once it is full). Mount trace instead of dev. Traces can
+   be stacked. Returns 0 or -1 with errno set */
+int fat_trace_create(kos_blockdev_t *trace, kos_blockdev_t *dev, size_t ring_size);
+
+/* Free the ring buffer. Doesn't touch the device underneath. Unmount first */
+void fat_trace_destroy(kos_blockdev_t *trace);
+
+/* Copy up to max records, oldest first. Returns how many were copied */
+size_t fat_trace_get(kos_blockdev_t *trace, fat_trace_rec_t *recs, size_t max);
+
+/* Records in the ring right now and records that were overwritten since the last clear */
+size_t fat_trace_count(kos_blockdev_t *trace, uint64_t *dropped);
+
+void fat_trace_clear(kos_blockdev_t *trace);
+
+/* Write the ring(oldest first) to path as CSV or the binary format fat_trace_load() reads */
+int fat_trace_dump(kos_blockdev_t *trace, const char *path, int format);
+
+/* Read a dump(CSV or binary) into a malloc'd array. Returns the number of records or -1 */
+int fat_trace_load(const char *path, fat_trace_rec_t **recs);
+
+const char *fat_trace_tag_name(int tag);
+
+/* read_blocks()/write_blocks() on dev with a tag. libfatfs does all its I/O through these. If dev is a
+   trace the request is recorded with tag, otherwise it is a plain read_blocks()/write_blocks() */
+int fat_dev_read(kos_blockdev_t *dev, int tag, uint64_t block, size_t count, void *buf);
+int fat_dev_write(kos_blockdev_t *dev, int tag, uint64_t block, size_t count, const void *buf);
+
+__END_DECLS
+
+#endif /* _FAT_TRACE_H_ */
@@ -7,6 +7,8 @@
 __BEGIN_DECLS
 
 #include <stdint.h>
+#include <sys/stat.h>
+#include <kos/fs.h>
 #include <kos/blockdev.h>
 
 int fs_fat_init(void);
@@ -16,13 +18,206 @@ int fs_fat_shutdown(void);
 /* Mount flags */
 #define FS_FAT_MOUNT_READONLY      0x00000000  /**< \brief Mount read-only */
 #define FS_FAT_MOUNT_READWRITE     0x00000001  /**< \brief Mount read-write */
+#define FS_FAT_MOUNT_DISCARD       0x00000002  /**< \brief Discard freed clusters(see fs_fat_set_discard()) */
 
 int fat_partition(uint8 partition_type);
 
 int fs_fat_mount(const char *mp, kos_blockdev_t *dev, uint32_t flags);
 
+/* Mount with options. opts can be NULL, which is the same as fs_fat_mount().
+   With au_bytes set, clusters are allocated with the allocation units(AUs, erase blocks) of the card in mind, as
+   SD cards write fastest when each AU is written from start to end: files keep going in their AU, big files(and
+   streams, once they get big) are given whole free AUs and small files are packed into AUs already in use.
+   The mount reads the whole FAT once to count the used clusters of every AU */
+typedef struct fs_fat_mount_opts {
+    uint32_t au_bytes;                        /* AU size of the card. Power of 2, 0 for first free cluster allocation */
+    uint32_t stream_bytes;                    /* Files that get this big are big. 0 for a quarter AU */
+} fs_fat_mount_opts_t;
+
+int fs_fat_mount_ex(const char *mp, kos_blockdev_t *dev, uint32_t flags, const fs_fat_mount_opts_t *opts);
+
 int fs_fat_unmount(const char *mp);
 
+/* KOS block devices have no discard(TRIM) call, so the function that tells dev some of its blocks aren't used
+   anymore is set here. Mounts of dev made with FS_FAT_MOUNT_DISCARD after this call it for the clusters they
+   free(unlink, truncate, fs_fat_check() and fs_fat_defrag()), one call per run of clusters next to each other.
+   Errors from it are only counted. fn NULL removes it */
+typedef int (*fs_fat_discard_fn)(kos_blockdev_t *dev, uint64_t block, size_t count);
+
+int fs_fat_set_discard(kos_blockdev_t *dev, fs_fat_discard_fn fn);
+
+/* Lookups relative to a directory opened with O_DIR on a FAT mount. fn must not start with the mount name.
+   Opening a subdirectory with O_DIR gives a descriptor for fs_readdir() and further *at() calls. */
+file_t fs_fat_openat(file_t dirfd, const char *fn, int mode);
+
+int fs_fat_fstatat(file_t dirfd, const char *fn, struct stat *st, int flag);
+
+/* stat() of the file or directory behind fd. Like stat() on a path(fs_stat()), it is filled in from the directory
+   entry: size, attributes(as st_mode) and the write, access and creation times as st_mtime, st_atime and st_ctime */
+int fs_fat_fstat(file_t fd, struct stat *st);
+
+/* Read/write at an explicit offset. The file pointer of fd isn't used or moved.
+   fs_fat_pread() calls on the same fd can run at the same time. Writing past the end of the file fills the gap with
+   zeros. FAT files end at 4GB - 1: reads from there on return 0, writes that would go past it fail with EFBIG */
+ssize_t fs_fat_pread(file_t fd, void *buf, size_t cnt, off_t offset);
+
+ssize_t fs_fat_pwrite(file_t fd, const void *buf, size_t cnt, off_t offset);
+
+/* Cut the file behind fd(opened for writing) down to length bytes or grow it to that with zeros. The file pointer
+   doesn't move. Every handle of the file sees the new size. Returns 0 or -1(ENOSPC leaves the file as it was) */
+int fs_fat_ftruncate(file_t fd, off_t length);
+
+/* Async reads/writes. Requests are done in the background by worker threads in no particular order, so wait
+   for a write before reading what it wrote. A request belongs to fs_fat from fs_fat_aio_submit() until it is done. */
+#define FS_FAT_AIO_READ   0
+#define FS_FAT_AIO_WRITE  1
+
+typedef struct fs_fat_aio fs_fat_aio_t;
+
+struct fs_fat_aio {
+    /* Filled in by the caller */
+    file_t  fd;
+    int     op;                               /* FS_FAT_AIO_READ or FS_FAT_AIO_WRITE */
+    void    *buf;
+    size_t  cnt;
+    off_t   offset;                           /* The file pointer of fd isn't used or moved */
+    void    (*callback)(fs_fat_aio_t *req);   /* Called by the worker thread when the request is finished. Can be NULL */
+    void    *arg;                             /* For the callback */
+
+    /* Filled in by fs_fat */
+    int     done;                             /* Check with fs_fat_aio_done() */
+    ssize_t result;                           /* Bytes read/written or -1 */
+    int     error;                            /* errno when result is -1 */
+    fs_fat_aio_t *next;
+    void    *hnd;
+};
+
+int fs_fat_aio_submit(fs_fat_aio_t *reqs, int cnt);
+
+int fs_fat_aio_done(fs_fat_aio_t *req);
+
+ssize_t fs_fat_aio_wait(fs_fat_aio_t *req);
+
+/* Statistics of a mount. fs_ioctl() on any handle of the mount(or the mount itself, fs_open("/sd", O_RDONLY | O_DIR)):
+   fs_ioctl(fd, FS_FAT_IOCTL_GET_STATS, &stats) or fs_ioctl(fd, FS_FAT_IOCTL_RESET_STATS) */
+#define FS_FAT_IOCTL_GET_STATS     0x46415401  /* fs_fat_stats_t * */
+#define FS_FAT_IOCTL_RESET_STATS   0x46415402
+
+/* Operations that are timed. fs_fat_pread()/fs_fat_pwrite() count as read/write */
+#define FS_FAT_OP_OPEN      0
+#define FS_FAT_OP_READ      1
+#define FS_FAT_OP_WRITE     2
+#define FS_FAT_OP_READDIR   3
+#define FS_FAT_OP_UNLINK    4
+#define FS_FAT_OP_RENAME    5
+#define FS_FAT_OP_MKDIR     6
+#define FS_FAT_NUM_OPS      7
+
+/* hist[0] counts calls that took under 1us, hist[i] calls that took 2^(i-1) to 2^i - 1us. The last one gets everything slower */
+#define FS_FAT_HIST_BUCKETS 24
+
+typedef struct fs_fat_op_stats {
+    uint64_t count;
+    uint64_t errors;                          /* Calls that returned an error */
+    uint64_t total_us;                        /* Time spent in the calls, waiting for locks included */
+    uint32_t max_us;
+    uint32_t hist[FS_FAT_HIST_BUCKETS];
+} fs_fat_op_stats_t;
+
+typedef struct fs_fat_stats {
+    fs_fat_op_stats_t ops[FS_FAT_NUM_OPS];    /* FS_FAT_OP_* */
+
+    uint64_t dev_reads;                       /* Requests to the block device */
+    uint64_t dev_writes;
+    uint64_t dev_blocks_read;
+    uint64_t dev_blocks_written;
+    uint64_t dev_discards;
+    uint64_t dev_blocks_discarded;
+    uint64_t dev_errors;
+    uint64_t dev_us;                          /* Time spent in the block device */
+
+    uint64_t fat_hits;                        /* FAT lookups the cached FAT sector had */
+    uint64_t fat_misses;                      /* FAT lookups that had to read a sector */
+
+    uint64_t lookups;                         /* Names looked up in a directory */
+    uint64_t lookup_sectors;                  /* Directory sectors those went through */
+    uint32_t lookup_sectors_max;              /* Most sectors one lookup went through */
+
+    uint64_t clusters_allocated;
+    uint64_t clusters_freed;
+    uint32_t au_total;                        /* AUs the volume has all of. 0 without au_bytes */
+    uint32_t au_free;                         /* Of those, the ones nothing uses right now */
+
+    uint64_t since_us;                        /* timer_us_gettime64() when the mount was made or the stats were reset */
+} fs_fat_stats_t;
+
+/* Online defragmenter. Moves fragmented files of the mount at mp(opened read-write) into runs of free
+   clusters, worst first. Files that are open are skipped. The mount can't be changed while it runs,
+   so keep max_files/max_clusters small for short steps and call it again until it returns 0 or moves
+   nothing. Returns the number of fragmented files left or -1(errno ECANCELED when *cancel got set) */
+typedef struct fs_fat_defrag {
+    /* Filled in by the caller. 0 for no limit */
+    uint32_t max_files;                       /* Most files to move in this call */
+    uint32_t max_clusters;                    /* Most clusters to move in this call */
+    uint32_t min_extents;                     /* Only move files with at least this many pieces(2 if less) */
+    volatile int *cancel;                     /* Stops between transfers once *cancel is non-zero. Can be NULL */
+
+    /* Filled in by fs_fat */
+    uint32_t files_fragmented;                /* Files that had at least min_extents pieces */
+    uint32_t files_moved;
+    uint32_t files_skipped;                   /* Open, over the limits or no free run big enough */
+    uint32_t clusters_moved;
+    uint32_t extents_before;                  /* Pieces the fragmented files had */
+} fs_fat_defrag_t;
+
+int fs_fat_defrag(const char *mp, fs_fat_defrag_t *d);
+
+/* Put a new FAT16/FAT32 volume on dev, which can't be mounted. The FAT and the data area(so every cluster) start
+   on an erase block boundary, counted from the start of dev, so a partition should start on one too. fmt can be
+   NULL for the defaults and is filled in with the layout used */
+typedef struct fs_fat_format {
+    /* Filled in by the caller. 0 to let fs_fat pick */
+    uint32_t fat_type;                        /* 16 or 32. FAT32 over 2GB, FAT16 below(like SD/SDHC cards) */
+    uint32_t sectors_per_cluster;             /* Power of 2 up to 128. 16KB clusters up to 1GB, 32KB above */
+    uint32_t align_bytes;                     /* Erase block size. Power of 2, default 4MB(less on small volumes) */
+    const char *label;                        /* Up to 11 characters. NULL for "NO NAME" */
+
+    /* Filled in by fs_fat, in sectors */
+    uint32_t fat_start;
+    uint32_t fat_sectors;                     /* Size of one FAT */
+    uint32_t root_start;                      /* FAT16 root directory. End of the FATs on FAT32 */
+    uint32_t data_start;                      /* Cluster 2 */
+    uint32_t clusters;
+} fs_fat_format_t;
+
+int fs_fat_format(kos_blockdev_t *dev, fs_fat_format_t *fmt);
+
+/* Consistency check of the mount at mp. Every folder is read(by 'threads' threads at the same time), then every
+   cluster chain is followed to find chains that are broken, cross-linked or don't match the size of their file
+   and clusters nothing uses(lost). With fix set these get repaired: chains are cut short, sizes made to match,
+   lost clusters freed and the FSInfo free count recomputed. Fixing needs the mount read-write with nothing on it
+   open. Returns the number of problems found or -1 */
+typedef struct fs_fat_check {
+    /* Filled in by the caller */
+    int      fix;                             /* 0 to only report */
+    int      threads;                         /* Folder readers. 0 for 1 */
+    void     (*report)(const char *path, const char *problem, void *arg);   /* Called for every problem. Can be NULL */
+    void     *arg;                            /* For report */
+
+    /* Filled in by fs_fat */
+    uint32_t files;
+    uint32_t folders;
+    uint32_t bad_chains;                      /* Chains that ran into a free or invalid cluster */
+    uint32_t cross_links;                     /* Chains that ran into a cluster something else uses */
+    uint32_t bad_sizes;                       /* Files whose size doesn't match their clusters, folders with a size */
+    uint32_t lost_chains;
+    uint32_t lost_clusters;
+    uint32_t free_clusters;                   /* After fixing */
+    uint32_t fixed;                           /* Problems that got repaired */
+} fs_fat_check_t;
+
+int fs_fat_check(const char *mp, fs_fat_check_t *c);
+
 __END_DECLS
 
 #endif /* _FS_FAT_H_ */
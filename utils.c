@@ -10,9 +10,7 @@
 #include "utils.h"
 #include "fatfs.h"
 #include "fat_defs.h"
-
-/* Used to hold FSInfo sector so we dont have to keep reading it. */
-static unsigned char buffer[512];
+#include "dir_cache.h"
 
 int num_alpha(char *str)
 {
@@ -80,14 +78,66 @@ int contains_lowercase(const char *str)
 	return count;
 }
 
+/* Turn 'fn' into the way a short name is stored on disk: 8 + 3 characters, upper case, padded with spaces and no period.
+   Trailing spaces of both parts are padding, so the padded names generate_short_filename() tries("A_B~1   .TXT")
+   give the key of the entry too. key has to hold 16 bytes(the last 5 are zeroed). Returns -1 if fn can not be a
+   short name at all */
+int make_short_key(const char *fn, unsigned char *key)
+{
+	int i;
+	int base_len;
+	int ext_len = 0;
+	const char *dot = strrchr(fn, '.');
+	
+	base_len = (dot != NULL) ? dot - fn : strlen(fn);
+	
+	if(dot != NULL)
+		ext_len = strlen(dot + 1);
+	
+	if(dot != NULL && ext_len == 0)
+		return -1;
+	
+	while(base_len > 0 && fn[base_len-1] == ' ')
+		base_len--;
+	
+	while(ext_len > 0 && dot[ext_len] == ' ')
+		ext_len--;
+	
+	if(base_len < 1 || base_len > 8 || ext_len > 3)
+		return -1;
+	
+	memset(key, ' ', 11);
+	memset(key + 11, 0, 5);
+	
+	for(i = 0; i < base_len; i++)
+	{
+		if(fn[i] == '.' || fn[i] == ' ')
+			return -1;
+		
+		key[i] = toupper((int)fn[i]);
+	}
+	
+	for(i = 0; i < ext_len; i++)
+	{
+		if(dot[i+1] == ' ')
+			return -1;
+		
+		key[8+i] = toupper((int)dot[i+1]);
+	}
+	
+	return 0;
+}
+
 /* http://stackoverflow.com/questions/1071542/in-c-check-if-a-char-exists-in-a-char-array */
 int correct_filename(const char* str)
 {
    const char *invalid_characters = "\\?:*\"><|";
    const char *c = str;
    
-   /* Make sure the string is long and short enough */
-   if(strlen(str) > 255 || strlen(str) <= 0)
+   unsigned short ucs[255];
+   
+   /* Make sure the string is long and short enough. Long file names hold up to 255 UCS-2 characters */
+   if(strlen(str) <= 0 || utf8_to_ucs2((const unsigned char *)str, ucs, 255) < 0)
    {
 #ifdef FATFS_DEBUG
        printf("Invalid filename, strlen: %d\n", strlen(str)); 
@@ -127,21 +177,33 @@ char *generate_short_filename(fatfs_t *fat, node_entry_t *curdir, char * fn, int
 	char *copy = NULL;
 	char *integer_string = malloc(7); 
 	
+	char *c;
 	char *fn_temp;
 	char *filename = malloc(strlen(fn)+1); 
 	char *ext = malloc(4);      
 	char *fn_final;
+	node_entry_t *found;
 	
 	/* 1. Remove all spaces. For example "My File" becomes "MyFile". */
 	copy = remove_all_chars(fn, ' ');
 	
 	/* 3. Translate all illegal 8.3 characters( : + , ; = [ ] ) into "_" (underscore). For example, "The[First]Folder" becomes "The_First_Folder". */
 	replace_all_chars(&copy, ":+,;=[]", '_');
+	
+	/* Anything outside of ASCII cant go in a short name either. The long file name keeps the real name */
+	for(c = copy; *c; c++)
+	{
+		if((unsigned char)*c >= 0x80)
+		{
+			*c = '_';
+			*lfn = 1;
+		}
+	}
 
 	/* 2. Initial periods, trailing periods, and extra periods prior to the last embedded period are removed.
 	For example ".logon" becomes "logon", "junk.c.o" becomes "junkc.o", and "main." becomes "main". */
 
-	temp1 = malloc(strlen(fn)+1);
+	temp1 = malloc(strlen(fn)+13); /* Short names get padded to "XXXXXXXX.XXX" even when fn is shorter */
 	
 	strncpy(filename, strtok(copy, "."), strlen(fn)); /* Copy Filename */
 	filename[strlen(fn)] = '\0';
@@ -292,8 +354,10 @@ length of the basis is shortened until the new name fits in 8 characters. For ex
 			fn_temp[i] = toupper((int)fn_temp[i]);
 	}
 	
-	while(search_directory(fat, curdir, fn_temp) != NULL)
+	while((found = search_directory(fat, curdir, fn_temp)) != NULL)
 	{
+		delete_struct_entry(found);
+		
 		if(diff > 99999)
 		{
 #ifdef FATFS_DEBUG
@@ -400,145 +464,153 @@ length of the basis is shortened until the new name fits in 8 characters. For ex
 	return fn_final;
 }
 
-fat_lfn_entry_t *generate_long_filename_entry(char * fn, unsigned char checksum, unsigned char order)
+/* Byte offsets of the 13 UCS-2 characters inside a long file name entry(FNPart1, FNPart2 and FNPart3) */
+static const unsigned char lfn_char_offset[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+/* Fill in long file name entry number 'order'(starts at 1) of the UCS-2 name 'name' that is 'len' characters long.
+   The entry holds characters (order-1)*13 up to 13 more. After the end of the name comes 0x0000 and then 0xFFFF filler */
+void generate_long_filename_entry(fat_lfn_entry_t *lfn_entry, const unsigned short *name, int len, unsigned char checksum, unsigned char order)
 {
 	int i;
-	unsigned char *filename = malloc(13);
-	fat_lfn_entry_t *lfn_entry = malloc(sizeof(fat_lfn_entry_t));
+	int pos = (order - 1)*13;
+	unsigned short c;
+	unsigned char *raw = (unsigned char *)lfn_entry;
 	
-	strncpy(filename,fn, 13);
+	memset(lfn_entry, 0, sizeof(fat_lfn_entry_t));
 	
-	if(strlen(filename) < 13)
-	{
-		filename[strlen(filename)] = '\0';
-		
-		for(i = strlen(filename)+1; i < 13; i++)
-		{
-			filename[i] = 0xFF;
-		}
-	}
-
 	lfn_entry->Order = order;
+	lfn_entry->Attr = 0xF; /* Specifying it is a long name entry */
 	lfn_entry->Checksum = checksum;
 	lfn_entry->Cluster = 0;
 	
-	memset(lfn_entry->FNPart1, 0, 10);
-	memset(lfn_entry->FNPart2, 0, 12);
-	memset(lfn_entry->FNPart3, 0, 4);
-	
-	/* Part One */
-	if(filename[0] == 0xFF)
-	{
-		lfn_entry->FNPart1[0] = 0xFF;
-		lfn_entry->FNPart1[1] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart1[0] = filename[0];
-		
-	if(filename[1] == 0xFF)
+	for(i = 0; i < 13; i++, pos++)
 	{
-		lfn_entry->FNPart1[2] = 0xFF;
-		lfn_entry->FNPart1[3] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart1[2] = filename[1];
+		if(pos < len)
+			c = name[pos];
+		else if(pos == len)
+			c = 0x0000;
+		else
+			c = 0xFFFF;
 		
-	if(filename[2] == 0xFF)
-	{
-		lfn_entry->FNPart1[4] = 0xFF;
-		lfn_entry->FNPart1[5] = 0xFF;
+		/* Stored little endian no matter what we run on */
+		raw[lfn_char_offset[i]] = c & 0xFF;
+		raw[lfn_char_offset[i] + 1] = c >> 8;
 	}
-	else 
-		lfn_entry->FNPart1[4] = filename[2];
+}
+
+/* Copy the 13 UCS-2 characters of a long file name entry(raw 32 bytes) into out. Returns how many belong to
+   the name(the 0x0000 terminator and the 0xFFFF filler after it dont) */
+int extract_long_name(const unsigned char *entry, unsigned short *out)
+{
+	int i;
 	
-	if(filename[3] == 0xFF)
+	for(i = 0; i < 13; i++)
 	{
-		lfn_entry->FNPart1[6] = 0xFF;
-		lfn_entry->FNPart1[7] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart1[6] = filename[3];
+		out[i] = entry[lfn_char_offset[i]] | (entry[lfn_char_offset[i] + 1] << 8);
 		
-	if(filename[4] == 0xFF)
-	{
-		lfn_entry->FNPart1[8] = 0xFF;
-		lfn_entry->FNPart1[9] = 0xFF;
+		if(out[i] == 0x0000)
+			break;
 	}
-	else 
-		lfn_entry->FNPart1[8] = filename[4];
+	
+	return i;
+}
 
+/* Decode the UTF-8 string str into UCS-2(characters above 0xFFFF become surrogate pairs). 
+   Returns the number of characters or -1 if str is not valid UTF-8 or needs more than 'max' characters */
+int utf8_to_ucs2(const unsigned char *str, unsigned short *out, int max)
+{
+	int len = 0;
+	unsigned int c;
 	
-	/* Part Two */
-	if(filename[5] == 0xFF)
+	while(*str)
 	{
-		lfn_entry->FNPart2[0] = 0xFF;
-		lfn_entry->FNPart2[1] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart2[0] = filename[5];
+		if(str[0] < 0x80)
+		{
+			c = str[0];
+			str += 1;
+		}
+		else if((str[0] & 0xE0) == 0xC0 && (str[1] & 0xC0) == 0x80)
+		{
+			c = ((str[0] & 0x1F) << 6) | (str[1] & 0x3F);
+			str += 2;
+			
+			if(c < 0x80) /* Overlong */
+				return -1;
+		}
+		else if((str[0] & 0xF0) == 0xE0 && (str[1] & 0xC0) == 0x80 && (str[2] & 0xC0) == 0x80)
+		{
+			c = ((str[0] & 0x0F) << 12) | ((str[1] & 0x3F) << 6) | (str[2] & 0x3F);
+			str += 3;
+			
+			if(c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))
+				return -1;
+		}
+		else if((str[0] & 0xF8) == 0xF0 && (str[1] & 0xC0) == 0x80 && (str[2] & 0xC0) == 0x80 && (str[3] & 0xC0) == 0x80)
+		{
+			c = ((str[0] & 0x07) << 18) | ((str[1] & 0x3F) << 12) | ((str[2] & 0x3F) << 6) | (str[3] & 0x3F);
+			str += 4;
+			
+			if(c < 0x10000 || c > 0x10FFFF || len + 2 > max)
+				return -1;
+			
+			c -= 0x10000;
+			out[len++] = 0xD800 | (c >> 10);
+			out[len++] = 0xDC00 | (c & 0x3FF);
+			continue;
+		}
+		else
+			return -1;
 		
-	if(filename[6] == 0xFF)
-	{
-		lfn_entry->FNPart2[2] = 0xFF;
-		lfn_entry->FNPart2[3] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart2[2] = filename[6];
+		if(len == max)
+			return -1;
 		
-	if(filename[7] == 0xFF)
-	{
-		lfn_entry->FNPart2[4] = 0xFF;
-		lfn_entry->FNPart2[5] = 0xFF;
+		out[len++] = c;
 	}
-	else 
-		lfn_entry->FNPart2[4] = filename[7];
 	
-	if(filename[8] == 0xFF)
-	{
-		lfn_entry->FNPart2[6] = 0xFF;
-		lfn_entry->FNPart2[7] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart2[6] = filename[8];
-		
-	if(filename[9] == 0xFF)
-	{
-		lfn_entry->FNPart2[8] = 0xFF;
-		lfn_entry->FNPart2[9] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart2[8] = filename[9];
-		
-	if(filename[10] == 0xFF)
-	{
-		lfn_entry->FNPart2[10] = 0xFF;
-		lfn_entry->FNPart2[11] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart2[10] = filename[10];
+	return len;
+}
+
+/* Encode 'len' UCS-2 characters as UTF-8. out needs room for len*3 + 1 bytes. Returns the number of bytes written(not counting the NUL) */
+int ucs2_to_utf8(const unsigned short *in, int len, unsigned char *out)
+{
+	int i;
+	unsigned int c;
+	unsigned char *o = out;
 	
-	/* Part 3 */
-	if(filename[11] == 0xFF)
+	for(i = 0; i < len; i++)
 	{
-		lfn_entry->FNPart3[0] = 0xFF;
-		lfn_entry->FNPart3[1] = 0xFF;
-	}
-	else 
-		lfn_entry->FNPart3[0] = filename[11];
+		c = in[i];
 		
-	if(filename[12] == 0xFF)
-	{
-		lfn_entry->FNPart3[2] = 0xFF;
-		lfn_entry->FNPart3[3] = 0xFF;
+		/* Put surrogate pairs back together */
+		if(c >= 0xD800 && c <= 0xDBFF && i + 1 < len && in[i+1] >= 0xDC00 && in[i+1] <= 0xDFFF)
+		{
+			c = 0x10000 + ((c - 0xD800) << 10) + (in[++i] - 0xDC00);
+			
+			*o++ = 0xF0 | (c >> 18);
+			*o++ = 0x80 | ((c >> 12) & 0x3F);
+			*o++ = 0x80 | ((c >> 6) & 0x3F);
+			*o++ = 0x80 | (c & 0x3F);
+		}
+		else if(c < 0x80)
+		{
+			*o++ = c;
+		}
+		else if(c < 0x800)
+		{
+			*o++ = 0xC0 | (c >> 6);
+			*o++ = 0x80 | (c & 0x3F);
+		}
+		else
+		{
+			*o++ = 0xE0 | (c >> 12);
+			*o++ = 0x80 | ((c >> 6) & 0x3F);
+			*o++ = 0x80 | (c & 0x3F);
+		}
 	}
-	else 
-		lfn_entry->FNPart3[2] = filename[12];
 	
-	lfn_entry->Attr = 0xF; /* Specifying it is a long name entry */
-
-	free(filename);
+	*o = '\0';
 	
-	return lfn_entry;
+	return o - out;
 }
 
 unsigned char generate_checksum(char * short_filename)
@@ -576,10 +648,10 @@ int write_entry(fatfs_t *fat, void * entry, unsigned char attr, int loc[])
 	time_t rawtime;
 	short int tme = 0;
 	short int date = 0;
-	struct tm * timeinfo;
+	struct tm timeinfo;
 	
 	time (&rawtime);
-	timeinfo = localtime (&rawtime);
+	localtime_r(&rawtime, &timeinfo);
 	
 	if(attr == 0x0F)
 	{
@@ -594,7 +666,7 @@ int write_entry(fatfs_t *fat, void * entry, unsigned char attr, int loc[])
 	memset(sector, 0, 512*sizeof(unsigned char));
 		
 	/* Read it */
-	fat->dev->read_blocks(fat->dev, loc[0], 1, sector); 
+	fat_read_sectors(fat, FAT_TRACE_DIR, loc[0], 1, sector); 
 	
 	if(attr == 0x0F) /* Long file entry */
 	{
@@ -608,8 +680,8 @@ int write_entry(fatfs_t *fat, void * entry, unsigned char attr, int loc[])
 	}
 	else             /* File/folder entry */
 	{
-		tme = generate_time(timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec/2);
-		date = generate_date(1900 + timeinfo->tm_year, timeinfo->tm_mon+1, timeinfo->tm_mday);
+		tme = generate_time(timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec/2);
+		date = generate_date(1900 + timeinfo.tm_year, timeinfo.tm_mon+1, timeinfo.tm_mday);
 		
 		memset(sector + loc[1], 0, ENTRYSIZE);
 		memcpy(sector + loc[1] + FILENAME, f_entry->FileName, 8);
@@ -623,6 +695,10 @@ int write_entry(fatfs_t *fat, void * entry, unsigned char attr, int loc[])
 		memcpy(sector + loc[1] + LASTWRITETIME, &(tme), 2);
 		memcpy(sector + loc[1] + LASTWRITEDATE, &(date), 2);
 		
+		/* For whoever builds a node for it */
+		f_entry->CrtTime = tme;
+		f_entry->CrtDate = date;
+		
 		memcpy(sector + loc[1] + STARTCLUSTERHI, &(f_entry->FstClusHI), 2);
 		memcpy(sector + loc[1] + STARTCLUSTERLOW, &(f_entry->FstClusLO), 2);
 		memcpy(sector + loc[1] + FILESIZE, &(f_entry->FileSize), 4);
@@ -630,33 +706,27 @@ int write_entry(fatfs_t *fat, void * entry, unsigned char attr, int loc[])
 	}
 	
 	/* Write it back */
-	fat->dev->write_blocks(fat->dev, loc[0], 1, sector);
+	fat_write_sectors(fat, FAT_TRACE_DIR, loc[0], 1, sector);
 
 	free(sector);
 	
 	return 0;
 }
 
-int *get_free_locations(fatfs_t *fat, node_entry_t *curdir, int num_entries)
+/* Read every sector of a directory and build its free slot map */
+static fat_dir_cache_t *scan_free_locations(fatfs_t *fat, node_entry_t *curdir)
 {
 	int i;
-	int j;
-	int empty_entry_count = 0;
 	int sector_loc;
-	int ptr_loc;
-	int *locations = malloc(sizeof(int)*2);
+	fat_dir_cache_t build;
 	unsigned char  *sector = malloc(512*sizeof(unsigned char)); /* Each sector is 512 bytes long */
 	unsigned int cur_cluster = curdir->StartCluster;
 	
-	locations[0] = -1;
-	locations[1] = -1;
-	
-#ifdef FATFS_DEBUG
-	printf("Trying to create the file in this directory: %s\n", curdir->Name);
-#endif
+	dir_cache_begin(&build, curdir->StartCluster);
+	build.no_bloom = 1;   /* Only the free entries are looked at here */
 	
 	/* Dealing with root directory (FAT16 only) */
-	if(fat->fat_type == FAT16 && strcasecmp(curdir->Name, fat->mount) == 0)  /* Fat16 root directory has a constant amount of memory to build entries while fat32's root directory uses clusters(expandable) */
+	if(fat->fat_type == FAT16 && curdir->StartCluster == 0)  /* Fat16 root directory has a constant amount of memory to build entries while fat32's root directory uses clusters(expandable) */
 	{
 		for(i = 0; i < fat->root_dir_sectors_num; i++) {
 			
@@ -664,40 +734,10 @@ int *get_free_locations(fatfs_t *fat, node_entry_t *curdir, int num_entries)
 			sector_loc = fat->root_dir_sec_loc + i;
 			
 			/* Read it */
-			fat->dev->read_blocks(fat->dev, sector_loc, 1, sector); 
+			fat_read_sectors(fat, FAT_TRACE_DIR, sector_loc, 1, sector); 
 			
-			ptr_loc = 0;
-				
-			/* Find the ptr loc */
-			for(j = 0; j < fat->boot_sector.bytes_per_sector/32; j++)
-			{
-				if(sector[ptr_loc] == 0x00 || sector[ptr_loc] == 0xe5)
-				{
-					empty_entry_count++;
-					
-					if(empty_entry_count == num_entries)
-					{
-						if(ptr_loc < ((num_entries - 1)* 32)) /* Corner case: traveling across sectors to fill the case */
-						{
-							locations[0] = sector_loc - 1;  /* Go to previous sector */ 
-							locations[1] = fat->boot_sector.bytes_per_sector - (((num_entries - 1)*32) - ptr_loc);
-						}
-						else
-						{
-							locations[0] = sector_loc;
-							locations[1] = ptr_loc - ((num_entries-1)*32);
-						}
-						
-						goto finish; /* OMG!@!!$!!@ Yes, its a goto. Used correctly. */
-					}
-				}
-				else
-				{
-					empty_entry_count = 0; /* Restart entry count */
-				}
-				
-				ptr_loc += 32;
-			}
+			if(dir_cache_add_sector(fat, &build, sector_loc, sector) != 0)
+				goto fail;
 		}
 	}
 	else
@@ -713,89 +753,126 @@ int *get_free_locations(fatfs_t *fat, node_entry_t *curdir, int num_entries)
 				sector_loc = fat->data_sec_loc + (cur_cluster - 2) * fat->boot_sector.sectors_per_cluster + i;
 				
 				/* Read it */
-				fat->dev->read_blocks(fat->dev, sector_loc, 1, sector); 
-				
-				ptr_loc = 0;
+				fat_read_sectors(fat, FAT_TRACE_DIR, sector_loc, 1, sector); 
 				
-				/* Find the ptr loc */
-				for(j = 0; j < fat->boot_sector.bytes_per_sector/32; j++)
-				{
-					if(sector[ptr_loc] == 0x00 || sector[ptr_loc] == 0xe5)
-					{
-						empty_entry_count++;
-						
-						if(empty_entry_count == num_entries)
-						{
-							if(ptr_loc < ((num_entries - 1)* 32)) /* Corner case: traveling across sectors to fill the case */
-							{
-								locations[0] = sector_loc - 1;  /* Go to previous sector */
-								locations[1] = fat->boot_sector.bytes_per_sector - (((num_entries - 1)*32) - ptr_loc);
-							}
-							else
-							{
-								locations[0] = sector_loc;
-								locations[1] = ptr_loc - ((num_entries-1)*32);
-							}
-							
-							goto finish; /* OMG!@!!$!!@ Yes, its a goto. Used correctly. */
-						}
-					}
-					else
-					{
-						empty_entry_count = 0; /* Restart entry count */
-					}
-					
-					ptr_loc += 32;
-				}
+				if(dir_cache_add_sector(fat, &build, sector_loc, sector) != 0)
+					goto fail;
 			}
 			
-			/* Cant go across clusters to fulfill case */
-			empty_entry_count = 0;  
+			build.end_cluster = cur_cluster;
 			cur_cluster = read_fat_table_value(fat, cur_cluster*fat->byte_offset);
 		}
 	}
-	finish:
 	
-	/* Didnt find one? Allocate a new cluster for this folder and set loc accordingly. */
-	if(locations[0] == -1 && locations[1] == -1)
+	free(sector);
+	
+	return dir_cache_publish(fat, &build);
+	
+	fail:
+	
+	free(sector);
+	dir_cache_discard(&build);
+	
+	return NULL;
+}
+
+int *get_free_locations(fatfs_t *fat, node_entry_t *curdir, int num_entries)
+{
+	int i;
+	int *locations = malloc(sizeof(int)*2);
+	unsigned int cur_cluster;
+	fat_dir_cache_t *dc;
+	
+	locations[0] = -1;
+	locations[1] = -1;
+	
+#ifdef FATFS_DEBUG
+	printf("Trying to create the file in this directory: %s\n", curdir->Name);
+#endif
+	
+	/* Creates run with the namespace locked for writing, so the map cant be thrown out under us */
+	mutex_lock(&fat->cache_lock);
+	
+	/* Use the free slot map of the directory. Only have to go through the directory if we dont have one yet */
+	if((dc = dir_cache_find(fat, curdir->StartCluster)) == NULL 
+	&& (dc = scan_free_locations(fat, curdir)) == NULL)
+	{
+		mutex_unlock(&fat->cache_lock);
+		free(locations);
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	/* Free entries can be anywhere in the directory, even across clusters */
+	if(dir_cache_find_run(fat, dc, num_entries, locations) == 0)
+	{
+		mutex_unlock(&fat->cache_lock);
+		return locations;
+	}
+	
+	/* Fat16 root directory cant grow */
+	if(fat->fat_type == FAT16 && curdir->StartCluster == 0)
+	{
+		mutex_unlock(&fat->cache_lock);
+		free(locations);
+		errno = ENOSPC;
+		return NULL;
+	}
+		
+	/* Didnt find one? Allocate new clusters for this folder until the entries fit. */
+	do
 	{
 		
 #ifdef FATFS_DEBUG
 		printf("Couldn't find the free entries. Allocating a Cluster...\n");
 #endif
+	
+		if((cur_cluster = allocate_cluster(fat, dc->end_cluster, 1)) == 0)
+		{
+			mutex_unlock(&fat->cache_lock);
+			free(locations);
+			errno = ENOSPC;
+			return NULL;
+		}
 		
-		cur_cluster = allocate_cluster(fat, curdir->EndCluster);
+		dc->end_cluster = cur_cluster;
 		curdir->EndCluster = cur_cluster;
 		
 		clear_cluster(fat, cur_cluster);
 		
 		if(fat->fat_type == FAT32)
 			set_fsinfo_nextfree(fat); /* Write it to FSInfo sector which only exists for Fat32 */
-			
-		locations[0] = fat->data_sec_loc + ((cur_cluster - 2) * fat->boot_sector.sectors_per_cluster);   
-		locations[1] = 0;
-	}
+		
+		/* Add the empty sectors to the map */
+		for(i = 0; i < fat->boot_sector.sectors_per_cluster; i++)
+		{
+			if(dir_cache_add_sector(fat, dc, fat->data_sec_loc + ((cur_cluster - 2) * fat->boot_sector.sectors_per_cluster) + i, NULL) != 0)
+			{
+				dir_cache_invalidate(fat, curdir->StartCluster);
+				mutex_unlock(&fat->cache_lock);
+				free(locations);
+				errno = ENOMEM;
+				return NULL;
+			}
+		}
+		
+	/* Can start in the free entries at the end of the last cluster */
+	} while(dir_cache_find_run(fat, dc, num_entries, locations) != 0);
 	
-	free(sector);
+	mutex_unlock(&fat->cache_lock);
 	
 	return locations;
 }
 
+/* Shared by everything that writes zeros(new folder clusters, files grown with fs_fat_ftruncate()) */
+const unsigned char fat_zero_buf[ZERO_BUF_SECTORS * 512];
+
+/* Zero a cluster with one write */
 void clear_cluster(fatfs_t *fat, unsigned int cluster_num)
 {
-	int i;
-	int sector_loc;
-	unsigned char *empty = malloc(512*sizeof(unsigned char));
-	
-	memset(empty, 0, 512*sizeof(unsigned char));
+	int sector_loc = fat->data_sec_loc + ((cluster_num - 2) * fat->boot_sector.sectors_per_cluster);
 	
-	for(i = 0; i < fat->boot_sector.sectors_per_cluster; i++)
-	{
-		sector_loc = fat->data_sec_loc + ((cluster_num - 2) * fat->boot_sector.sectors_per_cluster) + i;   
-		fat->dev->write_blocks(fat->dev, sector_loc, 1, empty);
-	}
-	
-	free(empty);
+	fat_write_sectors(fat, FAT_TRACE_DIR, sector_loc, fat->boot_sector.sectors_per_cluster, fat_zero_buf);
 }
 
 short int generate_time(int hour, int minutes, int seconds)
@@ -833,6 +910,37 @@ y  y  y  y  y  y  y  m  m  m  m  d  d  d  d  d
 	return date;
 }
 
+/* Turn a date/time out of an entry back into a time_t. Plain arithmetic instead of mktime(), which uses global state
+   of the C library, so any number of threads can call it. The fields are taken as UTC, which is what localtime() gives
+   on KOS(there are no time zones). 0 when the entry has no date */
+time_t fat_entry_time(unsigned short date, unsigned short tme)
+{
+	int year = ((date >> 9) & 0x7F) + 1980;
+	int month = (date >> 5) & 0x0F;
+	int day = date & 0x1F;
+	int era, yoe, doy, doe;
+	long days;
+	
+	if(date == 0)
+		return 0;
+	
+	/* Days since 1970-01-01 of a date in the proleptic Gregorian calendar, with years starting in March so the
+	   leap day is the last day of the year */
+	if(month < 1 || month > 12)
+		month = 1;
+	
+	if(month <= 2)
+		year--;
+	
+	era = year / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	days = (long)era * 146097 + doe - 719468;
+	
+	return (time_t)days * 86400 + ((tme >> 11) & 0x1F) * 3600 + ((tme >> 5) & 0x3F) * 60 + (tme & 0x1F) * 2;
+}
+
 int strcasecmp( const char *s1, const char *s2 )
 {
 	int c1, c2;
@@ -867,10 +975,10 @@ unsigned int get_fsinfo_nextfree(fatfs_t *fat, unsigned short sector_loc)
 {
 	unsigned int clust_index;
 	
-	if(fat->dev->read_blocks(fat->dev, sector_loc, 1, buffer))
+	if(fat_read_sectors(fat, FAT_TRACE_FSINFO, sector_loc, 1, fat->fsinfo_buf))
         return -EIO;
 		
-	memcpy(&clust_index, buffer + NEXTFREE, 4);
+	memcpy(&clust_index, fat->fsinfo_buf + NEXTFREE, 4);
 	
 	if(clust_index == 0xFFFFFFFF)
 		clust_index = 2;
@@ -880,6 +988,8 @@ unsigned int get_fsinfo_nextfree(fatfs_t *fat, unsigned short sector_loc)
 
 void set_fsinfo_nextfree(fatfs_t *fat)
 {
-	memcpy(buffer + NEXTFREE, &(fat->next_free_fat_index), 4);
-	fat->dev->write_blocks(fat->dev, fat->fsinfo_sector, 1, buffer);
+	mutex_lock(&fat->fat_lock);
+	memcpy(fat->fsinfo_buf + NEXTFREE, &(fat->next_free_fat_index), 4);
+	fat_write_sectors(fat, FAT_TRACE_FSINFO, fat->fsinfo_sector, 1, fat->fsinfo_buf);
+	mutex_unlock(&fat->fat_lock);
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 __BEGIN_DECLS
 
+#include <time.h>
 #include "dir_entry.h"
 
 char *remove_all_chars(const unsigned char* str, unsigned char c);
@@ -11,16 +12,26 @@ void replace_all_chars(char **str, const char* replace_chars, unsigned char repl
 
 short int generate_time(int hour, int minutes, int seconds);
 short int generate_date(int year, int month, int day);
+time_t fat_entry_time(unsigned short date, unsigned short tme);
 unsigned char generate_checksum(char * short_filename);
 char *generate_short_filename(fatfs_t *fat, node_entry_t *curdir, char * fn, int *lfn, unsigned char *res);
-fat_lfn_entry_t *generate_long_filename_entry(char * fn, unsigned char checksum, unsigned char order);
+void generate_long_filename_entry(fat_lfn_entry_t *lfn_entry, const unsigned short *name, int len, unsigned char checksum, unsigned char order);
+int extract_long_name(const unsigned char *entry, unsigned short *out);
+
+int utf8_to_ucs2(const unsigned char *str, unsigned short *out, int max);
+int ucs2_to_utf8(const unsigned short *in, int len, unsigned char *out);
 
 int correct_filename(const char* str);
 int contains_lowercase(const char *str);
+int make_short_key(const char *fn, unsigned char *key);
 
 int write_entry(fatfs_t *fat, void * entry, unsigned char attr, int loc[]);
 int *get_free_locations(fatfs_t *fat, node_entry_t *curdir, int num_entries);
 
+#define ZERO_BUF_SECTORS 128   /* Sectors of zeros in fat_zero_buf(64KB, the biggest cluster there is) */
+
+extern const unsigned char fat_zero_buf[ZERO_BUF_SECTORS * 512];
+
 void clear_cluster(fatfs_t *fat, unsigned int cluster_num);
 unsigned int end_cluster(fatfs_t *fat, unsigned int start_cluster);
 